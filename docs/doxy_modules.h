@@ -1,5 +1,6 @@
 /**
  * \example rc_benchmark_algebra.c
+ * \example rc_benchmark_mpu.c
  * \example rc_mpu_calibrate_gyro.c
  * \example rc_mpu_calibrate_mag.c
  * \example rc_test_dmp.c
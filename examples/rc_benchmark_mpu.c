@@ -0,0 +1,320 @@
+/**
+ * @file rc_benchmark_mpu.c
+ * @example    rc_benchmark_mpu
+ *
+ * @brief      runs the MPU driver in DMP, raw FIFO or data-ready mode
+ *             against the software emulator and reports throughput and
+ *             interrupt-to-callback latency
+ *
+ *             No hardware or root privileges are needed. Emulated time can be
+ *             sped up to push the driver past the 200hz the real DMP allows,
+ *             which shows how much headroom the interrupt thread has. With -b
+ *             the FIFO is read in batches, compare the wakeups, CPU time and
+ *             sample age against a run without it to see what batching trades.
+ *             -p does the same with polling for boards without an interrupt
+ *             pin.
+ *             With -q a second thread follows the sample ring as well and
+ *             counts what it read and what was overwritten before it got
+ *             there. With -P the ring is published in shared memory for
+ *             rc_test_mpu_subscriber to follow from other processes.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h> // for atoi
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <rc/mpu.h>
+#include <rc/mpu_emulator.h>
+#include <rc/time.h>
+
+#define DEFAULT_RATE	200
+#define DEFAULT_SCALE	1.0
+#define DEFAULT_SECONDS	5
+
+static rc_mpu_data_t data;
+static int running;
+static uint64_t callbacks;
+static uint64_t latency_sum, latency_min = UINT64_MAX, latency_max;
+static uint64_t samples, last_sample_ns, spacing_min = UINT64_MAX, spacing_max;
+static uint64_t ring_records, ring_lost;
+
+void print_usage(){
+	printf("\n");
+	printf("-r {rate}   DMP sample rate in hz, default %d\n", DEFAULT_RATE);
+	printf("-R {rate}   raw FIFO mode at this rate in hz instead of the DMP\n");
+	printf("-D {rate}   data-ready mode at this rate in hz instead of the DMP\n");
+	printf("-b {n}      let the FIFO collect n samples before each read, default 1\n");
+	printf("-p          poll the FIFO from a timer as if no interrupt pin was wired\n");
+	printf("-x {scale}  emulated seconds per real second, default %.1f\n", DEFAULT_SCALE);
+	printf("-s {secs}   seconds to run for, default %d\n", DEFAULT_SECONDS);
+	printf("-a          also fetch accel and gyro from the DMP\n");
+	printf("-m          enable the magnetometer\n");
+	printf("-M          enable the magnetometer behind the MPU's I2C master,\n");
+	printf("            also in the FIFO in raw mode\n");
+	printf("-S          talk to the emulator through the SPI transport\n");
+	printf("-q {depth}  also follow the sample ring from another thread\n");
+	printf("-P {name}   publish the sample ring in shared memory under name\n");
+	printf("-h          print this help message\n");
+	printf("\n");
+}
+
+// interrupt handler to catch ctrl-c
+void signal_handler(__attribute__ ((unused)) int dummy)
+{
+	running=0;
+	return;
+}
+
+// record how old a sample is when it reaches us
+static void record_latency(uint64_t ts)
+{
+	int64_t ns = rc_nanos_since_epoch() - ts;
+	if(ns<0) ns = 0;
+	callbacks++;
+	latency_sum += ns;
+	if((uint64_t)ns<latency_min) latency_min = ns;
+	if((uint64_t)ns>latency_max) latency_max = ns;
+}
+
+// checks the spacing of the sample timestamps
+static void record_sample(uint64_t ts)
+{
+	uint64_t d;
+	if(last_sample_ns!=0){
+		d = ts - last_sample_ns;
+		if(d<spacing_min) spacing_min = d;
+		if(d>spacing_max) spacing_max = d;
+	}
+	last_sample_ns = ts;
+	samples++;
+}
+
+void dmp_callback(void)
+{
+	record_latency(data.dmp_timestamp_ns);
+	record_sample(data.dmp_timestamp_ns);
+}
+
+// same for raw FIFO batches
+void raw_callback(__attribute__ ((unused)) rc_mpu_t* mpu, const rc_mpu_raw_sample_t* s,
+					int n, __attribute__ ((unused)) void* user)
+{
+	int i;
+	record_latency(s[0].timestamp_ns);
+	for(i=0;i<n;i++) record_sample(s[i].timestamp_ns);
+}
+
+// follows the sample ring until rc_mpu_power_off closes it
+static void* ring_reader(__attribute__ ((unused)) void* ptr)
+{
+	rc_mpu_record_t rec[32];
+	uint64_t cursor = 0, last = 0;
+	int i, n;
+	while(rc_mpu_ring_wait(cursor, -1)==0){
+		while((n = rc_mpu_ring_read(&cursor, rec, 32))>0){
+			for(i=0;i<n;i++){
+				if(last!=0) ring_lost += rec[i].seq - last - 1;
+				last = rec[i].seq;
+			}
+			ring_records += n;
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int seconds = DEFAULT_SECONDS;
+	double scale = DEFAULT_SCALE;
+	uint64_t t1, t2;
+	double elapsed;
+	const float spin[3] = {0.0, 0.0, 30.0};
+	rc_mpu_emulator_t* emu;
+	rc_mpu_emulator_stats_t stats;
+	rc_mpu_stats_t st1, st2;
+	struct rusage ru1, ru2;
+	double cpu;
+	rc_mpu_spi_t spi = {.speed_hz = 20000000};
+	int use_spi = 0;
+	int raw = 0; // 1 for raw FIFO, 2 for data-ready mode
+	const char* mode[] = {"DMP", "raw FIFO", "data-ready"};
+	int use_ring = 0;
+	pthread_t ring_thread;
+	rc_mpu_config_t conf = rc_mpu_default_config();
+	conf.dmp_sample_rate = DEFAULT_RATE;
+
+	// parse arguments
+	opterr = 0;
+	while ((c = getopt(argc, argv, "r:R:D:b:px:s:amMSq:P:h")) != -1){
+		switch (c){
+		case 'r':
+			conf.dmp_sample_rate = atoi(optarg);
+			break;
+		case 'R':
+			raw = 1;
+			conf.raw_sample_rate = atoi(optarg);
+			conf.gyro_dlpf = GYRO_DLPF_OFF;
+			break;
+		case 'D':
+			raw = 2;
+			conf.raw_sample_rate = atoi(optarg);
+			break;
+		case 'b':
+			conf.fifo_batch = atoi(optarg);
+			break;
+		case 'p':
+			conf.fifo_poll = 1;
+			break;
+		case 'x':
+			scale = atof(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'a':
+			conf.dmp_fetch_accel_gyro = 1;
+			break;
+		case 'm':
+			conf.enable_magnetometer = 1;
+			break;
+		case 'M':
+			conf.enable_magnetometer = 1;
+			conf.mag_i2c_master = 1;
+			conf.raw_fifo_mag = 1;
+			break;
+		case 'S':
+			use_spi = 1;
+			break;
+		case 'q':
+			use_ring = 1;
+			conf.ring_depth = atoi(optarg);
+			break;
+		case 'P':
+			conf.ring_shm_name = optarg;
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		default:
+			print_usage();
+			return -1;
+		}
+	}
+
+	emu = rc_mpu_emulator_create();
+	if(emu==NULL) return -1;
+	if(rc_mpu_emulator_set_time_scale(emu, scale)){
+		rc_mpu_emulator_destroy(emu);
+		return -1;
+	}
+	rc_mpu_emulator_set_rotation_rate(emu, spin);
+	if(use_spi){
+		spi.xfer = rc_mpu_emulator_spi_xfer;
+		spi.xfer_ctx = emu;
+		spi.irq = &rc_mpu_emulator_transport;
+		spi.irq_ctx = emu;
+		conf.transport = &rc_mpu_spi_transport;
+		conf.transport_ctx = &spi;
+	}
+	else{
+		conf.transport = &rc_mpu_emulator_transport;
+		conf.transport_ctx = emu;
+	}
+
+	signal(SIGINT, signal_handler);
+	running = 1;
+
+	printf("initializing %s at %dhz, time scale %.1f, over %s\n", mode[raw],
+			raw ? conf.raw_sample_rate : conf.dmp_sample_rate, scale, use_spi ? "SPI" : "I2C");
+	if(raw==2){
+		if(rc_mpu_initialize_data_ready(&data, conf)){
+			fprintf(stderr,"rc_mpu_initialize_data_ready failed\n");
+			rc_mpu_emulator_destroy(emu);
+			return -1;
+		}
+		rc_mpu_set_raw_callback(raw_callback, NULL);
+	}
+	else if(raw){
+		if(rc_mpu_initialize_raw_fifo(&data, conf)){
+			fprintf(stderr,"rc_mpu_initialize_raw_fifo failed\n");
+			rc_mpu_emulator_destroy(emu);
+			return -1;
+		}
+		rc_mpu_set_raw_callback(raw_callback, NULL);
+	}
+	else{
+		if(rc_mpu_initialize_dmp(&data, conf)){
+			fprintf(stderr,"rc_mpu_initialize_dmp failed\n");
+			rc_mpu_emulator_destroy(emu);
+			return -1;
+		}
+		rc_mpu_set_dmp_callback(&dmp_callback);
+	}
+	if(use_ring && pthread_create(&ring_thread, NULL, ring_reader, NULL)){
+		fprintf(stderr,"failed to start ring reader\n");
+		use_ring = 0;
+	}
+	rc_mpu_emulator_reset_stats(emu);
+	rc_mpu_get_stats(&st1);
+
+	getrusage(RUSAGE_SELF, &ru1);
+	t1 = rc_nanos_since_boot();
+	while(running && rc_nanos_since_boot()-t1 < (uint64_t)seconds*1000000000){
+		rc_usleep(100000);
+	}
+	t2 = rc_nanos_since_boot();
+	getrusage(RUSAGE_SELF, &ru2);
+	rc_mpu_get_stats(&st2);
+	rc_mpu_power_off();
+	if(use_ring) pthread_join(ring_thread, NULL);
+	rc_mpu_emulator_get_stats(emu, &stats);
+	rc_mpu_emulator_destroy(emu);
+
+	elapsed = (t2-t1)/1e9;
+	printf("\n");
+	printf("ran for:          %.2f s\n", elapsed);
+	printf("callbacks:        %llu (%.1f /s)\n", (unsigned long long)callbacks, callbacks/elapsed);
+	printf("packets produced: %llu\n", (unsigned long long)stats.fifo_packets);
+	printf("interrupts:       %llu (%llu missed)\n", (unsigned long long)stats.interrupts,
+			(unsigned long long)rc_mpu_missed_dmp_interrupts());
+	printf("driver wakeups:   %llu (%.1f /s, max batch %llu)\n", (unsigned long long)(st2.wakeups-st1.wakeups),
+			(st2.wakeups-st1.wakeups)/elapsed, (unsigned long long)st2.max_batch);
+	cpu = (ru2.ru_utime.tv_sec-ru1.ru_utime.tv_sec) + (ru2.ru_stime.tv_sec-ru1.ru_stime.tv_sec) +
+		((ru2.ru_utime.tv_usec-ru1.ru_utime.tv_usec) + (ru2.ru_stime.tv_usec-ru1.ru_stime.tv_usec))/1e6;
+	printf("process cpu:      %.1f%%, %ld context switches\n", 100.0*cpu/elapsed,
+			(ru2.ru_nvcsw-ru1.ru_nvcsw) + (ru2.ru_nivcsw-ru1.ru_nivcsw));
+	printf("fifo overflows:   %llu bytes\n", (unsigned long long)stats.fifo_overflows);
+	printf("register reads:   %llu (%.1f /callback)\n", (unsigned long long)stats.reg_reads,
+					callbacks ? (double)stats.reg_reads/callbacks : 0.0);
+	if(conf.enable_magnetometer){
+		printf("mag samples:      %llu (%llu polled by the I2C master)\n",
+				(unsigned long long)stats.mag_samples, (unsigned long long)stats.mag_reads);
+		printf("final mag:        %.1f %.1f %.1f uT\n", data.mag[0], data.mag[1], data.mag[2]);
+	}
+	if(raw){
+		printf("samples:          %llu (%.1f /callback)\n", (unsigned long long)samples,
+					callbacks ? (double)samples/callbacks : 0.0);
+	}
+	if(use_ring){
+		printf("ring records:     %llu (%llu overwritten unread)\n",
+				(unsigned long long)ring_records, (unsigned long long)ring_lost);
+	}
+	if(st2.sample_rate_hz>0.0){
+		printf("measured rate:    %.3f hz, arrival jitter %.1f us\n", st2.sample_rate_hz,
+				st2.arrival_jitter_ns/1e3);
+	}
+	if(spacing_max){
+		printf("spacing us:       min %.1f  max %.1f\n", spacing_min/1e3, spacing_max/1e3);
+	}
+	if(raw) printf("final gyro z:     %.1f deg/s\n", data.gyro[2]);
+	else printf("final yaw:        %.1f deg\n", data.dmp_TaitBryan[TB_YAW_Z]*RAD_TO_DEG);
+	if(callbacks){
+		printf("sample age us:    min %.1f  avg %.1f  max %.1f\n", latency_min/1e3,
+					(double)latency_sum/callbacks/1e3, latency_max/1e3);
+	}
+	return 0;
+}
@@ -153,19 +153,13 @@ int main(int argc, char *argv[]){
 	while (running) {
 		printf("\r");
 
-		// read sensor data
-		if(rc_mpu_read_accel(&data)<0){
-			printf("read accel data failed\n");
-		}
-		if(rc_mpu_read_gyro(&data)<0){
-			printf("read gyro data failed\n");
+		// read accel, gyro and thermometer in one go
+		if(rc_mpu_read_all(&data)<0){
+			printf("read sensor data failed\n");
 		}
 		if(enable_magnetometer && rc_mpu_read_mag(&data)){
 			printf("read mag data failed\n");
 		}
-		if(enable_thermometer && rc_mpu_read_temp(&data)){
-			printf("read imu thermometer failed\n");
-		}
 
 
 		switch(a_mode){
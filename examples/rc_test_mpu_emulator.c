@@ -0,0 +1,98 @@
+/**
+ * @file rc_test_mpu_emulator.c
+ * @example    rc_test_mpu_emulator
+ *
+ * @brief      checks the MPU driver against the software emulator, no
+ *             hardware or root privileges needed
+ *
+ *             Runs the driver in DMP and then data-ready mode and resets the
+ *             emulator's statistics halfway through each run, which must not
+ *             disturb the interrupt sequence numbers the driver counts missed
+ *             interrupts from. Prints PASS or FAIL for each and returns -1 if
+ *             any failed.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <rc/mpu.h>
+#include <rc/mpu_emulator.h>
+#include <rc/time.h>
+
+#define RUN_US		1000000
+#define RATE		200
+
+static uint64_t callbacks;
+
+static void dmp_callback(__attribute__ ((unused)) rc_mpu_t* mpu,
+				__attribute__ ((unused)) void* user)
+{
+	callbacks++;
+}
+
+static void raw_callback(__attribute__ ((unused)) rc_mpu_t* mpu,
+				__attribute__ ((unused)) const rc_mpu_raw_sample_t* samples,
+				int n, __attribute__ ((unused)) void* user)
+{
+	callbacks += n;
+}
+
+// runs one mode for two periods with a stats reset between, returns 0 on pass
+static int test_stats_reset(const char* name, int data_ready)
+{
+	rc_mpu_emulator_t* emu;
+	rc_mpu_t* mpu;
+	rc_mpu_data_t data;
+	rc_mpu_config_t conf = rc_mpu_default_config();
+	uint64_t missed;
+	int ret;
+
+	emu = rc_mpu_emulator_create();
+	if(emu==NULL) return -1;
+	mpu = rc_mpu_dev_create();
+	if(mpu==NULL){
+		rc_mpu_emulator_destroy(emu);
+		return -1;
+	}
+	conf.transport = &rc_mpu_emulator_transport;
+	conf.transport_ctx = emu;
+	callbacks = 0;
+	if(data_ready){
+		conf.raw_sample_rate = RATE;
+		ret = rc_mpu_dev_initialize_data_ready(mpu, &data, conf);
+		if(ret==0) rc_mpu_dev_set_raw_callback(mpu, raw_callback, NULL);
+	}
+	else{
+		conf.dmp_sample_rate = RATE;
+		ret = rc_mpu_dev_initialize_dmp(mpu, &data, conf);
+		if(ret==0) rc_mpu_dev_set_dmp_callback(mpu, dmp_callback, NULL);
+	}
+	if(ret){
+		printf("FAIL %s: initialization failed\n", name);
+		rc_mpu_dev_destroy(mpu);
+		rc_mpu_emulator_destroy(emu);
+		return -1;
+	}
+	rc_usleep(RUN_US);
+	rc_mpu_emulator_reset_stats(emu);
+	rc_usleep(RUN_US);
+	missed = rc_mpu_dev_missed_dmp_interrupts(mpu);
+	rc_mpu_dev_destroy(mpu);
+	rc_mpu_emulator_destroy(emu);
+
+	if(callbacks==0 || missed!=0){
+		printf("FAIL %s: %llu samples, %llu missed interrupts after stats reset\n", name,
+			(unsigned long long)callbacks, (unsigned long long)missed);
+		return -1;
+	}
+	printf("PASS %s: %llu samples, no missed interrupts after stats reset\n", name,
+			(unsigned long long)callbacks);
+	return 0;
+}
+
+int main()
+{
+	int fails = 0;
+	if(test_stats_reset("dmp", 0)) fails++;
+	if(test_stats_reset("data ready", 1)) fails++;
+	return fails ? -1 : 0;
+}
@@ -0,0 +1,101 @@
+/**
+ * @file rc_test_mpu_subscriber.c
+ * @example    rc_test_mpu_subscriber
+ *
+ * @brief      follows the sample ring another process publishes in shared
+ *             memory and prints the newest record a few times a second
+ *
+ *             Start a publisher first, for example
+ *             rc_benchmark_mpu -P /rc_mpu -s 30, then run this with the same
+ *             name. Every record is read, so the count of records missed
+ *             shows whether this process keeps up with the publisher.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <getopt.h>
+#include <rc/mpu.h>
+#include <rc/mpu_subscriber.h>
+#include <rc/time.h>
+
+#define DEFAULT_NAME	"/rc_mpu"
+#define PRINT_NS	200000000
+
+static int running;
+
+// interrupt handler to catch ctrl-c
+static void signal_handler(__attribute__ ((unused)) int dummy)
+{
+	running=0;
+	return;
+}
+
+static void print_usage(void)
+{
+	printf("\n");
+	printf("-n {name}   shared memory name to follow, default %s\n", DEFAULT_NAME);
+	printf("-h          print this help message\n");
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, n;
+	const char* name = DEFAULT_NAME;
+	rc_mpu_subscriber_t* sub;
+	rc_mpu_record_t rec[32];
+	uint64_t cursor = 0, last = 0, records = 0, missed = 0;
+	uint64_t last_print = 0;
+
+	// parse arguments
+	opterr = 0;
+	while ((c = getopt(argc, argv, "n:h")) != -1){
+		switch (c){
+		case 'n':
+			name = optarg;
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		default:
+			print_usage();
+			return -1;
+		}
+	}
+
+	sub = rc_mpu_subscriber_open(name);
+	if(sub==NULL) return -1;
+
+	signal(SIGINT, signal_handler);
+	running = 1;
+
+	printf("following %s, ctrl-c to stop\n", name);
+	printf("     seq |   records |    missed | gyro z deg/s | age us\n");
+	while(running){
+		// wake at least every 100ms to notice ctrl-c
+		if(rc_mpu_subscriber_wait(sub, cursor, 100)){
+			if(rc_mpu_subscriber_closed(sub)==1){
+				printf("\npublisher powered off\n");
+				break;
+			}
+			continue;
+		}
+		n = rc_mpu_subscriber_read(sub, &cursor, rec, 32);
+		for(i=0;i<n;i++){
+			if(last!=0) missed += rec[i].seq - last - 1;
+			last = rec[i].seq;
+		}
+		records += n;
+		if(n>0 && rc_nanos_since_boot()-last_print>PRINT_NS){
+			last_print = rc_nanos_since_boot();
+			printf("\r%8llu | %9llu | %9llu | %12.1f | %6.1f", (unsigned long long)last,
+					(unsigned long long)records, (unsigned long long)missed,
+					rec[n-1].data.gyro[2], (rc_nanos_since_epoch()-rec[n-1].timestamp_ns)/1e3);
+			fflush(stdout);
+		}
+	}
+	printf("\n");
+	rc_mpu_subscriber_close(sub);
+	return 0;
+}
@@ -0,0 +1,152 @@
+/**
+ * @headerfile error_log.h <rc/error_log.h>
+ *
+ * @brief      Lock-free error and warning reporting for real-time threads.
+ *
+ *             Bus and sensor code that runs in time-critical threads reports
+ *             problems here instead of writing to stdio, which can block on a
+ *             slow terminal and turn one bad transaction into a run of missed
+ *             samples. rc_error_report formats the message into a fixed-size
+ *             ring without taking any locks or making any system calls.
+ *
+ *             Each source is rate limited to ERROR_LOG_RATE_LIMIT events per
+ *             second. Anything past that is only counted, and the next event
+ *             that gets through carries the number suppressed before it.
+ *
+ *             Events are read back with rc_error_drain, or printed to stderr
+ *             from an ordinary thread started with rc_error_printer_start.
+ *
+ * @addtogroup error_log
+ * @{
+ */
+
+#ifndef RC_ERROR_LOG_H
+#define RC_ERROR_LOG_H
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/**
+ * @brief      Number of events the ring holds before new ones are dropped.
+ */
+#define ERROR_LOG_SIZE 128
+
+/**
+ * @brief      Longest message kept, including the terminating null.
+ */
+#define ERROR_LOG_MSG_LEN 112
+
+/**
+ * @brief      Events accepted per source per second.
+ */
+#define ERROR_LOG_RATE_LIMIT 20
+
+/**
+ * @brief      Subsystem an event came from.
+ */
+typedef enum rc_error_source_t{
+	ERR_SRC_I2C = 0,
+	ERR_SRC_MPU = 1,
+	ERR_SRC_OTHER = 2,
+	ERR_SRC_SPI = 3
+} rc_error_source_t;
+
+/**
+ * @brief      Number of sources.
+ */
+#define ERR_NUM_SOURCES 4
+
+/**
+ * @brief      Severity of an event.
+ */
+typedef enum rc_error_level_t{
+	ERR_LEVEL_ERROR = 0,
+	ERR_LEVEL_WARNING = 1
+} rc_error_level_t;
+
+/**
+ * @brief      One reported event, see rc_error_drain.
+ */
+typedef struct rc_error_event_t{
+	uint64_t timestamp_ns;	///< when it was reported, from rc_nanos_since_boot
+	uint32_t suppressed;	///< events from the same source dropped by the rate limit just before this one
+	uint8_t source;		///< one of rc_error_source_t
+	uint8_t level;		///< one of rc_error_level_t
+	char msg[ERROR_LOG_MSG_LEN]; ///< the formatted message, truncated if need be
+} rc_error_event_t;
+
+/**
+ * @brief      Counters kept per source, see rc_error_get_counts.
+ */
+typedef struct rc_error_counts_t{
+	uint64_t reported;	///< calls to rc_error_report
+	uint64_t rate_limited;	///< events dropped by the rate limit
+	uint64_t overflowed;	///< events dropped because the ring was full
+} rc_error_counts_t;
+
+/**
+ * @brief      Reports an error or warning.
+ *
+ *             Safe to call from any thread, never blocks and never does I/O.
+ *
+ * @param[in]  source  The source
+ * @param[in]  level   The level
+ * @param[in]  fmt     printf style format string
+ *
+ * @return     0 if the event was queued, -1 if it was dropped
+ */
+int rc_error_report(rc_error_source_t source, rc_error_level_t level, const char* fmt, ...)
+	__attribute__ ((format (printf, 3, 4)));
+
+/**
+ * @brief      Takes the oldest queued events out of the ring.
+ *
+ *             Any number of threads may drain, each event goes to exactly one
+ *             of them.
+ *
+ * @param[out] events  array to fill
+ * @param[in]  max     size of the array
+ *
+ * @return     number of events written or -1 on failure
+ */
+int rc_error_drain(rc_error_event_t* events, int max);
+
+/**
+ * @brief      Reads the counters of a source.
+ *
+ * @param[in]  source  The source
+ * @param[out] counts  written with a snapshot of the counters
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_error_get_counts(rc_error_source_t source, rc_error_counts_t* counts);
+
+/**
+ * @brief      Starts a thread that prints queued events to stderr.
+ *
+ *             The thread runs at normal priority and checks the ring every
+ *             50ms. Calls are counted, the thread keeps running until
+ *             rc_error_printer_stop has been called as many times.
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_error_printer_start(void);
+
+/**
+ * @brief      Releases one rc_error_printer_start, stopping the thread after
+ *             printing anything left when it was the last.
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_error_printer_stop(void);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif // RC_ERROR_LOG_H
+
+/** @} end group error_log */
@@ -0,0 +1,137 @@
+/**
+ * @headerfile event_loop.h <rc/event_loop.h>
+ *
+ * @brief      One thread waiting on many file descriptors.
+ *
+ *             An event loop is an epoll set plus a callback per descriptor.
+ *             Any number of IMU interrupt descriptors, timers, sockets or
+ *             other user descriptors can share one loop and so one thread,
+ *             which can be given a real-time priority once instead of per
+ *             sensor. Stopping a loop wakes it through an internal eventfd,
+ *             so it returns immediately rather than after a poll timeout.
+ *
+ *             The loop can run on a thread of its own from
+ *             rc_event_loop_start, or on the caller's thread with
+ *             rc_event_loop_run. See rc_mpu_config_t.event_loop for handing
+ *             a loop to the MPU driver.
+ *
+ * @addtogroup event_loop
+ * @{
+ */
+
+#ifndef RC_EVENT_LOOP_H
+#define RC_EVENT_LOOP_H
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/**
+ * @brief      Most descriptors one loop watches at once.
+ */
+#define EVENT_LOOP_MAX_FDS 32
+
+/**
+ * @brief      opaque loop, create with rc_event_loop_create
+ */
+typedef struct rc_event_loop_t rc_event_loop_t;
+
+/**
+ * @brief      Called on the loop's thread when a descriptor is ready.
+ *
+ *             events holds the EPOLLIN/EPOLLPRI/... bits that fired. These
+ *             have the same values as the matching POLL* bits.
+ */
+typedef void (*rc_event_cb_t)(int fd, uint32_t events, void* user);
+
+/**
+ * @brief      Creates an empty loop.
+ *
+ * @return     the loop, or NULL on failure
+ */
+rc_event_loop_t* rc_event_loop_create(void);
+
+/**
+ * @brief      Stops the loop if needed and frees it.
+ *
+ *             Registered descriptors are not closed. Called from one of the
+ *             loop's callbacks it returns at once and the loop is freed as
+ *             soon as that callback returns, nothing else is called then.
+ *
+ * @param      loop  The loop
+ */
+void rc_event_loop_destroy(rc_event_loop_t* loop);
+
+/**
+ * @brief      Starts watching a descriptor.
+ *
+ *             Safe to call while the loop is running, including from a
+ *             callback.
+ *
+ * @param      loop    The loop
+ * @param[in]  fd      descriptor to watch
+ * @param[in]  events  EPOLLIN, EPOLLPRI etc. or the equivalent POLL* bits
+ * @param[in]  cb      function to call when it is ready
+ * @param      user    passed to cb
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_event_loop_add(rc_event_loop_t* loop, int fd, uint32_t events, rc_event_cb_t cb, void* user);
+
+/**
+ * @brief      Stops watching a descriptor.
+ *
+ *             Once this returns the callback is not running and won't be
+ *             called again, so whatever it uses can be torn down. Calling it
+ *             from inside a callback is allowed.
+ *
+ * @param      loop  The loop
+ * @param[in]  fd    descriptor given to rc_event_loop_add
+ *
+ * @return     0 on success or -1 if fd wasn't registered
+ */
+int rc_event_loop_remove(rc_event_loop_t* loop, int fd);
+
+/**
+ * @brief      Runs the loop on the calling thread until rc_event_loop_stop.
+ *
+ * @param      loop  The loop
+ *
+ * @return     0 after a stop, -1 on error
+ */
+int rc_event_loop_run(rc_event_loop_t* loop);
+
+/**
+ * @brief      Runs the loop on a new thread.
+ *
+ *             Policy and priority are as for rc_pthread_create.
+ *
+ * @param      loop      The loop
+ * @param[in]  policy    SCHED_OTHER, SCHED_FIFO or SCHED_RR
+ * @param[in]  priority  The priority
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_event_loop_start(rc_event_loop_t* loop, int policy, int priority);
+
+/**
+ * @brief      Makes the loop return as soon as the current callback is done.
+ *
+ *             If the loop was started with rc_event_loop_start this also
+ *             waits for its thread to exit, unless called from that thread.
+ *
+ * @param      loop  The loop
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_event_loop_stop(rc_event_loop_t* loop);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif // RC_EVENT_LOOP_H
+
+/** @} end group event_loop */
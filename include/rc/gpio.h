@@ -24,6 +24,8 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+
 #define GPIO_HIGH 1
 #define GPIO_LOW 0
 
@@ -57,12 +59,28 @@ typedef enum rc_pin_edge_t{
 /**
  * @brief      Exports (initializes) a gpio pin with the system driver.
  *
+ *             Returns as soon as the pin's value file can be opened, waiting
+ *             up to a second for the driver and udev to set it up.
+ *
  * @param[in]  pin   The pin ID
  *
  * @return     0 on success or -1 on failure.
  */
 int rc_gpio_export(int pin);
 
+/**
+ * @brief      Exports several pins at once.
+ *
+ *             All the exports are requested before waiting on any of them so
+ *             the delays overlap rather than add up.
+ *
+ * @param[in]  pins  array of pin IDs
+ * @param[in]  n     number of pins
+ *
+ * @return     0 on success or -1 if any pin failed.
+ */
+int rc_gpio_export_batch(const int* pins, int n);
+
 /**
  * @brief      Unexports (uninitializes) a gpio pin with the system driver. Not
  *             normally needed.
@@ -103,6 +121,19 @@ int rc_gpio_set_value(int pin, int value);
  */
 int rc_gpio_get_value(int pin);
 
+/**
+ * @brief      Reads a value file descriptor from rc_gpio_get_value_fd.
+ *
+ *             Uses a single pread at offset 0, which also acknowledges an edge
+ *             so the descriptor can be polled for the next one. Meant for
+ *             interrupt handlers, so it prints nothing on error.
+ *
+ * @param[in]  fd    The value fd
+ *
+ * @return     1 if pin is high, 0 if pin is low, -1 on error
+ */
+int rc_gpio_read_value_fd(int fd);
+
 /**
  * @brief      Enbales edge detection (triggering) for the pin
  *
@@ -144,6 +175,66 @@ int rc_gpio_print_value(int pin);
 int rc_gpio_print_dir(int pin);
 
 
+/**
+ * @brief      Largest number of events rc_gpio_line_read_events returns at
+ *             once, matching the kernel's default per-line event buffer.
+ */
+#define GPIO_MAX_LINE_EVENTS 16
+
+/**
+ * @brief      One edge reported by the GPIO character device.
+ */
+typedef struct rc_gpio_event_t{
+	uint64_t timestamp_ns;	///< when the kernel saw the edge, CLOCK_MONOTONIC as from rc_nanos_since_boot
+	uint32_t seqno;		///< number of edges seen on this line so far, counting this one
+	int rising;		///< 1 for a rising edge, 0 for falling
+} rc_gpio_event_t;
+
+/**
+ * @brief      Requests a line of a /dev/gpiochipN device as an input with
+ *             edge events.
+ *
+ *             This is the GPIO character device (v2 uAPI) alternative to
+ *             exporting the pin through sysfs. Each edge is queued by the
+ *             kernel with the time it happened and a sequence number, so
+ *             scheduling delays don't end up in the timestamp and edges that
+ *             were missed can be counted. Works the same with the gpio-sim
+ *             and gpio-mockup modules for testing.
+ *
+ *             The returned descriptor is non-blocking and becomes readable
+ *             (POLLIN) when events are queued. Close it with
+ *             rc_gpio_line_release.
+ *
+ * @param[in]  chip      chip number N of /dev/gpiochipN
+ * @param[in]  line      line offset within the chip
+ * @param[in]  edge      which edges to report, not GPIO_EDGE_NONE
+ * @param[in]  consumer  label shown in the kernel's debug output, may be NULL
+ *
+ * @return     file descriptor of the request or -1 on failure
+ */
+int rc_gpio_line_request_events(int chip, int line, rc_pin_edge_t edge, const char* consumer);
+
+/**
+ * @brief      Reads the events queued on a line request without blocking.
+ *
+ * @param[in]  fd      descriptor from rc_gpio_line_request_events
+ * @param[out] events  array to fill, oldest first
+ * @param[in]  max     size of the array, at most GPIO_MAX_LINE_EVENTS are
+ *                     read per call
+ *
+ * @return     number of events read, 0 if none were queued, or -1 on error
+ */
+int rc_gpio_line_read_events(int fd, rc_gpio_event_t* events, int max);
+
+/**
+ * @brief      Releases a line requested with rc_gpio_line_request_events.
+ *
+ * @param[in]  fd    descriptor of the request
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_gpio_line_release(int fd);
+
 #ifdef  __cplusplus
 }
 #endif
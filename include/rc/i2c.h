@@ -31,12 +31,40 @@ extern "C" {
  */
 #define I2C_MAX_BUS 5
 
+/**
+ * @brief      Number of slave addresses per bus that get their own file
+ *             descriptor, see rc_i2c_set_device_address.
+ */
+#define I2C_MAX_SLAVES 4
+
 /**
  * @brief      size of i2c buffer in bytes for writing to registers. Only
  *             increase if you know what you are doing.
  */
 #define I2C_BUFFER_SIZE 128
 
+/**
+ * @brief      Maximum number of segments in one rc_i2c_transfer call. This
+ *             matches the kernel limit for a single I2C_RDWR ioctl.
+ */
+#define I2C_MAX_SEGMENTS 42
+
+/**
+ * @brief      One read or write segment of a multi-message transfer.
+ *
+ *             A write segment sends length bytes from data, so to write a
+ *             register the register address goes in data[0]. A read segment
+ *             fills data with length bytes, usually after a one-byte write
+ *             segment selecting the register to read from.
+ */
+typedef struct rc_i2c_seg_t{
+	uint8_t devAddr;	///< 7-bit slave address this segment talks to
+	uint8_t read;		///< 1 to read from the device, 0 to write to it
+	uint16_t length;	///< number of bytes to transfer
+	uint8_t* data;		///< bytes to send, or buffer to fill when reading
+	int result;		///< written back: bytes transferred, or -1 if the segment did not complete
+} rc_i2c_seg_t;
+
 /**
  * @brief      Initializes a bus and sets it to talk to a particular device
  *             address.
@@ -61,19 +89,66 @@ int rc_i2c_close(int bus);
  * @brief      Changes the device address the bus is configured to talk to.
  *
  *             Actually changing the device address in the I2C driver requires a
- *             system call and is relatively slow. This function records which
- *             device address the bus is set to and will only make the system
- *             call if the requested address is different than the set address.
- *             This makes it safe to call this function repeatedly with no
- *             performance penalty.
+ *             system call and is relatively slow. Instead, the first time each
+ *             address is used a separate file descriptor on the same
+ *             /dev/i2c-N is opened and bound to it. Switching between up to
+ *             I2C_MAX_SLAVES addresses afterwards only swaps which descriptor
+ *             is active and makes no system call at all. This makes it safe to
+ *             call this function repeatedly with no performance penalty, even
+ *             when alternating between devices. Further addresses share one
+ *             more descriptor that is re-bound each time.
  *
  * @param[in]  bus      The bus
  * @param[in]  devAddr  The new device address
  *
- * @return     { description_of_the_return_value }
+ * @return     0 on success or -1 on failure
  */
 int rc_i2c_set_device_address(int bus, uint8_t devAddr);
 
+/**
+ * @brief      Fetches the file descriptor bound to a particular slave address.
+ *
+ *             The descriptor is opened and bound on first use without
+ *             changing the bus's active address. It stays owned by this API
+ *             and is closed by rc_i2c_close, so the caller must not close it.
+ *             Plain read() and write() calls on it go to devAddr regardless of
+ *             what rc_i2c_set_device_address has selected. Fails once
+ *             I2C_MAX_SLAVES addresses already have one.
+ *
+ * @param[in]  bus      The bus
+ * @param[in]  devAddr  The device address
+ *
+ * @return     file descriptor, or -1 on failure
+ */
+int rc_i2c_get_fd(int bus, uint8_t devAddr);
+
+/**
+ * @brief      Selects how register reads are performed on a bus.
+ *
+ *             By default rc_i2c_init enables combined mode if the adapter
+ *             reports plain I2C support. In combined mode the register address
+ *             write and the data read are issued as a single I2C_RDWR ioctl
+ *             with a repeated start in between, saving one system call and one
+ *             STOP condition per read. If the adapter rejects I2C_RDWR, the bus
+ *             silently falls back to the separate write() and read() path.
+ *
+ * @param[in]  bus     The bus
+ * @param[in]  enable  1 to use combined transactions, 0 for separate
+ *                     write/read system calls
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_i2c_set_combined_rw(int bus, int enable);
+
+/**
+ * @brief      Fetches whether combined write/read transactions are in use.
+ *
+ * @param[in]  bus   The bus
+ *
+ * @return     1 if combined mode is in use, 0 if not, or -1 on error.
+ */
+int rc_i2c_get_combined_rw(int bus);
+
 /**
  * @brief      Reads a single byte from a device register.
  *
@@ -233,53 +308,329 @@ int rc_i2c_send_bytes(int bus, uint8_t length, uint8_t* data);
 int rc_i2c_send_byte(int bus, uint8_t data);
 
 /**
- * @brief      Locks the bus so other threads in the process know the bus is in
- *             use.
+ * @brief      Performs a sequence of read and write segments as one bus
+ *             transaction.
  *
- *             Locking a bus is similar to locking a mutex, it is a way for
- *             threads to communicate within one process when sharing a bus.
- *             This, however, is not a hard lock in the sense that it does not
- *             block and does not stop any of the other functions in this API
- *             from being called. It only serves as a flag that can be checked
- *             between threads if the user chooses to do so. This is encouraged
- *             in multithraded applications to prevent timing-sensitive i2c
- *             communication from being interrupted but is not enforced.
+ *             All segments are submitted in a single I2C_RDWR ioctl with
+ *             repeated starts between them and one STOP at the end. Segments
+ *             may address different slaves. If the adapter does not support
+ *             I2C_RDWR the segments are performed one system call at a time
+ *             instead. The result field of each segment is written back so the
+ *             caller can see how far the transfer got.
  *
- *             All read/write functions in this API will lock the bus during the
- *             transaction and return the lockstate to what it was at the
- *             beginning of the transaction. Ideally the user should lock the
- *             bus themselves before a sequence of transactions and unlock it
- *             afterwards.
+ * @param[in]  bus   The bus
+ * @param      segs  Array of segments
+ * @param[in]  n     Number of segments, up to I2C_MAX_SEGMENTS
+ *
+ * @return     number of segments completed (n) on success or -1 on failure
+ */
+int rc_i2c_transfer(int bus, rc_i2c_seg_t* segs, int n);
+
+/**
+ * @brief      Acquires exclusive use of a bus for the calling thread.
+ *
+ *             This is a real lock: if another thread holds the bus, this
+ *             function blocks until it is released. The lock is recursive, so
+ *             the thread holding it may lock it again and call any of the
+ *             read/write functions in this API, which take the same lock for
+ *             the duration of each transaction. Every lock must be balanced by
+ *             an rc_i2c_unlock_bus from the same thread.
+ *
+ *             Locking the bus around a sequence of transactions keeps other
+ *             threads from interleaving their own transactions, or changing the
+ *             device address, in the middle of the sequence. If cross-process
+ *             locking has been enabled with rc_i2c_set_process_lock, the
+ *             outermost lock also excludes other processes using this API on
+ *             the same bus.
  *
  * @param[in]  bus   The bus ID
  *
- * @return     Returns the lock state (0 or 1) when this function is called, or -1 on
- *             error.
+ * @return     Returns 1 if the calling thread already held the lock, 0 if it
+ *             was just acquired, or -1 on error.
  */
 int rc_i2c_lock_bus(int bus);
 
 /**
- * @brief      Unlocks a bus to indicate to other threads in the process that
- *             the bus is now free.
+ * @brief      Releases one level of the bus lock held by the calling thread.
  *
  *             see rc_i2c_lock_bus for further description.
  *
  * @param[in]  bus   The bus ID
  *
- * @return     Returns the lock state (0 or 1) when this function is called, or -1 on
- *             error.
+ * @return     Returns 1 if the calling thread held the lock, 0 if nobody held
+ *             it, or -1 on error including when another thread holds it.
  */
 int rc_i2c_unlock_bus(int bus);
 
 /**
  * @brief      Fetches the current lock state of the bus.
  *
+ *             This only reports whether a thread in this process holds the
+ *             lock. It is useful for diagnostics but the answer may be stale by
+ *             the time it is used, call rc_i2c_lock_bus to actually claim the
+ *             bus.
+ *
  * @param[in]  bus   The bus ID
  *
  * @return     Returns 0 if unlocked, 1 if locked, or -1 on error.
  */
 int rc_i2c_get_lock(int bus);
 
+/**
+ * @brief      Enables or disables locking the bus across processes.
+ *
+ *             When enabled, the outermost rc_i2c_lock_bus (and every
+ *             transaction made without holding the lock) also takes an
+ *             exclusive flock on /dev/i2c-N, so every process using this API
+ *             with process locking enabled is serialized on the bus. The flock
+ *             is dropped by the kernel if a process dies while holding it.
+ *             Disabled by default since it costs two extra system calls per
+ *             acquisition. Must not be called while holding the bus lock.
+ *
+ * @param[in]  bus     The bus ID
+ * @param[in]  enable  1 to enable, 0 to disable
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_i2c_set_process_lock(int bus, int enable);
+
+/**
+ * @brief      Bus lock contention statistics, see rc_i2c_get_lock_stats.
+ *
+ *             Only outermost acquisitions are counted, recursive locks by the
+ *             thread already holding the bus are not.
+ */
+typedef struct rc_i2c_lock_stats_t{
+	uint64_t acquisitions;	///< number of times the bus lock was acquired
+	uint64_t contended;	///< acquisitions that had to wait for another thread or process
+	uint64_t wait_ns_total;	///< total nanoseconds spent waiting in contended acquisitions
+	uint64_t wait_ns_max;	///< longest single wait in nanoseconds
+	uint64_t hold_ns_total;	///< total nanoseconds the lock was held
+	uint64_t hold_ns_max;	///< longest single hold in nanoseconds
+} rc_i2c_lock_stats_t;
+
+/**
+ * @brief      Fetches a snapshot of the lock statistics for a bus.
+ *
+ * @param[in]  bus    The bus ID
+ * @param[out] stats  Pointer to user's struct to write the statistics to
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_i2c_get_lock_stats(int bus, rc_i2c_lock_stats_t* stats);
+
+/**
+ * @brief      Zeros the lock statistics for a bus.
+ *
+ * @param[in]  bus   The bus ID
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_i2c_reset_lock_stats(int bus);
+
+/**
+ * @brief      Priority of an asynchronous request, lower values are served
+ *             first.
+ */
+typedef enum rc_i2c_priority_t{
+	I2C_PRIORITY_HIGH = 0,	///< time critical reads such as draining the IMU FIFO
+	I2C_PRIORITY_NORMAL = 1,///< periodic sensor reads such as the magnetometer
+	I2C_PRIORITY_LOW = 2	///< anything that can wait such as temperature
+} rc_i2c_priority_t;
+
+/**
+ * @brief      Number of priority levels.
+ */
+#define I2C_NUM_PRIORITIES 3
+
+typedef struct rc_i2c_request_t rc_i2c_request_t;
+
+/**
+ * @brief      An asynchronous transaction, see rc_i2c_submit.
+ *
+ *             The caller owns the request and its segments. Fill in the first
+ *             group of fields, submit it, and leave it alone until done reads
+ *             1. When it finishes the worker sets result, calls callback if
+ *             set, writes 1 to efd if it isn't -1, then sets done.
+ */
+struct rc_i2c_request_t{
+	rc_i2c_seg_t* segs;		///< segments of the transaction, as for rc_i2c_transfer
+	int n;				///< number of segments
+	rc_i2c_priority_t priority;	///< queue to wait in
+	void (*callback)(rc_i2c_request_t* req); ///< optional, called from the worker thread
+	int efd;			///< optional eventfd to signal, -1 for none
+	void* user;			///< for the caller's use, untouched by the queue
+	int result;			///< written back: rc_i2c_transfer return value
+	int done;			///< written back: 0 while pending, 1 once complete
+	rc_i2c_request_t* next;		///< used by the queue
+};
+
+/**
+ * @brief      Queues a transaction for the bus's worker thread and returns
+ *             immediately.
+ *
+ *             Each bus has one worker thread, started by the first submit,
+ *             that runs queued transactions one at a time with
+ *             rc_i2c_transfer. Higher priority requests always go first,
+ *             requests of equal priority go in the order they were submitted.
+ *             A long queue of low priority reads therefore delays a high
+ *             priority one by at most the transaction already on the wire.
+ *             Synchronous calls on other threads still share the bus through
+ *             the normal bus lock.
+ *
+ * @param[in]  bus   The bus ID, must be initialized
+ * @param      req   The request, must stay valid until req->done is set
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_i2c_submit(int bus, rc_i2c_request_t* req);
+
+/**
+ * @brief      Gets the number of requests waiting in a bus's queue, not
+ *             counting the one in progress.
+ *
+ * @param[in]  bus   The bus ID
+ *
+ * @return     queue depth or -1 on failure
+ */
+int rc_i2c_get_queue_depth(int bus);
+
+/**
+ * @brief      Stops a bus's worker thread.
+ *
+ *             The transaction in progress is finished, anything still queued
+ *             completes with result -1. rc_i2c_close calls this. Must not be
+ *             called from a request callback.
+ *
+ * @param[in]  bus   The bus ID
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_i2c_async_stop(int bus);
+
+/**
+ * @brief      Number of entries kept in the transaction trace ring.
+ */
+#define I2C_TRACE_SIZE 256
+
+/**
+ * @brief      Number of buckets in a latency histogram. Bucket i counts
+ *             transactions that took from 2^i up to 2^(i+1) nanoseconds, the
+ *             last one also takes anything slower.
+ */
+#define I2C_HIST_BINS 32
+
+/**
+ * @brief      Number of distinct device/register pairs tracked per bus.
+ */
+#define I2C_TRACE_MAX_REGS 64
+
+/**
+ * @brief      Kind of transaction recorded in the trace.
+ */
+typedef enum rc_i2c_trace_op_t{
+	I2C_TRACE_READ = 0,	///< register read
+	I2C_TRACE_WRITE = 1,	///< register write or raw send
+	I2C_TRACE_TRANSFER = 2	///< rc_i2c_transfer, reg is the first byte written
+} rc_i2c_trace_op_t;
+
+/**
+ * @brief      One traced transaction, see rc_i2c_get_trace.
+ */
+typedef struct rc_i2c_trace_t{
+	uint64_t timestamp_ns;	///< start of the transaction, from rc_nanos_since_boot
+	uint32_t duration_ns;	///< time spent in the system calls, excluding the wait for the bus lock
+	int16_t result;		///< bytes transferred or -1 on failure
+	uint16_t length;	///< bytes requested, not counting the register address
+	uint8_t bus;		///< bus ID
+	uint8_t addr;		///< 7-bit slave address
+	uint8_t reg;		///< register address
+	uint8_t op;		///< one of rc_i2c_trace_op_t
+} rc_i2c_trace_t;
+
+/**
+ * @brief      Latency histogram of a set of transactions.
+ */
+typedef struct rc_i2c_histogram_t{
+	uint64_t count;		///< number of transactions
+	uint64_t errors;	///< transactions that failed
+	uint64_t total_ns;	///< sum of all durations
+	uint64_t max_ns;	///< longest duration
+	uint32_t bins[I2C_HIST_BINS]; ///< log2 duration buckets
+} rc_i2c_histogram_t;
+
+/**
+ * @brief      Latency histogram of one register of one device.
+ */
+typedef struct rc_i2c_reg_histogram_t{
+	uint8_t addr;		///< 7-bit slave address
+	uint8_t reg;		///< register address
+	rc_i2c_histogram_t hist;///< transactions starting at this register
+} rc_i2c_reg_histogram_t;
+
+/**
+ * @brief      Turns transaction tracing on or off for all buses.
+ *
+ *             Off by default. When on, every transaction on any bus is timed,
+ *             added to the trace ring, and counted in the histograms of its
+ *             bus and register. Recording takes no locks so it doesn't add
+ *             contention, it costs two clock reads and a handful of atomic
+ *             adds per transaction. When off it costs one load.
+ *
+ * @param[in]  enable  1 to enable, 0 to disable
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_i2c_set_tracing(int enable);
+
+/**
+ * @brief      Copies the most recent traced transactions, oldest first.
+ *
+ *             Entries being overwritten while they are copied are skipped.
+ *
+ * @param[out] entries  array to fill
+ * @param[in]  max      size of the array
+ *
+ * @return     number of entries written or -1 on failure
+ */
+int rc_i2c_get_trace(rc_i2c_trace_t* entries, int max);
+
+/**
+ * @brief      Copies the latency histogram of all transactions on a bus.
+ *
+ * @param[in]  bus   The bus ID
+ * @param[out] hist  histogram to fill
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_i2c_get_histogram(int bus, rc_i2c_histogram_t* hist);
+
+/**
+ * @brief      Copies the latency histograms of each register seen on a bus.
+ *
+ *             Registers are identified by the slave address and the register
+ *             a transaction starts at. Only the first I2C_TRACE_MAX_REGS pairs
+ *             seen get their own histogram, later ones only count towards the
+ *             bus histogram.
+ *
+ * @param[in]  bus   The bus ID
+ * @param[out] regs  array to fill
+ * @param[in]  max   size of the array
+ *
+ * @return     number of histograms written or -1 on failure
+ */
+int rc_i2c_get_register_histograms(int bus, rc_i2c_reg_histogram_t* regs, int max);
+
+/**
+ * @brief      Empties the trace ring and zeroes every histogram.
+ *
+ *             Transactions completing at the same moment may or may not be
+ *             counted.
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_i2c_reset_trace(void);
+
 #ifdef  __cplusplus
 }
 #endif
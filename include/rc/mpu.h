@@ -24,6 +24,52 @@
  *             function of your choosing set with the rc_mpu_set_dmp_callback()
  *             function.
  *
+ *             RAW FIFO: Without the DMP, accel, gyro and optionally temperature
+ *             samples go into the FIFO at up to 1khz, or 8khz with the gyro
+ *             DLPF bypassed. Each interrupt drains every queued sample and
+ *             hands the whole batch, each with its own timestamp, to the
+ *             function set with rc_mpu_set_raw_callback(). Start it with
+ *             rc_mpu_initialize_raw_fifo().
+ *
+ *             DATA READY: Accel, gyro and temperature are read straight from
+ *             the sensor registers on every data-ready interrupt, one sample
+ *             per interrupt at up to 1khz, and delivered through the same raw
+ *             callback. Nothing is loaded or queued on the chip, so it starts
+ *             as quickly as NORMAL mode. Start it with
+ *             rc_mpu_initialize_data_ready().
+ *
+ *             TIMESTAMPS: The MPU's oscillator runs a few percent off the
+ *             configured rate, and interrupts reach the interrupt thread with
+ *             varying latency. In the interrupt-driven modes the driver fits a
+ *             line to sample number against interrupt arrival time on
+ *             CLOCK_MONOTONIC and timestamps every sample on that line, so
+ *             timestamps are evenly spaced at the measured rate without the
+ *             arrival jitter. The fit settles after about a second, see
+ *             rc_mpu_get_stats for the measured rate and jitter, and
+ *             rc_mpu_config_t.timestamp_clock to choose the clock they are
+ *             given in.
+ *
+ *             SAMPLE RING: In the interrupt-driven modes every sample is also
+ *             published to a ring of rc_mpu_record_t, each with a timestamp
+ *             and a sequence number. The interrupt thread never waits for a
+ *             reader and readers never lock anything, they keep their own
+ *             cursor and can take records one at a time with
+ *             rc_mpu_ring_pop, catch up on everything queued with
+ *             rc_mpu_ring_read, or just look at the newest with
+ *             rc_mpu_ring_latest. A reader that falls more than
+ *             rc_mpu_config_t.ring_depth records behind loses the oldest,
+ *             which shows up as a gap in the sequence numbers.
+ *
+ *             With rc_mpu_config_t.ring_shm_name set the ring itself lives in
+ *             POSIX shared memory, so other processes can follow it through
+ *             <rc/mpu_subscriber.h> at no extra bus or copy cost to this one.
+ *
+ *             The functions above all work on one built-in device. To run
+ *             several IMUs in the same process, on different buses or
+ *             addresses, create a handle for each with rc_mpu_dev_create and
+ *             use the rc_mpu_dev_ version of each function, which takes the
+ *             handle as its first argument.
+ *
  * @author     James Strawson
  * @date       1/19/2018
  *
@@ -39,10 +85,15 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 #include <pthread.h>
+#include <rc/i2c.h>
+#include <rc/event_loop.h>
 
 #define RC_MPU_DEFAULT_I2C_ADDR	0x68 ///< default i2c address if AD0 is left low
 #define RC_MPU_ALT_I2C_ADDR	0x69 ///< alternate i2c address if AD0 pin pulled high
+#define RC_MPU_RAW_MAX_SAMPLES	85 ///< most samples handed to a raw FIFO callback at once, a full 1kB FIFO of accel and gyro
+#define RC_MPU_RING_MAX_DEPTH	8192 ///< largest rc_mpu_config_t.ring_depth, about a second of raw FIFO samples at 8khz
 
 
 // defines for index location within TaitBryan and quaternion vectors
@@ -131,6 +182,19 @@ typedef enum rc_mpu_gyro_dlpf_t{
 	GYRO_DLPF_5
 } rc_mpu_gyro_dlpf_t;
 
+/**
+ * @brief      clocks sample timestamps can be given in
+ *
+ *             Timestamps are always worked out against CLOCK_MONOTONIC and
+ *             then moved to the chosen clock. CLOCK_REALTIME follows the
+ *             system clock when it is stepped, the other two never jump.
+ */
+typedef enum rc_mpu_timestamp_clock_t{
+	TIMESTAMP_REALTIME,	///< CLOCK_REALTIME as from rc_nanos_since_epoch
+	TIMESTAMP_MONOTONIC,	///< CLOCK_MONOTONIC as from rc_nanos_since_boot
+	TIMESTAMP_MONOTONIC_RAW	///< CLOCK_MONOTONIC_RAW, not slewed by NTP either
+} rc_mpu_timestamp_clock_t;
+
 
 /**
  * @brief      Orientation of the sensor.
@@ -150,6 +214,90 @@ typedef enum rc_mpu_orientation_t{
 	ORIENTATION_X_BACK	= 161
 } rc_mpu_orientation_t;
 
+/**
+ * @brief      register-level transport used by the MPU driver
+ *
+ *             By default the driver talks to the sensor through the Linux I2C
+ *             bus selected with rc_mpu_config_t.i2c_bus and the GPIO interrupt
+ *             pin rc_mpu_config_t.gpio_interrupt_pin. Pointing
+ *             rc_mpu_config_t.transport at another instance of this struct
+ *             routes every register access, bus lock and interrupt wait
+ *             through it instead, for example to the software emulator in
+ *             <rc/mpu_emulator.h>.
+ *
+ *             Every function receives rc_mpu_config_t.transport_ctx as its
+ *             first argument. The addr argument is the 7-bit slave address,
+ *             either rc_mpu_config_t.i2c_addr for the MPU itself or 0x0C for
+ *             the AK8963 magnetometer behind it. Unless noted otherwise all
+ *             functions return 0 on success or -1 on failure.
+ */
+typedef struct rc_mpu_transport_t{
+	/** open the transport, bus and addr come from the config struct */
+	int (*init)(void* ctx, int bus, uint8_t addr);
+	/** optional, release anything init opened, called on power off */
+	int (*close)(void* ctx);
+	/** read length consecutive registers starting at reg */
+	int (*read_regs)(void* ctx, uint8_t addr, uint8_t reg, size_t length, uint8_t* data);
+	/** write length consecutive registers starting at reg */
+	int (*write_regs)(void* ctx, uint8_t addr, uint8_t reg, size_t length, const uint8_t* data);
+	/** read length bytes out of a single non-incrementing register such as the FIFO */
+	int (*burst_read)(void* ctx, uint8_t addr, uint8_t reg, size_t length, uint8_t* data);
+	/** optional, multi-segment transaction, see rc_i2c_transfer for semantics */
+	int (*transfer)(void* ctx, rc_i2c_seg_t* segs, int n);
+	/** claim exclusive use of the bus, must be recursive */
+	int (*lock)(void* ctx);
+	/** release the bus claimed with lock */
+	int (*unlock)(void* ctx);
+	/** set up the data interrupt, returns an fd to poll for the events written to *events */
+	int (*interrupt_open)(void* ctx, int pin, short* events);
+	/** consume an event after poll fires, returns 0 if it was a real interrupt */
+	int (*interrupt_ack)(void* ctx, int fd);
+	/** release the interrupt set up with interrupt_open */
+	void (*interrupt_close)(void* ctx, int pin);
+	/**
+	 * optional, used in place of interrupt_ack. Consumes every pending event
+	 * and reports the CLOCK_MONOTONIC time of the newest edge and a sequence
+	 * number that goes up by one per edge, either may be left 0 if unknown.
+	 * Returns 0 if it was a real interrupt.
+	 */
+	int (*interrupt_event)(void* ctx, int fd, uint64_t* timestamp_ns, uint32_t* seqno);
+} rc_mpu_transport_t;
+
+/**
+ * @brief      settings for talking to an MPU6500/MPU9250 over SPI
+ *
+ *             Use with rc_mpu_spi_transport by pointing
+ *             rc_mpu_config_t.transport_ctx at an instance of this struct. The
+ *             device is /dev/spidev<bus>.<slave>. Configuration registers are
+ *             always written and read at 1MHz as the datasheet requires, sensor,
+ *             interrupt and FIFO registers are read at speed_hz.
+ *
+ *             The AK8963 magnetometer inside the MPU9250 only hangs off the
+ *             MPU's auxiliary I2C bus so it can't be reached through the bypass
+ *             over SPI.
+ *
+ *             For testing without hardware, xfer can stand in for spidev. It
+ *             receives each full-duplex message exactly as it would go on the
+ *             wire, and irq can supply the interrupt functions in place of the
+ *             GPIO pin.
+ */
+typedef struct rc_mpu_spi_t{
+	int bus;		///< spidev bus number
+	int slave;		///< spidev chip select
+	uint32_t speed_hz;	///< clock for sensor and FIFO reads, up to 20MHz, default 1MHz if 0
+	/** optional stand-in for spidev, return 0 on success */
+	int (*xfer)(void* xfer_ctx, const uint8_t* tx, uint8_t* rx, size_t length);
+	void* xfer_ctx;		///< passed to xfer
+	const rc_mpu_transport_t* irq; ///< optional source of the interrupt functions, default is the GPIO pin
+	void* irq_ctx;		///< passed to the irq functions
+} rc_mpu_spi_t;
+
+/**
+ * @brief      transport for MPU6500/MPU9250 parts wired to SPI, see
+ *             rc_mpu_spi_t
+ */
+extern const rc_mpu_transport_t rc_mpu_spi_transport;
+
 /**
  * @brief      configuration of the mpu sensor
  *
@@ -160,10 +308,14 @@ typedef enum rc_mpu_orientation_t{
 typedef struct rc_mpu_config_t{
 	/** @name physical connection configuration */
 	///@{
-	int gpio_interrupt_pin;		///< gpio pin, default 117 on Robotics Cape and BB Blue
+	int gpio_interrupt_pin;		///< gpio pin, default 117 on Robotics Cape and BB Blue, or the line offset when gpio_interrupt_chip is set
+	int gpio_interrupt_chip;	///< use line gpio_interrupt_pin of /dev/gpiochip<n> instead of sysfs, giving kernel edge timestamps, default -1 for sysfs
 	int i2c_bus;			///< which bus to use, default 2 on Robotics Cape and BB Blue
 	uint8_t i2c_addr;		///< default is 0x68, pull pin ad0 high to make it 0x69
 	int show_warnings;		///< set to 1 to print i2c_bus warnings for debug
+	int print_errors;		///< print errors reported to the error log to stderr from a background thread, started at the beginning of any initialize call, see rc/error_log.h, default 1
+	const rc_mpu_transport_t* transport; ///< register transport, default NULL for the built-in I2C and GPIO drivers
+	void* transport_ctx;		///< passed as the first argument to every transport function, default NULL
 	///@}
 
 	/** @name accelerometer, gyroscope, and magnetometer configuration */
@@ -173,6 +325,7 @@ typedef struct rc_mpu_config_t{
 	rc_mpu_accel_dlpf_t accel_dlpf;	///< internal low pass filter cutoff, default ACCEL_DLPF_184
 	rc_mpu_gyro_dlpf_t gyro_dlpf;	///< internal low pass filter cutoff, default GYRO_DLPF_184
 	int enable_magnetometer;	///< magnetometer use is optional, set to 1 to enable, default 0 (off)
+	int mag_i2c_master;		///< reach the magnetometer through the MPU's own I2C master, which polls it into the EXT_SENS_DATA registers, instead of the I2C bypass. Mag data then comes in the same reads as the other sensors and works over SPI too. default 0 (bypass)
 	///@}
 
 	/** @name DMP settings, only used with DMP mode */
@@ -184,11 +337,36 @@ typedef struct rc_mpu_config_t{
 	float compass_time_constant;	///< time constant (seconds) for filtering compass with gyroscope yaw value, default 25
 	int dmp_interrupt_sched_policy;	///< Scheduler policy for DMP interrupt handler and user callback, default SCHED_OTHER
 	int dmp_interrupt_priority;	///< scheduler priority for DMP interrupt handler and user callback, default 0
-	int read_mag_after_callback;	///< reads magnetometer after DMP callback function to improve latency, default 1 (true)
-	int mag_sample_rate_div;	///< magnetometer_sample_rate = dmp_sample_rate/mag_sample_rate_div, default: 4
+	rc_event_loop_t* event_loop;	///< loop to service the DMP interrupt on, shared with other sensors and fds and run by the caller, default NULL for a private loop thread using the two settings above
+	int read_mag_after_callback;	///< reads magnetometer after DMP callback function to improve latency, default 1 (true). Not used with mag_i2c_master, the magnetometer then comes with every FIFO read
+	int mag_sample_rate_div;	///< magnetometer_sample_rate = dmp_sample_rate/mag_sample_rate_div, default: 4. Not used with mag_i2c_master
 	int tap_threshold;		///< threshold impulse for triggering a tap in units of mg/ms
 	///@}
 
+	/** @name raw FIFO settings, only used with raw FIFO and data-ready modes. The interrupt thread settings above apply too. */
+	///@{
+	int raw_sample_rate;		///< sample rate in hertz, must divide 1000, or 8000 when gyro_dlpf is GYRO_DLPF_OFF or GYRO_DLPF_250, and be at most 1000 in data-ready mode. default 1000
+	int raw_fifo_temp;		///< set to 1 to also put the temperature in the FIFO, default 0 (off)
+	int raw_fifo_mag;		///< set to 1 to also put the magnetometer in the FIFO, needs mag_i2c_master, default 0 (off)
+	///@}
+
+	/** @name FIFO batching and polling, used by DMP and raw FIFO modes */
+	///@{
+	int fifo_batch;			///< DMP packets or raw samples to let the FIFO collect before waking the interrupt thread, see rc_mpu_dev_set_dmp_batch_callback. default 1 wakes on every interrupt
+	int fifo_poll;			///< set to 1 when the interrupt pin isn't wired. A timer then wakes the interrupt thread slightly faster than every fifo_batch samples to read whatever the FIFO holds, and gpio_interrupt_pin is not used. default 0 (off)
+	///@}
+
+	/** @name sample timestamps, used by DMP, raw FIFO and data-ready modes */
+	///@{
+	rc_mpu_timestamp_clock_t timestamp_clock; ///< clock for dmp_timestamp_ns and the other sample timestamps, default TIMESTAMP_REALTIME
+	///@}
+
+	/** @name sample ring, used by DMP, raw FIFO and data-ready modes */
+	///@{
+	int ring_depth;			///< records kept for rc_mpu_ring_read and friends, a power of two up to RC_MPU_RING_MAX_DEPTH, default 64
+	const char* ring_shm_name;	///< also publish the ring as this POSIX shared memory object, e.g. "/rc_mpu", for rc_mpu_subscriber_open in other processes. default NULL keeps it private
+	///@}
+
 } rc_mpu_config_t;
 
 /**
@@ -220,6 +398,7 @@ typedef struct rc_mpu_data_t{
 	///@{
 	float dmp_quat[4];	///< normalized quaternion from DMP based on ONLY Accel/Gyro
 	float dmp_TaitBryan[3];	///< Tait-Bryan angles (roll pitch yaw) in radians from DMP based on ONLY Accel/Gyro
+	uint64_t dmp_timestamp_ns; ///< when this sample was taken, on rc_mpu_config_t.timestamp_clock
 	int tap_detected;	///< set to 1 if there was a tap detect on the last dmp sample, reset to 0 on next sample
 	int last_tap_direction;	///< direction of last tap, 1-6 corresponding to X+ X- Y+ Y- Z+ Z-
 	int last_tap_count;	///< current counter of rapid consecutive taps
@@ -235,6 +414,78 @@ typedef struct rc_mpu_data_t{
 } rc_mpu_data_t;
 
 
+/**
+ * @brief      one sample drained from the FIFO in raw FIFO mode, or read on
+ *             its interrupt in data-ready mode
+ *
+ *             The accelerometer only samples at 1khz, or 4khz with
+ *             ACCEL_DLPF_OFF, so above that rate consecutive samples repeat
+ *             its last reading.
+ */
+typedef struct rc_mpu_raw_sample_t{
+	uint64_t timestamp_ns;	///< when the sample was taken, on rc_mpu_config_t.timestamp_clock
+	float accel[3];		///< accelerometer (XYZ) in units of m/s^2
+	float gyro[3];		///< gyroscope (XYZ) in units of degrees/s
+	float temp;		///< thermometer in degrees Celsius, only with rc_mpu_config_t.raw_fifo_temp or in data-ready mode
+	float mag[3];		///< magnetometer (XYZ) in uT, only with rc_mpu_config_t.raw_fifo_mag, or mag_i2c_master in data-ready mode. Updates at 100hz, samples in between repeat the last value
+	int16_t raw_accel[3];	///< raw accelerometer (XYZ) from 16-bit ADC
+	int16_t raw_gyro[3];	///< raw gyroscope (XYZ) from 16-bit ADC
+} rc_mpu_raw_sample_t;
+
+/**
+ * @brief      one sample as published to the sample ring
+ *
+ *             data is the data struct as it was after this sample. In raw
+ *             FIFO mode only the sensor fields change from one record to the
+ *             next.
+ */
+typedef struct rc_mpu_record_t{
+	uint64_t seq;		///< counts up from 1 with each sample, carrying on across restarts that keep the same ring_depth and ring_shm_name
+	uint64_t timestamp_ns;	///< when the sample was taken, on rc_mpu_config_t.timestamp_clock
+	rc_mpu_data_t data;	///< the sample
+} rc_mpu_record_t;
+
+/**
+ * @brief      opaque handle to one IMU, see rc_mpu_dev_create
+ */
+typedef struct rc_mpu_t rc_mpu_t;
+
+/**
+ * @brief      DMP callback for rc_mpu_dev_set_dmp_callback, called with the
+ *             handle the data came from
+ */
+typedef void (*rc_mpu_dmp_callback_t)(rc_mpu_t* mpu, void* user);
+
+/**
+ * @brief      tap callback for rc_mpu_dev_set_tap_callback
+ */
+typedef void (*rc_mpu_tap_callback_t)(rc_mpu_t* mpu, int direction, int counter, void* user);
+
+/**
+ * @brief      raw FIFO and data-ready callback, called with the n samples
+ *             read on one interrupt, oldest first. The array is only valid during the call.
+ */
+typedef void (*rc_mpu_raw_callback_t)(rc_mpu_t* mpu, const rc_mpu_raw_sample_t* samples, int n, void* user);
+
+/**
+ * @brief      DMP batch callback, called once per wakeup with the n samples
+ *             read, oldest first. Each is the data struct as it was after that
+ *             packet. The array is only valid during the call.
+ */
+typedef void (*rc_mpu_dmp_batch_callback_t)(rc_mpu_t* mpu, const rc_mpu_data_t* samples, int n, void* user);
+
+/**
+ * @brief      counters kept by the interrupt thread, see rc_mpu_dev_get_stats
+ */
+typedef struct rc_mpu_stats_t{
+	uint64_t wakeups;	///< times the interrupt thread woke to read the FIFO
+	uint64_t samples;	///< DMP packets or raw samples delivered
+	uint64_t max_batch;	///< most samples delivered on one wakeup
+	double sample_rate_hz;	///< sample rate measured against CLOCK_MONOTONIC, 0 until about a second of samples came in
+	double arrival_jitter_ns; ///< rms of interrupt arrival times around the measured sample clock, which sample timestamps don't carry
+} rc_mpu_stats_t;
+
+
 /** @name common functions */
 ///@{
 
@@ -262,6 +513,8 @@ int rc_mpu_set_config_to_default(rc_mpu_config_t* conf);
  *             Only call this after powering on the MPU with rc_mpu_initialize
  *             or rc_mpu_initialize_dmp. This should geenrally be called at the
  *             end of your main function to make sure the MPU is put to sleep.
+ *             It may also be called from one of the data callbacks, nothing
+ *             more is delivered after it returns.
  *
  * @return     0 on success or -1 on failure.
  */
@@ -285,7 +538,8 @@ int rc_mpu_power_off();
  *
  *             After this, you may read sensor data at any time with the
  *             functions rc_mpu_read_accel, rc_mpu_read_gyro, and
- *             rc_mpu_read_temp. The magentometer can also be read with
+ *             rc_mpu_read_temp, or all three at once with rc_mpu_read_all.
+ *             The magentometer can also be read with
  *             rc_mpu_read_mag if using an MPU9150 or MPU9250 and the
  *             enable_magnetometer field in the rc_mpu_config_t struct has been
  *             set to 1.
@@ -341,12 +595,33 @@ int rc_mpu_read_temp(rc_mpu_data_t* data);
  *             enable_magnetometer flag must has been set in the user's
  *             rc_mpu_config_t when it was passed to rc_mpu_initialize()
  *
+ *             With mag_i2c_master set this is a single read of the
+ *             EXT_SENS_DATA registers the MPU keeps up to date, and
+ *             rc_mpu_read_all picks up the magnetometer as well.
+ *
  * @param      data  Pointer to user's data struct where new data will be
  *                   written
  *
  * @return     0 on success or -1 on failure.
  */
 int rc_mpu_read_mag(rc_mpu_data_t* data);
+
+/**
+ * @brief      Reads accelerometer, thermometer and gyroscope data in one
+ *             transaction
+ *
+ *             Same result as rc_mpu_read_accel, rc_mpu_read_temp and
+ *             rc_mpu_read_gyro together, but with one 14-byte bus read instead
+ *             of three, and all three values are guaranteed to come from the
+ *             same sample. With mag_i2c_master set the read extends over the
+ *             EXT_SENS_DATA registers and also fills in the magnetometer.
+ *
+ * @param      data  Pointer to user's data struct where new data will be
+ *                   written
+ *
+ * @return     0 on success or -1 on failure.
+ */
+int rc_mpu_read_all(rc_mpu_data_t* data);
 ///@} end normal one-shot sampling functions
 
 
@@ -361,6 +636,10 @@ int rc_mpu_read_mag(rc_mpu_data_t* data);
  *             mag. Instead the data will automatically be read into the user's
  *             data struct at the dmp_sample_rate set in the config struct.
  *
+ *             On boards where the MPU's interrupt pin isn't connected set
+ *             fifo_poll in the config. The FIFO is then checked from a timer
+ *             instead and packets are delivered exactly as they would be on
+ *             interrupts, with the same timestamps, a little later on average.
  *
  * @param      data  Pointer to user's data struct where new data will be
  *                   written
@@ -374,6 +653,11 @@ int rc_mpu_initialize_dmp(rc_mpu_data_t* data, rc_mpu_config_t conf);
  * @brief      Sets the callback function that will be triggered when new DMP
  *             data is ready.
  *
+ *             If the interrupt thread fell behind and several packets were
+ *             waiting, the data struct is filled from each in turn and the
+ *             callback runs once per packet. Use dmp_timestamp_ns to tell
+ *             them apart.
+ *
  * @param[in]  func  user's callback function
  *
  * @return     0 on success or -1 on failure.
@@ -396,6 +680,40 @@ int rc_mpu_block_until_dmp_data();
  */
 int64_t rc_mpu_nanos_since_last_dmp_interrupt();
 
+/**
+ * @brief      counts DMP interrupts that were never serviced
+ *
+ *             Only the gpio character device backend (see
+ *             rc_mpu_config_t.gpio_interrupt_chip) and transports with an
+ *             interrupt_event function number their edges, so with sysfs
+ *             this stays 0. Reset by rc_mpu_initialize_dmp.
+ *
+ * @return     edges that arrived while the handler was still busy with an
+ *             earlier one, or were dropped by the kernel
+ */
+uint64_t rc_mpu_missed_dmp_interrupts(void);
+
+/**
+ * @brief      Sets the function called once per wakeup with every DMP sample
+ *             read on it. See rc_mpu_dev_set_dmp_batch_callback for how this
+ *             goes with rc_mpu_config_t.fifo_batch.
+ *
+ * @param[in]  func  user's callback function, NULL to remove it
+ * @param      user  passed to func
+ *
+ * @return     0 on success or -1 on failure.
+ */
+int rc_mpu_set_dmp_batch_callback(rc_mpu_dmp_batch_callback_t func, void* user);
+
+/**
+ * @brief      Reads the interrupt thread's wakeup and sample counters.
+ *
+ * @param[out] stats  filled in with the counters
+ *
+ * @return     0 on success or -1 on failure.
+ */
+int rc_mpu_get_stats(rc_mpu_stats_t* stats);
+
 /**
  * @brief      sets the callback function triggered when a tap is detected
  *
@@ -424,6 +742,156 @@ int64_t rc_mpu_nanos_since_last_tap();
 
 
 
+/** @name interrupt-driven raw FIFO mode functions */
+///@{
+
+/**
+ * @brief      Initializes the MPU in raw FIFO mode.
+ *
+ *             Accel and gyro, plus temperature if raw_fifo_temp is set, are
+ *             written to the FIFO at raw_sample_rate without loading the DMP.
+ *             The data-ready interrupt wakes the interrupt thread, which reads
+ *             every complete sample in the FIFO in one burst. With fifo_batch
+ *             above 1 a timer wakes it every fifo_batch samples instead, and
+ *             with fifo_poll a timer wakes it a little more often than that
+ *             for boards without the interrupt pin wired.
+ *             Samples are timestamped as described under TIMESTAMPS above. If
+ *             the reader falls so far behind that the FIFO fills, the samples
+ *             in it are still delivered but those that didn't fit are lost and
+ *             the timing restarts.
+ *
+ *             The newest sample is also copied to the accel, gyro and temp
+ *             fields of data, and rc_mpu_block_until_dmp_data and
+ *             rc_mpu_nanos_since_last_dmp_interrupt work as in DMP mode. The
+ *             magnetometer is set up if enabled. With mag_i2c_master and
+ *             raw_fifo_mag it is part of every sample, otherwise the interrupt
+ *             thread doesn't read it, use rc_mpu_read_mag.
+ *
+ * @param      data  Pointer to user's data struct where the newest sample
+ *                   will be written
+ * @param[in]  conf  User's configuration struct
+ *
+ * @return     0 on success or -1 on failure.
+ */
+int rc_mpu_initialize_raw_fifo(rc_mpu_data_t* data, rc_mpu_config_t conf);
+
+/**
+ * @brief      Sets the function called with each batch of raw FIFO samples.
+ *
+ * @param[in]  func  user's callback function, NULL to remove it
+ * @param      user  passed to func
+ *
+ * @return     0 on success or -1 on failure.
+ */
+int rc_mpu_set_raw_callback(rc_mpu_raw_callback_t func, void* user);
+///@} end interrupt-driven raw FIFO mode functions
+
+
+
+/** @name interrupt-driven data-ready mode functions */
+///@{
+
+/**
+ * @brief      Initializes the MPU in data-ready mode.
+ *
+ *             An interrupt-driven alternative to rc_mpu_initialize for when
+ *             the DMP isn't needed. The MPU samples at raw_sample_rate, up to
+ *             1khz, and raises the data-ready interrupt for each sample. The
+ *             interrupt thread then reads accel, temperature and gyro in one
+ *             14 byte burst. Startup skips
+ *             the DMP firmware load and the FIFO is not used, so there is
+ *             nothing to drain or realign but every sample costs a bus read
+ *             of its own. fifo_batch must be 1.
+ *
+ *             Each sample is handed to the callback set with
+ *             rc_mpu_set_raw_callback as a batch of one, timestamped as
+ *             described under TIMESTAMPS above, published to the sample ring
+ *             and left in the accel, gyro and temp fields of data.
+ *             rc_mpu_block_until_dmp_data and
+ *             rc_mpu_nanos_since_last_dmp_interrupt work as in DMP mode. The
+ *             magnetometer is set up if enabled. With mag_i2c_master it comes
+ *             in the same read, otherwise use rc_mpu_read_mag. The pin
+ *             pulses for every sample, so the interrupt thread falling behind
+ *             loses only the samples whose edges it missed, and those are
+ *             counted by rc_mpu_missed_dmp_interrupts.
+ *
+ * @param      data  Pointer to user's data struct where each sample will be
+ *                   written
+ * @param[in]  conf  User's configuration struct
+ *
+ * @return     0 on success or -1 on failure.
+ */
+int rc_mpu_initialize_data_ready(rc_mpu_data_t* data, rc_mpu_config_t conf);
+///@} end interrupt-driven data-ready mode functions
+
+
+
+/** @name sample ring functions, DMP, raw FIFO and data-ready modes */
+///@{
+
+/**
+ * @brief      Takes the next record after a reader's cursor.
+ *
+ *             Each reader keeps its own cursor, the sequence number of the
+ *             next record it wants, so any number of threads can read without
+ *             affecting each other or the interrupt thread. Start the cursor
+ *             at 0 for the oldest record still in the ring, or at
+ *             rc_mpu_ring_latest's seq + 1 for only those still to come. If
+ *             the wanted record has already been overwritten the oldest one
+ *             left is returned instead, so compare rec->seq with the cursor
+ *             to count what was lost.
+ *
+ * @param      cursor  the reader's cursor, advanced past the record returned
+ * @param[out] rec     the record
+ *
+ * @return     0 if a record was returned, 1 if there is nothing new yet, or -1
+ *             on error.
+ */
+int rc_mpu_ring_pop(uint64_t* cursor, rc_mpu_record_t* rec);
+
+/**
+ * @brief      Takes up to max records after a reader's cursor at once.
+ *
+ *             The backlog version of rc_mpu_ring_pop, use it to catch up
+ *             after being busy. Records are oldest first.
+ *
+ * @param      cursor  the reader's cursor, advanced past the last record
+ *                     returned
+ * @param[out] recs    array for the records
+ * @param[in]  max     length of recs
+ *
+ * @return     number of records returned, 0 if there is nothing new, or -1 on
+ *             error.
+ */
+int rc_mpu_ring_read(uint64_t* cursor, rc_mpu_record_t* recs, int max);
+
+/**
+ * @brief      Copies the newest record without moving any cursor.
+ *
+ * @param[out] rec   the record
+ *
+ * @return     0 on success, 1 if nothing has been published yet, or -1 on
+ *             error.
+ */
+int rc_mpu_ring_latest(rc_mpu_record_t* rec);
+
+/**
+ * @brief      Sleeps until the record a cursor points at is published.
+ *
+ *             Sleeping readers cost the interrupt thread one futex wake per
+ *             wakeup, it never waits on them.
+ *
+ * @param[in]  cursor      a reader's cursor, as kept for rc_mpu_ring_pop
+ * @param[in]  timeout_ms  longest to wait, or -1 for no limit
+ *
+ * @return     0 once the record is there, 1 on timeout or if the MPU is
+ *             shutting down due to rc_mpu_power_off, or -1 on error.
+ */
+int rc_mpu_ring_wait(uint64_t cursor, int timeout_ms);
+///@} end sample ring functions
+
+
+
 /** @name calibration functions */
 ///@{
 
@@ -476,11 +944,195 @@ int rc_mpu_is_gyro_calibrated();
 int rc_mpu_is_mag_calibrated();
 ///@} end calibration functions
 
-  /* Thread control */
-  #include <pthread.h>
-  pthread_mutex_t read_mutex;
-  pthread_cond_t  read_condition;
-  
+
+
+/** @name multiple device functions */
+///@{
+
+/**
+ * @brief      Allocates a handle for one IMU.
+ *
+ *             The handle starts out powered off, bring it up with
+ *             rc_mpu_dev_initialize or rc_mpu_dev_initialize_dmp with a config
+ *             naming its own bus, address and interrupt pin. Each handle in
+ *             DMP mode can share one interrupt thread with the others through
+ *             rc_mpu_config_t.event_loop.
+ *
+ * @return     the handle, or NULL on failure
+ */
+rc_mpu_t* rc_mpu_dev_create(void);
+
+/**
+ * @brief      Powers off the IMU if needed and frees the handle.
+ *
+ * @param      mpu   handle from rc_mpu_dev_create
+ */
+void rc_mpu_dev_destroy(rc_mpu_t* mpu);
+
+/**
+ * @brief      Returns the handle the functions without one operate on, for
+ *             mixing the two APIs.
+ *
+ * @return     the default handle
+ */
+rc_mpu_t* rc_mpu_dev_default(void);
+
+/** @brief rc_mpu_power_off for a given handle */
+int rc_mpu_dev_power_off(rc_mpu_t* mpu);
+/** @brief rc_mpu_initialize for a given handle */
+int rc_mpu_dev_initialize(rc_mpu_t* mpu, rc_mpu_data_t* data, rc_mpu_config_t conf);
+/** @brief rc_mpu_read_accel for a given handle */
+int rc_mpu_dev_read_accel(rc_mpu_t* mpu, rc_mpu_data_t* data);
+/** @brief rc_mpu_read_gyro for a given handle */
+int rc_mpu_dev_read_gyro(rc_mpu_t* mpu, rc_mpu_data_t* data);
+/** @brief rc_mpu_read_temp for a given handle */
+int rc_mpu_dev_read_temp(rc_mpu_t* mpu, rc_mpu_data_t* data);
+/** @brief rc_mpu_read_mag for a given handle */
+int rc_mpu_dev_read_mag(rc_mpu_t* mpu, rc_mpu_data_t* data);
+/** @brief rc_mpu_read_all for a given handle */
+int rc_mpu_dev_read_all(rc_mpu_t* mpu, rc_mpu_data_t* data);
+/** @brief rc_mpu_initialize_dmp for a given handle */
+int rc_mpu_dev_initialize_dmp(rc_mpu_t* mpu, rc_mpu_data_t* data, rc_mpu_config_t conf);
+/** @brief rc_mpu_initialize_raw_fifo for a given handle */
+int rc_mpu_dev_initialize_raw_fifo(rc_mpu_t* mpu, rc_mpu_data_t* data, rc_mpu_config_t conf);
+/** @brief rc_mpu_initialize_data_ready for a given handle */
+int rc_mpu_dev_initialize_data_ready(rc_mpu_t* mpu, rc_mpu_data_t* data, rc_mpu_config_t conf);
+/** @brief rc_mpu_set_raw_callback for a given handle */
+int rc_mpu_dev_set_raw_callback(rc_mpu_t* mpu, rc_mpu_raw_callback_t func, void* user);
+
+/**
+ * @brief      Sets the function called after each DMP sample is read.
+ *
+ * @param      mpu   The handle
+ * @param[in]  func  called with mpu and user, NULL to remove it
+ * @param      user  passed to func
+ *
+ * @return     0 on success or -1 on failure.
+ */
+int rc_mpu_dev_set_dmp_callback(rc_mpu_t* mpu, rc_mpu_dmp_callback_t func, void* user);
+
+/** @brief rc_mpu_block_until_dmp_data for a given handle */
+int rc_mpu_dev_block_until_dmp_data(rc_mpu_t* mpu);
+/** @brief rc_mpu_nanos_since_last_dmp_interrupt for a given handle */
+int64_t rc_mpu_dev_nanos_since_last_dmp_interrupt(rc_mpu_t* mpu);
+/** @brief rc_mpu_missed_dmp_interrupts for a given handle */
+uint64_t rc_mpu_dev_missed_dmp_interrupts(rc_mpu_t* mpu);
+
+/**
+ * @brief      Sets the function called once per wakeup with every DMP sample
+ *             read on it.
+ *
+ *             Runs after the per-sample DMP callback has been called for each
+ *             of them. This is the natural consumer when fifo_batch in the
+ *             config is above 1. The interrupt thread then no longer wakes on
+ *             every DMP interrupt but from a timer every fifo_batch sample
+ *             periods, and reads the whole batch in one burst. That divides
+ *             the thread's wakeups and context switches by fifo_batch. The
+ *             cost is latency: the oldest sample of a batch is up to
+ *             fifo_batch periods old when delivered, instead of about one
+ *             read's worth. rc_mpu_dev_get_stats shows the wakeup rate that
+ *             results.
+ *
+ * @param      mpu   The handle
+ * @param[in]  func  called with mpu, the samples, their count and user, NULL
+ *                   to remove it
+ * @param      user  passed to func
+ *
+ * @return     0 on success or -1 on failure.
+ */
+int rc_mpu_dev_set_dmp_batch_callback(rc_mpu_t* mpu, rc_mpu_dmp_batch_callback_t func, void* user);
+
+/**
+ * @brief      Reads the interrupt thread's counters.
+ *
+ *             They are reset by the initialize functions.
+ *
+ * @param      mpu    The handle
+ * @param[out] stats  filled in with the counters
+ *
+ * @return     0 on success or -1 on failure.
+ */
+int rc_mpu_dev_get_stats(rc_mpu_t* mpu, rc_mpu_stats_t* stats);
+/** @brief rc_mpu_ring_pop for a given handle */
+int rc_mpu_dev_ring_pop(rc_mpu_t* mpu, uint64_t* cursor, rc_mpu_record_t* rec);
+/** @brief rc_mpu_ring_read for a given handle */
+int rc_mpu_dev_ring_read(rc_mpu_t* mpu, uint64_t* cursor, rc_mpu_record_t* recs, int max);
+/** @brief rc_mpu_ring_latest for a given handle */
+int rc_mpu_dev_ring_latest(rc_mpu_t* mpu, rc_mpu_record_t* rec);
+/** @brief rc_mpu_ring_wait for a given handle */
+int rc_mpu_dev_ring_wait(rc_mpu_t* mpu, uint64_t cursor, int timeout_ms);
+
+/**
+ * @brief      Sets the function called when a tap is detected.
+ *
+ * @param      mpu   The handle
+ * @param[in]  func  called with mpu, the direction, the count and user, NULL
+ *                   to remove it
+ * @param      user  passed to func
+ *
+ * @return     0 on success or -1 on failure.
+ */
+int rc_mpu_dev_set_tap_callback(rc_mpu_t* mpu, rc_mpu_tap_callback_t func, void* user);
+
+/** @brief rc_mpu_block_until_tap for a given handle */
+int rc_mpu_dev_block_until_tap(rc_mpu_t* mpu);
+/** @brief rc_mpu_nanos_since_last_tap for a given handle */
+int64_t rc_mpu_dev_nanos_since_last_tap(rc_mpu_t* mpu);
+
+/**
+ * @brief      rc_mpu_calibrate_gyro_routine for a given handle
+ *
+ *             A device on the cape's IMU bus and address uses the same
+ *             calibration file as the default device, any other I2C bus or
+ *             address gets its own file keyed by both and an
+ *             rc_mpu_spi_transport device one keyed by its spidev bus and
+ *             chip select. Other transports, including the emulator and SPI
+ *             with an xfer stand-in, have no calibration file and this fails.
+ */
+int rc_mpu_dev_calibrate_gyro_routine(rc_mpu_t* mpu, rc_mpu_config_t conf);
+
+/**
+ * @brief      rc_mpu_is_gyro_calibrated for a given handle
+ *
+ *             Looks for the file rc_mpu_dev_calibrate_gyro_routine would write
+ *             for the bus, address or transport the handle was last
+ *             initialized or calibrated with.
+ *
+ * @return     1 if the file exists, otherwise 0
+ */
+int rc_mpu_dev_is_gyro_calibrated(rc_mpu_t* mpu);
+
+/**
+ * @brief      rc_mpu_calibrate_mag_routine for a given handle
+ *
+ *             A device on the cape's IMU bus and address uses the same
+ *             calibration file as the default device, any other I2C bus or
+ *             address gets its own file keyed by both and an
+ *             rc_mpu_spi_transport device one keyed by its spidev bus and
+ *             chip select. Other transports, including the emulator and SPI
+ *             with an xfer stand-in, have no calibration file and this fails.
+ */
+int rc_mpu_dev_calibrate_mag_routine(rc_mpu_t* mpu, rc_mpu_config_t conf);
+
+/**
+ * @brief      rc_mpu_is_mag_calibrated for a given handle
+ *
+ *             Looks for the file rc_mpu_dev_calibrate_mag_routine would write
+ *             for the bus, address or transport the handle was last
+ *             initialized or calibrated with.
+ *
+ * @return     1 if the file exists, otherwise 0
+ */
+int rc_mpu_dev_is_mag_calibrated(rc_mpu_t* mpu);
+///@} end multiple device functions
+
+  /* Thread control of the default device, defined in mpu.c. read_condition
+   * is still broadcast after each batch of samples, but the interrupt thread
+   * no longer holds read_mutex while it updates the data struct, use the
+   * sample ring for consistent copies. */
+  extern pthread_mutex_t read_mutex;
+  extern pthread_cond_t  read_condition;
+
 #ifdef  __cplusplus
 }
 #endif
@@ -0,0 +1,172 @@
+/**
+ * @headerfile mpu_emulator.h <rc/mpu_emulator.h>
+ *
+ * @brief      Software MPU9250/AK8963 for running the MPU driver without
+ *             hardware.
+ *
+ *             The emulator models the MPU9250 register file, the 1kB FIFO
+ *             filled at the configured sample rate, the DMP memory and the
+ *             packets the motion driver firmware produces, and the AK8963
+ *             magnetometer behind the I2C bypass. The data interrupt is an
+ *             eventfd that is written whenever the real chip would pull its
+ *             INT pin.
+ *
+ *             Hand it to the driver through the transport fields of
+ *             rc_mpu_config_t:
+ *
+ * @code
+ * rc_mpu_emulator_t* emu = rc_mpu_emulator_create();
+ * rc_mpu_config_t conf = rc_mpu_default_config();
+ * conf.transport = &rc_mpu_emulator_transport;
+ * conf.transport_ctx = emu;
+ * rc_mpu_initialize_dmp(&data, conf);
+ * @endcode
+ *
+ *             The sensor is simulated as a rigid body spinning at a constant
+ *             rate in a fixed gravity and magnetic field so the quaternion,
+ *             accelerometer, gyroscope and magnetometer outputs all agree with
+ *             each other. Time can be sped up with
+ *             rc_mpu_emulator_set_time_scale to push the driver well past the
+ *             rates real hardware allows.
+ *
+ * @addtogroup MPU
+ * @{
+ */
+
+#ifndef RC_MPU_EMULATOR_H
+#define RC_MPU_EMULATOR_H
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <rc/mpu.h>
+
+/**
+ * @brief      opaque emulator instance, create with rc_mpu_emulator_create
+ */
+typedef struct rc_mpu_emulator_t rc_mpu_emulator_t;
+
+/**
+ * @brief      counters kept by the emulator, see rc_mpu_emulator_get_stats
+ */
+typedef struct rc_mpu_emulator_stats_t{
+	uint64_t reg_reads;	///< register read transactions
+	uint64_t reg_writes;	///< register write transactions
+	uint64_t bytes_read;	///< bytes returned by register reads
+	uint64_t bytes_written;	///< bytes accepted by register writes
+	uint64_t samples;	///< accel/gyro samples generated
+	uint64_t mag_samples;	///< magnetometer samples generated
+	uint64_t fifo_packets;	///< DMP packets or raw samples pushed into the FIFO
+	uint64_t fifo_overflows;///< bytes lost because the FIFO was full
+	uint64_t interrupts;	///< interrupts raised on the eventfd
+	uint64_t mag_reads;	///< magnetometer reads done by the I2C master's slave 0
+} rc_mpu_emulator_stats_t;
+
+/**
+ * @brief      transport functions to put in rc_mpu_config_t.transport, with
+ *             the emulator instance as rc_mpu_config_t.transport_ctx
+ */
+extern const rc_mpu_transport_t rc_mpu_emulator_transport;
+
+/**
+ * @brief      Handles one SPI message as the emulated chip would.
+ *
+ *             Matches the xfer member of rc_mpu_spi_t so the SPI transport can
+ *             be run against the emulator. Put the emulator in both xfer_ctx
+ *             and irq_ctx and rc_mpu_emulator_transport in irq. The first byte
+ *             of tx is the register address with the top bit set for reads.
+ *
+ * @param      emu     The emulator
+ * @param[in]  tx      bytes clocked out
+ * @param[out] rx      bytes clocked back in, may be NULL for writes
+ * @param[in]  length  message length including the address byte
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_mpu_emulator_spi_xfer(void* emu, const uint8_t* tx, uint8_t* rx, size_t length);
+
+/**
+ * @brief      Creates an emulator and starts its sampling thread.
+ *
+ *             The emulated chip starts out as if just powered on. Time runs at
+ *             real speed and the body is stationary with Z up.
+ *
+ * @return     new instance or NULL on failure
+ */
+rc_mpu_emulator_t* rc_mpu_emulator_create(void);
+
+/**
+ * @brief      Stops the sampling thread and frees the emulator.
+ *
+ *             Power off the MPU driver first if it is using this instance.
+ *
+ * @param      emu   instance from rc_mpu_emulator_create
+ */
+void rc_mpu_emulator_destroy(rc_mpu_emulator_t* emu);
+
+/**
+ * @brief      Speeds up or slows down emulated time.
+ *
+ *             A scale of 10 makes a 200hz DMP produce 2000 packets per second
+ *             of wall time. Data contents are still computed in emulated time
+ *             so the motion looks the same at any speed. When the host can't
+ *             keep up the emulator generates samples in bursts, which the
+ *             driver sees as several packets waiting in the FIFO.
+ *
+ * @param      emu    The emulator
+ * @param[in]  scale  emulated seconds per real second, must be >0
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_mpu_emulator_set_time_scale(rc_mpu_emulator_t* emu, double scale);
+
+/**
+ * @brief      Sets the rate the emulated body is spinning at.
+ *
+ * @param      emu       The emulator
+ * @param[in]  rate_degs  angular rate about body XYZ in degrees/s
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_mpu_emulator_set_rotation_rate(rc_mpu_emulator_t* emu, const float rate_degs[3]);
+
+/**
+ * @brief      Makes the next DMP packet report a tap.
+ *
+ * @param      emu        The emulator
+ * @param[in]  direction  tap direction 1-6 as reported by the DMP
+ * @param[in]  count      number of consecutive taps 1-8
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_mpu_emulator_inject_tap(rc_mpu_emulator_t* emu, int direction, int count);
+
+/**
+ * @brief      Reads the emulator's counters.
+ *
+ * @param      emu    The emulator
+ * @param[out] stats  written with a snapshot of the counters
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_mpu_emulator_get_stats(rc_mpu_emulator_t* emu, rc_mpu_emulator_stats_t* stats);
+
+/**
+ * @brief      Zeroes the emulator's counters.
+ *
+ * @param      emu   The emulator
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_mpu_emulator_reset_stats(rc_mpu_emulator_t* emu);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif // RC_MPU_EMULATOR_H
+
+/** @} end group MPU */
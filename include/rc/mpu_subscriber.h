@@ -0,0 +1,132 @@
+/**
+ * @headerfile mpu_subscriber.h <rc/mpu_subscriber.h>
+ *
+ * @brief      Follows another process's MPU sample ring through shared
+ *             memory.
+ *
+ *             The process running the driver publishes its sample ring by
+ *             setting rc_mpu_config_t.ring_shm_name before starting DMP or
+ *             raw FIFO mode. The interrupt thread writes each record straight
+ *             into the shared memory object, so any number of subscribers cost
+ *             it nothing more than one futex wake per batch.
+ *
+ * @code
+ * // publisher
+ * conf.ring_shm_name = "/rc_mpu";
+ * rc_mpu_initialize_dmp(&data, conf);
+ *
+ * // subscriber, in another process
+ * rc_mpu_subscriber_t* sub = rc_mpu_subscriber_open("/rc_mpu");
+ * uint64_t cursor = 0;
+ * rc_mpu_record_t rec[16];
+ * while(rc_mpu_subscriber_wait(sub, cursor, -1)==0){
+ * 	n = rc_mpu_subscriber_read(sub, &cursor, rec, 16);
+ * 	...
+ * }
+ * @endcode
+ *
+ *             A subscriber maps the ring read-only and reads it exactly as
+ *             rc_mpu_ring_read does in the driver's process, so taking the
+ *             newest record or a backlog is a plain memory copy with no system
+ *             call. Only rc_mpu_subscriber_wait enters the kernel, to sleep.
+ *
+ *             The ring stays mapped until rc_mpu_subscriber_close even if the
+ *             publisher powers off or exits. A clean rc_mpu_power_off marks it
+ *             closed, and a publisher that starts again in the same process
+ *             reopens it where it left off. A new publisher process replaces
+ *             the object with a fresh one, so a subscriber that finds its
+ *             ring closed for good should open the name again. A publisher
+ *             that crashed never closes its ring, its timestamps just stop
+ *             moving.
+ *
+ * @addtogroup MPU
+ * @{
+ */
+
+#ifndef RC_MPU_SUBSCRIBER_H
+#define RC_MPU_SUBSCRIBER_H
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <rc/mpu.h>
+
+/**
+ * @brief      opaque subscription, create with rc_mpu_subscriber_open
+ */
+typedef struct rc_mpu_subscriber_t rc_mpu_subscriber_t;
+
+/**
+ * @brief      Maps a sample ring published under a shared memory name.
+ *
+ *             Fails if nothing is published under that name or it was
+ *             published by a build of the library with a different
+ *             rc_mpu_record_t.
+ *
+ * @param[in]  name  rc_mpu_config_t.ring_shm_name of the publisher
+ *
+ * @return     the subscription, or NULL on failure
+ */
+rc_mpu_subscriber_t* rc_mpu_subscriber_open(const char* name);
+
+/**
+ * @brief      Unmaps the ring and frees the subscription.
+ *
+ * @param      sub   The subscription
+ */
+void rc_mpu_subscriber_close(rc_mpu_subscriber_t* sub);
+
+/**
+ * @brief      Copies the records from cursor on, as rc_mpu_ring_read.
+ *
+ * @param      sub     The subscription
+ * @param      cursor  sequence number of the next record wanted, 0 to start
+ *                     from the oldest kept. Moved past the records copied.
+ * @param[out] recs    array of at least max records
+ * @param[in]  max     most records to copy
+ *
+ * @return     the number of records copied, or -1 on error
+ */
+int rc_mpu_subscriber_read(rc_mpu_subscriber_t* sub, uint64_t* cursor, rc_mpu_record_t* recs, int max);
+
+/**
+ * @brief      Copies the newest record, as rc_mpu_ring_latest.
+ *
+ * @param      sub   The subscription
+ * @param[out] rec   the record
+ *
+ * @return     0 on success, 1 if nothing was published yet, or -1 on error
+ */
+int rc_mpu_subscriber_latest(rc_mpu_subscriber_t* sub, rc_mpu_record_t* rec);
+
+/**
+ * @brief      Sleeps until the record numbered cursor is published, as
+ *             rc_mpu_ring_wait.
+ *
+ * @param      sub         The subscription
+ * @param[in]  cursor      sequence number to wait for
+ * @param[in]  timeout_ms  longest to wait, or -1 for no limit
+ *
+ * @return     0 once the record is there, 1 on timeout or if the publisher
+ *             is powered off, or -1 on error.
+ */
+int rc_mpu_subscriber_wait(rc_mpu_subscriber_t* sub, uint64_t cursor, int timeout_ms);
+
+/**
+ * @brief      Checks whether the publisher has powered off.
+ *
+ * @param      sub   The subscription
+ *
+ * @return     1 if closed, 0 if still publishing, or -1 on error
+ */
+int rc_mpu_subscriber_closed(rc_mpu_subscriber_t* sub);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif // RC_MPU_SUBSCRIBER_H
+
+/** @} end group MPU */
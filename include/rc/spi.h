@@ -0,0 +1,161 @@
+/**
+ * @headerfile spi.h <rc/spi.h>
+ *
+ * @brief      userspace C interface for the Linux spidev driver
+ *
+ *             Each slave is addressed by its bus and chip-select number and
+ *             corresponds to the device node /dev/spidev<bus>.<slave>.
+ *             Transfers are full-duplex: every byte clocked out clocks one byte
+ *             back in.
+ *
+ * @addtogroup SPI
+ * @ingroup IO
+ * @{
+ */
+
+
+#ifndef RC_SPI_H
+#define RC_SPI_H
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief      Maximum SPI bus identifier.
+ */
+#define SPI_MAX_BUS 2
+
+/**
+ * @brief      Number of chip selects per bus.
+ */
+#define SPI_MAX_SLAVES 4
+
+/**
+ * @brief      Largest single transfer in bytes, the spidev default bufsiz.
+ */
+#define SPI_MAX_TRANSFER 4096
+
+/**
+ * @brief      SPI clock polarity and phase, see the SPI_MODE_* constants in
+ *             linux/spi/spidev.h.
+ */
+typedef enum rc_spi_mode_t{
+	SPI_MODE_CPOL0_CPHA0 = 0,
+	SPI_MODE_CPOL0_CPHA1 = 1,
+	SPI_MODE_CPOL1_CPHA0 = 2,
+	SPI_MODE_CPOL1_CPHA1 = 3
+} rc_spi_mode_t;
+
+/**
+ * @brief      Opens a slave and configures its mode and default clock.
+ *
+ *             Words are always 8 bits, most significant bit first. Calling
+ *             again on an open slave reconfigures it.
+ *
+ * @param[in]  bus       The bus
+ * @param[in]  slave     The chip select
+ * @param[in]  mode      The clock mode
+ * @param[in]  speed_hz  The default clock speed in hz
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_spi_init(int bus, int slave, rc_spi_mode_t mode, uint32_t speed_hz);
+
+/**
+ * @brief      Closes a slave opened with rc_spi_init.
+ *
+ * @param[in]  bus    The bus
+ * @param[in]  slave  The chip select
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_spi_close(int bus, int slave);
+
+/**
+ * @brief      Gets the spidev file descriptor of an open slave.
+ *
+ * @param[in]  bus    The bus
+ * @param[in]  slave  The chip select
+ *
+ * @return     the file descriptor or -1 if the slave isn't open
+ */
+int rc_spi_get_fd(int bus, int slave);
+
+/**
+ * @brief      Full-duplex transfer with chip select held for the whole
+ *             message.
+ *
+ *             Sends length bytes from tx while receiving length bytes into
+ *             rx. Either may be NULL to send zeros or discard what comes back.
+ *             Safe to call from real-time threads, failures are reported
+ *             through rc_error_report with ERR_SRC_SPI rather than printed.
+ *
+ * @param[in]  bus       The bus
+ * @param[in]  slave     The chip select
+ * @param[in]  tx        bytes to send or NULL
+ * @param[out] rx        buffer for received bytes or NULL
+ * @param[in]  length    number of bytes, at most SPI_MAX_TRANSFER
+ * @param[in]  speed_hz  clock for this transfer, 0 for the rc_spi_init default
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_spi_transfer(int bus, int slave, const uint8_t* tx, uint8_t* rx, size_t length, uint32_t speed_hz);
+
+/**
+ * @brief      Sends bytes, discarding anything clocked back in.
+ *
+ * @param[in]  bus     The bus
+ * @param[in]  slave   The chip select
+ * @param[in]  data    bytes to send
+ * @param[in]  length  number of bytes
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_spi_write(int bus, int slave, const uint8_t* data, size_t length);
+
+/**
+ * @brief      Reads bytes while sending zeros.
+ *
+ * @param[in]  bus     The bus
+ * @param[in]  slave   The chip select
+ * @param[out] data    buffer to fill
+ * @param[in]  length  number of bytes
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_spi_read(int bus, int slave, uint8_t* data, size_t length);
+
+/**
+ * @brief      Claims a bus for the calling thread.
+ *
+ *             Each transfer is already atomic, this is for keeping a sequence
+ *             of transfers together. The lock is recursive and does not need
+ *             the bus to be initialized.
+ *
+ * @param[in]  bus   The bus
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_spi_lock_bus(int bus);
+
+/**
+ * @brief      Releases a bus claimed with rc_spi_lock_bus.
+ *
+ * @param[in]  bus   The bus
+ *
+ * @return     0 on success or -1 on failure
+ */
+int rc_spi_unlock_bus(int bus);
+
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif // RC_SPI_H
+
+///@} end group IO
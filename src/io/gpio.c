@@ -10,6 +10,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h> // for O_WRONLY
+#include <sys/ioctl.h>
+#include <linux/gpio.h> // for the character device uAPI
 
 #include <rc/gpio.h>
 
@@ -20,64 +22,104 @@
 #define SYSFS_GPIO_DIR "/sys/class/gpio"
 #define MAX_BUF 64
 #define NUM_PINS 128
+#define GPIO_EXPORT_TIMEOUT_MS 1000
 
 // value file handle for each pin, uninitialized if ==0
 static int value_fd[NUM_PINS];
 
 
-// public functions
-int rc_gpio_export(int pin)
+// local function
+// asks the kernel to export a pin unless it already is, doesn't wait for it
+static int __request_export(int pin)
 {
 	int fd, len;
 	char buf[MAX_BUF];
 	// sanity check
-	if(unlikely(pin<0 || pin>NUM_PINS)){
-		fprintf(stderr,"ERROR: gpio pin must be between 0 & %d\n", NUM_PINS);
+	if(unlikely(pin<0 || pin>=NUM_PINS)){
+		fprintf(stderr,"ERROR: gpio pin must be between 0 & %d\n", NUM_PINS-1);
 		return -1;
 	}
 	// warn user if pin is already configured,
 	// but keep going anyway in case this was intentional
-	if(value_fd[pin]==0){
+	if(value_fd[pin]!=0){
 		#ifdef DEBUG
 		printf("WARNING: in rc_gpio_export, pin %d is already exported\n",pin);
 		#endif
 	}
 	// check if pin has already been exported
-	len = snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "/gpio%d/value", pin);
+	snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "/gpio%d/value", pin);
 	if(access(buf, F_OK)==0){
 		#ifdef DEBUG
 		fprintf(stderr,"WARNING tried to export gpio %d when already exported\n", pin);
 		#endif
+		return 0;
 	}
 	// if not exported, write to export file
-	else{
-		// open export file
-		fd = open(SYSFS_GPIO_DIR "/export", O_WRONLY);
-		if(unlikely(fd<0)){
-			perror("ERROR: in rc_gpio_export failed to open gpio/export file");
-			return -1;
-		}
-		// write gpio number to the export file
-		len = snprintf(buf, sizeof(buf), "%d", pin);
-		if(unlikely(write(fd, buf, len)!=len)){
-			perror("ERROR: in rc_gpio_export failed to write to gpio/export file");
-			close(fd);
-			return -1;
-		}
+	fd = open(SYSFS_GPIO_DIR "/export", O_WRONLY);
+	if(unlikely(fd<0)){
+		perror("ERROR: in rc_gpio_export failed to open gpio/export file");
+		return -1;
+	}
+	// write gpio number to the export file
+	len = snprintf(buf, sizeof(buf), "%d", pin);
+	if(unlikely(write(fd, buf, len)!=len)){
+		perror("ERROR: in rc_gpio_export failed to write to gpio/export file");
 		close(fd);
-		// wait at least 50ms for the gpio driver to figure itself out
-		// this is a hacky workaround but is necessary right now on the
-		// BBB or the driver will misbehave
-		usleep(100000);
+		return -1;
 	}
-	// get the value FD to save for later
+	close(fd);
+	return 0;
+}
+
+
+// local function
+// Opens the value file once the driver has created it and udev has given it
+// its permissions, which on the BBB can take tens of ms after the export
+// write returns. sysfs doesn't raise inotify events so just retry the open
+// every ms up to a limit.
+static int __open_value_fd(int pin)
+{
+	char buf[MAX_BUF];
+	int fd, waited_ms = 0;
+	if(value_fd[pin]!=0) return 0;
 	snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "/gpio%d/value", pin);
-	int temp_fd = open(buf, O_RDWR);
-	if(temp_fd<0){
-		perror("ERROR in rc_gpio_export, failed to open gpio value fd");
+	for(;;){
+		fd = open(buf, O_RDWR|O_CLOEXEC);
+		if(fd>=0) break;
+		if((errno!=ENOENT && errno!=EACCES) || waited_ms>=GPIO_EXPORT_TIMEOUT_MS){
+			perror("ERROR in rc_gpio_export, failed to open gpio value fd");
+			return -1;
+		}
+		usleep(1000);
+		waited_ms++;
+	}
+	value_fd[pin]=fd;
+	return 0;
+}
+
+
+// public functions
+int rc_gpio_export(int pin)
+{
+	if(__request_export(pin)) return -1;
+	return __open_value_fd(pin);
+}
+
+
+int rc_gpio_export_batch(const int* pins, int n)
+{
+	int i;
+	if(unlikely(pins==NULL || n<0)){
+		fprintf(stderr,"ERROR: in rc_gpio_export_batch, invalid arguments\n");
 		return -1;
 	}
-	value_fd[pin]=temp_fd;
+	// queue every export first so the waits overlap
+	for(i=0;i<n;i++){
+		if(__request_export(pins[i])) return -1;
+	}
+	for(i=0;i<n;i++){
+		if(__open_value_fd(pins[i])) return -1;
+	}
 	return 0;
 }
 
@@ -179,11 +221,27 @@ int rc_gpio_set_value(int pin, int value)
 }
 
 
+int rc_gpio_read_value_fd(int fd)
+{
+	char ch;
+	// one syscall, and reading from the start also re-arms POLLPRI
+	if(unlikely(pread(fd, &ch, 1, 0)!=1)) return -1;
+	if(ch == '0') return 0;
+	if(likely(ch == '1')) return 1;
+	return -1;
+}
+
+
 int rc_gpio_get_value(int pin)
 {
 	char buf[MAX_BUF];
 	char ch;
 	int ret;
+	if(likely(pin>=0 && pin<NUM_PINS && value_fd[pin]!=0)){
+		ret = rc_gpio_read_value_fd(value_fd[pin]);
+		if(unlikely(ret<0)) perror("ERROR: in rc_gpio_get_value while reading from fd");
+		return ret;
+	}
 	snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "/gpio%d/value", pin);
 	int fd;
 	fd = open(buf, O_RDONLY);
@@ -306,3 +364,86 @@ int rc_gpio_print_dir(int pin)
 	return 0;
 }
 
+
+int rc_gpio_line_request_events(int chip, int line, rc_pin_edge_t edge, const char* consumer)
+{
+	struct gpio_v2_line_request req;
+	char path[32];
+	int fd, flags;
+
+	if(unlikely(chip<0 || line<0)){
+		fprintf(stderr,"ERROR: in rc_gpio_line_request_events, chip and line must be >=0\n");
+		return -1;
+	}
+	memset(&req, 0, sizeof(req));
+	switch(edge){
+	case GPIO_EDGE_RISING:
+		req.config.flags = GPIO_V2_LINE_FLAG_EDGE_RISING;
+		break;
+	case GPIO_EDGE_FALLING:
+		req.config.flags = GPIO_V2_LINE_FLAG_EDGE_FALLING;
+		break;
+	case GPIO_EDGE_BOTH:
+		req.config.flags = GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+		break;
+	default:
+		fprintf(stderr,"ERROR: in rc_gpio_line_request_events, edge must be rising, falling, or both\n");
+		return -1;
+	}
+	req.config.flags |= GPIO_V2_LINE_FLAG_INPUT;
+	req.offsets[0] = line;
+	req.num_lines = 1;
+	req.event_buffer_size = GPIO_MAX_LINE_EVENTS;
+	strncpy(req.consumer, consumer!=NULL ? consumer : "librcmpu", sizeof(req.consumer)-1);
+
+	snprintf(path, sizeof(path), "/dev/gpiochip%d", chip);
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if(fd<0){
+		perror("ERROR: in rc_gpio_line_request_events, failed to open gpiochip");
+		return -1;
+	}
+	if(ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req)<0){
+		perror("ERROR: in rc_gpio_line_request_events, GPIO_V2_GET_LINE_IOCTL failed");
+		close(fd);
+		return -1;
+	}
+	// the chip descriptor is only needed to make the request
+	close(fd);
+	flags = fcntl(req.fd, F_GETFL);
+	if(flags<0 || fcntl(req.fd, F_SETFL, flags|O_NONBLOCK)<0){
+		perror("ERROR: in rc_gpio_line_request_events, failed to make request non-blocking");
+		close(req.fd);
+		return -1;
+	}
+	return req.fd;
+}
+
+
+int rc_gpio_line_read_events(int fd, rc_gpio_event_t* events, int max)
+{
+	struct gpio_v2_line_event ev[GPIO_MAX_LINE_EVENTS];
+	ssize_t ret;
+	int i, n;
+
+	if(unlikely(fd<0 || events==NULL || max<1)) return -1;
+	if(max>GPIO_MAX_LINE_EVENTS) max = GPIO_MAX_LINE_EVENTS;
+	ret = read(fd, ev, max*sizeof(struct gpio_v2_line_event));
+	if(ret<0){
+		if(errno==EAGAIN || errno==EWOULDBLOCK) return 0;
+		return -1;
+	}
+	n = ret/sizeof(struct gpio_v2_line_event);
+	for(i=0;i<n;i++){
+		events[i].timestamp_ns = ev[i].timestamp_ns;
+		events[i].seqno = ev[i].line_seqno;
+		events[i].rising = ev[i].id==GPIO_V2_LINE_EVENT_RISING_EDGE;
+	}
+	return n;
+}
+
+
+int rc_gpio_line_release(int fd)
+{
+	if(unlikely(fd<0)) return -1;
+	return close(fd) ? -1 : 0;
+}
@@ -7,12 +7,19 @@
 #include <stdint.h> // for uint8_t types etc
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/file.h> // for flock
 #include <sys/ioctl.h>
+#include <linux/i2c.h> // for i2c_msg
 #include <linux/i2c-dev.h> //for IOCTL defs
 
 #include <rc/i2c.h>
+#include <rc/error_log.h>
+#include <rc/time.h>
 
 // preposessor macros
 #define unlikely(x)	__builtin_expect (!!(x), 0)
@@ -30,10 +37,81 @@ typedef struct rc_i2c_t {
 	uint8_t devAddr;
 	int file;
 	int initialized;
-	int lock;
+	int combined_rw;
+	// bus lock, recursive for the owning thread
+	pthread_mutex_t mutex;
+	pthread_t owner;
+	int owned;
+	int depth;
+	int lock_file;	// separate descriptor for flock, -1 if not locking across processes
+	uint64_t lock_time;
+	rc_i2c_lock_stats_t stats;
+	// file descriptors already bound to a slave address, file is one of these
+	int num_slaves;
+	uint8_t slave_addr[I2C_MAX_SLAVES];
+	int slave_file[I2C_MAX_SLAVES];
+	int spare_file;	// re-bound for addresses past the table, never handed out
+	char path[16];
 } rc_i2c_t;
 
-static rc_i2c_t i2c[I2C_MAX_BUS+1];
+static rc_i2c_t i2c[I2C_MAX_BUS+1] = {
+	[0 ... I2C_MAX_BUS] = {
+		.file = -1,
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.lock_file = -1,
+		.spare_file = -1
+	}
+};
+
+
+/*******************************************************************************
+* struct rc_i2c_async_t
+* request queue and worker thread of a bus, one for each is allocated here.
+* Kept apart from rc_i2c_t since it has its own mutex and the worker must be
+* able to take the bus lock without holding the queue.
+*******************************************************************************/
+typedef struct rc_i2c_async_t {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	int depth;
+	rc_i2c_request_t* head[I2C_NUM_PRIORITIES];
+	rc_i2c_request_t* tail[I2C_NUM_PRIORITIES];
+} rc_i2c_async_t;
+
+static rc_i2c_async_t async[I2C_MAX_BUS+1] = {
+	[0 ... I2C_MAX_BUS] = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER
+	}
+};
+
+
+/*******************************************************************************
+* transaction tracing
+*
+* Everything here is written without locks from whichever thread finished the
+* transaction. Each ring slot carries a sequence number that is zeroed while
+* the slot is rewritten so readers can tell a torn copy. Register histograms
+* live in a small open-addressed table per bus whose keys are claimed with a
+* compare and swap and never released, a reset only zeroes the counts.
+*******************************************************************************/
+typedef struct rc_i2c_trace_slot_t {
+	uint64_t seq;	// index+1 of the entry held, 0 while being written
+	rc_i2c_trace_t entry;
+} rc_i2c_trace_slot_t;
+
+typedef struct rc_i2c_trace_reg_t {
+	uint32_t key;	// 0x10000 | addr<<8 | reg, 0 if unused
+	rc_i2c_histogram_t hist;
+} rc_i2c_trace_reg_t;
+
+static int tracing;
+static uint64_t trace_head;
+static rc_i2c_trace_slot_t trace_ring[I2C_TRACE_SIZE];
+static rc_i2c_histogram_t trace_bus_hist[I2C_MAX_BUS+1];
+static rc_i2c_trace_reg_t trace_regs[I2C_MAX_BUS+1][I2C_TRACE_MAX_REGS];
 
 
 // local function
@@ -46,33 +124,331 @@ int __check_bus_range(int bus){
 }
 
 
+// local function
+// returns 1 if the calling thread currently holds the bus lock
+static inline int __is_owner(int bus)
+{
+	return __atomic_load_n(&i2c[bus].owned, __ATOMIC_ACQUIRE) &&
+		pthread_equal(i2c[bus].owner, pthread_self());
+}
+
+
+// local function
+// acquires the bus lock, blocking until it is free. The lock is recursive for
+// the thread that holds it. Only the outermost acquisition takes the optional
+// cross-process flock and is counted in the contention statistics. Returns 1
+// if the calling thread already held the lock, 0 otherwise.
+static int __lock(int bus)
+{
+	rc_i2c_t* b = &i2c[bus];
+	uint64_t start, wait;
+	int contended = 0;
+
+	if(__is_owner(bus)){
+		b->depth++;
+		return 1;
+	}
+	start = rc_nanos_since_boot();
+	if(pthread_mutex_trylock(&b->mutex)!=0){
+		contended = 1;
+		pthread_mutex_lock(&b->mutex);
+	}
+	if(b->lock_file!=-1 && flock(b->lock_file, LOCK_EX|LOCK_NB)!=0){
+		contended = 1;
+		while(flock(b->lock_file, LOCK_EX)!=0 && errno==EINTR);
+	}
+	b->owner = pthread_self();
+	__atomic_store_n(&b->owned, 1, __ATOMIC_RELEASE);
+	b->depth = 1;
+	b->lock_time = rc_nanos_since_boot();
+	// statistics are only touched while holding the lock
+	b->stats.acquisitions++;
+	if(contended){
+		wait = b->lock_time - start;
+		b->stats.contended++;
+		b->stats.wait_ns_total += wait;
+		if(wait>b->stats.wait_ns_max) b->stats.wait_ns_max = wait;
+	}
+	return 0;
+}
+
+
+// local function
+// releases one level of the bus lock. Returns -1 if the calling thread does not
+// hold the lock.
+static int __unlock(int bus)
+{
+	rc_i2c_t* b = &i2c[bus];
+	uint64_t hold;
+
+	if(unlikely(!__is_owner(bus))) return -1;
+	if(--b->depth>0) return 0;
+	hold = rc_nanos_since_boot() - b->lock_time;
+	b->stats.hold_ns_total += hold;
+	if(hold>b->stats.hold_ns_max) b->stats.hold_ns_max = hold;
+	__atomic_store_n(&b->owned, 0, __ATOMIC_RELEASE);
+	if(b->lock_file!=-1) flock(b->lock_file, LOCK_UN);
+	pthread_mutex_unlock(&b->mutex);
+	return 0;
+}
+
+
+// local function
+// makes devAddr the active slave address on the bus. Each address gets its own
+// file descriptor bound with I2C_SLAVE the first time it is used so switching
+// back and forth between devices afterwards costs no system calls. If the cache
+// is full a spare descriptor is re-bound instead. Never one from the table,
+// rc_i2c_get_fd may have handed those out.
+static int __select_slave(int bus, uint8_t devAddr)
+{
+	int i, fd;
+	rc_i2c_t* b = &i2c[bus];
+
+	if(likely(b->devAddr==devAddr)) return 0;
+	for(i=0;i<b->num_slaves;i++){
+		if(b->slave_addr[i]==devAddr){
+			b->file = b->slave_file[i];
+			b->devAddr = devAddr;
+			return 0;
+		}
+	}
+	// not seen yet, open a new descriptor if there is room
+	if(b->num_slaves<I2C_MAX_SLAVES){
+		fd = open(b->path, O_RDWR);
+		if(unlikely(fd==-1)) return -1;
+		if(unlikely(ioctl(fd, I2C_SLAVE, devAddr)<0)){
+			close(fd);
+			return -1;
+		}
+		i = b->num_slaves++;
+		b->slave_file[i] = fd;
+	}
+	else{
+		if(b->spare_file==-1){
+			b->spare_file = open(b->path, O_RDWR);
+			if(unlikely(b->spare_file==-1)) return -1;
+		}
+		if(unlikely(ioctl(b->spare_file, I2C_SLAVE, devAddr)<0)) return -1;
+		b->file = b->spare_file;
+		b->devAddr = devAddr;
+		return 0;
+	}
+	b->slave_addr[i] = devAddr;
+	b->file = b->slave_file[i];
+	b->devAddr = devAddr;
+	return 0;
+}
+
+
+// local function
+// closes every descriptor opened for the bus
+static void __close_slaves(int bus)
+{
+	int i;
+	for(i=0;i<i2c[bus].num_slaves;i++) close(i2c[bus].slave_file[i]);
+	if(i2c[bus].spare_file!=-1) close(i2c[bus].spare_file);
+	i2c[bus].spare_file = -1;
+	i2c[bus].num_slaves = 0;
+	i2c[bus].file = -1;
+}
+
+
+// local function
+// returns the start time of a transaction, or 0 when not tracing
+static inline uint64_t __trace_start(void)
+{
+	if(likely(!__atomic_load_n(&tracing, __ATOMIC_RELAXED))) return 0;
+	return rc_nanos_since_boot();
+}
+
+
+// local function
+static void __hist_add(rc_i2c_histogram_t* h, uint64_t ns, int failed)
+{
+	uint64_t max;
+	int bin = 0;
+	if(ns>0) bin = 63 - __builtin_clzll(ns);
+	if(bin>=I2C_HIST_BINS) bin = I2C_HIST_BINS-1;
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	if(failed) __atomic_fetch_add(&h->errors, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->bins[bin], 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+	while(ns>max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+// local function
+// finds or claims the histogram of a register, NULL if the table is full
+static rc_i2c_histogram_t* __reg_hist(int bus, uint8_t addr, uint8_t reg)
+{
+	uint32_t key = 0x10000 | (uint32_t)addr<<8 | reg;
+	uint32_t cur;
+	int i, n;
+	i = (addr*31 + reg) % I2C_TRACE_MAX_REGS;
+	for(n=0;n<I2C_TRACE_MAX_REGS;n++){
+		cur = __atomic_load_n(&trace_regs[bus][i].key, __ATOMIC_ACQUIRE);
+		if(cur==key) return &trace_regs[bus][i].hist;
+		if(cur==0){
+			if(__atomic_compare_exchange_n(&trace_regs[bus][i].key, &cur, key, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return &trace_regs[bus][i].hist;
+			if(cur==key) return &trace_regs[bus][i].hist;
+		}
+		i = (i+1) % I2C_TRACE_MAX_REGS;
+	}
+	return NULL;
+}
+
+
+// local function
+// records a finished transaction that began at start
+static void __trace_end(uint64_t start, int bus, uint8_t addr, uint8_t reg, int op, int length, int result)
+{
+	rc_i2c_trace_slot_t* slot;
+	rc_i2c_histogram_t* h;
+	uint64_t ns, idx;
+
+	if(likely(start==0)) return;
+	ns = rc_nanos_since_boot() - start;
+	idx = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+	slot = &trace_ring[idx % I2C_TRACE_SIZE];
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->entry.timestamp_ns = start;
+	slot->entry.duration_ns = ns>UINT32_MAX ? UINT32_MAX : ns;
+	slot->entry.result = result<0 ? -1 : result;
+	slot->entry.length = length;
+	slot->entry.bus = bus;
+	slot->entry.addr = addr;
+	slot->entry.reg = reg;
+	slot->entry.op = op;
+	__atomic_store_n(&slot->seq, idx+1, __ATOMIC_RELEASE);
+
+	__hist_add(&trace_bus_hist[bus], ns, result<0);
+	h = __reg_hist(bus, addr, reg);
+	if(h!=NULL) __hist_add(h, ns, result<0);
+}
+
+
+// local function
+// write() to the active slave, traced with the first byte as the register
+static int __write_traced(int bus, const uint8_t* data, int length)
+{
+	uint64_t start = __trace_start();
+	int ret;
+	ret = write(i2c[bus].file, data, length);
+	__trace_end(start, bus, i2c[bus].devAddr, data[0], I2C_TRACE_WRITE, length-1, ret);
+	return ret;
+}
+
+
+// local function
+// writes the register address and reads the response in a single I2C_RDWR
+// ioctl with a repeated start in between. Returns 0 on success, -1 on failure
+// with errno set by the ioctl.
+static int __read_combined(int bus, uint8_t regAddr, uint16_t length, uint8_t* data)
+{
+	struct i2c_msg msgs[2];
+	struct i2c_rdwr_ioctl_data xfer;
+
+	msgs[0].addr = i2c[bus].devAddr;
+	msgs[0].flags = 0;
+	msgs[0].len = 1;
+	msgs[0].buf = &regAddr;
+	msgs[1].addr = i2c[bus].devAddr;
+	msgs[1].flags = I2C_M_RD;
+	msgs[1].len = length;
+	msgs[1].buf = data;
+	xfer.msgs = msgs;
+	xfer.nmsgs = 2;
+
+	if(unlikely(ioctl(i2c[bus].file, I2C_RDWR, &xfer)!=2)) return -1;
+	return 0;
+}
+
+
+// local function
+// reads a register the old way with a separate write() and read() system call.
+// Returns number of bytes read or -1 on failure.
+static int __read_split(int bus, uint8_t regAddr, uint16_t length, uint8_t* data)
+{
+	int ret;
+	// write register to device
+	ret = write(i2c[bus].file, &regAddr, 1);
+	if(unlikely(ret!=1)) return -1;
+	// then read the response
+	ret = read(i2c[bus].file, data, length);
+	if(unlikely(ret!=length)) return -1;
+	return ret;
+}
+
+
+// local function
+// picks the combined or split read path for the bus. If the adapter turns out
+// not to support I2C_RDWR, combined mode is switched off for the bus and the
+// split path is used from then on.
+static int __read_reg(int bus, uint8_t regAddr, uint16_t length, uint8_t* data)
+{
+	uint64_t start = __trace_start();
+	int ret;
+	if(likely(i2c[bus].combined_rw)){
+		if(likely(__read_combined(bus, regAddr, length, data)==0)){
+			__trace_end(start, bus, i2c[bus].devAddr, regAddr, I2C_TRACE_READ, length, length);
+			return length;
+		}
+		if(errno!=EOPNOTSUPP && errno!=EINVAL && errno!=ENOTTY){
+			__trace_end(start, bus, i2c[bus].devAddr, regAddr, I2C_TRACE_READ, length, -1);
+			return -1;
+		}
+		i2c[bus].combined_rw = 0;
+	}
+	ret = __read_split(bus, regAddr, length, data);
+	__trace_end(start, bus, i2c[bus].devAddr, regAddr, I2C_TRACE_READ, length, ret);
+	return ret;
+}
+
+
 int rc_i2c_init(int bus, uint8_t devAddr)
 {
 	// sanity check
 	if(unlikely(__check_bus_range(bus))) return -1;
 
 	// lock the bus during this operation
-	i2c[bus].lock = 1;
+	__lock(bus);
+	// start from scratch if the bus was already open
+	if(i2c[bus].initialized) __close_slaves(bus);
 	i2c[bus].initialized = 0;
 
 	// open file descriptor
-	char str[16];
-	sprintf(str,"/dev/i2c-%d",bus);
-	i2c[bus].file = open(str, O_RDWR);
+	snprintf(i2c[bus].path, sizeof(i2c[bus].path), "/dev/i2c-%d", bus);
+	i2c[bus].file = open(i2c[bus].path, O_RDWR);
 	if(i2c[bus].file==-1){
 		fprintf(stderr,"ERROR: in rc_i2c_init, failed to open /dev/i2c\n");
+		__unlock(bus);
 		return -1;
 	}
 
 	// set device adress
 	if(unlikely(ioctl(i2c[bus].file, I2C_SLAVE, devAddr)<0)){
 		fprintf(stderr,"ERROR: in rc_i2c_init, ioctl slave address change failed\n");
+		close(i2c[bus].file);
+		__unlock(bus);
 		return -1;
 	}
 	i2c[bus].devAddr = devAddr;
-	// return the lock state to previous state.
-	i2c[bus].lock = 0;
+	i2c[bus].num_slaves = 1;
+	i2c[bus].slave_addr[0] = devAddr;
+	i2c[bus].slave_file[0] = i2c[bus].file;
+	// use combined write/read transactions if the adapter can do plain i2c
+	unsigned long funcs = 0;
+	if(ioctl(i2c[bus].file, I2C_FUNCS, &funcs)==0 && (funcs & I2C_FUNC_I2C)){
+		i2c[bus].combined_rw = 1;
+	}
+	else i2c[bus].combined_rw = 0;
 	i2c[bus].initialized = 1;
+	// release the bus
+	__unlock(bus);
 	return 0;
 }
 
@@ -85,63 +461,114 @@ int rc_i2c_set_device_address(int bus, uint8_t devAddr)
 		fprintf(stderr,"ERROR: in rc_i2c_set_device_address, bus not initialized yet\n");
 		return -1;
 	}
-	// if the device address is already correct, just return
-	if(i2c[bus].devAddr == devAddr){
-		return 0;
-	}
-	// if not, change it with ioctl
-	if(unlikely(ioctl(i2c[bus].file, I2C_SLAVE, devAddr)<0)){
+	// switch to the descriptor already bound to this address
+	__lock(bus);
+	if(unlikely(__select_slave(bus, devAddr))){
 		fprintf(stderr,"ERROR: in rc_i2c_set_device_address, ioctl slave address change failed\n");
+		__unlock(bus);
 		return -1;
 	}
-	i2c[bus].devAddr = devAddr;
+	__unlock(bus);
 	return 0;
 }
 
+
+int rc_i2c_get_fd(int bus, uint8_t devAddr)
+{
+	int i, fd;
+	uint8_t old_addr;
+	// sanity check
+	if(unlikely(__check_bus_range(bus))) return -1;
+	if(unlikely(i2c[bus].initialized==0)){
+		fprintf(stderr,"ERROR: in rc_i2c_get_fd, bus not initialized yet\n");
+		return -1;
+	}
+	// __select_slave may be adding an entry on another thread, only look
+	// at the table with the bus held
+	__lock(bus);
+	for(i=0;i<i2c[bus].num_slaves;i++){
+		if(i2c[bus].slave_addr[i]==devAddr){
+			fd = i2c[bus].slave_file[i];
+			__unlock(bus);
+			return fd;
+		}
+	}
+	// bind a new descriptor without changing the active address
+	old_addr = i2c[bus].devAddr;
+	if(unlikely(__select_slave(bus, devAddr) || __select_slave(bus, old_addr))){
+		fprintf(stderr,"ERROR: in rc_i2c_get_fd, failed to bind slave address 0x%x\n", devAddr);
+		__unlock(bus);
+		return -1;
+	}
+	fd = -1;
+	for(i=0;i<i2c[bus].num_slaves;i++){
+		if(i2c[bus].slave_addr[i]==devAddr) fd = i2c[bus].slave_file[i];
+	}
+	__unlock(bus);
+	if(fd!=-1) return fd;
+	// cache was full, only the spare descriptor is bound to it for now
+	fprintf(stderr,"ERROR: in rc_i2c_get_fd, more than %d slave addresses in use\n", I2C_MAX_SLAVES);
+	return -1;
+}
+
 int rc_i2c_close(int bus)
 {
 	if(unlikely(__check_bus_range(bus))) return -1;
-	if(close(i2c[bus].file)<0) return -1;
+	if(i2c[bus].initialized==0) return -1;
+	rc_i2c_async_stop(bus);
+	__lock(bus);
+	__close_slaves(bus);
 	i2c[bus].devAddr = 0;
 	i2c[bus].initialized = 0;
-	i2c[bus].lock=0;
+	i2c[bus].combined_rw = 0;
+	__unlock(bus);
 	return 0;
 }
 
 
-int rc_i2c_read_bytes(int bus, uint8_t regAddr, uint8_t length, uint8_t *data)
+int rc_i2c_set_combined_rw(int bus, int enable)
 {
-	int ret, old_lock;
-
-	// sanity check
 	if(unlikely(__check_bus_range(bus))) return -1;
 	if(unlikely(i2c[bus].initialized==0)){
-		fprintf(stderr,"ERROR: in rc_i2c_read_bytes, bus not initialized yet\n");
+		fprintf(stderr,"ERROR: in rc_i2c_set_combined_rw, bus not initialized yet\n");
 		return -1;
 	}
+	i2c[bus].combined_rw = (enable!=0);
+	return 0;
+}
 
-	// lock the bus during this operation, preserving old state to return to
-	old_lock = i2c[bus].lock;
-	i2c[bus].lock = 1;
 
-	// write register to device
-	ret = write(i2c[bus].file, &regAddr, 1);
-	if(unlikely(ret!=1)){
-		fprintf(stderr,"ERROR: in rc_i2c_read_bytes, failed to write to bus\n");
-		i2c[bus].lock = old_lock;
+int rc_i2c_get_combined_rw(int bus)
+{
+	if(unlikely(__check_bus_range(bus))) return -1;
+	return i2c[bus].combined_rw;
+}
+
+
+int rc_i2c_read_bytes(int bus, uint8_t regAddr, uint8_t length, uint8_t *data)
+{
+	int ret;
+
+	// sanity check
+	if(unlikely(__check_bus_range(bus))) return -1;
+	if(unlikely(i2c[bus].initialized==0)){
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_read_bytes, bus not initialized yet");
 		return -1;
 	}
 
-	// then read the response
-	ret = read(i2c[bus].file, data, length);
+	// lock the bus during this operation
+	__lock(bus);
+
+	// write register address and read the response
+	ret = __read_reg(bus, regAddr, length, data);
 	if(unlikely(ret!=length)){
-		fprintf(stderr,"ERROR: in rc_i2c_read_bytes, received %d bytes from device, expected %d\n", ret, length);
-		i2c[bus].lock = old_lock;
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_read_bytes, failed to read %d bytes from device", length);
+		__unlock(bus);
 		return -1;
 	}
 
-	// return the lock state to previous state.
-	i2c[bus].lock = old_lock;
+	// release the bus
+	__unlock(bus);
 	return ret;
 }
 
@@ -153,47 +580,38 @@ int rc_i2c_read_byte(int bus, uint8_t regAddr, uint8_t *data)
 
 int rc_i2c_read_words(int bus, uint8_t regAddr, uint8_t length, uint16_t *data)
 {
-	int ret, i, old_lock;
-	char buf[I2C_BUFFER_SIZE];
+	int ret, i;
+	uint8_t buf[I2C_BUFFER_SIZE];
 
 	// sanity check
 	if(unlikely(__check_bus_range(bus))) return -1;
 	if(unlikely(i2c[bus].initialized==0)){
-		fprintf(stderr,"ERROR: in rc_i2c_read_words, bus not initialized yet\n");
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_read_words, bus not initialized yet");
 		return -1;
 	}
 	if(length>(I2C_BUFFER_SIZE/2)){
-		printf("rc_i2c_read_words length must be less than I2C_BUFFER_SIZE/2\n");
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_read_words, length must be less than I2C_BUFFER_SIZE/2");
 		return -1;
 	}
 
 	// lock the bus during this operation
-	old_lock = i2c[bus].lock;
-	i2c[bus].lock = 1;
+	__lock(bus);
 
-	// write register to device
-	ret = write(i2c[bus].file, &regAddr, 1);
-	if(unlikely(ret!=1)){
-		fprintf(stderr,"ERROR: in rc_i2c_read_words, failed to write to bus\n");
-		i2c[bus].lock = old_lock;
-		return -1;
-	}
-
-	// then read the response
-	ret = read(i2c[bus].file, buf, length*2);
-	if(ret!=(length*2)){
-		fprintf(stderr,"ERROR: in rc_i2c_read_words, received %d bytes, expected %d\n", ret, length*2);
-		i2c[bus].lock = old_lock;
+	// write register address and read the response
+	ret = __read_reg(bus, regAddr, length*2, buf);
+	if(unlikely(ret!=(length*2))){
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_read_words, failed to read %d bytes from device", length*2);
+		__unlock(bus);
 		return -1;
 	}
 
 	// form words from bytes and put into user's data array
 	for(i=0;i<length;i++){
-		data[i] = (((uint16_t)buf[0])<<8 | buf[1]);
+		data[i] = ((uint16_t)buf[i*2])<<8 | buf[i*2+1];
 	}
 
-	// return the lock state to previous state.
-	i2c[bus].lock = old_lock;
+	// release the bus
+	__unlock(bus);
 	return 0;
 }
 
@@ -206,96 +624,93 @@ int rc_i2c_read_word(int bus, uint8_t regAddr, uint16_t *data)
 
 int rc_i2c_write_bytes(int bus, uint8_t regAddr, uint8_t length, uint8_t* data)
 {
-	int i, ret, old_lock;
+	int i, ret;
 	uint8_t writeData[I2C_BUFFER_SIZE+1];
 
 	// sanity check
 	if(unlikely(__check_bus_range(bus))) return -1;
 	if(unlikely(i2c[bus].initialized==0)){
-		fprintf(stderr,"ERROR: in rc_i2c_write_bytes, bus not initialized yet\n");
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_write_bytes, bus not initialized yet");
 		return -1;
 	}
 	if(unlikely(length>I2C_BUFFER_SIZE)){
-		fprintf(stderr, "ERROR in rc_i2c_write_bytes, length exceeds I2C_BUFFER_SIZE %d\n", I2C_BUFFER_SIZE);
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_write_bytes, length exceeds I2C_BUFFER_SIZE %d", I2C_BUFFER_SIZE);
 		return -1;
 	}
 
 	// lock the bus during this operation
-	old_lock = i2c[bus].lock;
-	i2c[bus].lock = 1;
+	__lock(bus);
 
 	// assemble array to send, starting with the register address
 	writeData[0] = regAddr;
 	for(i=0; i<length; i++) writeData[i+1]=data[i];
 
 	// send the bytes
-	ret = write(i2c[bus].file, writeData, length+1);
+	ret = __write_traced(bus, writeData, length+1);
 	// write should have returned the correct # bytes written
 	if(unlikely(ret!=(length+1))){
-		fprintf(stderr,"ERROR in rc_i2c_write_bytes, bus wrote %d bytes, expected %d\n", ret, length+1);
-		i2c[bus].lock = old_lock;
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_write_bytes, bus wrote %d bytes, expected %d", ret, length+1);
+		__unlock(bus);
 		return -1;
 	}
-	// return the lock state to previous state.
-	i2c[bus].lock = old_lock;
+	// release the bus
+	__unlock(bus);
 	return 0;
 }
 
 
 int rc_i2c_write_byte(int bus, uint8_t regAddr, uint8_t data)
 {
-	int ret, old_lock;
+	int ret;
 	uint8_t writeData[2];
 
 	// sanity check
 	if(unlikely(__check_bus_range(bus))) return -1;
 	if(unlikely(i2c[bus].initialized==0)){
-		fprintf(stderr,"ERROR: in rc_i2c_write_byte, bus not initialized yet\n");
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_write_byte, bus not initialized yet");
 		return -1;
 	}
 
 	// lock the bus during this operation
-	old_lock = i2c[bus].lock;
-	i2c[bus].lock = 1;
+	__lock(bus);
 
 	// assemble array to send, starting with the register address
 	writeData[0] = regAddr;
 	writeData[1] = data;
 
 	// send the bytes
-	ret = write(i2c[bus].file, writeData, 2);
+	ret = __write_traced(bus, writeData, 2);
 
 	// write should have returned the correct # bytes written
 	if(unlikely(ret!=2)){
-		fprintf(stderr,"ERROR: in rc_i2c_write_byte, system write returned %d, expected 2\n", ret);
-		i2c[bus].lock = old_lock;
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_write_byte, system write returned %d, expected 2", ret);
+		__unlock(bus);
 		return -1;
 	}
-	// return the lock state to previous state.
-	i2c[bus].lock = old_lock;
+	// release the bus
+	__unlock(bus);
 	return 0;
 }
 
 
 int rc_i2c_write_words(int bus, uint8_t regAddr, uint8_t length, uint16_t* data)
 {
-	int i,ret,old_lock;
+	int i,ret;
 	uint8_t writeData[I2C_BUFFER_SIZE+1];
 
 	// sanity check
 	if(unlikely(__check_bus_range(bus))) return -1;
 	if(unlikely(i2c[bus].initialized==0)){
-		fprintf(stderr,"ERROR: in rc_i2c_write_words, bus not initialized yet\n");
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_write_words, bus not initialized yet");
 		return -1;
 	}
 	if(unlikely(length>(I2C_BUFFER_SIZE/2))){
-		fprintf(stderr, "ERROR in rc_i2c_write_words, length exceeds I2C_BUFFER_SIZE %d\n", I2C_BUFFER_SIZE);
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_write_words, length exceeds I2C_BUFFER_SIZE %d", I2C_BUFFER_SIZE);
 		return -1;
 	}
 
 	// lock the bus during this operation
-	old_lock = i2c[bus].lock;
-	i2c[bus].lock = 1;
+	__lock(bus);
 
 	// assemble bytes to send
 	writeData[0] = regAddr;
@@ -304,47 +719,46 @@ int rc_i2c_write_words(int bus, uint8_t regAddr, uint8_t length, uint16_t* data)
 		writeData[(i*2)+2] = (uint8_t)(data[i] & 0xFF);
 	}
 
-	ret = write(i2c[bus].file, writeData, (length*2)+1);
+	ret = __write_traced(bus, writeData, (length*2)+1);
 	if(unlikely(ret!=(length*2)+1)){
-		fprintf(stderr,"ERROR: in rc_i2c_write_words, system write returned %d, expected %d\n", ret, (length*2)+1);
-		i2c[bus].lock = old_lock;
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_write_words, system write returned %d, expected %d", ret, (length*2)+1);
+		__unlock(bus);
 		return -1;
 	}
-	// return the lock state to previous state.
-	i2c[bus].lock = old_lock;
+	// release the bus
+	__unlock(bus);
 	return 0;
 }
 
 
 int rc_i2c_write_word(int bus, uint8_t regAddr, uint16_t data)
 {
-	int ret,old_lock;
+	int ret;
 	uint8_t writeData[3];
 
 	// sanity check
 	if(unlikely(__check_bus_range(bus))) return -1;
 	if(unlikely(i2c[bus].initialized==0)){
-		fprintf(stderr,"ERROR: in rc_i2c_write_words, bus not initialized yet\n");
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_write_words, bus not initialized yet");
 		return -1;
 	}
 
 	// lock the bus during this operation
-	old_lock = i2c[bus].lock;
-	i2c[bus].lock = 1;
+	__lock(bus);
 
 	// assemble bytes to send from data casted as uint8_t*
 	writeData[0] = regAddr;
 	writeData[1] = (uint8_t)(data >> 8);
 	writeData[2] = (uint8_t)(data & 0xFF);
 
-	ret = write(i2c[bus].file, writeData, 3);
+	ret = __write_traced(bus, writeData, 3);
 	if(unlikely(ret!=3)){
-		fprintf(stderr,"ERROR: in rc_i2c_write_word, system write returned %d, expected 3\n", ret);
-		i2c[bus].lock = old_lock;
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_write_word, system write returned %d, expected 3", ret);
+		__unlock(bus);
 		return -1;
 	}
-	// return the lock state to previous state.
-	i2c[bus].lock = old_lock;
+	// release the bus
+	__unlock(bus);
 	return 0;
 }
 
@@ -357,25 +771,24 @@ int rc_i2c_send_bytes(int bus, uint8_t length, uint8_t* data)
 	// sanity check
 	if(unlikely(__check_bus_range(bus))) return -1;
 	if(unlikely(i2c[bus].initialized==0)){
-		fprintf(stderr,"ERROR: in rc_i2c_send_bytes, bus not initialized yet\n");
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_send_bytes, bus not initialized yet");
 		return -1;
 	}
 
 	// lock the bus during this operation
-	int old_lock= i2c[bus].lock;
-	i2c[bus].lock = 1;
+	__lock(bus);
 
 	// send the bytes
-	ret = write(i2c[bus].file, data, length);
+	ret = __write_traced(bus, data, length);
 	// write should have returned the correct # bytes written
 	if(ret!=length){
-		fprintf(stderr,"ERROR: in rc_i2c_send_bytes, system write returned %d, expected %d\n", ret, length);
-		i2c[bus].lock = old_lock;
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_send_bytes, system write returned %d, expected %d", ret, length);
+		__unlock(bus);
 		return -1;
 	}
 
-	// return the lock state to previous state.
-	i2c[bus].lock = old_lock;
+	// release the bus
+	__unlock(bus);
 
 	return 0;
 }
@@ -388,26 +801,442 @@ int rc_i2c_send_byte(int bus, uint8_t data)
 
 
 
+// local function
+// traces a whole rc_i2c_transfer as one entry keyed by its first register
+static void __trace_transfer(uint64_t start, int bus, rc_i2c_seg_t* segs, int n, int result)
+{
+	int i, length = 0;
+	uint8_t reg = 0;
+	if(likely(start==0)) return;
+	for(i=0;i<n;i++) length += segs[i].length;
+	if(!segs[0].read && segs[0].length>0){
+		reg = segs[0].data[0];
+		length--;
+	}
+	__trace_end(start, bus, segs[0].devAddr, reg, I2C_TRACE_TRANSFER, length, result<0 ? -1 : length);
+}
+
+
+int rc_i2c_transfer(int bus, rc_i2c_seg_t* segs, int n)
+{
+	int i, ret;
+	uint8_t old_addr;
+	uint64_t start;
+	struct i2c_msg msgs[I2C_MAX_SEGMENTS];
+	struct i2c_rdwr_ioctl_data xfer;
+
+	// sanity check
+	if(unlikely(__check_bus_range(bus))) return -1;
+	if(unlikely(i2c[bus].initialized==0)){
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_transfer, bus not initialized yet");
+		return -1;
+	}
+	if(unlikely(segs==NULL || n<1 || n>I2C_MAX_SEGMENTS)){
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_transfer, number of segments must be between 1 & %d", I2C_MAX_SEGMENTS);
+		return -1;
+	}
+
+	// lock the bus during this operation
+	__lock(bus);
+
+	for(i=0;i<n;i++) segs[i].result = -1;
+	start = __trace_start();
+
+	// submit everything in one ioctl when the adapter allows it
+	if(likely(i2c[bus].combined_rw)){
+		for(i=0;i<n;i++){
+			msgs[i].addr = segs[i].devAddr;
+			msgs[i].flags = segs[i].read ? I2C_M_RD : 0;
+			msgs[i].len = segs[i].length;
+			msgs[i].buf = segs[i].data;
+		}
+		xfer.msgs = msgs;
+		xfer.nmsgs = n;
+		ret = ioctl(i2c[bus].file, I2C_RDWR, &xfer);
+		if(likely(ret==n)){
+			for(i=0;i<n;i++) segs[i].result = segs[i].length;
+			__trace_transfer(start, bus, segs, n, n);
+			__unlock(bus);
+			return n;
+		}
+		if(errno!=EOPNOTSUPP && errno!=EINVAL && errno!=ENOTTY){
+			rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_transfer, I2C_RDWR ioctl failed");
+			__trace_transfer(start, bus, segs, n, -1);
+			__unlock(bus);
+			return -1;
+		}
+		i2c[bus].combined_rw = 0;
+	}
+
+	// fallback, one system call per segment, then put back the address the
+	// caller selected so rc_i2c_read_bytes and friends still reach it
+	old_addr = i2c[bus].devAddr;
+	for(i=0;i<n;i++){
+		if(unlikely(__select_slave(bus, segs[i].devAddr))){
+			rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_transfer, ioctl slave address change failed");
+			break;
+		}
+		if(segs[i].read) ret = read(i2c[bus].file, segs[i].data, segs[i].length);
+		else ret = write(i2c[bus].file, segs[i].data, segs[i].length);
+		if(unlikely(ret!=segs[i].length)){
+			rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_transfer, segment %d transferred %d bytes, expected %d", i, ret, segs[i].length);
+			break;
+		}
+		segs[i].result = ret;
+	}
+	if(unlikely(__select_slave(bus, old_addr))){
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c_transfer, failed to restore slave address 0x%x", old_addr);
+		i = -1; // fail the whole transfer
+	}
+
+	__trace_transfer(start, bus, segs, n, i<n ? -1 : n);
+	// release the bus
+	__unlock(bus);
+	if(i<n) return -1;
+	return n;
+}
+
+
 int rc_i2c_lock_bus(int bus)
 {
 	if(unlikely(__check_bus_range(bus))) return -1;
-	int ret=i2c[bus].lock;
-	i2c[bus].lock=1;
-	return ret;
+	return __lock(bus);
 }
 
 
 int rc_i2c_unlock_bus(int bus)
 {
 	if(unlikely(__check_bus_range(bus))) return -1;
-	int ret=i2c[bus].lock;
-	i2c[bus].lock=0;
-	return ret;
+	if(__is_owner(bus)){
+		__unlock(bus);
+		return 1;
+	}
+	// unlocking a bus nobody holds is harmless, but not one held elsewhere
+	if(__atomic_load_n(&i2c[bus].owned, __ATOMIC_ACQUIRE)) return -1;
+	return 0;
 }
 
 
 int rc_i2c_get_lock(int bus)
 {
 	if(unlikely(__check_bus_range(bus))) return -1;
-	return i2c[bus].lock;
-}
\ No newline at end of file
+	return __atomic_load_n(&i2c[bus].owned, __ATOMIC_ACQUIRE);
+}
+
+
+int rc_i2c_set_process_lock(int bus, int enable)
+{
+	int fd;
+	if(unlikely(__check_bus_range(bus))) return -1;
+	if(unlikely(i2c[bus].initialized==0)){
+		fprintf(stderr,"ERROR: in rc_i2c_set_process_lock, bus not initialized yet\n");
+		return -1;
+	}
+	// swap the lock descriptor while holding the in-process lock so nobody
+	// is between flock calls on the old one
+	if(unlikely(__lock(bus))){
+		fprintf(stderr,"ERROR: in rc_i2c_set_process_lock, can't change while holding the bus lock\n");
+		__unlock(bus);
+		return -1;
+	}
+	if(enable && i2c[bus].lock_file==-1){
+		// flock belongs to the open file description so this must be a
+		// descriptor of its own, not one of the slave descriptors
+		fd = open(i2c[bus].path, O_RDONLY);
+		if(fd==-1){
+			perror("ERROR: in rc_i2c_set_process_lock, failed to open lock descriptor");
+			__unlock(bus);
+			return -1;
+		}
+		// this acquisition is already underway, take the flock now so the
+		// release in __unlock stays balanced
+		while(flock(fd, LOCK_EX)!=0 && errno==EINTR);
+		i2c[bus].lock_file = fd;
+	}
+	else if(!enable && i2c[bus].lock_file!=-1){
+		flock(i2c[bus].lock_file, LOCK_UN);
+		close(i2c[bus].lock_file);
+		i2c[bus].lock_file = -1;
+	}
+	__unlock(bus);
+	return 0;
+}
+
+
+int rc_i2c_get_lock_stats(int bus, rc_i2c_lock_stats_t* stats)
+{
+	if(unlikely(__check_bus_range(bus))) return -1;
+	if(unlikely(stats==NULL)){
+		fprintf(stderr,"ERROR: in rc_i2c_get_lock_stats, received NULL pointer\n");
+		return -1;
+	}
+	// copy under the mutex itself so the snapshot is consistent but does
+	// not count as an acquisition
+	if(__is_owner(bus)){
+		*stats = i2c[bus].stats;
+		return 0;
+	}
+	pthread_mutex_lock(&i2c[bus].mutex);
+	*stats = i2c[bus].stats;
+	pthread_mutex_unlock(&i2c[bus].mutex);
+	return 0;
+}
+
+
+int rc_i2c_reset_lock_stats(int bus)
+{
+	if(unlikely(__check_bus_range(bus))) return -1;
+	if(__is_owner(bus)){
+		memset(&i2c[bus].stats, 0, sizeof(rc_i2c_lock_stats_t));
+		return 0;
+	}
+	pthread_mutex_lock(&i2c[bus].mutex);
+	memset(&i2c[bus].stats, 0, sizeof(rc_i2c_lock_stats_t));
+	pthread_mutex_unlock(&i2c[bus].mutex);
+	return 0;
+}
+
+
+// local function
+// finishes a request, the callback and eventfd go before done is set since the
+// caller may reuse the request as soon as it sees done
+static void __complete(rc_i2c_request_t* req, int result)
+{
+	uint64_t one = 1;
+	req->result = result;
+	if(req->callback!=NULL) req->callback(req);
+	if(req->efd!=-1 && write(req->efd, &one, sizeof(one))!=sizeof(one)){
+		rc_error_report(ERR_SRC_I2C, ERR_LEVEL_ERROR, "in rc_i2c worker, failed to signal request eventfd");
+	}
+	__atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+}
+
+
+// local function
+// takes the oldest request of the highest priority, call with the queue mutex
+static rc_i2c_request_t* __dequeue(rc_i2c_async_t* a)
+{
+	rc_i2c_request_t* req;
+	int p;
+	for(p=0;p<I2C_NUM_PRIORITIES;p++){
+		req = a->head[p];
+		if(req==NULL) continue;
+		a->head[p] = req->next;
+		if(a->head[p]==NULL) a->tail[p] = NULL;
+		a->depth--;
+		return req;
+	}
+	return NULL;
+}
+
+
+// local function
+// worker thread, one per bus while there is anything to do with it
+static void* __worker(void* ptr)
+{
+	int bus = (int)(intptr_t)ptr;
+	rc_i2c_async_t* a = &async[bus];
+	rc_i2c_request_t* req;
+	int ret;
+
+	pthread_mutex_lock(&a->mutex);
+	while(a->running){
+		req = __dequeue(a);
+		if(req==NULL){
+			pthread_cond_wait(&a->cond, &a->mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&a->mutex);
+		ret = rc_i2c_transfer(bus, req->segs, req->n);
+		__complete(req, ret);
+		pthread_mutex_lock(&a->mutex);
+	}
+	pthread_mutex_unlock(&a->mutex);
+	return NULL;
+}
+
+
+int rc_i2c_submit(int bus, rc_i2c_request_t* req)
+{
+	rc_i2c_async_t* a;
+	int p;
+
+	if(unlikely(__check_bus_range(bus))) return -1;
+	if(unlikely(req==NULL || req->segs==NULL || req->n<1 || req->n>I2C_MAX_SEGMENTS)){
+		fprintf(stderr,"ERROR: in rc_i2c_submit, invalid request\n");
+		return -1;
+	}
+	p = req->priority;
+	if(unlikely(p<0 || p>=I2C_NUM_PRIORITIES)){
+		fprintf(stderr,"ERROR: in rc_i2c_submit, invalid priority %d\n", p);
+		return -1;
+	}
+	if(unlikely(i2c[bus].initialized==0)){
+		fprintf(stderr,"ERROR: in rc_i2c_submit, bus not initialized yet\n");
+		return -1;
+	}
+	a = &async[bus];
+	req->result = -1;
+	req->done = 0;
+	req->next = NULL;
+
+	pthread_mutex_lock(&a->mutex);
+	if(!a->running){
+		a->running = 1;
+		if(pthread_create(&a->thread, NULL, __worker, (void*)(intptr_t)bus)){
+			a->running = 0;
+			pthread_mutex_unlock(&a->mutex);
+			fprintf(stderr,"ERROR: in rc_i2c_submit, failed to start worker thread\n");
+			return -1;
+		}
+	}
+	if(a->tail[p]==NULL) a->head[p] = req;
+	else a->tail[p]->next = req;
+	a->tail[p] = req;
+	a->depth++;
+	pthread_cond_signal(&a->cond);
+	pthread_mutex_unlock(&a->mutex);
+	return 0;
+}
+
+
+int rc_i2c_get_queue_depth(int bus)
+{
+	int depth;
+	if(unlikely(__check_bus_range(bus))) return -1;
+	pthread_mutex_lock(&async[bus].mutex);
+	depth = async[bus].depth;
+	pthread_mutex_unlock(&async[bus].mutex);
+	return depth;
+}
+
+
+int rc_i2c_async_stop(int bus)
+{
+	rc_i2c_async_t* a;
+	rc_i2c_request_t* req;
+
+	if(unlikely(__check_bus_range(bus))) return -1;
+	a = &async[bus];
+	pthread_mutex_lock(&a->mutex);
+	if(!a->running){
+		pthread_mutex_unlock(&a->mutex);
+		return 0;
+	}
+	if(unlikely(pthread_equal(a->thread, pthread_self()))){
+		pthread_mutex_unlock(&a->mutex);
+		fprintf(stderr,"ERROR: in rc_i2c_async_stop, can't stop the worker from its own callback\n");
+		return -1;
+	}
+	a->running = 0;
+	pthread_cond_signal(&a->cond);
+	pthread_mutex_unlock(&a->mutex);
+	pthread_join(a->thread, NULL);
+
+	// fail whatever the worker didn't get to
+	pthread_mutex_lock(&a->mutex);
+	while((req = __dequeue(a))!=NULL){
+		pthread_mutex_unlock(&a->mutex);
+		__complete(req, -1);
+		pthread_mutex_lock(&a->mutex);
+	}
+	pthread_mutex_unlock(&a->mutex);
+	return 0;
+}
+
+
+int rc_i2c_set_tracing(int enable)
+{
+	__atomic_store_n(&tracing, enable ? 1 : 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+int rc_i2c_get_trace(rc_i2c_trace_t* entries, int max)
+{
+	rc_i2c_trace_slot_t* slot;
+	rc_i2c_trace_t e;
+	uint64_t head, idx, seq;
+	int n = 0;
+
+	if(unlikely(entries==NULL || max<0)){
+		fprintf(stderr,"ERROR: in rc_i2c_get_trace, invalid arguments\n");
+		return -1;
+	}
+	head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	if(max>I2C_TRACE_SIZE) max = I2C_TRACE_SIZE;
+	idx = head>(uint64_t)max ? head-max : 0;
+	for(;idx<head;idx++){
+		slot = &trace_ring[idx % I2C_TRACE_SIZE];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if(seq!=idx+1) continue;
+		e = slot->entry;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED)!=seq) continue;
+		entries[n++] = e;
+	}
+	return n;
+}
+
+
+// local function
+// copies a histogram that may be updated concurrently, field by field
+static void __hist_copy(rc_i2c_histogram_t* dst, rc_i2c_histogram_t* src)
+{
+	int i;
+	dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->errors = __atomic_load_n(&src->errors, __ATOMIC_RELAXED);
+	dst->total_ns = __atomic_load_n(&src->total_ns, __ATOMIC_RELAXED);
+	dst->max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+	for(i=0;i<I2C_HIST_BINS;i++) dst->bins[i] = __atomic_load_n(&src->bins[i], __ATOMIC_RELAXED);
+}
+
+
+int rc_i2c_get_histogram(int bus, rc_i2c_histogram_t* hist)
+{
+	if(unlikely(__check_bus_range(bus))) return -1;
+	if(unlikely(hist==NULL)){
+		fprintf(stderr,"ERROR: in rc_i2c_get_histogram, received NULL pointer\n");
+		return -1;
+	}
+	__hist_copy(hist, &trace_bus_hist[bus]);
+	return 0;
+}
+
+
+int rc_i2c_get_register_histograms(int bus, rc_i2c_reg_histogram_t* regs, int max)
+{
+	uint32_t key;
+	int i, n = 0;
+
+	if(unlikely(__check_bus_range(bus))) return -1;
+	if(unlikely(regs==NULL || max<0)){
+		fprintf(stderr,"ERROR: in rc_i2c_get_register_histograms, invalid arguments\n");
+		return -1;
+	}
+	for(i=0;i<I2C_TRACE_MAX_REGS && n<max;i++){
+		key = __atomic_load_n(&trace_regs[bus][i].key, __ATOMIC_ACQUIRE);
+		if(key==0) continue;
+		regs[n].addr = (key>>8) & 0xFF;
+		regs[n].reg = key & 0xFF;
+		__hist_copy(&regs[n].hist, &trace_regs[bus][i].hist);
+		if(regs[n].hist.count==0) continue;
+		n++;
+	}
+	return n;
+}
+
+
+int rc_i2c_reset_trace(void)
+{
+	int bus, i;
+	for(i=0;i<I2C_TRACE_SIZE;i++) __atomic_store_n(&trace_ring[i].seq, 0, __ATOMIC_RELAXED);
+	for(bus=0;bus<=I2C_MAX_BUS;bus++){
+		memset(&trace_bus_hist[bus], 0, sizeof(rc_i2c_histogram_t));
+		for(i=0;i<I2C_TRACE_MAX_REGS;i++){
+			memset(&trace_regs[bus][i].hist, 0, sizeof(rc_i2c_histogram_t));
+		}
+	}
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return 0;
+}
@@ -0,0 +1,165 @@
+/**
+ * @file spi.c
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#include <rc/spi.h>
+#include <rc/error_log.h>
+
+// preposessor macros
+#define unlikely(x)	__builtin_expect (!!(x), 0)
+#define likely(x)	__builtin_expect (!!(x), 1)
+
+
+/*******************************************************************************
+* struct rc_spi_t
+* state of one chip select, one for each is allocated here
+*******************************************************************************/
+typedef struct rc_spi_t {
+	int fd;
+	uint32_t speed_hz;
+} rc_spi_t;
+
+static rc_spi_t spi[SPI_MAX_BUS+1][SPI_MAX_SLAVES] = {
+	[0 ... SPI_MAX_BUS] = {
+		[0 ... SPI_MAX_SLAVES-1] = { .fd = -1 }
+	}
+};
+
+// one recursive lock per bus
+static pthread_mutex_t bus_mutex[SPI_MAX_BUS+1] = {
+	[0 ... SPI_MAX_BUS] = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
+};
+
+
+// local function
+static int __check_spi_range(int bus, int slave)
+{
+	if(unlikely(bus<0 || bus>SPI_MAX_BUS)){
+		fprintf(stderr,"ERROR: spi bus must be between 0 & %d\n", SPI_MAX_BUS);
+		return -1;
+	}
+	if(unlikely(slave<0 || slave>=SPI_MAX_SLAVES)){
+		fprintf(stderr,"ERROR: spi slave must be between 0 & %d\n", SPI_MAX_SLAVES-1);
+		return -1;
+	}
+	return 0;
+}
+
+
+int rc_spi_init(int bus, int slave, rc_spi_mode_t mode, uint32_t speed_hz)
+{
+	char path[32];
+	uint8_t m = mode;
+	uint8_t bits = 8;
+	int fd;
+
+	if(unlikely(__check_spi_range(bus, slave))) return -1;
+	if(unlikely(speed_hz==0)){
+		fprintf(stderr,"ERROR: in rc_spi_init, speed_hz must be nonzero\n");
+		return -1;
+	}
+
+	fd = spi[bus][slave].fd;
+	if(fd==-1){
+		snprintf(path, sizeof(path), "/dev/spidev%d.%d", bus, slave);
+		fd = open(path, O_RDWR|O_CLOEXEC);
+		if(fd==-1){
+			fprintf(stderr,"ERROR: in rc_spi_init, failed to open %s: %s\n", path, strerror(errno));
+			return -1;
+		}
+	}
+	if(ioctl(fd, SPI_IOC_WR_MODE, &m)<0 ||
+			ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits)<0 ||
+			ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz)<0){
+		perror("ERROR: in rc_spi_init, failed to configure spidev");
+		if(spi[bus][slave].fd==-1) close(fd);
+		return -1;
+	}
+	spi[bus][slave].fd = fd;
+	spi[bus][slave].speed_hz = speed_hz;
+	return 0;
+}
+
+
+int rc_spi_close(int bus, int slave)
+{
+	if(unlikely(__check_spi_range(bus, slave))) return -1;
+	if(spi[bus][slave].fd==-1) return -1;
+	close(spi[bus][slave].fd);
+	spi[bus][slave].fd = -1;
+	return 0;
+}
+
+
+int rc_spi_get_fd(int bus, int slave)
+{
+	if(unlikely(__check_spi_range(bus, slave))) return -1;
+	return spi[bus][slave].fd;
+}
+
+
+int rc_spi_transfer(int bus, int slave, const uint8_t* tx, uint8_t* rx, size_t length, uint32_t speed_hz)
+{
+	struct spi_ioc_transfer xfer;
+
+	if(unlikely(__check_spi_range(bus, slave))) return -1;
+	if(unlikely(spi[bus][slave].fd==-1)){
+		rc_error_report(ERR_SRC_SPI, ERR_LEVEL_ERROR, "in rc_spi_transfer, spi%d.%d not initialized yet", bus, slave);
+		return -1;
+	}
+	if(unlikely(length==0 || length>SPI_MAX_TRANSFER)){
+		rc_error_report(ERR_SRC_SPI, ERR_LEVEL_ERROR, "in rc_spi_transfer, length must be between 1 & %d", SPI_MAX_TRANSFER);
+		return -1;
+	}
+
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.tx_buf = (unsigned long)tx;
+	xfer.rx_buf = (unsigned long)rx;
+	xfer.len = length;
+	xfer.speed_hz = speed_hz ? speed_hz : spi[bus][slave].speed_hz;
+	xfer.bits_per_word = 8;
+	if(unlikely(ioctl(spi[bus][slave].fd, SPI_IOC_MESSAGE(1), &xfer)<0)){
+		rc_error_report(ERR_SRC_SPI, ERR_LEVEL_ERROR, "in rc_spi_transfer, ioctl failed, errno %d", errno);
+		return -1;
+	}
+	return 0;
+}
+
+
+int rc_spi_write(int bus, int slave, const uint8_t* data, size_t length)
+{
+	return rc_spi_transfer(bus, slave, data, NULL, length, 0);
+}
+
+
+int rc_spi_read(int bus, int slave, uint8_t* data, size_t length)
+{
+	return rc_spi_transfer(bus, slave, NULL, data, length, 0);
+}
+
+
+int rc_spi_lock_bus(int bus)
+{
+	if(unlikely(__check_spi_range(bus, 0))) return -1;
+	return pthread_mutex_lock(&bus_mutex[bus]) ? -1 : 0;
+}
+
+
+int rc_spi_unlock_bus(int bus)
+{
+	if(unlikely(__check_spi_range(bus, 0))) return -1;
+	return pthread_mutex_unlock(&bus_mutex[bus]) ? -1 : 0;
+}
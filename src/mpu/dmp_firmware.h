@@ -7,8 +7,11 @@
 #define MPU6500_BANK_SIZE		256
 #define MPU6500_BANK_SEL		0x6D
 #define MPU6500_MEM_R_W			0x6F
-#define DMP_LOAD_CHUNK			(16)
+// largest piece of a bank sent as one segment, the register transports take
+// at most 255 bytes at a time. Must divide evenly into the bank size.
+#define DMP_LOAD_CHUNK			(128)
 #define DMP_CODE_SIZE           (3062)
+#define DMP_CODE_BANKS			((DMP_CODE_SIZE+MPU6500_BANK_SIZE-1)/MPU6500_BANK_SIZE)
 #define DMP_SAMPLE_RATE     	(200)
 
 #define DMP_INT_GESTURE     (0x01)
@@ -14,6 +14,7 @@
 #include <unistd.h>
 #include <poll.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <stdint.h>
 #include <errno.h>
 
@@ -26,9 +27,14 @@
 #include <rc/time.h>
 #include <rc/gpio.h>
 #include <rc/i2c.h>
+#include <rc/error_log.h>
+#include <rc/spi.h>
 #include <rc/pthread_helpers.h>
 
 #include "mpu_defs.h"
+#include "mpu_decode.h"
+#include "mpu_ring.h"
+#include "mpu_clock.h"
 #include "dmp_firmware.h"
 #include "dmpKey.h"
 #include "dmpmap.h"
@@ -36,6 +42,7 @@
 // macros
 #define ARRAY_SIZE(array) sizeof(array)/sizeof(array[0])
 #define min(a, b)	((a < b) ? a : b)
+#define likely(x)	__builtin_expect (!!(x), 1)
 #define unlikely(x)	__builtin_expect (!!(x), 0)
 #define __unused	__attribute__ ((unused))
 
@@ -48,7 +55,15 @@
 // or enabled.
 #define FIFO_LEN_QUAT_TAP 20 // 16 for quat, 4 for tap
 #define FIFO_LEN_QUAT_ACCEL_GYRO_TAP 32 // 16 quat, 6 accel, 6 gyro, 4 tap
-#define MAX_FIFO_BUFFER	(FIFO_LEN_QUAT_ACCEL_GYRO_TAP*5)
+#define CAL_MAX_SAMPLES	(512/6) // gyro samples that fit in the MPU9250 FIFO
+#define MPU_FIFO_SIZE	1024 // FIFO size selected in ACCEL_CONFIG_2
+#define FIFO_POLL_AHEAD	16 // fifo_poll wakes 1/16 faster than batches fill
+// a whole FIFO plus the partial packet carried over from the last read
+#define FIFO_BUF_SIZE	(MPU_FIFO_SIZE+FIFO_LEN_QUAT_ACCEL_GYRO_TAP)
+#define DMP_MAX_PACKETS	(FIFO_BUF_SIZE/FIFO_LEN_QUAT_TAP)
+#define FIFO_LEN_RAW	12 // 6 accel, 6 gyro
+#define FIFO_LEN_RAW_TEMP 14 // 6 accel, 2 temp, 6 gyro
+#define FIFO_LEN_MAG	8 // AK8963_ST1 through AK8963_ST2 from I2C slave 0
 
 
 // error threshold checks
@@ -59,65 +74,623 @@
 #define GYRO_CAL_THRESH		50
 #define GYRO_OFFSET_THRESH	500
 
+/*******************************************************************************
+* struct rc_mpu_t
+*
+* Everything the driver knows about one IMU. The functions without a handle
+* all work on default_mpu.
+*******************************************************************************/
+struct rc_mpu_t {
+	rc_mpu_config_t config;
+	int bypass_en;
+	int dmp_en;
+	int raw_en; // raw FIFO mode
+	int drdy_en; // data-ready mode
+	int packet_len;
+	rc_event_loop_t* imu_loop; // loop the interrupt fd is registered with
+	int own_loop; // imu_loop was created here rather than given in config
+	int thread_running_flag;
+	// thread control, the read pair are the exported globals for default_mpu
+	pthread_mutex_t* read_mutex;
+	pthread_cond_t* read_condition;
+	pthread_mutex_t read_mutex_own;
+	pthread_cond_t read_condition_own;
+	uint32_t tap_futex; // bumped on each tap for rc_mpu_block_until_tap
+	mpu_ring_t* ring; // sample ring, kept until the handle is destroyed
+	int ring_depth; // depth ring was allocated for
+	char* ring_shm; // shared memory name ring was published under, or NULL
+	rc_mpu_dmp_callback_t dmp_callback_func;
+	void* dmp_callback_user;
+	rc_mpu_tap_callback_t tap_callback_func;
+	void* tap_callback_user;
+	rc_mpu_raw_callback_t raw_callback_func;
+	void* raw_callback_user;
+	rc_mpu_dmp_batch_callback_t dmp_batch_func;
+	void* dmp_batch_user;
+	rc_mpu_stats_t stats;
+	float mag_factory_adjust[3];
+	float mag_offsets[3];
+	float mag_scales[3];
+	int last_read_successful;
+	uint64_t last_interrupt_ns; // CLOCK_MONOTONIC time of the last edge or batch timer wakeup
+	uint64_t missed_interrupts;
+	uint32_t last_seqno; // line sequence number of the last serviced edge
+	int mag_div_step;
+	int first_run;
+	int fifo_first_run; // no fifo read has succeeded yet
+	int fusion_first_run; // filters not primed yet
+	uint64_t last_tap_timestamp_nanos;
+	rc_mpu_data_t* data_ptr;
+	int imu_shutdown_flag;
+	rc_filter_t low_pass, high_pass; // for magnetometer Yaw filtering
+	float mag_yaw, dmp_yaw; // yaw from the last fusion run, for unwrapping
+	int mag_spin_counter, dmp_spin_counter; // whole turns of each yaw
+	const rc_mpu_transport_t* tp; // active transport
+	void* tp_ctx; // context handed to every transport call
+	uint8_t tp_addr; // slave address register accesses go to
+	int i2c_transport_bus; // context of the built-in transport
+	const rc_mpu_transport_t* irq_tp; // where the interrupt functions come from
+	void* irq_ctx; // context handed to the interrupt functions
+	int error_printer_on;
+	int imu_interrupt_fd;
+	short imu_interrupt_events;
+	int timer_fd; // wakes the interrupt thread instead when batching, else -1
+	// magnetometer read handed to the I2C worker by the interrupt thread
+	rc_i2c_request_t mag_req;
+	rc_i2c_seg_t mag_segs[2];
+	uint8_t mag_reg;
+	uint8_t mag_raw[8];
+	int mag_ready; // mag_raw holds a completed read not decoded yet
+	int mag_master; // magnetometer reached through the MPU's I2C master
+	uint8_t mag_mst_dly; // I2C master sample skip so it polls at about 100hz
+	// FIFO contents, DMP packets start at fifo_pkt[]
+	uint8_t fifo_buf[FIFO_BUF_SIZE];
+	int fifo_pkt[DMP_MAX_PACKETS];
+	uint8_t fifo_carry[FIFO_LEN_QUAT_ACCEL_GYRO_TAP]; // start of a packet still being written
+	int fifo_carry_len;
+	int fifo_ahead; // bytes the last FIFO_COUNT showed that weren't read yet
+	uint64_t sample_period_ns;
+	mpu_clock_t clock; // sample clock model, timestamps samples on CLOCK_MONOTONIC
+	int64_t clock_offset; // timestamp_clock minus CLOCK_MONOTONIC for the current batch
+	uint64_t last_stamp_ns; // newest timestamp handed out on timestamp_clock
+	// raw FIFO mode
+	int raw_pkt_len;
+	uint8_t raw_fifo_en; // FIFO_EN register value
+	rc_mpu_raw_sample_t raw_samples[RC_MPU_RAW_MAX_SAMPLES];
+	rc_mpu_data_t dmp_batch[DMP_MAX_PACKETS]; // for the DMP batch callback
+};
+
+#define RC_MPU_STATE_INITIALIZER {					\
+	.read_mutex		= &read_mutex,				\
+	.read_condition		= &read_condition,			\
+	.imu_interrupt_fd	= -1,					\
+	.timer_fd		= -1,					\
+	.fifo_first_run		= 1,					\
+	.fusion_first_run	= 1,					\
+	.mag_req		= { .efd = -1, .done = 1 },		\
+	.mag_reg		= AK8963_ST1				\
+}
+
 // Thread control
 pthread_mutex_t read_mutex	= PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t  read_condition	= PTHREAD_COND_INITIALIZER;
-pthread_mutex_t tap_mutex	= PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  tap_condition	= PTHREAD_COND_INITIALIZER;
-
-/*******************************************************************************
-*	Local variables
-*******************************************************************************/
-static rc_mpu_config_t config;
-static int bypass_en;
-static int dmp_en=0;
-static int packet_len;
-static pthread_t imu_interrupt_thread;
-static int thread_running_flag;
-static void (*dmp_callback_func)()=NULL;
-static void (*tap_callback_func)(int dir, int cnt)=NULL;
-static float mag_factory_adjust[3];
-static float mag_offsets[3];
-static float mag_scales[3];
-static int last_read_successful;
-static uint64_t last_interrupt_timestamp_nanos;
-static uint64_t last_tap_timestamp_nanos;
-static rc_mpu_data_t* data_ptr;
-static int imu_shutdown_flag = 0;
-static rc_filter_t low_pass, high_pass; // for magnetometer Yaw filtering
+
+static rc_mpu_t default_mpu = RC_MPU_STATE_INITIALIZER;
+// callbacks of the functions without a handle, called through an adapter
+static void (*legacy_dmp_callback)(void);
+static void (*legacy_tap_callback)(int dir, int cnt);
 
 /*******************************************************************************
 * functions for internal use only
 *******************************************************************************/
-static int __reset_mpu();
-static int __check_who_am_i();
-static int __set_gyro_fsr(rc_mpu_gyro_fsr_t fsr, rc_mpu_data_t* data);
-static int __set_accel_fsr(rc_mpu_accel_fsr_t, rc_mpu_data_t* data);
-static int __set_gyro_dlpf(rc_mpu_gyro_dlpf_t dlpf);
-static int __set_accel_dlpf(rc_mpu_accel_dlpf_t dlpf);
-static int __init_magnetometer(int cal_mode);
-static int __power_off_magnetometer();
-static int __mpu_set_bypass(unsigned char bypass_on);
-static int __mpu_write_mem(unsigned short mem_addr, unsigned short length, unsigned char *data);
-static int __mpu_read_mem(unsigned short mem_addr, unsigned short length, unsigned char *data);
-static int __dmp_load_motion_driver_firmware();
-static int __dmp_set_orientation(unsigned short orient);
-static int __dmp_enable_gyro_cal(unsigned char enable);
-static int __dmp_enable_lp_quat(unsigned char enable);
-static int __dmp_enable_6x_lp_quat(unsigned char enable);
-static int __mpu_reset_fifo(void);
-static int __mpu_set_sample_rate(int rate);
-static int __dmp_set_fifo_rate(unsigned short rate);
-static int __dmp_enable_feature(unsigned short mask);
-static int __mpu_set_dmp_state(unsigned char enable);
-static int __set_int_enable(unsigned char enable);
-static int __dmp_set_interrupt_mode(unsigned char mode);
-static int __load_gyro_calibration();
-static int __load_mag_calibration();
-static int __write_mag_cal_to_disk(float offsets[3], float scale[3]);
-static void* __dmp_interrupt_handler(void* ptr);
-static int __read_dmp_fifo(rc_mpu_data_t* data);
-static int __data_fusion(rc_mpu_data_t* data);
+static int __reset_mpu(rc_mpu_t* mpu);
+static int __check_who_am_i(rc_mpu_t* mpu);
+static int __set_gyro_fsr(rc_mpu_t* mpu, rc_mpu_gyro_fsr_t fsr, rc_mpu_data_t* data);
+static int __set_accel_fsr(rc_mpu_t* mpu, rc_mpu_accel_fsr_t, rc_mpu_data_t* data);
+static int __set_gyro_dlpf(rc_mpu_t* mpu, rc_mpu_gyro_dlpf_t dlpf);
+static int __set_accel_dlpf(rc_mpu_t* mpu, rc_mpu_accel_dlpf_t dlpf);
+static int __init_magnetometer(rc_mpu_t* mpu, int cal_mode);
+static int __initialize(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf);
+static int __initialize_dmp(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf);
+static int __initialize_raw_fifo(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf);
+static int __initialize_data_ready(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf);
+static int __power_off_magnetometer(rc_mpu_t* mpu);
+static int __mpu_set_bypass(rc_mpu_t* mpu, unsigned char bypass_on);
+static int __mpu_write_mem(rc_mpu_t* mpu, unsigned short mem_addr, unsigned short length, unsigned char *data);
+static int __dmp_mem_burst(rc_mpu_t* mpu, unsigned short mem_addr, unsigned short length, unsigned char* data, int read);
+static int __dmp_load_motion_driver_firmware(rc_mpu_t* mpu);
+static int __dmp_set_orientation(rc_mpu_t* mpu, unsigned short orient);
+static int __dmp_enable_gyro_cal(rc_mpu_t* mpu, unsigned char enable);
+static int __dmp_enable_lp_quat(rc_mpu_t* mpu, unsigned char enable);
+static int __dmp_enable_6x_lp_quat(rc_mpu_t* mpu, unsigned char enable);
+static int __mpu_reset_fifo(rc_mpu_t* mpu);
+static int __mpu_set_sample_rate(rc_mpu_t* mpu, int rate);
+static int __dmp_set_fifo_rate(rc_mpu_t* mpu, unsigned short rate);
+static int __dmp_enable_feature(rc_mpu_t* mpu, unsigned short mask);
+static int __mpu_set_dmp_state(rc_mpu_t* mpu, unsigned char enable);
+static int __set_int_enable(rc_mpu_t* mpu, unsigned char enable);
+static int __dmp_set_interrupt_mode(rc_mpu_t* mpu, unsigned char mode);
+static int __load_gyro_calibration(rc_mpu_t* mpu);
+static int __load_mag_calibration(rc_mpu_t* mpu);
+static int __write_mag_cal_to_disk(rc_mpu_t* mpu, float offsets[3], float scale[3]);
+static int __cal_file_path(rc_mpu_t* mpu, const char* file, char* path, size_t len);
+static void __dmp_interrupt_handler(int fd, uint32_t events, void* user);
+static void __raw_interrupt_handler(int fd, uint32_t events, void* user);
+static void __drdy_interrupt_handler(int fd, uint32_t events, void* user);
+static int __mpu_reset_raw_fifo(rc_mpu_t* mpu);
+static int __read_dmp_fifo(rc_mpu_t* mpu);
+static void __parse_dmp_packet(rc_mpu_t* mpu, const uint8_t* p, rc_mpu_data_t* data);
+static void __batch_timestamp(rc_mpu_t* mpu, int n);
+static uint64_t __sample_timestamp(rc_mpu_t* mpu, int k);
+static void __deliver_raw(rc_mpu_t* mpu, int n);
+static int __wake_fd(rc_mpu_t* mpu);
+static void __close_interrupt(rc_mpu_t* mpu);
+static int __data_fusion(rc_mpu_t* mpu, rc_mpu_data_t* data);
+
+/*******************************************************************************
+* void __set_write_seg(rc_i2c_seg_t* seg, uint8_t* data, uint16_t length)
+* void __set_read_seg(rc_i2c_seg_t* seg, uint8_t* data, uint16_t length)
+*
+* fill in one segment of an rc_i2c_transfer addressed to the MPU itself
+*******************************************************************************/
+static inline void __set_write_seg(rc_mpu_t* mpu, rc_i2c_seg_t* seg, uint8_t* data, uint16_t length)
+{
+	seg->devAddr = mpu->config.i2c_addr;
+	seg->read = 0;
+	seg->length = length;
+	seg->data = data;
+}
+
+static inline void __set_read_seg(rc_mpu_t* mpu, rc_i2c_seg_t* seg, uint8_t* data, uint16_t length)
+{
+	seg->devAddr = mpu->config.i2c_addr;
+	seg->read = 1;
+	seg->length = length;
+	seg->data = data;
+}
+
+/*******************************************************************************
+* built-in transport
+*
+* Talks to the MPU over the Linux I2C bus driver and waits for interrupts on a
+* sysfs GPIO pin. The context is just the bus number. Each register access
+* holds the bus lock while it selects the slave address so another thread
+* can't retarget the bus between the two.
+*******************************************************************************/
+static int __i2c_tp_init(void* ctx, int bus, uint8_t addr)
+{
+	*(int*)ctx = bus;
+	return rc_i2c_init(bus, addr);
+}
+
+static int __i2c_tp_read_regs(void* ctx, uint8_t addr, uint8_t reg, size_t length, uint8_t* data)
+{
+	int bus = *(int*)ctx;
+	int ret;
+	if(unlikely(length>255)) return -1;
+	rc_i2c_lock_bus(bus);
+	ret = rc_i2c_set_device_address(bus, addr);
+	if(likely(ret==0)) ret = rc_i2c_read_bytes(bus, reg, length, data);
+	rc_i2c_unlock_bus(bus);
+	return ret<0 ? -1 : 0;
+}
+
+static int __i2c_tp_write_regs(void* ctx, uint8_t addr, uint8_t reg, size_t length, const uint8_t* data)
+{
+	int bus = *(int*)ctx;
+	int ret;
+	if(unlikely(length>255)) return -1;
+	rc_i2c_lock_bus(bus);
+	ret = rc_i2c_set_device_address(bus, addr);
+	if(likely(ret==0)){
+		if(length==1) ret = rc_i2c_write_byte(bus, reg, data[0]);
+		else ret = rc_i2c_write_bytes(bus, reg, length, (uint8_t*)data);
+	}
+	rc_i2c_unlock_bus(bus);
+	return ret<0 ? -1 : 0;
+}
+
+static int __i2c_tp_burst_read(void* ctx, uint8_t addr, uint8_t reg, size_t length, uint8_t* data)
+{
+	int bus = *(int*)ctx;
+	int ret = 0;
+	size_t n;
+	// the register doesn't auto-increment so long reads can be split into
+	// as many transactions as rc_i2c_read_bytes needs
+	rc_i2c_lock_bus(bus);
+	if(unlikely(rc_i2c_set_device_address(bus, addr))) ret = -1;
+	while(ret==0 && length>0){
+		n = min(length, (size_t)255);
+		if(unlikely(rc_i2c_read_bytes(bus, reg, n, data)!=(int)n)) ret = -1;
+		data += n;
+		length -= n;
+	}
+	rc_i2c_unlock_bus(bus);
+	return ret;
+}
+
+static int __i2c_tp_transfer(void* ctx, rc_i2c_seg_t* segs, int n)
+{
+	return rc_i2c_transfer(*(int*)ctx, segs, n)<0 ? -1 : 0;
+}
+
+static int __i2c_tp_lock(void* ctx)
+{
+	return rc_i2c_lock_bus(*(int*)ctx)<0 ? -1 : 0;
+}
+
+static int __i2c_tp_unlock(void* ctx)
+{
+	return rc_i2c_unlock_bus(*(int*)ctx)<0 ? -1 : 0;
+}
+
+static int __gpio_interrupt_open(void* ctx, int pin, short* events)
+{
+	rc_mpu_t* mpu = ctx;
+	int fd;
+	// character device, the line is requested for the lifetime of the fd
+	if(mpu->config.gpio_interrupt_chip>=0){
+		fd = rc_gpio_line_request_events(mpu->config.gpio_interrupt_chip, pin, GPIO_EDGE_FALLING, "rc_mpu");
+		if(fd==-1){
+			fprintf(stderr,"ERROR: in rc_mpu_initialize_dmp, failed to request line %d of gpiochip%d\n", pin, mpu->config.gpio_interrupt_chip);
+			return -1;
+		}
+		*events = POLLIN;
+		return fd;
+	}
+	if(rc_gpio_export(pin)){
+		fprintf(stderr,"ERROR: in rc_mpu_initialize_dmp, failed to export GPIO %d\n", pin);
+		fprintf(stderr,"probably insufficient privileges\n");
+		return -1;
+	}
+	if(rc_gpio_set_dir(pin, GPIO_INPUT_PIN)){
+		fprintf(stderr,"ERROR: in rc_mpu_initialize_dmp, failed to configure GPIO %d direction\n", pin);
+		return -1;
+	}
+	if(rc_gpio_set_edge(pin, GPIO_EDGE_FALLING)){
+		fprintf(stderr,"ERROR: in rc_mpu_initialize_dmp, failed to configure GPIO %d edge\n", pin);
+		return -1;
+	}
+	fd = rc_gpio_get_value_fd(pin);
+	if(fd==-1){
+		fprintf(stderr,"ERROR: in rc_mpu_initialize_dmp, can't open GPIO %d value fd\n", pin);
+		return -1;
+	}
+	*events = POLLPRI;
+	return fd;
+}
+
+static int __gpio_interrupt_ack(__unused void* ctx, int fd)
+{
+	if(rc_gpio_read_value_fd(fd)<0){
+		rc_error_report(ERR_SRC_MPU, ERR_LEVEL_ERROR, "in __dmp_interrupt_handler, failed to read gpio value FD, errno %d", errno);
+		return -1;
+	}
+	return 0;
+}
+
+static void __gpio_interrupt_close(void* ctx, int pin)
+{
+	rc_mpu_t* mpu = ctx;
+	if(mpu->config.gpio_interrupt_chip>=0){
+		rc_gpio_line_release(mpu->imu_interrupt_fd);
+		return;
+	}
+	rc_gpio_unexport(pin);
+}
+
+static int __gpio_interrupt_event(void* ctx, int fd, uint64_t* timestamp_ns, uint32_t* seqno)
+{
+	rc_mpu_t* mpu = ctx;
+	rc_gpio_event_t ev[GPIO_MAX_LINE_EVENTS];
+	int n;
+	if(mpu->config.gpio_interrupt_chip<0){
+		*timestamp_ns = 0;
+		*seqno = 0;
+		return __gpio_interrupt_ack(NULL, fd);
+	}
+	n = rc_gpio_line_read_events(fd, ev, GPIO_MAX_LINE_EVENTS);
+	if(n<0){
+		rc_error_report(ERR_SRC_MPU, ERR_LEVEL_ERROR, "in __dmp_interrupt_handler, failed to read gpio line events, errno %d", errno);
+		return -1;
+	}
+	if(n==0) return -1;
+	// only the newest edge matters, seqno exposes any before it
+	*timestamp_ns = ev[n-1].timestamp_ns;
+	*seqno = ev[n-1].seqno;
+	return 0;
+}
+
+// the built-in interrupt, the context is the rc_mpu_t
+static const rc_mpu_transport_t gpio_interrupt = {
+	.interrupt_open	= __gpio_interrupt_open,
+	.interrupt_ack	= __gpio_interrupt_ack,
+	.interrupt_close= __gpio_interrupt_close,
+	.interrupt_event= __gpio_interrupt_event
+};
+
+static const rc_mpu_transport_t i2c_transport = {
+	.init		= __i2c_tp_init,
+	.close		= NULL,
+	.read_regs	= __i2c_tp_read_regs,
+	.write_regs	= __i2c_tp_write_regs,
+	.burst_read	= __i2c_tp_burst_read,
+	.transfer	= __i2c_tp_transfer,
+	.lock		= __i2c_tp_lock,
+	.unlock		= __i2c_tp_unlock,
+	.interrupt_open	= NULL,
+	.interrupt_ack	= NULL,
+	.interrupt_close= NULL,
+	.interrupt_event= NULL
+};
+
+/*******************************************************************************
+* SPI transport
+*
+* The context is an rc_mpu_spi_t. The first byte of each message is the
+* register address with the top bit set for reads. The MPU6500/9250 only
+* accepts register writes at up to 1MHz but the sensor, interrupt status and
+* FIFO registers can be read at up to 20MHz, so only those reads use the fast
+* clock. The chip's I2C interface is disabled whenever USER_CTRL is written so
+* it can't mistake SPI traffic for an I2C start condition.
+*******************************************************************************/
+#define SPI_WRITE_HZ		1000000
+#define SPI_READ_BIT		0x80
+#define SPI_MAX_REG_READ	1024
+
+static int __spi_xfer(rc_mpu_spi_t* s, const uint8_t* tx, uint8_t* rx, size_t length, uint32_t speed_hz)
+{
+	if(s->xfer!=NULL) return s->xfer(s->xfer_ctx, tx, rx, length) ? -1 : 0;
+	return rc_spi_transfer(s->bus, s->slave, tx, rx, length, speed_hz);
+}
+
+// registers that may be read at the fast clock
+static inline int __spi_fast_reg(uint8_t reg)
+{
+	return (reg>=INT_STATUS && reg<=EXT_SENS_DATA_23) ||
+		(reg>=FIFO_COUNTH && reg<=FIFO_R_W);
+}
+
+static int __spi_tp_init(void* ctx, __unused int bus, __unused uint8_t addr)
+{
+	rc_mpu_spi_t* s = ctx;
+	if(unlikely(s==NULL)){
+		fprintf(stderr,"ERROR: in rc_mpu_spi_transport, transport_ctx must point to an rc_mpu_spi_t\n");
+		return -1;
+	}
+	if(s->xfer!=NULL) return 0;
+	return rc_spi_init(s->bus, s->slave, SPI_MODE_CPOL1_CPHA1, SPI_WRITE_HZ);
+}
+
+static int __spi_tp_close(void* ctx)
+{
+	rc_mpu_spi_t* s = ctx;
+	if(s->xfer!=NULL) return 0;
+	return rc_spi_close(s->bus, s->slave);
+}
+
+static int __spi_tp_read_regs(void* ctx, uint8_t addr, uint8_t reg, size_t length, uint8_t* data)
+{
+	rc_mpu_spi_t* s = ctx;
+	uint8_t tx[SPI_MAX_REG_READ+1];
+	uint8_t rx[SPI_MAX_REG_READ+1];
+	uint32_t speed = SPI_WRITE_HZ;
+
+	// the magnetometer is only on the MPU's auxiliary I2C bus
+	if(unlikely(addr==AK8963_ADDR)){
+		errno = ENXIO;
+		return -1;
+	}
+	if(unlikely(length==0 || length>SPI_MAX_REG_READ)) return -1;
+	if(__spi_fast_reg(reg) && s->speed_hz>SPI_WRITE_HZ) speed = s->speed_hz;
+	memset(tx, 0, length+1);
+	tx[0] = reg|SPI_READ_BIT;
+	if(unlikely(__spi_xfer(s, tx, rx, length+1, speed))) return -1;
+	memcpy(data, rx+1, length);
+	return 0;
+}
+
+static int __spi_tp_write_regs(void* ctx, uint8_t addr, uint8_t reg, size_t length, const uint8_t* data)
+{
+	rc_mpu_spi_t* s = ctx;
+	uint8_t tx[SPI_MAX_REG_READ+1];
+
+	if(unlikely(addr==AK8963_ADDR)){
+		errno = ENXIO;
+		return -1;
+	}
+	if(unlikely(length==0 || length>SPI_MAX_REG_READ)) return -1;
+	tx[0] = reg&~SPI_READ_BIT;
+	memcpy(tx+1, data, length);
+	if(reg<=USER_CTRL && reg+length>USER_CTRL) tx[1+USER_CTRL-reg] |= (I2C_IF_DIS);
+	return __spi_xfer(s, tx, NULL, length+1, SPI_WRITE_HZ);
+}
+
+static int __spi_tp_lock(void* ctx)
+{
+	rc_mpu_spi_t* s = ctx;
+	if(s->xfer!=NULL) return 0;
+	return rc_spi_lock_bus(s->bus);
+}
+
+static int __spi_tp_unlock(void* ctx)
+{
+	rc_mpu_spi_t* s = ctx;
+	if(s->xfer!=NULL) return 0;
+	return rc_spi_unlock_bus(s->bus);
+}
+
+// only reached with an irq override, without one __transport_init points the
+// driver at the built-in GPIO interrupt directly
+static int __spi_tp_interrupt_open(void* ctx, int pin, short* events)
+{
+	rc_mpu_spi_t* s = ctx;
+	if(s->irq==NULL || s->irq->interrupt_open==NULL) return -1;
+	return s->irq->interrupt_open(s->irq_ctx, pin, events);
+}
+
+static int __spi_tp_interrupt_ack(void* ctx, int fd)
+{
+	rc_mpu_spi_t* s = ctx;
+	if(s->irq==NULL) return -1;
+	return s->irq->interrupt_ack(s->irq_ctx, fd);
+}
+
+static int __spi_tp_interrupt_event(void* ctx, int fd, uint64_t* timestamp_ns, uint32_t* seqno)
+{
+	rc_mpu_spi_t* s = ctx;
+	if(s->irq==NULL) return -1;
+	if(s->irq->interrupt_event!=NULL){
+		return s->irq->interrupt_event(s->irq_ctx, fd, timestamp_ns, seqno);
+	}
+	*timestamp_ns = 0;
+	*seqno = 0;
+	return s->irq->interrupt_ack(s->irq_ctx, fd);
+}
+
+static void __spi_tp_interrupt_close(void* ctx, int pin)
+{
+	rc_mpu_spi_t* s = ctx;
+	if(s->irq!=NULL && s->irq->interrupt_close!=NULL){
+		s->irq->interrupt_close(s->irq_ctx, pin);
+	}
+}
+
+const rc_mpu_transport_t rc_mpu_spi_transport = {
+	.init		= __spi_tp_init,
+	.close		= __spi_tp_close,
+	.read_regs	= __spi_tp_read_regs,
+	.write_regs	= __spi_tp_write_regs,
+	.burst_read	= __spi_tp_read_regs,
+	.transfer	= NULL,
+	.lock		= __spi_tp_lock,
+	.unlock		= __spi_tp_unlock,
+	.interrupt_open	= __spi_tp_interrupt_open,
+	.interrupt_ack	= __spi_tp_interrupt_ack,
+	.interrupt_close= __spi_tp_interrupt_close,
+	.interrupt_event= __spi_tp_interrupt_event
+};
+
+/*******************************************************************************
+* int __transport_init()
+*
+* picks the transport named in the config struct, or the built-in one if none
+* was given, and opens it. All register access below goes through the small
+* wrappers that follow so the rest of the driver doesn't care which it is.
+*******************************************************************************/
+static int __transport_init(rc_mpu_t* mpu)
+{
+	const rc_mpu_transport_t* t = mpu->config.transport;
+	if(t==NULL){
+		mpu->tp = &i2c_transport;
+		mpu->tp_ctx = &mpu->i2c_transport_bus;
+	}
+	else{
+		if(t->read_regs==NULL || t->write_regs==NULL || t->burst_read==NULL ||
+						t->lock==NULL || t->unlock==NULL){
+			fprintf(stderr,"ERROR: in __transport_init, transport is missing a required function\n");
+			return -1;
+		}
+		mpu->tp = t;
+		mpu->tp_ctx = mpu->config.transport_ctx;
+	}
+	// the built-in GPIO interrupt serves the built-in bus and SPI without an
+	// irq override, anything else brings its own
+	if(mpu->tp==&i2c_transport || (mpu->tp==&rc_mpu_spi_transport &&
+				((rc_mpu_spi_t*)mpu->tp_ctx)->irq==NULL)){
+		mpu->irq_tp = &gpio_interrupt;
+		mpu->irq_ctx = mpu;
+	}
+	else{
+		mpu->irq_tp = mpu->tp;
+		mpu->irq_ctx = mpu->tp_ctx;
+	}
+	mpu->tp_addr = mpu->config.i2c_addr;
+	mpu->mag_master = mpu->config.enable_magnetometer && mpu->config.mag_i2c_master;
+	if(mpu->tp->init==NULL) return 0;
+	return mpu->tp->init(mpu->tp_ctx, mpu->config.i2c_bus, mpu->config.i2c_addr);
+}
+
+static inline int __set_address(rc_mpu_t* mpu, uint8_t addr)
+{
+	mpu->tp_addr = addr;
+	return 0;
+}
+
+static inline int __read_bytes(rc_mpu_t* mpu, uint8_t reg, size_t length, uint8_t* data)
+{
+	return mpu->tp->read_regs(mpu->tp_ctx, mpu->tp_addr, reg, length, data);
+}
+
+static inline int __read_byte(rc_mpu_t* mpu, uint8_t reg, uint8_t* data)
+{
+	return mpu->tp->read_regs(mpu->tp_ctx, mpu->tp_addr, reg, 1, data);
+}
+
+static inline int __read_word(rc_mpu_t* mpu, uint8_t reg, uint16_t* data)
+{
+	uint8_t buf[2];
+	if(unlikely(mpu->tp->read_regs(mpu->tp_ctx, mpu->tp_addr, reg, 2, buf))) return -1;
+	*data = ((uint16_t)buf[0]<<8) | buf[1];
+	return 0;
+}
+
+static inline int __burst_read(rc_mpu_t* mpu, uint8_t reg, size_t length, uint8_t* data)
+{
+	return mpu->tp->burst_read(mpu->tp_ctx, mpu->tp_addr, reg, length, data);
+}
+
+static inline int __write_bytes(rc_mpu_t* mpu, uint8_t reg, size_t length, const uint8_t* data)
+{
+	return mpu->tp->write_regs(mpu->tp_ctx, mpu->tp_addr, reg, length, data);
+}
+
+static inline int __write_byte(rc_mpu_t* mpu, uint8_t reg, uint8_t data)
+{
+	return mpu->tp->write_regs(mpu->tp_ctx, mpu->tp_addr, reg, 1, &data);
+}
+
+static inline int __lock_bus(rc_mpu_t* mpu)
+{
+	return mpu->tp->lock(mpu->tp_ctx);
+}
+
+static inline int __unlock_bus(rc_mpu_t* mpu)
+{
+	return mpu->tp->unlock(mpu->tp_ctx);
+}
+
+/*******************************************************************************
+* int __transfer(rc_i2c_seg_t* segs, int n)
+*
+* runs a multi-segment transaction. Transports without a transfer function get
+* it split into register accesses: a one-byte write followed by a read from the
+* same device is a register read, any other write is a register write.
+*******************************************************************************/
+static int __transfer(rc_mpu_t* mpu, rc_i2c_seg_t* segs, int n)
+{
+	int i;
+	rc_i2c_seg_t* seg;
+	if(mpu->tp->transfer!=NULL) return mpu->tp->transfer(mpu->tp_ctx, segs, n);
+	for(i=0;i<n;i++) segs[i].result = -1;
+	__lock_bus(mpu);
+	for(i=0;i<n;i++){
+		seg = &segs[i];
+		if(unlikely(seg->read || seg->length<1)) break;
+		if(i+1<n && segs[i+1].read && segs[i+1].devAddr==seg->devAddr && seg->length==1){
+			if(mpu->tp->read_regs(mpu->tp_ctx, seg->devAddr, seg->data[0], segs[i+1].length, segs[i+1].data)) break;
+			seg->result = 1;
+			segs[i+1].result = segs[i+1].length;
+			i++;
+		}
+		else{
+			if(mpu->tp->write_regs(mpu->tp_ctx, seg->devAddr, seg->data[0], seg->length-1, seg->data+1)) break;
+			seg->result = seg->length;
+		}
+	}
+	__unlock_bus(mpu);
+	return i<n ? -1 : 0;
+}
 
 /*******************************************************************************
 * rc_mpu_config_t rc_mpu_default_config()
@@ -130,9 +703,13 @@ rc_mpu_config_t rc_mpu_default_config()
 
 	// connectivity
 	conf.gpio_interrupt_pin = RC_IMU_INTERRUPT_PIN;
+	conf.gpio_interrupt_chip = -1;
 	conf.i2c_bus = RC_IMU_BUS;
 	conf.i2c_addr = RC_MPU_DEFAULT_I2C_ADDR;
 	conf.show_warnings = 0;
+	conf.print_errors = 1;
+	conf.transport = NULL;
+	conf.transport_ctx = NULL;
 
 	// general stuff
 	conf.accel_fsr	= ACCEL_FSR_8G;
@@ -149,10 +726,23 @@ rc_mpu_config_t rc_mpu_default_config()
 	conf.compass_time_constant = 20.0;
 	conf.dmp_interrupt_sched_policy = SCHED_OTHER;
 	conf.dmp_interrupt_priority = 0;
+	conf.event_loop = NULL;
 	conf.read_mag_after_callback = 1;
 	conf.mag_sample_rate_div = 4;
+	conf.mag_i2c_master = 0;
 	conf.tap_threshold=210;
 
+	// raw FIFO stuff
+	conf.raw_sample_rate = 1000;
+	conf.raw_fifo_temp = 0;
+	conf.raw_fifo_mag = 0;
+
+	conf.fifo_batch = 1;
+	conf.fifo_poll = 0;
+	conf.timestamp_clock = TIMESTAMP_REALTIME;
+	conf.ring_depth = 64;
+	conf.ring_shm_name = NULL;
+
 	return conf;
 }
 
@@ -168,119 +758,229 @@ int rc_mpu_set_config_to_default(rc_mpu_config_t *conf)
 }
 
 /*******************************************************************************
-* int rc_mpu_initialize(rc_mpu_config_t conf)
+* int __start_error_printer(rc_mpu_t* mpu, rc_mpu_config_t conf)
+*
+* Starts printing the error log if the config asks for it. Done before anything
+* else in device init so failures during init get printed too. Returns 1 if this
+* call started the printer so the caller knows to stop it again on failure.
+*******************************************************************************/
+static int __start_error_printer(rc_mpu_t* mpu, rc_mpu_config_t conf)
+{
+	if(!conf.print_errors || mpu->error_printer_on) return 0;
+	if(rc_error_printer_start()) return 0;
+	mpu->error_printer_on = 1;
+	return 1;
+}
+
+/*******************************************************************************
+* void __stop_error_printer(rc_mpu_t* mpu)
+*
+* Stops the error printer if this handle started it, printing anything left
+*******************************************************************************/
+static void __stop_error_printer(rc_mpu_t* mpu)
+{
+	if(!mpu->error_printer_on) return;
+	rc_error_printer_stop();
+	mpu->error_printer_on = 0;
+}
+
+/*******************************************************************************
+* int __initialize_failed(rc_mpu_t* mpu, int started_printer)
+*
+* Cleanup shared by every initialize function that fails part way. A gpiochip
+* line request holds the interrupt line until it is closed, so an interrupt
+* opened before the failure must be released or the next attempt gets EBUSY.
+* Returns -1 for the caller to pass on.
+*******************************************************************************/
+static int __initialize_failed(rc_mpu_t* mpu, int started_printer)
+{
+	if(!mpu->thread_running_flag) __close_interrupt(mpu);
+	if(started_printer) __stop_error_printer(mpu);
+	return -1;
+}
+
+/*******************************************************************************
+* int rc_mpu_dev_initialize(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf)
+*
+* Polling mode, see __initialize
+*******************************************************************************/
+int rc_mpu_dev_initialize(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf)
+{
+	int started = __start_error_printer(mpu, conf);
+	if(__initialize(mpu, data, conf)==0) return 0;
+	return __initialize_failed(mpu, started);
+}
+
+/*******************************************************************************
+* int rc_mpu_dev_initialize_dmp(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf)
+*
+* DMP mode, see __initialize_dmp
+*******************************************************************************/
+int rc_mpu_dev_initialize_dmp(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf)
+{
+	int started = __start_error_printer(mpu, conf);
+	if(__initialize_dmp(mpu, data, conf)==0) return 0;
+	return __initialize_failed(mpu, started);
+}
+
+/*******************************************************************************
+* int rc_mpu_dev_initialize_raw_fifo(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf)
+*
+* Raw FIFO mode, see __initialize_raw_fifo
+*******************************************************************************/
+int rc_mpu_dev_initialize_raw_fifo(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf)
+{
+	int started = __start_error_printer(mpu, conf);
+	if(__initialize_raw_fifo(mpu, data, conf)==0) return 0;
+	return __initialize_failed(mpu, started);
+}
+
+/*******************************************************************************
+* int rc_mpu_dev_initialize_data_ready(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf)
+*
+* Data-ready mode, see __initialize_data_ready
+*******************************************************************************/
+int rc_mpu_dev_initialize_data_ready(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf)
+{
+	int started = __start_error_printer(mpu, conf);
+	if(__initialize_data_ready(mpu, data, conf)==0) return 0;
+	return __initialize_failed(mpu, started);
+}
+
+/*******************************************************************************
+* int __initialize(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf)
 *
 * Set up the imu for one-shot sampling of sensor data by user
 *******************************************************************************/
-int rc_mpu_initialize(rc_mpu_data_t *data, rc_mpu_config_t conf)
+int __initialize(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf)
 {
 	// update local copy of config struct with new values
-	config=conf;
+	mpu->config=conf;
 
 	// make sure the bus is not currently in use by another thread
 	// do not proceed to prevent interfering with that process
-	if(rc_i2c_get_lock(config.i2c_bus)){
+	if(mpu->config.transport==NULL && rc_i2c_get_lock(mpu->config.i2c_bus)){
 		printf("i2c bus claimed by another process\n");
 		printf("Continuing with rc_mpu_initialize() anyway.\n");
 	}
 
 	// if it is not claimed, start the i2c bus
-	if(rc_i2c_init(config.i2c_bus, config.i2c_addr)<0){
+	if(__transport_init(mpu)<0){
 		fprintf(stderr,"failed to initialize i2c bus\n");
 		return -1;
 	}
-	// claiming the bus does no guarantee other code will not interfere
-	// with this process, but best to claim it so other code can check
-	// like we did above
-	rc_i2c_lock_bus(config.i2c_bus);
+	mpu->imu_shutdown_flag = 0;
+	// hold the bus for the whole sequence so other threads using the
+	// bus wait rather than interleave transactions with ours
+	__lock_bus(mpu);
 
 	// restart the device so we start with clean registers
-	if(__reset_mpu()<0){
+	if(__reset_mpu(mpu)<0){
 		fprintf(stderr,"ERROR: failed to reset_mpu9250\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
 		return -1;
 	}
-	if(__check_who_am_i()){
-		rc_i2c_unlock_bus(config.i2c_bus);
+	if(__check_who_am_i(mpu)){
+		__unlock_bus(mpu);
 		return -1;
 	}
 
 	// load in gyro calibration offsets from disk
-	if(__load_gyro_calibration()<0){
+	if(__load_gyro_calibration(mpu)<0){
 		fprintf(stderr,"ERROR: failed to load gyro calibration offsets\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
 		return -1;
 	}
 
 	// Set sample rate = 1000/(1 + SMPLRT_DIV)
 	// here we use a divider of 0 for 1khz sample
-	if(rc_i2c_write_byte(config.i2c_bus, SMPLRT_DIV, 0x00)){
+	if(__write_byte(mpu, SMPLRT_DIV, 0x00)){
 		fprintf(stderr,"I2C bus write error\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
 		return -1;
 	}
 
 	// set full scale ranges and filter constants
-	if(__set_gyro_fsr(conf.gyro_fsr, data)){
+	if(__set_gyro_fsr(mpu, conf.gyro_fsr, data)){
 		fprintf(stderr,"failed to set gyro fsr\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
 		return -1;
 	}
-	if(__set_accel_fsr(conf.accel_fsr, data)){
+	if(__set_accel_fsr(mpu, conf.accel_fsr, data)){
 		fprintf(stderr,"failed to set accel fsr\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
 		return -1;
 	}
-	if(__set_gyro_dlpf(conf.gyro_dlpf)){
+	if(__set_gyro_dlpf(mpu, conf.gyro_dlpf)){
 		fprintf(stderr,"failed to set gyro dlpf\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
 		return -1;
 	}
-	if(__set_accel_dlpf(conf.accel_dlpf)){
+	if(__set_accel_dlpf(mpu, conf.accel_dlpf)){
 		fprintf(stderr,"failed to set accel_dlpf\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
 		return -1;
 	}
 
 	// initialize the magnetometer too if requested in config
 	if(conf.enable_magnetometer){
-		if(__init_magnetometer(0)){
+		if(__init_magnetometer(mpu, 0)){
 			fprintf(stderr,"failed to initialize magnetometer\n");
-			rc_i2c_unlock_bus(config.i2c_bus);
+			__unlock_bus(mpu);
 			return -1;
 		}
 	}
-	else __power_off_magnetometer();
+	else __power_off_magnetometer(mpu);
 
 	// all done!!
-	rc_i2c_unlock_bus(config.i2c_bus);
+	__unlock_bus(mpu);
 	return 0;
 }
 
+/*******************************************************************************
+* void __decode_accel(const uint8_t* raw, rc_mpu_data_t* data)
+* void __decode_gyro(const uint8_t* raw, rc_mpu_data_t* data)
+* float __decode_temp(const uint8_t* raw)
+*
+* Decode one big-endian XYZ sample into the raw and real unit fields of data,
+* or the two temperature bytes into degrees C.
+*******************************************************************************/
+static void __decode_accel(const uint8_t* raw, rc_mpu_data_t* data)
+{
+	const float s[3] = {data->accel_to_ms2, data->accel_to_ms2, data->accel_to_ms2};
+	mpu_decode_be16x3(raw, 6, 1, data->raw_accel, data->accel, s);
+}
+
+static void __decode_gyro(const uint8_t* raw, rc_mpu_data_t* data)
+{
+	const float s[3] = {data->gyro_to_degs, data->gyro_to_degs, data->gyro_to_degs};
+	mpu_decode_be16x3(raw, 6, 1, data->raw_gyro, data->gyro, s);
+}
+
+// the temperature is signed too, it goes negative below about 21C
+static inline float __decode_temp(const uint8_t* raw)
+{
+	return 21.0 + (int16_t)(((uint16_t)raw[0]<<8) | raw[1])/TEMP_SENSITIVITY;
+}
+
 /*******************************************************************************
 * int rc_mpu_read_accel(rc_mpu_data_t* data)
 *
 * Always reads in latest accelerometer values. The sensor
 * self-samples at 1khz and this retrieves the latest data.
 *******************************************************************************/
-int rc_mpu_read_accel(rc_mpu_data_t *data)
+int rc_mpu_dev_read_accel(rc_mpu_t* mpu, rc_mpu_data_t *data)
 {
 	// new register data stored here
 	uint8_t raw[6];
 	// set the device address
-	rc_i2c_set_device_address(config.i2c_bus, config.i2c_addr);
+	__set_address(mpu, mpu->config.i2c_addr);
 	 // Read the six raw data registers into data array
-	if(rc_i2c_read_bytes(config.i2c_bus, ACCEL_XOUT_H, 6, &raw[0])<0){
+	if(__read_bytes(mpu, ACCEL_XOUT_H, 6, &raw[0])<0){
 		return -1;
 	}
-	// Turn the MSB and LSB into a signed 16-bit value
-	data->raw_accel[0] = (int16_t)(((uint16_t)raw[0]<<8)|raw[1]);
-	data->raw_accel[1] = (int16_t)(((uint16_t)raw[2]<<8)|raw[3]);
-	data->raw_accel[2] = (int16_t)(((uint16_t)raw[4]<<8)|raw[5]);
-	// Fill in real unit values
-	data->accel[0] = data->raw_accel[0] * data->accel_to_ms2;
-	data->accel[1] = data->raw_accel[1] * data->accel_to_ms2;
-	data->accel[2] = data->raw_accel[2] * data->accel_to_ms2;
+	// Turn the MSB and LSB into signed 16-bit values and real units
+	__decode_accel(raw, data);
 	return 0;
 }
 
@@ -290,85 +990,56 @@ int rc_mpu_read_accel(rc_mpu_data_t *data)
 * Always reads in latest gyroscope values. The sensor self-samples
 * at 1khz and this retrieves the latest data.
 *******************************************************************************/
-int rc_mpu_read_gyro(rc_mpu_data_t *data)
+int rc_mpu_dev_read_gyro(rc_mpu_t* mpu, rc_mpu_data_t *data)
 {
 	// new register data stored here
 	uint8_t raw[6];
 	// set the device address
-	rc_i2c_set_device_address(config.i2c_bus, config.i2c_addr);
+	__set_address(mpu, mpu->config.i2c_addr);
 	// Read the six raw data registers into data array
-	if(rc_i2c_read_bytes(config.i2c_bus, GYRO_XOUT_H, 6, &raw[0])<0){
+	if(__read_bytes(mpu, GYRO_XOUT_H, 6, &raw[0])<0){
 		return -1;
 	}
-	// Turn the MSB and LSB into a signed 16-bit value
-	data->raw_gyro[0] = (int16_t)(((int16_t)raw[0]<<8)|raw[1]);
-	data->raw_gyro[1] = (int16_t)(((int16_t)raw[2]<<8)|raw[3]);
-	data->raw_gyro[2] = (int16_t)(((int16_t)raw[4]<<8)|raw[5]);
-	// Fill in real unit values
-	data->gyro[0] = data->raw_gyro[0] * data->gyro_to_degs;
-	data->gyro[1] = data->raw_gyro[1] * data->gyro_to_degs;
-	data->gyro[2] = data->raw_gyro[2] * data->gyro_to_degs;
+	// Turn the MSB and LSB into signed 16-bit values and real units
+	__decode_gyro(raw, data);
 	return 0;
 }
 
 /*******************************************************************************
-* int rc_mpu_read_mag(rc_mpu_data_t* data)
+* int __decode_mag(const uint8_t* raw, rc_mpu_data_t* data)
 *
-* Checks if there is new magnetometer data and reads it in if true.
-* Magnetometer only updates at 100hz, if there is no new data then
-* the values in rc_mpu_data_t struct are left alone.
+* Turns the 8 bytes from AK8963_ST1 through AK8963_ST2 into calibrated field
+* strength in data->mag. Returns 1 without touching data if the sample wasn't
+* new, -1 if it saturated and 0 otherwise. The I2C master polls faster than the
+* magnetometer measures, so without bypass a stale sample is normal and not
+* worth a warning.
 *******************************************************************************/
-int rc_mpu_read_mag(rc_mpu_data_t* data)
+static int __decode_mag(rc_mpu_t* mpu, const uint8_t* raw, rc_mpu_data_t* data)
 {
-	uint8_t raw[7];
 	int16_t adc[3];
 	float factory_cal_data[3];
-	if(!config.enable_magnetometer){
-		fprintf(stderr,"ERROR: can't read magnetometer unless it is enabled in \n");
-		fprintf(stderr,"rc_mpu_config_t struct before calling rc_mpu_initialize\n");
-		return -1;
-	}
-	// magnetometer is actually a separate device with its
-	// own address inside the mpu9250
-	// MPU9250 was put into passthrough mode
-	if(unlikely(rc_i2c_set_device_address(config.i2c_bus, AK8963_ADDR))){
-		fprintf(stderr,"ERROR: in rc_mpu_read_mag, failed to set i2c address\n");
-		return -1;
-	}
-	// don't worry about checking data ready bit, not worth thet time
-	// read the data ready bit to see if there is new data
-	uint8_t st1;
-	if(unlikely(rc_i2c_read_byte(config.i2c_bus, AK8963_ST1, &st1)<0)){
-		fprintf(stderr,"ERROR reading Magnetometer, i2c_bypass is probably not set\n");
-		return -1;
-	}
 	#ifdef DEBUG
-	printf("st1: %d", st1);
+	printf("st1: %d", raw[0]);
 	#endif
-	if(!(st1&MAG_DATA_READY)){
-		if(config.show_warnings){
-			printf("no new magnetometer data ready, skipping read\n");
+	if(!(raw[0]&MAG_DATA_READY)){
+		if(mpu->config.show_warnings && !mpu->mag_master){
+			rc_error_report(ERR_SRC_MPU, ERR_LEVEL_WARNING, "no new magnetometer data ready, skipping read");
 		}
-		return 0;
-	}
-	// Read the six raw data regs into data array
-	if(unlikely(rc_i2c_read_bytes(config.i2c_bus,AK8963_XOUT_L,7,&raw[0])<0)){
-		fprintf(stderr,"ERROR: rc_mpu_read_mag failed to read data register\n");
-		return -1;
+		return 1;
 	}
 	// check if the readings saturated such as because
 	// of a local field source, discard data if so
-	if(raw[6]&MAGNETOMETER_SATURATION){
-		if(config.show_warnings){
-			printf("WARNING: magnetometer saturated, discarding data\n");
+	if(raw[7]&MAGNETOMETER_SATURATION){
+		if(mpu->config.show_warnings){
+			rc_error_report(ERR_SRC_MPU, ERR_LEVEL_WARNING, "magnetometer saturated, discarding data");
 		}
 		return -1;
 	}
 	// Turn the MSB and LSB into a signed 16-bit value
 	// Data stored as little Endian
-	adc[0] = (int16_t)(((int16_t)raw[1]<<8) | raw[0]);
-	adc[1] = (int16_t)(((int16_t)raw[3]<<8) | raw[2]);
-	adc[2] = (int16_t)(((int16_t)raw[5]<<8) | raw[4]);
+	adc[0] = (int16_t)(((int16_t)raw[2]<<8) | raw[1]);
+	adc[1] = (int16_t)(((int16_t)raw[4]<<8) | raw[3]);
+	adc[2] = (int16_t)(((int16_t)raw[6]<<8) | raw[5]);
 	#ifdef DEBUG
 	printf("raw mag:%d %d %d\n", adc[0], adc[1], adc[2]);
 	#endif
@@ -377,20 +1048,110 @@ int rc_mpu_read_mag(rc_mpu_data_t* data)
 	// Teslas. Also correct the coordinate system as someone in invensense
 	// thought it would be bright idea to have the magnetometer coordiate
 	// system aligned differently than the accelerometer and gyro.... -__-
-	factory_cal_data[0] = adc[1] * mag_factory_adjust[1] * MAG_RAW_TO_uT;
-	factory_cal_data[1] = adc[0] * mag_factory_adjust[0] * MAG_RAW_TO_uT;
-	factory_cal_data[2] = -adc[2] * mag_factory_adjust[2] * MAG_RAW_TO_uT;
+	factory_cal_data[0] = adc[1] * mpu->mag_factory_adjust[1] * MAG_RAW_TO_uT;
+	factory_cal_data[1] = adc[0] * mpu->mag_factory_adjust[0] * MAG_RAW_TO_uT;
+	factory_cal_data[2] = -adc[2] * mpu->mag_factory_adjust[2] * MAG_RAW_TO_uT;
+
+	// now apply out own calibration, but first make sure we don't accidentally
+	// multiply by zero in case of uninitialized scale factors
+	if(mpu->mag_scales[0]==0.0) mpu->mag_scales[0]=1.0;
+	if(mpu->mag_scales[1]==0.0) mpu->mag_scales[1]=1.0;
+	if(mpu->mag_scales[2]==0.0) mpu->mag_scales[2]=1.0;
+	data->mag[0] = (factory_cal_data[0]-mpu->mag_offsets[0])*mpu->mag_scales[0];
+	data->mag[1] = (factory_cal_data[1]-mpu->mag_offsets[1])*mpu->mag_scales[1];
+	data->mag[2] = (factory_cal_data[2]-mpu->mag_offsets[2])*mpu->mag_scales[2];
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_mpu_read_mag(rc_mpu_data_t* data)
+*
+* Checks if there is new magnetometer data and reads it in if true.
+* Magnetometer only updates at 100hz, if there is no new data then
+* the values in rc_mpu_data_t struct are left alone.
+*******************************************************************************/
+int rc_mpu_dev_read_mag(rc_mpu_t* mpu, rc_mpu_data_t* data)
+{
+	uint8_t raw[8];
+	if(!mpu->config.enable_magnetometer){
+		fprintf(stderr,"ERROR: can't read magnetometer unless it is enabled in \n");
+		fprintf(stderr,"rc_mpu_config_t struct before calling rc_mpu_initialize\n");
+		return -1;
+	}
+	// the I2C master keeps a copy of the same 8 registers in EXT_SENS_DATA
+	if(mpu->mag_master){
+		__set_address(mpu, mpu->config.i2c_addr);
+		if(unlikely(__read_bytes(mpu, EXT_SENS_DATA_00, 8, raw)<0)){
+			rc_error_report(ERR_SRC_MPU, ERR_LEVEL_ERROR, "in rc_mpu_read_mag, failed to read EXT_SENS_DATA");
+			return -1;
+		}
+		return __decode_mag(mpu, raw, data)<0 ? -1 : 0;
+	}
+	// magnetometer is actually a separate device with its
+	// own address inside the mpu9250
+	// MPU9250 was put into passthrough mode
+	if(unlikely(__set_address(mpu, AK8963_ADDR))){
+		rc_error_report(ERR_SRC_MPU, ERR_LEVEL_ERROR, "in rc_mpu_read_mag, failed to set i2c address");
+		return -1;
+	}
+	// status, data and the ST2 read that ends the measurement are contiguous
+	// so take them in one transaction, the data registers are harmless to
+	// read when nothing new is ready
+	if(unlikely(__read_bytes(mpu, AK8963_ST1, 8, raw)<0)){
+		rc_error_report(ERR_SRC_MPU, ERR_LEVEL_ERROR, "reading Magnetometer, i2c_bypass is probably not set");
+		return -1;
+	}
+	return __decode_mag(mpu, raw, data)<0 ? -1 : 0;
+}
+
+/*******************************************************************************
+* int __submit_mag_read()
+*
+* Queues a read of AK8963_ST1 through AK8963_ST2 on the I2C worker so the
+* interrupt thread doesn't wait on it. The worker only flags mag_raw ready when
+* it completes, the interrupt thread decodes it on its next wakeup so data_ptr
+* is never written from two threads. If the previous read is still pending
+* this one is skipped, the magnetometer only updates at 100hz anyway.
+*******************************************************************************/
+static void __mag_read_done(rc_i2c_request_t* req)
+{
+	rc_mpu_t* mpu = req->user;
+	if(req->result>=0) __atomic_store_n(&mpu->mag_ready, 1, __ATOMIC_RELEASE);
+}
 
-	// now apply out own calibration, but first make sure we don't accidentally
-	// multiply by zero in case of uninitialized scale factors
-	if(mag_scales[0]==0.0) mag_scales[0]=1.0;
-	if(mag_scales[1]==0.0) mag_scales[1]=1.0;
-	if(mag_scales[2]==0.0) mag_scales[2]=1.0;
-	data->mag[0] = (factory_cal_data[0]-mag_offsets[0])*mag_scales[0];
-	data->mag[1] = (factory_cal_data[1]-mag_offsets[1])*mag_scales[1];
-	data->mag[2] = (factory_cal_data[2]-mag_offsets[2])*mag_scales[2];
+static int __submit_mag_read(rc_mpu_t* mpu)
+{
+	if(!__atomic_load_n(&mpu->mag_req.done, __ATOMIC_ACQUIRE)) return 0;
+	mpu->mag_segs[0].devAddr = AK8963_ADDR;
+	mpu->mag_segs[0].read = 0;
+	mpu->mag_segs[0].length = 1;
+	mpu->mag_segs[0].data = &mpu->mag_reg;
+	mpu->mag_segs[1].devAddr = AK8963_ADDR;
+	mpu->mag_segs[1].read = 1;
+	mpu->mag_segs[1].length = sizeof(mpu->mag_raw);
+	mpu->mag_segs[1].data = mpu->mag_raw;
+	mpu->mag_req.segs = mpu->mag_segs;
+	mpu->mag_req.n = 2;
+	mpu->mag_req.priority = I2C_PRIORITY_NORMAL;
+	mpu->mag_req.callback = __mag_read_done;
+	mpu->mag_req.efd = -1;
+	mpu->mag_req.user = mpu;
+	return rc_i2c_submit(mpu->config.i2c_bus, &mpu->mag_req);
+}
 
-	return 0;
+/*******************************************************************************
+* void __wait_mag_read()
+*
+* waits up to 100ms for an outstanding asynchronous magnetometer read
+*******************************************************************************/
+static void __wait_mag_read(rc_mpu_t* mpu)
+{
+	int i;
+	for(i=0;i<100;i++){
+		if(__atomic_load_n(&mpu->mag_req.done, __ATOMIC_ACQUIRE)) return;
+		rc_usleep(1000);
+	}
+	fprintf(stderr,"WARNING: magnetometer read still pending at power off\n");
 }
 
 /*******************************************************************************
@@ -398,18 +1159,42 @@ int rc_mpu_read_mag(rc_mpu_data_t* data)
 *
 * reads the latest temperature of the imu.
 *******************************************************************************/
-int rc_mpu_read_temp(rc_mpu_data_t* data)
+int rc_mpu_dev_read_temp(rc_mpu_t* mpu, rc_mpu_data_t* data)
 {
-	uint16_t adc;
+	uint8_t raw[2];
 	// set device address
-	rc_i2c_set_device_address(config.i2c_bus, config.i2c_addr);
+	__set_address(mpu, mpu->config.i2c_addr);
 	// Read the two raw data registers
-	if(rc_i2c_read_word(config.i2c_bus, TEMP_OUT_H, &adc)<0){
+	if(__read_bytes(mpu, TEMP_OUT_H, 2, raw)<0){
 		fprintf(stderr,"failed to read IMU temperature registers\n");
 		return -1;
 	}
 	// convert to real units
-	data->temp = 21.0 + adc/TEMP_SENSITIVITY;
+	data->temp = __decode_temp(raw);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_mpu_read_all(rc_mpu_data_t* data)
+*
+* ACCEL_XOUT_H through GYRO_ZOUT_L are contiguous, so accel, temperature and
+* gyro all come from one 14-byte read. The chip latches the block for the
+* duration of a burst so all three are from the same sample. EXT_SENS_DATA_00
+* follows straight on, so when the I2C master is polling the magnetometer it
+* comes along in the same read.
+*******************************************************************************/
+int rc_mpu_dev_read_all(rc_mpu_t* mpu, rc_mpu_data_t* data)
+{
+	uint8_t raw[14+8];
+	int len = mpu->mag_master ? 14+8 : 14;
+	__set_address(mpu, mpu->config.i2c_addr);
+	if(__read_bytes(mpu, ACCEL_XOUT_H, len, raw)<0){
+		return -1;
+	}
+	__decode_accel(&raw[0], data);
+	data->temp = __decode_temp(&raw[6]);
+	__decode_gyro(&raw[8], data);
+	if(mpu->mag_master) __decode_mag(mpu, &raw[14], data);
 	return 0;
 }
 
@@ -420,17 +1205,17 @@ int rc_mpu_read_temp(rc_mpu_data_t* data)
 * the device to defualt settings. a 0.1 second wait is also included
 * to let the device compelete the reset process.
 *******************************************************************************/
-int __reset_mpu()
+int __reset_mpu(rc_mpu_t* mpu)
 {
 	// disable the interrupt to prevent it from doing things while we reset
-	imu_shutdown_flag = 1;
+	mpu->imu_shutdown_flag = 1;
 	// set the device address
-	rc_i2c_set_device_address(config.i2c_bus, config.i2c_addr);
+	__set_address(mpu, mpu->config.i2c_addr);
 	// write the reset bit
-	if(rc_i2c_write_byte(config.i2c_bus, PWR_MGMT_1, H_RESET)){
+	if(__write_byte(mpu, PWR_MGMT_1, H_RESET)){
 		// wait and try again
 		rc_usleep(10000);
-			if(rc_i2c_write_byte(config.i2c_bus, PWR_MGMT_1, H_RESET)){
+			if(__write_byte(mpu, PWR_MGMT_1, H_RESET)){
 				fprintf(stderr,"I2C write to MPU Failed\n");
 			return -1;
 		}
@@ -442,10 +1227,10 @@ int __reset_mpu()
 /*******************************************************************************
 * int __check_who_am_i()
 *******************************************************************************/
-int __check_who_am_i(){
+int __check_who_am_i(rc_mpu_t* mpu){
 	uint8_t c;
 	//check the who am i register to make sure the chip is alive
-	if(rc_i2c_read_byte(config.i2c_bus, WHO_AM_I_MPU9250, &c)<0){
+	if(__read_byte(mpu, WHO_AM_I_MPU9250, &c)<0){
 		fprintf(stderr,"i2c_read_byte failed reading who_am_i register\n");
 		return -1;
 	}
@@ -465,7 +1250,7 @@ int __check_who_am_i(){
 *
 * set accelerometer full scale range and update conversion ratio
 *******************************************************************************/
-int __set_accel_fsr(rc_mpu_accel_fsr_t fsr, rc_mpu_data_t* data)
+int __set_accel_fsr(rc_mpu_t* mpu, rc_mpu_accel_fsr_t fsr, rc_mpu_data_t* data)
 {
 	uint8_t c;
 	switch(fsr){
@@ -489,7 +1274,7 @@ int __set_accel_fsr(rc_mpu_accel_fsr_t fsr, rc_mpu_data_t* data)
 		fprintf(stderr,"invalid accel fsr\n");
 		return -1;
 	}
-	return rc_i2c_write_byte(config.i2c_bus, ACCEL_CONFIG, c);
+	return __write_byte(mpu, ACCEL_CONFIG, c);
 }
 
 
@@ -498,7 +1283,7 @@ int __set_accel_fsr(rc_mpu_accel_fsr_t fsr, rc_mpu_data_t* data)
 *
 * set gyro full scale range and update conversion ratio
 *******************************************************************************/
-int __set_gyro_fsr(rc_mpu_gyro_fsr_t fsr, rc_mpu_data_t* data)
+int __set_gyro_fsr(rc_mpu_t* mpu, rc_mpu_gyro_fsr_t fsr, rc_mpu_data_t* data)
 {
 	uint8_t c;
 	switch(fsr){
@@ -522,7 +1307,7 @@ int __set_gyro_fsr(rc_mpu_gyro_fsr_t fsr, rc_mpu_data_t* data)
 		fprintf(stderr,"invalid gyro fsr\n");
 		return -1;
 	}
-	return rc_i2c_write_byte(config.i2c_bus, GYRO_CONFIG, c);
+	return __write_byte(mpu, GYRO_CONFIG, c);
 }
 
 /*******************************************************************************
@@ -531,7 +1316,7 @@ int __set_gyro_fsr(rc_mpu_gyro_fsr_t fsr, rc_mpu_data_t* data)
 * Set accel low pass filter constants. This is the same register as
 * the sample rate. We set it at 1khz as 4khz is unnecessary.
 *******************************************************************************/
-int __set_accel_dlpf(rc_mpu_accel_dlpf_t dlpf)
+int __set_accel_dlpf(rc_mpu_t* mpu, rc_mpu_accel_dlpf_t dlpf)
 {
 	uint8_t c = ACCEL_FCHOICE_1KHZ | BIT_FIFO_SIZE_1024;
 	switch(dlpf){
@@ -563,7 +1348,7 @@ int __set_accel_dlpf(rc_mpu_accel_dlpf_t dlpf)
 		fprintf(stderr,"invalid config.accel_dlpf\n");
 		return -1;
 	}
-	return rc_i2c_write_byte(config.i2c_bus, ACCEL_CONFIG_2, c);
+	return __write_byte(mpu, ACCEL_CONFIG_2, c);
 }
 
 /*******************************************************************************
@@ -572,7 +1357,7 @@ int __set_accel_dlpf(rc_mpu_accel_dlpf_t dlpf)
 * Set GYRO low pass filter constants. This is the same register as
 * the fifo overflow mode so we set it to keep the newest data too.
 *******************************************************************************/
-int __set_gyro_dlpf(rc_mpu_gyro_dlpf_t dlpf)
+int __set_gyro_dlpf(rc_mpu_t* mpu, rc_mpu_gyro_dlpf_t dlpf)
 {
 	uint8_t c = FIFO_MODE_REPLACE_OLD;
 	switch(dlpf){
@@ -604,7 +1389,108 @@ int __set_gyro_dlpf(rc_mpu_gyro_dlpf_t dlpf)
 		fprintf(stderr,"invalid gyro_dlpf\n");
 		return -1;
 	}
-	return rc_i2c_write_byte(config.i2c_bus, CONFIG, c);
+	return __write_byte(mpu, CONFIG, c);
+}
+
+/*******************************************************************************
+* int __slv4_transfer(rc_mpu_t* mpu, uint8_t reg, uint8_t* data, int read)
+*
+* One byte to or from the AK8963 through I2C slave 4 of the MPU's I2C master.
+* The master only runs once per sample, so this polls I2C_MST_STATUS for up to
+* 300ms to cover the slowest sample rates. A NACK sets errno to ENXIO.
+*******************************************************************************/
+static int __slv4_transfer(rc_mpu_t* mpu, uint8_t reg, uint8_t* data, int read)
+{
+	uint8_t status;
+	int i;
+	__set_address(mpu, mpu->config.i2c_addr);
+	if(__write_byte(mpu, I2C_SLV4_ADDR, AK8963_ADDR|(read ? BIT_I2C_READ : 0)) ||
+				__write_byte(mpu, I2C_SLV4_REG, reg)) return -1;
+	if(!read && __write_byte(mpu, I2C_SLV4_DO, *data)) return -1;
+	if(__write_byte(mpu, I2C_SLV4_CTRL, BIT_SLAVE_EN|mpu->mag_mst_dly)) return -1;
+	for(i=0;i<300;i++){
+		rc_usleep(1000);
+		if(__read_byte(mpu, I2C_MST_STATUS, &status)) return -1;
+		if(status&I2C_SLV4_NACK){
+			errno = ENXIO;
+			return -1;
+		}
+		if(status&I2C_SLV4_DONE){
+			if(read) return __read_byte(mpu, I2C_SLV4_DI, data);
+			return 0;
+		}
+	}
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+/*******************************************************************************
+* int __mag_write(rc_mpu_t* mpu, uint8_t reg, uint8_t data)
+* int __mag_read(rc_mpu_t* mpu, uint8_t reg, size_t length, uint8_t* data)
+*
+* AK8963 register access for setup and shutdown, directly over the bypass or
+* byte by byte through slave 4 with mag_i2c_master. The MPU's own address is
+* selected again afterwards either way.
+*******************************************************************************/
+static int __mag_write(rc_mpu_t* mpu, uint8_t reg, uint8_t data)
+{
+	int ret;
+	if(mpu->mag_master) return __slv4_transfer(mpu, reg, &data, 0);
+	__set_address(mpu, AK8963_ADDR);
+	ret = __write_byte(mpu, reg, data);
+	__set_address(mpu, mpu->config.i2c_addr);
+	return ret;
+}
+
+static int __mag_read(rc_mpu_t* mpu, uint8_t reg, size_t length, uint8_t* data)
+{
+	size_t i;
+	int ret;
+	if(mpu->mag_master){
+		for(i=0;i<length;i++){
+			if(__slv4_transfer(mpu, reg+i, &data[i], 1)) return -1;
+		}
+		return 0;
+	}
+	__set_address(mpu, AK8963_ADDR);
+	ret = __read_bytes(mpu, reg, length, data);
+	__set_address(mpu, mpu->config.i2c_addr);
+	return ret<0 ? -1 : 0;
+}
+
+/*******************************************************************************
+* int __mag_start_polling()
+*
+* Sets I2C slave 0 to read AK8963_ST1 through AK8963_ST2 into EXT_SENS_DATA_00
+* onwards. The master runs once per sample, far more often than the 100hz the
+* magnetometer measures at, so the slave 0 delay skips enough samples to poll
+* at about 100hz, or as close as the 5-bit delay gets at 8khz. That leaves the
+* rest of the samples free of the extra bus time and keeps ST2 reads from
+* holding up a measurement.
+*******************************************************************************/
+static int __mag_start_polling(rc_mpu_t* mpu)
+{
+	uint8_t cfg, div;
+	int rate, dly;
+	__set_address(mpu, mpu->config.i2c_addr);
+	if(__read_byte(mpu, CONFIG, &cfg) || __read_byte(mpu, SMPLRT_DIV, &div)) return -1;
+	// the sample rate divider runs off 8khz with DLPF_CFG 0 or 7,
+	// 1khz otherwise
+	cfg &= 0x07;
+	rate = (cfg==0 || cfg==7) ? 8000 : 1000;
+	rate /= 1+div;
+	dly = rate/100 - 1;
+	if(dly<0) dly = 0;
+	if(dly>BITS_I2C_MASTER_DLY) dly = BITS_I2C_MASTER_DLY;
+	mpu->mag_mst_dly = dly;
+	if(__write_byte(mpu, I2C_SLV0_ADDR, AK8963_ADDR|BIT_I2C_READ) ||
+		__write_byte(mpu, I2C_SLV0_REG, AK8963_ST1) ||
+		__write_byte(mpu, I2C_SLV4_CTRL, mpu->mag_mst_dly) ||
+		__write_byte(mpu, I2C_MST_DELAY_CTRL, dly ? BIT_S0_DELAY_EN : 0) ||
+		__write_byte(mpu, I2C_SLV0_CTRL, BIT_SLAVE_EN|FIFO_LEN_MAG)){
+		return -1;
+	}
+	return 0;
 }
 
 /*******************************************************************************
@@ -615,46 +1501,57 @@ int __set_gyro_dlpf(rc_mpu_gyro_dlpf_t dlpf)
  * if cal mode is set to nonzero value it will not bother to load calibration
  * data from the disk
 *******************************************************************************/
-int __init_magnetometer(int cal_mode)
+int __init_magnetometer(rc_mpu_t* mpu, int cal_mode)
 {
 	uint8_t raw[3];	// calibration data stored here
 
-	// Enable i2c bypass to allow talking to magnetometer
-	if(__mpu_set_bypass(1)){
+	// Enable i2c bypass to allow talking to magnetometer, or with
+	// mag_i2c_master enable the I2C master instead
+	if(__mpu_set_bypass(mpu, 1)){
 		fprintf(stderr,"failed to set mpu9250 into bypass i2c mode\n");
 		return -1;
 	}
-	// magnetometer is actually a separate device with its
-	// own address inside the mpu9250
-	if(rc_i2c_set_device_address(config.i2c_bus, AK8963_ADDR)){
-		fprintf(stderr, "ERROR: in __init_magnetometer, failed to set i2c device address\n");
-		return -1;
+	if(mpu->mag_master){
+		// slave 0 stays off until the magnetometer is running, and the
+		// slave 4 transfers below take one sample each
+		mpu->mag_mst_dly = 0;
+		if(__write_byte(mpu, I2C_SLV0_CTRL, 0) ||
+			__write_byte(mpu, I2C_MST_DELAY_CTRL, 0) ||
+			__write_byte(mpu, I2C_MST_CTRL, I2C_MST_CLK_400KHZ)){
+			fprintf(stderr, "ERROR: in __init_magnetometer, failed to configure the I2C master\n");
+			return -1;
+		}
 	}
 	// Power down magnetometer
-	if(rc_i2c_write_byte(config.i2c_bus, AK8963_CNTL, MAG_POWER_DN)<0){
+	if(__mag_write(mpu, AK8963_CNTL, MAG_POWER_DN)<0){
+		if(errno==ENXIO){
+			fprintf(stderr, "ERROR: in __init_magnetometer, magnetometer not reachable through this transport\n");
+			if(!mpu->mag_master){
+				fprintf(stderr, "set mag_i2c_master to reach it through the MPU's I2C master instead\n");
+			}
+			return -1;
+		}
 		fprintf(stderr, "ERROR: in __init_magnetometer, failed to write to AK8963_CNTL register to power down\n");
 		return -1;
 	}
 	rc_usleep(1000);
 	// Enter Fuse ROM access mode
-	if(rc_i2c_write_byte(config.i2c_bus, AK8963_CNTL, MAG_FUSE_ROM)){
+	if(__mag_write(mpu, AK8963_CNTL, MAG_FUSE_ROM)){
 		fprintf(stderr, "ERROR: in __init_magnetometer, failed to write to AK8963_CNTL register\n");
 		return -1;
 	}
 	rc_usleep(1000);
 	// Read the xyz sensitivity adjustment values
-	if(rc_i2c_read_bytes(config.i2c_bus, AK8963_ASAX, 3, &raw[0])<0){
+	if(__mag_read(mpu, AK8963_ASAX, 3, &raw[0])<0){
 		fprintf(stderr,"failed to read magnetometer adjustment register\n");
-		rc_i2c_set_device_address(config.i2c_bus, config.i2c_addr);
-		//__mpu_set_bypass(0);
 		return -1;
 	}
 	// Return sensitivity adjustment values
-	mag_factory_adjust[0] = (raw[0]-128)/256.0 + 1.0;
-	mag_factory_adjust[1] = (raw[1]-128)/256.0 + 1.0;
-	mag_factory_adjust[2] = (raw[2]-128)/256.0 + 1.0;
+	mpu->mag_factory_adjust[0] = (raw[0]-128)/256.0 + 1.0;
+	mpu->mag_factory_adjust[1] = (raw[1]-128)/256.0 + 1.0;
+	mpu->mag_factory_adjust[2] = (raw[2]-128)/256.0 + 1.0;
 	// Power down magnetometer again
-	if(rc_i2c_write_byte(config.i2c_bus, AK8963_CNTL, MAG_POWER_DN)){
+	if(__mag_write(mpu, AK8963_CNTL, MAG_POWER_DN)){
 		fprintf(stderr, "ERROR: in __init_magnetometer, failed to write to AK8963_CNTL register to power on\n");
 		return -1;
 	}
@@ -662,16 +1559,18 @@ int __init_magnetometer(int cal_mode)
 	// Configure the magnetometer for 16 bit resolution
 	// and continuous sampling mode 2 (100hz)
 	uint8_t c = MSCALE_16|MAG_CONT_MES_2;
-	if(rc_i2c_write_byte(config.i2c_bus, AK8963_CNTL, c)){
+	if(__mag_write(mpu, AK8963_CNTL, c)){
 		fprintf(stderr, "ERROR: in __init_magnetometer, failed to write to AK8963_CNTL register to set sampling mode\n");
 		return -1;
 	}
 	rc_usleep(100);
-	// go back to configuring the IMU, leave bypass on
-	rc_i2c_set_device_address(config.i2c_bus,config.i2c_addr);
+	if(mpu->mag_master && __mag_start_polling(mpu)){
+		fprintf(stderr, "ERROR: in __init_magnetometer, failed to start I2C slave 0\n");
+		return -1;
+	}
 	// load in magnetometer calibration
 	if(!cal_mode){
-		__load_mag_calibration();
+		__load_mag_calibration(mpu);
 	}
 	return 0;
 }
@@ -681,81 +1580,285 @@ int __init_magnetometer(int cal_mode)
 *
 * Make sure the magnetometer is off.
 *******************************************************************************/
-int __power_off_magnetometer()
+int __power_off_magnetometer(rc_mpu_t* mpu)
 {
-	rc_i2c_set_device_address(config.i2c_bus, config.i2c_addr);
+	__set_address(mpu, mpu->config.i2c_addr);
 	// Enable i2c bypass to allow talking to magnetometer
-	if(__mpu_set_bypass(1)){
+	if(__mpu_set_bypass(mpu, 1)){
 		fprintf(stderr,"failed to set mpu9250 into bypass i2c mode\n");
 		return -1;
 	}
-	// magnetometer is actually a separate device with its
-	// own address inside the mpu9250
-	rc_i2c_set_device_address(config.i2c_bus, AK8963_ADDR);
-	// Power down magnetometer
-	if(rc_i2c_write_byte(config.i2c_bus, AK8963_CNTL, MAG_POWER_DN)<0){
+	// stop polling it before turning it off
+	if(mpu->mag_master) __write_byte(mpu, I2C_SLV0_CTRL, 0);
+	// Power down magnetometer, over SPI without the I2C master there is no
+	// path to it so nothing can have turned it on either
+	if(__mag_write(mpu, AK8963_CNTL, MAG_POWER_DN)<0){
+		if(errno==ENXIO) return 0;
 		fprintf(stderr,"failed to write to magnetometer\n");
 		return -1;
 	}
-	rc_i2c_set_device_address(config.i2c_bus, config.i2c_addr);
 	return 0;
 }
 
 /*******************************************************************************
 * Power down the IMU
 *******************************************************************************/
-int rc_mpu_power_off()
+int rc_mpu_dev_power_off(rc_mpu_t* mpu)
 {
-	imu_shutdown_flag = 1;
-	// wait for the interrupt thread to exit if it hasn't already
-	//allow up to 1 second for thread cleanup
-	if(thread_running_flag){
-
-		if(rc_pthread_timed_join(imu_interrupt_thread, NULL, 1.0)==1){
-			fprintf(stderr,"WARNING: mpu interrupt thread exit timeout\n");
-		}
-		// cleanup mutexes
-		pthread_cond_destroy(&read_condition);
-		pthread_mutex_destroy(&read_mutex);
-		pthread_cond_destroy(&tap_condition);
-		pthread_mutex_destroy(&tap_mutex);
+	if(mpu->tp==NULL){
+		fprintf(stderr,"ERROR: in rc_mpu_power_off, mpu was never initialized\n");
+		return -1;
 	}
+	mpu->imu_shutdown_flag = 1;
+	// stop servicing the interrupt, once this returns the handler is not
+	// running and won't run again
+	if(mpu->thread_running_flag){
+		if(mpu->own_loop){
+			rc_event_loop_destroy(mpu->imu_loop);
+			mpu->own_loop = 0;
+		}
+		else rc_event_loop_remove(mpu->imu_loop, __wake_fd(mpu));
+		mpu->imu_loop = NULL;
+		mpu->thread_running_flag = 0;
+		// release anyone blocked waiting for data
+		pthread_mutex_lock(mpu->read_mutex);
+		pthread_cond_broadcast(mpu->read_condition);
+		pthread_mutex_unlock(mpu->read_mutex);
+		mpu_ring_close(mpu->ring);
+		__atomic_fetch_add(&mpu->tap_futex, 1, __ATOMIC_RELEASE);
+		mpu_futex_wake(&mpu->tap_futex);
+	}
+	// the bus worker may still be finishing a magnetometer read
+	__wait_mag_read(mpu);
+	__stop_error_printer(mpu);
 	// shutdown magnetometer first if on since that requires
 	// the imu to the on for bypass to work
-	if(config.enable_magnetometer) __power_off_magnetometer();
+	if(mpu->config.enable_magnetometer) __power_off_magnetometer(mpu);
 	// set the device address to write the shutdown register
-	rc_i2c_set_device_address(config.i2c_bus, config.i2c_addr);
+	__set_address(mpu, mpu->config.i2c_addr);
 	// write the reset bit
-	if(rc_i2c_write_byte(config.i2c_bus, PWR_MGMT_1, H_RESET)){
+	if(__write_byte(mpu, PWR_MGMT_1, H_RESET)){
 		//wait and try again
 		rc_usleep(1000);
-		if(rc_i2c_write_byte(config.i2c_bus, PWR_MGMT_1, H_RESET)){
+		if(__write_byte(mpu, PWR_MGMT_1, H_RESET)){
 			fprintf(stderr,"I2C write to MPU9250 Failed\n");
 			return -1;
 		}
 	}
 	// write the sleep bit
-	if(rc_i2c_write_byte(config.i2c_bus, PWR_MGMT_1, MPU_SLEEP)){
+	if(__write_byte(mpu, PWR_MGMT_1, MPU_SLEEP)){
 		//wait and try again
 		rc_usleep(1000);
-		if(rc_i2c_write_byte(config.i2c_bus, PWR_MGMT_1, MPU_SLEEP)){
+		if(__write_byte(mpu, PWR_MGMT_1, MPU_SLEEP)){
 			fprintf(stderr,"I2C write to MPU9250 Failed\n");
 			return -1;
 		}
 	}
 
-	// if in dmp mode, also unexport the interrupt pin
-	if(dmp_en){
-		rc_gpio_unexport(config.gpio_interrupt_pin);
+	// if in dmp mode, also release the interrupt pin
+	__close_interrupt(mpu);
+	if(mpu->timer_fd>=0) close(mpu->timer_fd);
+	mpu->dmp_en = 0;
+	mpu->raw_en = 0;
+	mpu->drdy_en = 0;
+	mpu->timer_fd = -1;
+	if(mpu->tp->close!=NULL) mpu->tp->close(mpu->tp_ctx);
+
+	return 0;
+}
+
+/*******************************************************************************
+* int __setup_ring(rc_mpu_t* mpu, const char* fn)
+*
+* checks ring_depth and reopens the sample ring, creating it first if this is
+* the first start or the depth or shared memory name changed. Readers may still
+* hold a cursor from before, so an unchanged ring carries on numbering where it
+* stopped and is only freed with the handle.
+*******************************************************************************/
+static int __setup_ring(rc_mpu_t* mpu, const char* fn)
+{
+	int depth = mpu->config.ring_depth;
+	const char* name = mpu->config.ring_shm_name;
+	if(depth<2 || depth>RC_MPU_RING_MAX_DEPTH || (depth&(depth-1))){
+		fprintf(stderr,"ERROR: in %s, ring_depth must be a power of two between 2 and %d\n", fn, RC_MPU_RING_MAX_DEPTH);
+		return -1;
+	}
+	if(mpu->ring!=NULL && mpu->ring_depth==depth && (name==NULL ? mpu->ring_shm==NULL :
+			(mpu->ring_shm!=NULL && strcmp(name, mpu->ring_shm)==0))){
+		mpu_ring_reopen(mpu->ring);
+		return 0;
+	}
+	mpu_ring_destroy(mpu->ring, mpu->ring_shm);
+	free(mpu->ring_shm);
+	mpu->ring_shm = NULL;
+	mpu->ring_depth = 0;
+	mpu->ring = mpu_ring_create(depth, name);
+	if(mpu->ring==NULL){
+		fprintf(stderr,"ERROR: in %s, failed to set up sample ring\n", fn);
+		return -1;
+	}
+	if(name!=NULL && (mpu->ring_shm = strdup(name))==NULL){
+		fprintf(stderr,"ERROR: in %s, out of memory\n", fn);
+		mpu_ring_destroy(mpu->ring, name);
+		mpu->ring = NULL;
+		return -1;
+	}
+	mpu->ring_depth = depth;
+	return 0;
+}
+
+/*******************************************************************************
+* int __timer_driven(rc_mpu_t* mpu)
+*
+* whether the interrupt thread wakes from a timer rather than the interrupt pin
+*******************************************************************************/
+static inline int __timer_driven(rc_mpu_t* mpu)
+{
+	return mpu->config.fifo_batch>1 || mpu->config.fifo_poll;
+}
+
+/*******************************************************************************
+* int __open_interrupt(rc_mpu_t* mpu, int pkt_len, const char* fn)
+*
+* checks fifo_batch and opens the interrupt pin, unless batching or polling
+* leaves waking the interrupt thread to a timer. Batches can only take half the
+* FIFO so a late wakeup doesn't overflow it.
+*******************************************************************************/
+static int __open_interrupt(rc_mpu_t* mpu, int pkt_len, const char* fn)
+{
+	int max = MPU_FIFO_SIZE/2/pkt_len;
+	if(mpu->config.fifo_batch<1 || mpu->config.fifo_batch>max){
+		fprintf(stderr,"ERROR: in %s, fifo_batch must be between 1 and %d\n", fn, max);
+		return -1;
+	}
+	// a line left open by an earlier attempt would make this one busy
+	__close_interrupt(mpu);
+	if(__timer_driven(mpu)) return 0;
+	if(mpu->irq_tp->interrupt_open==NULL || mpu->irq_tp->interrupt_ack==NULL){
+		fprintf(stderr,"ERROR: in %s, transport has no interrupt support\n", fn);
+		return -1;
+	}
+	mpu->imu_interrupt_fd = mpu->irq_tp->interrupt_open(mpu->irq_ctx, mpu->config.gpio_interrupt_pin, &mpu->imu_interrupt_events);
+	if(mpu->imu_interrupt_fd<0){
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* void __close_interrupt(rc_mpu_t* mpu)
+*
+* releases the interrupt pin if __open_interrupt opened one
+*******************************************************************************/
+static void __close_interrupt(rc_mpu_t* mpu)
+{
+	if(mpu->imu_interrupt_fd>=0 && mpu->irq_tp!=NULL && mpu->irq_tp->interrupt_close!=NULL){
+		mpu->irq_tp->interrupt_close(mpu->irq_ctx, mpu->config.gpio_interrupt_pin);
+	}
+	mpu->imu_interrupt_fd = -1;
+}
+
+/*******************************************************************************
+* int __open_batch_timer(rc_mpu_t* mpu)
+*
+* starts a timer firing every fifo_batch sample periods. When polling for lack
+* of an interrupt pin it runs a little faster, so the FIFO is checked at least
+* once per batch whatever the MPU's oscillator is doing and a wakeup that finds
+* it one short just catches up on the next. The timer keeps its own absolute
+* schedule so late wakeups don't push the later ones back.
+*******************************************************************************/
+static int __open_batch_timer(rc_mpu_t* mpu)
+{
+	struct itimerspec its;
+	uint64_t ns = mpu->config.fifo_batch*mpu->sample_period_ns;
+
+	if(mpu->config.fifo_poll) ns -= ns/FIFO_POLL_AHEAD;
+
+	mpu->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if(mpu->timer_fd<0){
+		perror("ERROR in __open_batch_timer, failed to create timerfd");
+		return -1;
 	}
+	its.it_interval.tv_sec = ns/1000000000;
+	its.it_interval.tv_nsec = ns%1000000000;
+	its.it_value = its.it_interval;
+	if(timerfd_settime(mpu->timer_fd, 0, &its, NULL)){
+		perror("ERROR in __open_batch_timer, failed to start timer");
+		close(mpu->timer_fd);
+		mpu->timer_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int __wake_fd(rc_mpu_t* mpu)
+*
+* the descriptor the interrupt thread waits on
+*******************************************************************************/
+static int __wake_fd(rc_mpu_t* mpu)
+{
+	return mpu->timer_fd>=0 ? mpu->timer_fd : mpu->imu_interrupt_fd;
+}
+
+/*******************************************************************************
+* int __start_interrupt_thread(rc_mpu_t* mpu, rc_event_cb_t handler)
+*
+* registers handler for the already opened interrupt fd, or for a batch timer,
+* with the caller's event loop, or with a loop of our own running on a new
+* thread
+*******************************************************************************/
+static int __start_interrupt_thread(rc_mpu_t* mpu, rc_event_cb_t handler)
+{
+	uint32_t events = mpu->imu_interrupt_events;
 
+	memset(&mpu->stats, 0, sizeof(mpu->stats));
+	if(__timer_driven(mpu)){
+		if(__open_batch_timer(mpu)) return -1;
+		events = POLLIN;
+	}
+	// serve the interrupt from the caller's loop or one of our own
+	if(mpu->config.event_loop!=NULL){
+		mpu->imu_loop = mpu->config.event_loop;
+		mpu->own_loop = 0;
+	}
+	else{
+		mpu->imu_loop = rc_event_loop_create();
+		if(mpu->imu_loop==NULL){
+			fprintf(stderr,"ERROR in __start_interrupt_thread, failed to create event loop\n");
+			goto fail_timer;
+		}
+		mpu->own_loop = 1;
+	}
+	if(rc_event_loop_add(mpu->imu_loop, __wake_fd(mpu), events, handler, mpu)){
+		fprintf(stderr,"ERROR in __start_interrupt_thread, failed to register interrupt fd\n");
+		goto fail_loop;
+	}
+	if(mpu->own_loop && rc_event_loop_start(mpu->imu_loop, mpu->config.dmp_interrupt_sched_policy,
+					mpu->config.dmp_interrupt_priority)<0){
+		fprintf(stderr,"ERROR failed to start interrupt handler thread\n");
+		goto fail_loop;
+	}
+	mpu->thread_running_flag = 1;
 	return 0;
+
+fail_loop:
+	if(mpu->own_loop) rc_event_loop_destroy(mpu->imu_loop);
+	else rc_event_loop_remove(mpu->imu_loop, __wake_fd(mpu));
+	mpu->imu_loop = NULL;
+	mpu->own_loop = 0;
+fail_timer:
+	if(mpu->timer_fd>=0){
+		close(mpu->timer_fd);
+		mpu->timer_fd = -1;
+	}
+	return -1;
 }
 
 /*******************************************************************************
 * Set up the IMU for DMP accelerated filtering and interrupts
 *******************************************************************************/
-int rc_mpu_initialize_dmp(rc_mpu_data_t *data, rc_mpu_config_t conf)
+int __initialize_dmp(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf)
 {
 	uint8_t tmp;
 	// range check
@@ -777,8 +1880,8 @@ int rc_mpu_initialize_dmp(rc_mpu_data_t *data, rc_mpu_config_t conf)
 	}
 
 	// update local copy of config and data struct with new values
-	config = conf;
-	data_ptr = data;
+	mpu->config = conf;
+	mpu->data_ptr = data;
 
 	// check dlpf
 	if(conf.gyro_dlpf==GYRO_DLPF_OFF || conf.gyro_dlpf==GYRO_DLPF_250){
@@ -795,199 +1898,441 @@ int rc_mpu_initialize_dmp(rc_mpu_data_t *data, rc_mpu_config_t conf)
 	if(conf.gyro_fsr!=GYRO_FSR_2000DPS){
 		fprintf(stderr,"WARNING, gyro FSR must be GYRO_FSR_2000DPS in DMP mode\n");
 		fprintf(stderr,"setting to 2000DPS automatically\n");
-		config.gyro_fsr = GYRO_FSR_2000DPS;
+		mpu->config.gyro_fsr = GYRO_FSR_2000DPS;
 	}
 	if(conf.accel_fsr!=ACCEL_FSR_8G){
 		fprintf(stderr,"WARNING, accel FSR must be ACCEL_FSR_8G in DMP mode\n");
 		fprintf(stderr,"setting to ACCEL_FSR_8G automatically\n");
-		config.accel_fsr = ACCEL_FSR_8G;
+		mpu->config.accel_fsr = ACCEL_FSR_8G;
 	}
 
 	// start the i2c bus
-	if(rc_i2c_init(config.i2c_bus, config.i2c_addr)){
-		fprintf(stderr,"rc_mpu_initialize_dmp failed at rc_i2c_init\n");
+	if(__transport_init(mpu)){
+		fprintf(stderr,"rc_mpu_initialize_dmp failed to initialize the bus\n");
 		return -1;
 	}
-	// configure the gpio interrupt pin
-	if(rc_gpio_export(config.gpio_interrupt_pin)){
-		fprintf(stderr,"ERROR: in rc_mpu_initialize_dmp, failed to export GPIO %d\n", config.gpio_interrupt_pin);
-		fprintf(stderr,"probably insufficient privileges\n");
-		return -1;
-	}
-	if(rc_gpio_set_dir(config.gpio_interrupt_pin, GPIO_INPUT_PIN)){
-		fprintf(stderr,"ERROR: in rc_mpu_initialize_dmp, failed to configure GPIO %d direction\n", config.gpio_interrupt_pin);
-		return -1;
-	}
-	if(rc_gpio_set_edge(config.gpio_interrupt_pin, GPIO_EDGE_FALLING)){
-		fprintf(stderr,"ERROR: in rc_mpu_initialize_dmp, failed to configure GPIO %d edge\n", config.gpio_interrupt_pin);
+	if(__setup_ring(mpu, "rc_mpu_initialize_dmp")) return -1;
+	// configure the interrupt pin
+	if(__open_interrupt(mpu, conf.dmp_fetch_accel_gyro ? FIFO_LEN_QUAT_ACCEL_GYRO_TAP : FIFO_LEN_QUAT_TAP,
+						"rc_mpu_initialize_dmp")){
 		return -1;
 	}
-	// claiming the bus does no guarantee other code will not interfere
-	// with this process, but best to claim it so other code can check
-	rc_i2c_lock_bus(config.i2c_bus);
+	// hold the bus for the whole sequence so other threads using the
+	// bus wait rather than interleave transactions with ours
+	__lock_bus(mpu);
 	// restart the device so we start with clean registers
-	if(__reset_mpu()<0){
+	if(__reset_mpu(mpu)<0){
 		fprintf(stderr,"failed to __reset_mpu()\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
 		return -1;
 	}
-	if(__check_who_am_i()){
-		rc_i2c_unlock_bus(config.i2c_bus);
+	if(__check_who_am_i(mpu)){
+		__unlock_bus(mpu);
 		return -1;
 	}
 	// MPU6500 shares 4kB of memory between the DMP and the FIFO. Since the
 	//first 3kB are needed by the DMP, we'll use the last 1kB for the FIFO.
 	// this is also set in set_accel_dlpf but we set here early on
 	tmp = BIT_FIFO_SIZE_1024 | 0x8;
-	if(rc_i2c_write_byte(config.i2c_bus, ACCEL_CONFIG_2, tmp)){
+	if(__write_byte(mpu, ACCEL_CONFIG_2, tmp)){
 		fprintf(stderr,"ERROR: in rc_mpu_initialize_dmp, failed to write to ACCEL_CONFIG_2 register\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
 		return -1;
 	}
 	// load in gyro calibration offsets from disk
-	if(__load_gyro_calibration()<0){
+	if(__load_gyro_calibration(mpu)<0){
 		fprintf(stderr,"ERROR: failed to load gyro calibration offsets\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
 		return -1;
 	}
 
 	// set full scale ranges. It seems the DMP only scales the gyro properly
 	// at 2000DPS. I'll assume the same is true for accel and use 2G like their
 	// example
-	if(__set_gyro_fsr(config.gyro_fsr, data_ptr)==-1){
+	if(__set_gyro_fsr(mpu, mpu->config.gyro_fsr, mpu->data_ptr)==-1){
 		fprintf(stderr, "ERROR in rc_mpu_initialize_dmp, failed to set gyro_fsr register\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
 		return -1;
 	}
-	if(__set_accel_fsr(config.accel_fsr, data_ptr)==-1){
+	if(__set_accel_fsr(mpu, mpu->config.accel_fsr, mpu->data_ptr)==-1){
 		fprintf(stderr, "ERROR in rc_mpu_initialize_dmp, failed to set accel_fsr register\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
 		return -1;
 	}
 
 	// set dlpf, these values already checked for bounds above
-	if(__set_gyro_dlpf(conf.gyro_dlpf)){
+	if(__set_gyro_dlpf(mpu, conf.gyro_dlpf)){
 		fprintf(stderr,"failed to set gyro dlpf\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
 		return -1;
 	}
-	if(__set_accel_dlpf(conf.accel_dlpf)){
+	if(__set_accel_dlpf(mpu, conf.accel_dlpf)){
 		fprintf(stderr,"failed to set accel_dlpf\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
 		return -1;
 	}
 
 	// This actually sets the rate of accel/gyro sampling which should always be
 	// 200 as the dmp filters at that rate
-	if(__mpu_set_sample_rate(200)<0){
+	if(__mpu_set_sample_rate(mpu, 200)<0){
 	//if(__mpu_set_sample_rate(config.dmp_sample_rate)<0){
 		fprintf(stderr,"ERROR: setting IMU sample rate\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
+		return -1;
+	}
+
+	// enable bypass, more importantly this also configures the interrupt pin behavior
+	if(__mpu_set_bypass(mpu, 1)){
+		fprintf(stderr, "failed to run __mpu_set_bypass\n");
+		__unlock_bus(mpu);
+		return -1;
+	}
+
+	// initialize the magnetometer too if requested in config
+	if(conf.enable_magnetometer){
+		if(__init_magnetometer(mpu, 0)){
+			fprintf(stderr,"ERROR: failed to initialize_magnetometer\n");
+			__unlock_bus(mpu);
+			return -1;
+		}
+	}
+	else __power_off_magnetometer(mpu);
+
+
+	// set up the DMP, order is important, from motiondrive_tutorial.pdf:
+	// 1) load firmware
+	// 2) set orientation matrix
+	// 3) enable callbacks (we don't do this here)
+	// 4) enable features
+	// 5) set fifo rate
+	// 6) set any feature-specific control functions
+	// 7) turn dmp on
+	mpu->dmp_en = 1; // log locally that the dmp will be running
+	mpu->raw_en = 0;
+	mpu->drdy_en = 0;
+	if(__dmp_load_motion_driver_firmware(mpu)<0){
+		fprintf(stderr,"failed to load DMP motion driver\n");
+		__unlock_bus(mpu);
+		return -1;
+	}
+
+	// set the orientation of dmp quaternion
+	if(__dmp_set_orientation(mpu, (unsigned short)conf.orient)<0){
+		fprintf(stderr,"ERROR: failed to set dmp orientation\n");
+		__unlock_bus(mpu);
+		return -1;
+	}
+
+	/// enbale quaternion feature and accel/gyro if requested
+	// due to a known bug in the DMP, the tap feature must be enabled to
+	// get interrupts slower than 200hz
+	unsigned short feature_mask = DMP_FEATURE_6X_LP_QUAT|DMP_FEATURE_TAP;
+
+	// enable gyro calibration is requested
+	if(mpu->config.dmp_auto_calibrate_gyro){
+		feature_mask|=DMP_FEATURE_GYRO_CAL;
+	}
+	// enable reading accel/gyro is requested
+	if(mpu->config.dmp_fetch_accel_gyro){
+		feature_mask|=DMP_FEATURE_SEND_RAW_ACCEL|DMP_FEATURE_SEND_ANY_GYRO;
+	}
+	if(__dmp_enable_feature(mpu, feature_mask)<0){
+		fprintf(stderr,"ERROR: failed to enable DMP features\n");
+		__unlock_bus(mpu);
+		return -1;
+	}
+
+	// this changes the rate new dmp data is put in the fifo
+	// fixing at 200 causes gyro scaling issues at lower mpu sample rates
+	if(__dmp_set_fifo_rate(mpu, mpu->config.dmp_sample_rate)<0){
+		fprintf(stderr,"ERROR: failed to set DMP fifo rate\n");
+		__unlock_bus(mpu);
+		return -1;
+	}
+
+	// turn the dmp on
+	if(__mpu_set_dmp_state(mpu, 1)<0) {
+		fprintf(stderr,"ERROR: __mpu_set_dmp_state(1) failed\n");
+		__unlock_bus(mpu);
+		return -1;
+	}
+
+	// set interrupt mode to continuous as opposed to GESTURE
+	if(__dmp_set_interrupt_mode(mpu, DMP_INT_CONTINUOUS)<0){
+		fprintf(stderr,"ERROR: failed to set DMP interrupt mode to continuous\n");
+		__unlock_bus(mpu);
+		return -1;
+	}
+
+	// done writing to bus for now
+	__unlock_bus(mpu);
+
+	// get ready to start the interrupt handler
+	mpu->data_ptr->tap_detected=0;
+	mpu->imu_shutdown_flag = 0;
+	mpu->missed_interrupts = 0;
+	mpu->last_seqno = 0;
+	// start magnetometer read divider at the end of the counter
+	// so it reads on the first run
+	mpu->mag_div_step = mpu->config.mag_sample_rate_div;
+	mpu->mag_ready = 0;
+	mpu->first_run = 1;
+	mpu->fifo_first_run = 1;
+	mpu->fifo_carry_len = 0;
+	mpu->fifo_ahead = 0;
+	mpu->fusion_first_run = 1;
+	mpu->mag_yaw = 0;
+	mpu->dmp_yaw = 0;
+	mpu->mag_spin_counter = 0;
+	mpu->dmp_spin_counter = 0;
+	mpu->sample_period_ns = 1000000000/mpu->config.dmp_sample_rate;
+	mpu->last_interrupt_ns = 0;
+	mpu_clock_reset(&mpu->clock, mpu->sample_period_ns);
+	mpu->last_stamp_ns = 0;
+	mpu->dmp_callback_func=NULL;
+	mpu->tap_callback_func=NULL;
+	mpu->dmp_batch_func=NULL;
+	__mpu_reset_fifo(mpu);
+
+	return __start_interrupt_thread(mpu, __dmp_interrupt_handler);
+}
+
+/*******************************************************************************
+* Set up the IMU to stream raw samples through the FIFO, no DMP
+*******************************************************************************/
+int __initialize_raw_fifo(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf)
+{
+	int base, div, pkt_len;
+	uint8_t c;
+
+	// the internal sample clock runs at 8khz with the gyro DLPF bypassed
+	if(conf.gyro_dlpf==GYRO_DLPF_OFF || conf.gyro_dlpf==GYRO_DLPF_250) base = RAW_MAX_RATE;
+	else base = 1000;
+	if(conf.raw_sample_rate<RAW_MIN_RATE || conf.raw_sample_rate>base ||
+				base%conf.raw_sample_rate!=0){
+		fprintf(stderr,"ERROR: in rc_mpu_initialize_raw_fifo, raw_sample_rate must be a divisor of %d\n", base);
+		return -1;
+	}
+	div = base/conf.raw_sample_rate - 1;
+	if(div>255){
+		fprintf(stderr,"ERROR: in rc_mpu_initialize_raw_fifo, raw_sample_rate must be at least %d with the gyro DLPF off\n", base/256+1);
+		return -1;
+	}
+
+	// update local copy of config and data struct with new values
+	mpu->config = conf;
+	mpu->data_ptr = data;
+
+	// start the bus and configure the interrupt pin
+	if(__transport_init(mpu)){
+		fprintf(stderr,"rc_mpu_initialize_raw_fifo failed to initialize the bus\n");
+		return -1;
+	}
+	if(conf.raw_fifo_mag && !(conf.enable_magnetometer && conf.mag_i2c_master)){
+		fprintf(stderr,"ERROR: in rc_mpu_initialize_raw_fifo, raw_fifo_mag needs enable_magnetometer and mag_i2c_master\n");
+		return -1;
+	}
+	pkt_len = conf.raw_fifo_temp ? FIFO_LEN_RAW_TEMP : FIFO_LEN_RAW;
+	if(conf.raw_fifo_mag) pkt_len += FIFO_LEN_MAG;
+	if(__setup_ring(mpu, "rc_mpu_initialize_raw_fifo")) return -1;
+	if(__open_interrupt(mpu, pkt_len, "rc_mpu_initialize_raw_fifo")){
 		return -1;
 	}
-
-	// enable bypass, more importantly this also configures the interrupt pin behavior
-	if(__mpu_set_bypass(1)){
+	mpu->dmp_en = 0;
+	mpu->raw_en = 1;
+	mpu->drdy_en = 0;
+
+	// hold the bus for the whole sequence so other threads using the
+	// bus wait rather than interleave transactions with ours
+	__lock_bus(mpu);
+	if(__reset_mpu(mpu)<0){
+		fprintf(stderr,"failed to __reset_mpu()\n");
+		goto fail_bus;
+	}
+	if(__check_who_am_i(mpu)) goto fail_bus;
+	if(__load_gyro_calibration(mpu)<0){
+		fprintf(stderr,"ERROR: failed to load gyro calibration offsets\n");
+		goto fail_bus;
+	}
+	if(__set_gyro_fsr(mpu, conf.gyro_fsr, data)){
+		fprintf(stderr,"failed to set gyro fsr\n");
+		goto fail_bus;
+	}
+	if(__set_accel_fsr(mpu, conf.accel_fsr, data)){
+		fprintf(stderr,"failed to set accel fsr\n");
+		goto fail_bus;
+	}
+	// this also selects the 1kB FIFO
+	if(__set_accel_dlpf(mpu, conf.accel_dlpf)){
+		fprintf(stderr,"failed to set accel_dlpf\n");
+		goto fail_bus;
+	}
+	// when full, drop new samples rather than overwrite the oldest bytes so
+	// what is left in the FIFO still starts on a sample boundary
+	if(__set_gyro_dlpf(mpu, conf.gyro_dlpf) || __read_byte(mpu, CONFIG, &c) ||
+				__write_byte(mpu, CONFIG, c|FIFO_MODE_KEEP_OLD)){
+		fprintf(stderr,"failed to set gyro dlpf\n");
+		goto fail_bus;
+	}
+	if(__write_byte(mpu, SMPLRT_DIV, div)){
+		fprintf(stderr,"ERROR: in rc_mpu_initialize_raw_fifo, failed to write SMPLRT_DIV register\n");
+		goto fail_bus;
+	}
+	// configures the interrupt pin and leaves the magnetometer reachable
+	if(__mpu_set_bypass(mpu, 1)){
 		fprintf(stderr, "failed to run __mpu_set_bypass\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
-		return -1;
+		goto fail_bus;
 	}
-
-	// initialize the magnetometer too if requested in config
 	if(conf.enable_magnetometer){
-		if(__init_magnetometer(0)){
+		if(__init_magnetometer(mpu, 0)){
 			fprintf(stderr,"ERROR: failed to initialize_magnetometer\n");
-			rc_i2c_unlock_bus(config.i2c_bus);
-			return -1;
+			goto fail_bus;
 		}
 	}
-	else __power_off_magnetometer();
-
+	else __power_off_magnetometer(mpu);
+
+	// samples are written in register order, accel then temp then gyro,
+	// then the EXT_SENS_DATA bytes slave 0 fills
+	mpu->raw_fifo_en = FIFO_ACCEL_EN|FIFO_GYRO_X_EN|FIFO_GYRO_Y_EN|FIFO_GYRO_Z_EN;
+	if(conf.raw_fifo_temp) mpu->raw_fifo_en |= FIFO_TEMP_EN;
+	if(conf.raw_fifo_mag) mpu->raw_fifo_en |= FIFO_SLV0_EN;
+	mpu->raw_pkt_len = pkt_len;
+	mpu->sample_period_ns = (uint64_t)(div+1)*1000000000/base;
+
+	// get ready to start the interrupt handler
+	mpu->imu_shutdown_flag = 0;
+	mpu->missed_interrupts = 0;
+	mpu->last_seqno = 0;
+	mpu->last_interrupt_ns = 0;
+	mpu_clock_reset(&mpu->clock, mpu->sample_period_ns);
+	mpu->last_stamp_ns = 0;
+	mpu->raw_callback_func = NULL;
+	if(__mpu_reset_raw_fifo(mpu)){
+		fprintf(stderr,"ERROR: in rc_mpu_initialize_raw_fifo, failed to start the FIFO\n");
+		goto fail_bus;
+	}
+	__unlock_bus(mpu);
+
+	return __start_interrupt_thread(mpu, __raw_interrupt_handler);
+
+fail_bus:
+	__unlock_bus(mpu);
+	return -1;
+}
 
-	// set up the DMP, order is important, from motiondrive_tutorial.pdf:
-	// 1) load firmware
-	// 2) set orientation matrix
-	// 3) enable callbacks (we don't do this here)
-	// 4) enable features
-	// 5) set fifo rate
-	// 6) set any feature-specific control functions
-	// 7) turn dmp on
-	dmp_en = 1; // log locally that the dmp will be running
-	if(__dmp_load_motion_driver_firmware()<0){
-		fprintf(stderr,"failed to load DMP motion driver\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+/*******************************************************************************
+* Set up the IMU to interrupt on every new sample and read the sensor registers
+* directly, no FIFO or DMP
+*******************************************************************************/
+int __initialize_data_ready(rc_mpu_t* mpu, rc_mpu_data_t *data, rc_mpu_config_t conf)
+{
+	int base, div;
+
+	if(conf.gyro_dlpf==GYRO_DLPF_OFF || conf.gyro_dlpf==GYRO_DLPF_250) base = RAW_MAX_RATE;
+	else base = 1000;
+	if(conf.raw_sample_rate<RAW_MIN_RATE || conf.raw_sample_rate>DRDY_MAX_RATE ||
+				base%conf.raw_sample_rate!=0){
+		fprintf(stderr,"ERROR: in rc_mpu_initialize_data_ready, raw_sample_rate must divide %d and be at most %d\n",
+				base, DRDY_MAX_RATE);
 		return -1;
 	}
-
-	// set the orientation of dmp quaternion
-	if(__dmp_set_orientation((unsigned short)conf.orient)<0){
-		fprintf(stderr,"ERROR: failed to set dmp orientation\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+	div = base/conf.raw_sample_rate - 1;
+	if(div>255){
+		fprintf(stderr,"ERROR: in rc_mpu_initialize_data_ready, raw_sample_rate must be at least %d with the gyro DLPF off\n", base/256+1);
 		return -1;
 	}
-
-	/// enbale quaternion feature and accel/gyro if requested
-	// due to a known bug in the DMP, the tap feature must be enabled to
-	// get interrupts slower than 200hz
-	unsigned short feature_mask = DMP_FEATURE_6X_LP_QUAT|DMP_FEATURE_TAP;
-
-	// enable gyro calibration is requested
-	if(config.dmp_auto_calibrate_gyro){
-		feature_mask|=DMP_FEATURE_GYRO_CAL;
-	}
-	// enable reading accel/gyro is requested
-	if(config.dmp_fetch_accel_gyro){
-		feature_mask|=DMP_FEATURE_SEND_RAW_ACCEL|DMP_FEATURE_SEND_ANY_GYRO;
-	}
-	if(__dmp_enable_feature(feature_mask)<0){
-		fprintf(stderr,"ERROR: failed to enable DMP features\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+	// there is no FIFO to collect a batch in or to poll
+	if(conf.fifo_batch!=1 || conf.fifo_poll){
+		fprintf(stderr,"ERROR: in rc_mpu_initialize_data_ready, fifo_batch must be 1 and fifo_poll 0, use raw FIFO mode instead\n");
 		return -1;
 	}
 
-	// this changes the rate new dmp data is put in the fifo
-	// fixing at 200 causes gyro scaling issues at lower mpu sample rates
-	if(__dmp_set_fifo_rate(config.dmp_sample_rate)<0){
-		fprintf(stderr,"ERROR: failed to set DMP fifo rate\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
-		return -1;
-	}
+	// update local copy of config and data struct with new values
+	mpu->config = conf;
+	mpu->data_ptr = data;
 
-	// turn the dmp on
-	if(__mpu_set_dmp_state(1)<0) {
-		fprintf(stderr,"ERROR: __mpu_set_dmp_state(1) failed\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+	// start the bus and configure the interrupt pin
+	if(__transport_init(mpu)){
+		fprintf(stderr,"rc_mpu_initialize_data_ready failed to initialize the bus\n");
 		return -1;
 	}
-
-	// set interrupt mode to continuous as opposed to GESTURE
-	if(__dmp_set_interrupt_mode(DMP_INT_CONTINUOUS)<0){
-		fprintf(stderr,"ERROR: failed to set DMP interrupt mode to continuous\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+	if(__setup_ring(mpu, "rc_mpu_initialize_data_ready")) return -1;
+	if(__open_interrupt(mpu, FIFO_LEN_RAW_TEMP, "rc_mpu_initialize_data_ready")){
 		return -1;
 	}
+	mpu->dmp_en = 0;
+	mpu->raw_en = 0;
+	mpu->drdy_en = 1;
 
-	// done writing to bus for now
-	rc_i2c_unlock_bus(config.i2c_bus);
+	// hold the bus for the whole sequence so other threads using the
+	// bus wait rather than interleave transactions with ours
+	__lock_bus(mpu);
+	if(__reset_mpu(mpu)<0){
+		fprintf(stderr,"failed to __reset_mpu()\n");
+		goto fail_bus;
+	}
+	if(__check_who_am_i(mpu)) goto fail_bus;
+	if(__load_gyro_calibration(mpu)<0){
+		fprintf(stderr,"ERROR: failed to load gyro calibration offsets\n");
+		goto fail_bus;
+	}
+	if(__set_gyro_fsr(mpu, conf.gyro_fsr, data)){
+		fprintf(stderr,"failed to set gyro fsr\n");
+		goto fail_bus;
+	}
+	if(__set_accel_fsr(mpu, conf.accel_fsr, data)){
+		fprintf(stderr,"failed to set accel fsr\n");
+		goto fail_bus;
+	}
+	if(__set_accel_dlpf(mpu, conf.accel_dlpf)){
+		fprintf(stderr,"failed to set accel_dlpf\n");
+		goto fail_bus;
+	}
+	if(__set_gyro_dlpf(mpu, conf.gyro_dlpf)){
+		fprintf(stderr,"failed to set gyro dlpf\n");
+		goto fail_bus;
+	}
+	if(__write_byte(mpu, SMPLRT_DIV, div)){
+		fprintf(stderr,"ERROR: in rc_mpu_initialize_data_ready, failed to write SMPLRT_DIV register\n");
+		goto fail_bus;
+	}
+	// configures the interrupt pin to pulse on every sample
+	if(__mpu_set_bypass(mpu, 1)){
+		fprintf(stderr, "failed to run __mpu_set_bypass\n");
+		goto fail_bus;
+	}
+	if(conf.enable_magnetometer){
+		if(__init_magnetometer(mpu, 0)){
+			fprintf(stderr,"ERROR: failed to initialize_magnetometer\n");
+			goto fail_bus;
+		}
+	}
+	else __power_off_magnetometer(mpu);
 
-	// get ready to start the interrupt handler thread
-	data_ptr->tap_detected=0;
-	imu_shutdown_flag = 0;
-	dmp_callback_func=NULL;
-	tap_callback_func=NULL;
+	// accel, temp and gyro, then the EXT_SENS_DATA bytes slave 0 fills
+	mpu->raw_pkt_len = mpu->mag_master ? FIFO_LEN_RAW_TEMP+FIFO_LEN_MAG : FIFO_LEN_RAW_TEMP;
+	mpu->sample_period_ns = (uint64_t)(div+1)*1000000000/base;
 
-	// start the thread
-	if(rc_pthread_create(&imu_interrupt_thread, __dmp_interrupt_handler,NULL,
-					config.dmp_interrupt_sched_policy,
-					config.dmp_interrupt_priority)<0){
-		fprintf(stderr,"ERROR failed to start dmp handler thread\n");
-		return -1;
+	// get ready to start the interrupt handler
+	mpu->imu_shutdown_flag = 0;
+	mpu->missed_interrupts = 0;
+	mpu->last_seqno = 0;
+	mpu->last_interrupt_ns = 0;
+	mpu_clock_reset(&mpu->clock, mpu->sample_period_ns);
+	mpu->last_stamp_ns = 0;
+	mpu->raw_callback_func = NULL;
+	// the FIFO stays off from the reset
+	if(__write_byte(mpu, INT_ENABLE, BIT_DATA_RDY_EN)){
+		fprintf(stderr,"ERROR: in rc_mpu_initialize_data_ready, failed to enable the data ready interrupt\n");
+		goto fail_bus;
 	}
-	thread_running_flag = 1;
+	__unlock_bus(mpu);
 
-	// sleep for a ms so the thread can start predictably
-	rc_usleep(1000);
-	return 0;
+	return __start_interrupt_thread(mpu, __drdy_interrupt_handler);
+
+fail_bus:
+	__unlock_bus(mpu);
+	return -1;
 }
 
 /*******************************************************************************
@@ -999,91 +2344,137 @@ int rc_mpu_initialize_dmp(rc_mpu_data_t *data, rc_mpu_config_t conf)
  *  @param[in]  data        Bytes to write to memory.
  *  @return     0 if successful.
 *******************************************************************************/
-int __mpu_write_mem(unsigned short mem_addr, unsigned short length,\
+int __mpu_write_mem(rc_mpu_t* mpu, unsigned short mem_addr, unsigned short length,\
 							unsigned char *data)
 {
-	unsigned char tmp[2];
+	unsigned char bank[3];
+	unsigned char buf[MPU6500_BANK_SIZE+1];
+	rc_i2c_seg_t segs[2];
 	if (!data){
 		fprintf(stderr,"ERROR: in mpu_write_mem, NULL pointer\n");
 		return -1;
 	}
-	tmp[0] = (unsigned char)(mem_addr >> 8);
-	tmp[1] = (unsigned char)(mem_addr & 0xFF);
+	bank[0] = MPU6500_BANK_SEL;
+	bank[1] = (unsigned char)(mem_addr >> 8);
+	bank[2] = (unsigned char)(mem_addr & 0xFF);
 	// Check bank boundaries.
-	if (tmp[1] + length > MPU6500_BANK_SIZE){
+	if (bank[2] + length > MPU6500_BANK_SIZE){
 		fprintf(stderr,"mpu_write_mem exceeds bank size\n");
 		return -1;
 	}
-	if (rc_i2c_write_bytes(config.i2c_bus,MPU6500_BANK_SEL, 2, tmp))
-		return -1;
-	if (rc_i2c_write_bytes(config.i2c_bus,MPU6500_MEM_R_W, length, data))
+	buf[0] = MPU6500_MEM_R_W;
+	memcpy(&buf[1], data, length);
+	// select bank and start address, then write, in one transaction
+	__set_write_seg(mpu, &segs[0], bank, 3);
+	__set_write_seg(mpu, &segs[1], buf, length+1);
+	if (__transfer(mpu, segs, 2)<0)
 		return -1;
 	return 0;
 }
 
 /*******************************************************************************
- *  @brief      Read from the DMP memory.
- *  This function prevents I2C reads past the bank boundaries. The DMP memory
- *  is only accessible when the chip is awake.
- *  @param[in]  mem_addr    Memory location (bank << 8 | start address)
- *  @param[in]  length      Number of bytes to read.
- *  @param[out] data        Bytes read from memory.
- *  @return     0 if successful.
+* int __dmp_mem_burst(rc_mpu_t* mpu, unsigned short mem_addr, unsigned short length, unsigned char* data, int read)
+*
+* reads or writes up to a whole bank of DMP memory in one transaction. The
+* register transports take at most 255 bytes at a time so it goes as chunks,
+* each its own segment to MEM_R_W. The memory address carries on from one
+* chunk to the next so only the first needs the bank selected.
 *******************************************************************************/
-int __mpu_read_mem(unsigned short mem_addr, unsigned short length, unsigned char *data)
+static int __dmp_mem_burst(rc_mpu_t* mpu, unsigned short mem_addr, unsigned short length, unsigned char* data, int read)
 {
-	unsigned char tmp[2];
-	if (!data){
-		fprintf(stderr,"ERROR: in mpu_write_mem, NULL pointer\n");
+	unsigned char bank[3];
+	unsigned char reg = MPU6500_MEM_R_W;
+	unsigned char buf[MPU6500_BANK_SIZE/DMP_LOAD_CHUNK][DMP_LOAD_CHUNK+1];
+	rc_i2c_seg_t segs[1+2*MPU6500_BANK_SIZE/DMP_LOAD_CHUNK];
+	unsigned short len;
+	int i, n = 1;
+
+	bank[0] = MPU6500_BANK_SEL;
+	bank[1] = (unsigned char)(mem_addr >> 8);
+	bank[2] = (unsigned char)(mem_addr & 0xFF);
+	if (bank[2] + length > MPU6500_BANK_SIZE){
+		fprintf(stderr,"ERROR: in __dmp_mem_burst, exceeds bank size\n");
 		return -1;
 	}
-	tmp[0] = (unsigned char)(mem_addr >> 8);
-	tmp[1] = (unsigned char)(mem_addr & 0xFF);
-	// Check bank boundaries.
-	if (tmp[1] + length > MPU6500_BANK_SIZE){
-		printf("mpu_read_mem exceeds bank size\n");
-		return -1;
+	__set_write_seg(mpu, &segs[0], bank, 3);
+	for(i=0; length>0; i++){
+		len = min(length, DMP_LOAD_CHUNK);
+		if(read){
+			__set_write_seg(mpu, &segs[n++], &reg, 1);
+			__set_read_seg(mpu, &segs[n++], data, len);
+		}
+		else{
+			buf[i][0] = MPU6500_MEM_R_W;
+			memcpy(&buf[i][1], data, len);
+			__set_write_seg(mpu, &segs[n++], buf[i], len+1);
+		}
+		data += len;
+		length -= len;
 	}
-	if (rc_i2c_write_bytes(config.i2c_bus,MPU6500_BANK_SEL, 2, tmp))
-		return -1;
-	if (rc_i2c_read_bytes(config.i2c_bus,MPU6500_MEM_R_W, length, data)!=length)
-		return -1;
-	return 0;
+	return __transfer(mpu, segs, n);
 }
 
 /*******************************************************************************
 * int __dmp_load_motion_driver_firmware()
 *
-* loads pre-compiled firmware binary from invensense onto dmp
+* loads pre-compiled firmware binary from invensense onto dmp. The DMP memory
+* keeps its contents through a reset, so after a restart without a power cycle
+* the firmware is usually still there with only the few bytes the last run's
+* configuration and the running DMP changed. Those are found by reading the
+* memory first and only they are written again. Otherwise the whole image goes
+* a bank per transaction. Either way everything written is read back once at
+* the end and checked against the image.
 *******************************************************************************/
-int __dmp_load_motion_driver_firmware()
+int __dmp_load_motion_driver_firmware(rc_mpu_t* mpu)
 {
-	unsigned short ii;
-	unsigned short this_write;
-	// Must divide evenly into st.hw->bank_size to avoid bank crossings.
-	unsigned char cur[DMP_LOAD_CHUNK], tmp[2];
+	unsigned char cur[DMP_CODE_SIZE], tmp[2];
+	unsigned short lo[DMP_CODE_BANKS], hi[DMP_CODE_BANKS];
+	unsigned short ii, len, probe;
+	int b, warm;
 	// make sure the address is set correctly
-	rc_i2c_set_device_address(config.i2c_bus, config.i2c_addr);
-	// loop through 16 bytes at a time and check each write for corruption
-	for (ii=0; ii<DMP_CODE_SIZE; ii+=this_write) {
-		this_write = min(DMP_LOAD_CHUNK, DMP_CODE_SIZE - ii);
-		if (__mpu_write_mem(ii, this_write, (uint8_t*)&dmp_firmware[ii])){
+	__set_address(mpu, mpu->config.i2c_addr);
+	// the last bank is code that neither the running DMP nor the
+	// configuration written after the load touches, so finding it intact
+	// means the rest is worth reading rather than just writing over
+	probe = (DMP_CODE_SIZE-1) & ~(MPU6500_BANK_SIZE-1);
+	if (__dmp_mem_burst(mpu, probe, DMP_CODE_SIZE-probe, cur+probe, 1)<0){
+		fprintf(stderr,"dmp firmware read failed\n");
+		return -1;
+	}
+	warm = memcmp(cur+probe, dmp_firmware+probe, DMP_CODE_SIZE-probe)==0;
+	for (ii=0, b=0; ii<DMP_CODE_SIZE; ii+=MPU6500_BANK_SIZE, b++) {
+		len = min(MPU6500_BANK_SIZE, DMP_CODE_SIZE - ii);
+		lo[b] = 0;
+		hi[b] = len;
+		if (warm) {
+			if (ii!=probe && __dmp_mem_burst(mpu, ii, len, cur+ii, 1)<0){
+				fprintf(stderr,"dmp firmware read failed\n");
+				return -1;
+			}
+			while (lo[b]<len && cur[ii+lo[b]]==dmp_firmware[ii+lo[b]]) lo[b]++;
+			while (hi[b]>lo[b] && cur[ii+hi[b]-1]==dmp_firmware[ii+hi[b]-1]) hi[b]--;
+		}
+		if (lo[b]<hi[b] && __dmp_mem_burst(mpu, ii+lo[b], hi[b]-lo[b],
+					(unsigned char*)dmp_firmware+ii+lo[b], 0)<0){
 			fprintf(stderr,"dmp firmware write failed\n");
 			return -1;
 		}
-		if (__mpu_read_mem(ii, this_write, cur)){
+	}
+	// read back whatever was written, the rest of cur is already known good
+	for (ii=0, b=0; ii<DMP_CODE_SIZE; ii+=MPU6500_BANK_SIZE, b++) {
+		if (lo[b]<hi[b] && __dmp_mem_burst(mpu, ii+lo[b], hi[b]-lo[b], cur+ii+lo[b], 1)<0){
 			fprintf(stderr,"dmp firmware read failed\n");
 			return -1;
 		}
-		if (memcmp(dmp_firmware+ii, cur, this_write)){
-			fprintf(stderr,"dmp firmware write corrupted\n");
-			return -2;
-		}
+	}
+	if (memcmp(dmp_firmware, cur, DMP_CODE_SIZE)){
+		fprintf(stderr,"dmp firmware write corrupted\n");
+		return -2;
 	}
 	// Set program start address.
 	tmp[0] = dmp_start_addr >> 8;
 	tmp[1] = dmp_start_addr & 0xFF;
-	if (rc_i2c_write_bytes(config.i2c_bus, MPU6500_PRGM_START_H, 2, tmp)){
+	if (__write_bytes(mpu, MPU6500_PRGM_START_H, 2, tmp)){
 		fprintf(stderr,"ERROR writing to MPU6500_PRGM_START register\n");
 		return -1;
 	}
@@ -1097,7 +2488,7 @@ int __dmp_load_motion_driver_firmware()
  *  @param[in]  orient  Gyro and accel orientation in body frame.
  *  @return     0 if successful.
 *******************************************************************************/
-int __dmp_set_orientation(unsigned short orient)
+int __dmp_set_orientation(rc_mpu_t* mpu, unsigned short orient)
 {
 	unsigned char gyro_regs[3], accel_regs[3];
 	const unsigned char gyro_axes[3] = {DINA4C, DINACD, DINA6C};
@@ -1112,11 +2503,11 @@ int __dmp_set_orientation(unsigned short orient)
 	accel_regs[1] = accel_axes[(orient >> 3) & 3];
 	accel_regs[2] = accel_axes[(orient >> 6) & 3];
 	// Chip-to-body, axes only.
-	if (__mpu_write_mem(FCFG_1, 3, gyro_regs)){
+	if (__mpu_write_mem(mpu, FCFG_1, 3, gyro_regs)){
 		fprintf(stderr, "ERROR: in dmp_set_orientation, failed to write dmp mem\n");
 		return -1;
 	}
-	if (__mpu_write_mem(FCFG_2, 3, accel_regs)){
+	if (__mpu_write_mem(mpu, FCFG_2, 3, accel_regs)){
 		fprintf(stderr, "ERROR: in dmp_set_orientation, failed to write dmp mem\n");
 		return -1;
 	}
@@ -1135,11 +2526,11 @@ int __dmp_set_orientation(unsigned short orient)
 		accel_regs[2] |= 1;
 	}
 	// Chip-to-body, sign only.
-	if(__mpu_write_mem(FCFG_3, 3, gyro_regs)){
+	if(__mpu_write_mem(mpu, FCFG_3, 3, gyro_regs)){
 		fprintf(stderr, "ERROR: in dmp_set_orientation, failed to write dmp mem\n");
 		return -1;
 	}
-	if(__mpu_write_mem(FCFG_7, 3, accel_regs)){
+	if(__mpu_write_mem(mpu, FCFG_7, 3, accel_regs)){
 		fprintf(stderr, "ERROR: in dmp_set_orientation, failed to write dmp mem\n");
 		return -1;
 	}
@@ -1152,7 +2543,7 @@ int __dmp_set_orientation(unsigned short orient)
  *  @param[in]  rate    Desired fifo rate (Hz).
  *  @return     0 if successful.
 *******************************************************************************/
-int __dmp_set_fifo_rate(unsigned short rate)
+int __dmp_set_fifo_rate(rc_mpu_t* mpu, unsigned short rate)
 {
 	const unsigned char regs_end[12] = {DINAFE, DINAF2, DINAAB,
 		0xc4, DINAAA, DINAF1, DINADF, DINADF, 0xBB, 0xAF, DINADF, DINADF};
@@ -1165,11 +2556,11 @@ int __dmp_set_fifo_rate(unsigned short rate)
 	div = DMP_MAX_RATE / rate - 1;
 	tmp[0] = (unsigned char)((div >> 8) & 0xFF);
 	tmp[1] = (unsigned char)(div & 0xFF);
-	if (__mpu_write_mem(D_0_22, 2, tmp)){
+	if (__mpu_write_mem(mpu, D_0_22, 2, tmp)){
 		fprintf(stderr,"ERROR: writing dmp sample rate reg");
 		return -1;
 	}
-	if (__mpu_write_mem(CFG_6, 12, (unsigned char*)regs_end)){
+	if (__mpu_write_mem(mpu, CFG_6, 12, (unsigned char*)regs_end)){
 		fprintf(stderr,"ERROR: writing dmp regs_end");
 		return -1;
 	}
@@ -1185,39 +2576,44 @@ int __dmp_set_fifo_rate(unsigned short rate)
 * off after configuration and the MPU fetches magnetometer data automatically.
 * USER_CTRL - based on global variable dsp_en
 * INT_PIN_CFG based on requested bypass state
+* With mag_i2c_master the I2C master owns the auxiliary bus, so it stays on and
+* bypass is never enabled whatever is asked for.
 *******************************************************************************/
-int __mpu_set_bypass(uint8_t bypass_on)
+int __mpu_set_bypass(rc_mpu_t* mpu, uint8_t bypass_on)
 {
 	uint8_t tmp = 0;
-	rc_i2c_set_device_address(config.i2c_bus, config.i2c_addr);
+	if(mpu->mag_master) bypass_on = 0;
+	__set_address(mpu, mpu->config.i2c_addr);
 	// set up USER_CTRL first
 	// DONT USE FIFO_EN_BIT in DMP mode, or the MPU will generate lots of
 	// unwanted interruptss
-	if(dmp_en){
+	if(mpu->dmp_en){
 		tmp |= FIFO_EN_BIT; // enable fifo for dsp mode
 	}
 	if(!bypass_on){
 		tmp |= I2C_MST_EN; // i2c master mode when not in bypass
 	}
-	if (rc_i2c_write_byte(config.i2c_bus, USER_CTRL, tmp)){
+	if (__write_byte(mpu, USER_CTRL, tmp)){
 		fprintf(stderr,"ERROR in mpu_set_bypass, failed to write USER_CTRL register\n");
 		return -1;
 	}
 	rc_usleep(3000);
 	// INT_PIN_CFG settings
-	tmp = LATCH_INT_EN | INT_ANYRD_CLEAR | ACTL_ACTIVE_LOW; // latching
-	//tmp =  ACTL_ACTIVE_LOW;	// non-latching
+	// data-ready mode wants an edge for every sample, even one that comes
+	// before the last was read, so there the pin pulses instead
+	if(mpu->drdy_en) tmp = ACTL_ACTIVE_LOW; // non-latching
+	else tmp = LATCH_INT_EN | INT_ANYRD_CLEAR | ACTL_ACTIVE_LOW; // latching
 	if(bypass_on)
 		tmp |= BYPASS_EN;
-	if (rc_i2c_write_byte(config.i2c_bus, INT_PIN_CFG, tmp)){
+	if (__write_byte(mpu, INT_PIN_CFG, tmp)){
 		fprintf(stderr,"ERROR in mpu_set_bypass, failed to write INT_PIN_CFG register\n");
 		return -1;
 	}
 	if(bypass_on){
-		bypass_en = 1;
+		mpu->bypass_en = 1;
 	}
 	else{
-		bypass_en = 0;
+		mpu->bypass_en = 0;
 	}
 	return 0;
 }
@@ -1230,15 +2626,15 @@ int __mpu_set_bypass(uint8_t bypass_on)
 * but annoying in control systems we do not use it here and instead ask users
 * to run our own gyro_calibration routine.
 *******************************************************************************/
-int __dmp_enable_gyro_cal(unsigned char enable)
+int __dmp_enable_gyro_cal(rc_mpu_t* mpu, unsigned char enable)
 {
 	if(enable){
 		unsigned char regs[9] = {0xb8, 0xaa, 0xb3, 0x8d, 0xb4, 0x98, 0x0d, 0x35, 0x5d};
-		return __mpu_write_mem(CFG_MOTION_BIAS, 9, regs);
+		return __mpu_write_mem(mpu, CFG_MOTION_BIAS, 9, regs);
 	}
 	else{
 		unsigned char regs[9] = {0xb8, 0xaa, 0xaa, 0xaa, 0xb0, 0x88, 0xc3, 0xc5, 0xc7};
-		return __mpu_write_mem(CFG_MOTION_BIAS, 9, regs);
+		return __mpu_write_mem(mpu, CFG_MOTION_BIAS, 9, regs);
 	}
 }
 
@@ -1248,7 +2644,7 @@ int __dmp_enable_gyro_cal(unsigned char enable)
 * Taken straight from the Invensense DMP code. This enabled quaternion filtering
 * with accelerometer and gyro filtering.
 *******************************************************************************/
-int __dmp_enable_6x_lp_quat(unsigned char enable)
+int __dmp_enable_6x_lp_quat(rc_mpu_t* mpu, unsigned char enable)
 {
 	unsigned char regs[4];
 	if(enable){
@@ -1260,7 +2656,7 @@ int __dmp_enable_6x_lp_quat(unsigned char enable)
 	else{
 		memset(regs, 0xA3, 4);
 	}
-	__mpu_write_mem(CFG_8, 4, regs);
+	__mpu_write_mem(mpu, CFG_8, 4, regs);
 	return 0;
 }
 
@@ -1270,7 +2666,7 @@ int __dmp_enable_6x_lp_quat(unsigned char enable)
 * sets the DMP to do gyro-only quaternion filtering. This is not actually used
 * here but remains as a vestige of the Invensense DMP code.
 *******************************************************************************/
-int __dmp_enable_lp_quat(unsigned char enable)
+int __dmp_enable_lp_quat(rc_mpu_t* mpu, unsigned char enable)
 {
 	unsigned char regs[4];
 	if(enable){
@@ -1282,10 +2678,21 @@ int __dmp_enable_lp_quat(unsigned char enable)
 	else{
 		memset(regs, 0x8B, 4);
 	}
-	__mpu_write_mem(CFG_LP_QUAT, 4, regs);
+	__mpu_write_mem(mpu, CFG_LP_QUAT, 4, regs);
 	return 0;
 }
 
+/*******************************************************************************
+* uint8_t __user_ctrl(rc_mpu_t* mpu, uint8_t bits)
+*
+* USER_CTRL value for the FIFO and DMP bits given, keeping the I2C master on
+* when it is polling the magnetometer
+*******************************************************************************/
+static inline uint8_t __user_ctrl(rc_mpu_t* mpu, uint8_t bits)
+{
+	return mpu->mag_master ? (bits|I2C_MST_EN) : bits;
+}
+
 /*******************************************************************************
 * int __mpu_reset_fifo()
 *
@@ -1294,21 +2701,22 @@ int __dmp_enable_lp_quat(unsigned char enable)
 * interrupt, resets fifo and DMP, then starts them again. Used once while
 * initializing (probably no necessary) then again if the fifo gets too full.
 *******************************************************************************/
-int __mpu_reset_fifo(void)
+int __mpu_reset_fifo(rc_mpu_t* mpu)
 {
 	uint8_t data;
+	mpu->fifo_ahead = 0;
 	// make sure the i2c address is set correctly.
 	// this shouldn't take any time at all if already set
-	rc_i2c_set_device_address(config.i2c_bus, config.i2c_addr);
+	__set_address(mpu, mpu->config.i2c_addr);
 	// turn off interrupts, fifo, and usr_ctrl which is where the dmp fifo is enabled
 	data = 0;
-	if (rc_i2c_write_byte(config.i2c_bus, INT_ENABLE, data)) return -1;
-	if (rc_i2c_write_byte(config.i2c_bus, FIFO_EN, data)) return -1;
-	if (rc_i2c_write_byte(config.i2c_bus, USER_CTRL, data)) return -1;
+	if (__write_byte(mpu, INT_ENABLE, data)) return -1;
+	if (__write_byte(mpu, FIFO_EN, data)) return -1;
+	if (__write_byte(mpu, USER_CTRL, __user_ctrl(mpu, data))) return -1;
 
 	// reset fifo and wait
 	data = BIT_FIFO_RST | BIT_DMP_RST;
-	if (rc_i2c_write_byte(config.i2c_bus, USER_CTRL, data)) return -1;
+	if (__write_byte(mpu, USER_CTRL, __user_ctrl(mpu, data))) return -1;
 	//rc_usleep(1000); // how I had it
 	rc_usleep(50000); // invensense standard
 
@@ -1316,16 +2724,35 @@ int __mpu_reset_fifo(void)
 	// enabling DMP but NOT BIT_FIFO_EN gives quat out of bounds
 	// but also no empty interrupts
 	data = BIT_DMP_EN | BIT_FIFO_EN;
-	if(rc_i2c_write_byte(config.i2c_bus, USER_CTRL, data)){
+	if(__write_byte(mpu, USER_CTRL, __user_ctrl(mpu, data))){
 		return -1;
 	}
 
 	// turn on dmp interrupt enable bit again
 	data = BIT_DMP_INT_EN;
-	if (rc_i2c_write_byte(config.i2c_bus, INT_ENABLE, data)) return -1;
+	if (__write_byte(mpu, INT_ENABLE, data)) return -1;
 	data = 0;
-	if (rc_i2c_write_byte(config.i2c_bus, FIFO_EN, data)) return -1;
+	if (__write_byte(mpu, FIFO_EN, data)) return -1;
+
+	return 0;
+}
 
+/*******************************************************************************
+* int __mpu_reset_raw_fifo()
+*
+* Raw FIFO counterpart of __mpu_reset_fifo. Empties the FIFO and starts it
+* again with the sensors chosen in rc_mpu_initialize_raw_fifo, interrupting on
+* every new sample. No DMP to restart so no need to wait afterwards.
+*******************************************************************************/
+int __mpu_reset_raw_fifo(rc_mpu_t* mpu)
+{
+	__set_address(mpu, mpu->config.i2c_addr);
+	if(__write_byte(mpu, INT_ENABLE, 0)) return -1;
+	if(__write_byte(mpu, FIFO_EN, 0)) return -1;
+	if(__write_byte(mpu, USER_CTRL, __user_ctrl(mpu, BIT_FIFO_RST))) return -1;
+	if(__write_byte(mpu, USER_CTRL, __user_ctrl(mpu, BIT_FIFO_EN))) return -1;
+	if(__write_byte(mpu, FIFO_EN, mpu->raw_fifo_en)) return -1;
+	if(__write_byte(mpu, INT_ENABLE, BIT_DATA_RDY_EN)) return -1;
 	return 0;
 }
 
@@ -1336,7 +2763,7 @@ int __mpu_reset_fifo(void)
 * to trigger an interrupt either every sample or only on gestures. Here we
 * only ever configure for continuous sampling.
 *******************************************************************************/
-int __dmp_set_interrupt_mode(unsigned char mode)
+int __dmp_set_interrupt_mode(rc_mpu_t* mpu, unsigned char mode)
 {
 	const unsigned char regs_continuous[11] =
 		{0xd8, 0xb1, 0xb9, 0xf3, 0x8b, 0xa3, 0x91, 0xb6, 0x09, 0xb4, 0xd9};
@@ -1344,9 +2771,9 @@ int __dmp_set_interrupt_mode(unsigned char mode)
 		{0xda, 0xb1, 0xb9, 0xf3, 0x8b, 0xa3, 0x91, 0xb6, 0xda, 0xb4, 0xda};
 	switch(mode){
 	case DMP_INT_CONTINUOUS:
-		return __mpu_write_mem(CFG_FIFO_ON_EVENT, 11, (unsigned char*)regs_continuous);
+		return __mpu_write_mem(mpu, CFG_FIFO_ON_EVENT, 11, (unsigned char*)regs_continuous);
 	case DMP_INT_GESTURE:
-		return __mpu_write_mem(CFG_FIFO_ON_EVENT, 11, (unsigned char*)regs_gesture);
+		return __mpu_write_mem(mpu, CFG_FIFO_ON_EVENT, 11, (unsigned char*)regs_gesture);
 	default:
 		return -1;
 	}
@@ -1358,7 +2785,7 @@ int __dmp_set_interrupt_mode(unsigned char mode)
  *  @param[in]  thresh  Tap threshold, in mg/ms.
  *  @return     0 if successful.
  */
-int __dmp_set_tap_thresh(unsigned char axis, unsigned short thresh)
+int __dmp_set_tap_thresh(rc_mpu_t* mpu, unsigned char axis, unsigned short thresh)
 {
 	unsigned char tmp[4];
 	float scaled_thresh;
@@ -1368,7 +2795,7 @@ int __dmp_set_tap_thresh(unsigned char axis, unsigned short thresh)
 
 	scaled_thresh = (float)thresh / DMP_SAMPLE_RATE;
 
-	switch (config.accel_fsr) {
+	switch (mpu->config.accel_fsr) {
 	case ACCEL_FSR_2G:
 		dmp_thresh = (unsigned short)(scaled_thresh * 16384);
 		/* dmp_thresh * 0.75 */
@@ -1398,21 +2825,21 @@ int __dmp_set_tap_thresh(unsigned char axis, unsigned short thresh)
 	tmp[3] = (unsigned char)(dmp_thresh_2 & 0xFF);
 
 	if (axis & TAP_X) {
-		if (__mpu_write_mem(DMP_TAP_THX, 2, tmp))
+		if (__mpu_write_mem(mpu, DMP_TAP_THX, 2, tmp))
 			return -1;
-		if (__mpu_write_mem(D_1_36, 2, tmp+2))
+		if (__mpu_write_mem(mpu, D_1_36, 2, tmp+2))
 			return -1;
 	}
 	if (axis & TAP_Y) {
-		if (__mpu_write_mem(DMP_TAP_THY, 2, tmp))
+		if (__mpu_write_mem(mpu, DMP_TAP_THY, 2, tmp))
 			return -1;
-		if (__mpu_write_mem(D_1_40, 2, tmp+2))
+		if (__mpu_write_mem(mpu, D_1_40, 2, tmp+2))
 			return -1;
 	}
 	if (axis & TAP_Z) {
-		if (__mpu_write_mem(DMP_TAP_THZ, 2, tmp))
+		if (__mpu_write_mem(mpu, DMP_TAP_THZ, 2, tmp))
 			return -1;
-		if (__mpu_write_mem(D_1_44, 2, tmp+2))
+		if (__mpu_write_mem(mpu, D_1_44, 2, tmp+2))
 			return -1;
 	}
 	return 0;
@@ -1423,7 +2850,7 @@ int __dmp_set_tap_thresh(unsigned char axis, unsigned short thresh)
  *  @param[in]  axis    1, 2, and 4 for XYZ, respectively.
  *  @return     0 if successful.
  */
-int __dmp_set_tap_axes(unsigned char axis)
+int __dmp_set_tap_axes(rc_mpu_t* mpu, unsigned char axis)
 {
 	unsigned char tmp = 0;
 
@@ -1433,7 +2860,7 @@ int __dmp_set_tap_axes(unsigned char axis)
 	tmp |= 0x0C;
 	if (axis & TAP_Z)
 	tmp |= 0x03;
-	return __mpu_write_mem(D_1_72, 1, &tmp);
+	return __mpu_write_mem(mpu, D_1_72, 1, &tmp);
 }
 
 /**
@@ -1441,7 +2868,7 @@ int __dmp_set_tap_axes(unsigned char axis)
  *  @param[in]  min_taps    Minimum consecutive taps (1-4).
  *  @return     0 if successful.
  */
-int __dmp_set_tap_count(unsigned char min_taps)
+int __dmp_set_tap_count(rc_mpu_t* mpu, unsigned char min_taps)
 {
 	unsigned char tmp;
 
@@ -1451,7 +2878,7 @@ int __dmp_set_tap_count(unsigned char min_taps)
 	min_taps = 4;
 
 	tmp = min_taps - 1;
-	return __mpu_write_mem(D_1_79, 1, &tmp);
+	return __mpu_write_mem(mpu, D_1_79, 1, &tmp);
 }
 
 /**
@@ -1459,7 +2886,7 @@ int __dmp_set_tap_count(unsigned char min_taps)
  *  @param[in]  time    Milliseconds between taps.
  *  @return     0 if successful.
  */
-int __dmp_set_tap_time(unsigned short time)
+int __dmp_set_tap_time(rc_mpu_t* mpu, unsigned short time)
 {
 	unsigned short dmp_time;
 	unsigned char tmp[2];
@@ -1467,7 +2894,7 @@ int __dmp_set_tap_time(unsigned short time)
 	dmp_time = time / (1000 / DMP_SAMPLE_RATE);
 	tmp[0] = (unsigned char)(dmp_time >> 8);
 	tmp[1] = (unsigned char)(dmp_time & 0xFF);
-	return __mpu_write_mem(DMP_TAPW_MIN, 2, tmp);
+	return __mpu_write_mem(mpu, DMP_TAPW_MIN, 2, tmp);
 }
 
 /**
@@ -1475,7 +2902,7 @@ int __dmp_set_tap_time(unsigned short time)
  *  @param[in]  time    Max milliseconds between taps.
  *  @return     0 if successful.
  */
-int __dmp_set_tap_time_multi(unsigned short time)
+int __dmp_set_tap_time_multi(rc_mpu_t* mpu, unsigned short time)
 {
 	unsigned short dmp_time;
 	unsigned char tmp[2];
@@ -1483,7 +2910,7 @@ int __dmp_set_tap_time_multi(unsigned short time)
 	dmp_time = time / (1000 / DMP_SAMPLE_RATE);
 	tmp[0] = (unsigned char)(dmp_time >> 8);
 	tmp[1] = (unsigned char)(dmp_time & 0xFF);
-	return __mpu_write_mem(D_1_218, 2, tmp);
+	return __mpu_write_mem(mpu, D_1_218, 2, tmp);
 }
 
 /**
@@ -1493,7 +2920,7 @@ int __dmp_set_tap_time_multi(unsigned short time)
  *  @param[in]  thresh  Gyro threshold in dps.
  *  @return     0 if successful.
  */
-int __dmp_set_shake_reject_thresh(long sf, unsigned short thresh)
+int __dmp_set_shake_reject_thresh(rc_mpu_t* mpu, long sf, unsigned short thresh)
 {
 	unsigned char tmp[4];
 	long thresh_scaled = sf / 1000 * thresh;
@@ -1501,7 +2928,7 @@ int __dmp_set_shake_reject_thresh(long sf, unsigned short thresh)
 	tmp[1] = (unsigned char)(((long)thresh_scaled >> 16) & 0xFF);
 	tmp[2] = (unsigned char)(((long)thresh_scaled >> 8) & 0xFF);
 	tmp[3] = (unsigned char)((long)thresh_scaled & 0xFF);
-	return __mpu_write_mem(D_1_92, 4, tmp);
+	return __mpu_write_mem(mpu, D_1_92, 4, tmp);
 }
 
 /**
@@ -1512,14 +2939,14 @@ int __dmp_set_shake_reject_thresh(long sf, unsigned short thresh)
  *  @param[in]  time    Time in milliseconds.
  *  @return     0 if successful.
  */
-int __dmp_set_shake_reject_time(unsigned short time)
+int __dmp_set_shake_reject_time(rc_mpu_t* mpu, unsigned short time)
 {
 	unsigned char tmp[2];
 
 	time /= (1000 / DMP_SAMPLE_RATE);
 	tmp[0] = time >> 8;
 	tmp[1] = time & 0xFF;
-	return __mpu_write_mem(D_1_90,2,tmp);
+	return __mpu_write_mem(mpu, D_1_90,2,tmp);
 }
 
 /**
@@ -1530,14 +2957,14 @@ int __dmp_set_shake_reject_time(unsigned short time)
  *  @param[in]  time    Time in milliseconds.
  *  @return     0 if successful.
  */
-int __dmp_set_shake_reject_timeout(unsigned short time)
+int __dmp_set_shake_reject_timeout(rc_mpu_t* mpu, unsigned short time)
 {
 	unsigned char tmp[2];
 
 	time /= (1000 / DMP_SAMPLE_RATE);
 	tmp[0] = time >> 8;
 	tmp[1] = time & 0xFF;
-	return __mpu_write_mem(D_1_88,2,tmp);
+	return __mpu_write_mem(mpu, D_1_88,2,tmp);
 }
 
 /*******************************************************************************
@@ -1549,7 +2976,7 @@ int __dmp_set_shake_reject_timeout(unsigned short time)
 * isn't necessary to remain in its current form as rc_mpu_initialize_dmp uses
 * a fixed set of features but we keep it as is since it works fine.
 *******************************************************************************/
-int __dmp_enable_feature(unsigned short mask)
+int __dmp_enable_feature(rc_mpu_t* mpu, unsigned short mask)
 {
 	unsigned char tmp[10];
 	// Set integration scale factor.
@@ -1557,7 +2984,7 @@ int __dmp_enable_feature(unsigned short mask)
 	tmp[1] = (unsigned char)((GYRO_SF >> 16) & 0xFF);
 	tmp[2] = (unsigned char)((GYRO_SF >> 8) & 0xFF);
 	tmp[3] = (unsigned char)(GYRO_SF & 0xFF);
-	if(__mpu_write_mem(D_0_104, 4, tmp)<0){
+	if(__mpu_write_mem(mpu, D_0_104, 4, tmp)<0){
 		fprintf(stderr, "ERROR: in dmp_enable_feature, failed to write mpu mem\n");
 		return -1;
 	}
@@ -1584,7 +3011,7 @@ int __dmp_enable_feature(unsigned short mask)
 	tmp[7] = 0xA3;
 	tmp[8] = 0xA3;
 	tmp[9] = 0xA3;
-	if(__mpu_write_mem(CFG_15,10,tmp)<0){
+	if(__mpu_write_mem(mpu, CFG_15,10,tmp)<0){
 		fprintf(stderr, "ERROR: in dmp_enable_feature, failed to write mpu mem\n");
 		return -1;
 	}
@@ -1595,13 +3022,13 @@ int __dmp_enable_feature(unsigned short mask)
 	else{
 		tmp[0] = 0xD8;
 	}
-	if(__mpu_write_mem(CFG_27,1,tmp)){
+	if(__mpu_write_mem(mpu, CFG_27,1,tmp)){
 		fprintf(stderr, "ERROR: in dmp_enable_feature, failed to write mpu mem\n");
 		return -1;
 	}
 
-	if(mask & DMP_FEATURE_GYRO_CAL) __dmp_enable_gyro_cal(1);
-	else __dmp_enable_gyro_cal(0);
+	if(mask & DMP_FEATURE_GYRO_CAL) __dmp_enable_gyro_cal(mpu, 1);
+	else __dmp_enable_gyro_cal(mpu, 0);
 
 	if (mask & DMP_FEATURE_SEND_ANY_GYRO) {
 		if (mask & DMP_FEATURE_SEND_CAL_GYRO) {
@@ -1615,28 +3042,28 @@ int __dmp_enable_feature(unsigned short mask)
 			tmp[2] = DINAC2;
 			tmp[3] = DINA90;
 		}
-		__mpu_write_mem(CFG_GYRO_RAW_DATA, 4, tmp);
+		__mpu_write_mem(mpu, CFG_GYRO_RAW_DATA, 4, tmp);
 	}
 
 	// configure tap feature
 	if (mask & DMP_FEATURE_TAP) {
 		/* Enable tap. */
 		tmp[0] = 0xF8;
-		__mpu_write_mem(CFG_20, 1, tmp);
-		__dmp_set_tap_thresh(TAP_XYZ, config.tap_threshold);
-		__dmp_set_tap_axes(TAP_XYZ);
-		__dmp_set_tap_count(1); //minimum number of taps needed for an interrupt (1-4)
-		__dmp_set_tap_time(100); // ms between taps (factory default 100)
-		__dmp_set_tap_time_multi(600); // max time between taps for multitap detection (factory default 500)
+		__mpu_write_mem(mpu, CFG_20, 1, tmp);
+		__dmp_set_tap_thresh(mpu, TAP_XYZ, mpu->config.tap_threshold);
+		__dmp_set_tap_axes(mpu, TAP_XYZ);
+		__dmp_set_tap_count(mpu, 1); //minimum number of taps needed for an interrupt (1-4)
+		__dmp_set_tap_time(mpu, 100); // ms between taps (factory default 100)
+		__dmp_set_tap_time_multi(mpu, 600); // max time between taps for multitap detection (factory default 500)
 
 		// shake rejection ignores taps when system is moving, set threshold
 		// high so this doesn't happen too often
-		__dmp_set_shake_reject_thresh(GYRO_SF, 300); // default was 200
-		__dmp_set_shake_reject_time(80);
-		__dmp_set_shake_reject_timeout(100);
+		__dmp_set_shake_reject_thresh(mpu, GYRO_SF, 300); // default was 200
+		__dmp_set_shake_reject_time(mpu, 80);
+		__dmp_set_shake_reject_timeout(mpu, 100);
 	} else {
 		tmp[0] = 0xD8;
-		__mpu_write_mem(CFG_20, 1, tmp);
+		__mpu_write_mem(mpu, CFG_20, 1, tmp);
 	}
 
 
@@ -1644,33 +3071,33 @@ int __dmp_enable_feature(unsigned short mask)
 		tmp[0] = 0xD9;
 	} else
 		tmp[0] = 0xD8;
-	__mpu_write_mem(CFG_ANDROID_ORIENT_INT, 1, tmp);
+	__mpu_write_mem(mpu, CFG_ANDROID_ORIENT_INT, 1, tmp);
 
 	if (mask & DMP_FEATURE_LP_QUAT){
-		__dmp_enable_lp_quat(1);
+		__dmp_enable_lp_quat(mpu, 1);
 	}
 	else{
-		__dmp_enable_lp_quat(0);
+		__dmp_enable_lp_quat(mpu, 0);
 	}
 	if (mask & DMP_FEATURE_6X_LP_QUAT){
-		__dmp_enable_6x_lp_quat(1);
+		__dmp_enable_6x_lp_quat(mpu, 1);
 	}
 	else{
-		__dmp_enable_6x_lp_quat(0);
+		__dmp_enable_6x_lp_quat(mpu, 0);
 	}
-	__mpu_reset_fifo();
-	packet_len = 0;
+	__mpu_reset_fifo(mpu);
+	mpu->packet_len = 0;
 	if(mask & DMP_FEATURE_SEND_RAW_ACCEL){
-		packet_len += 6;
+		mpu->packet_len += 6;
 	}
 	if(mask & DMP_FEATURE_SEND_ANY_GYRO){
-		packet_len += 6;
+		mpu->packet_len += 6;
 	}
 	if(mask & (DMP_FEATURE_LP_QUAT | DMP_FEATURE_6X_LP_QUAT)){
-		packet_len += 16;
+		mpu->packet_len += 16;
 	}
 	if(mask & (DMP_FEATURE_TAP | DMP_FEATURE_ANDROID_ORIENT)){
-		packet_len += 4;
+		mpu->packet_len += 4;
 	}
 	return 0;
 }
@@ -1680,7 +3107,7 @@ int __dmp_enable_feature(unsigned short mask)
 * This is a vestige of the invensense mpu open source code and is probably
 * not necessary but remains here anyway.
 *******************************************************************************/
-int __set_int_enable(unsigned char enable)
+int __set_int_enable(rc_mpu_t* mpu, unsigned char enable)
 {
 	unsigned char tmp;
 	if (enable){
@@ -1689,12 +3116,12 @@ int __set_int_enable(unsigned char enable)
 	else{
 		tmp = 0x00;
 	}
-	if(rc_i2c_write_byte(config.i2c_bus, INT_ENABLE, tmp)){
+	if(__write_byte(mpu, INT_ENABLE, tmp)){
 		fprintf(stderr, "ERROR: in set_int_enable, failed to write INT_ENABLE register\n");
 		return -1;
 	}
 	// disable all other FIFO features leaving just DMP
-	if (rc_i2c_write_byte(config.i2c_bus, FIFO_EN, 0)){
+	if (__write_byte(mpu, FIFO_EN, 0)){
 		fprintf(stderr, "ERROR: in set_int_enable, failed to write FIFO_EN register\n");
 		return -1;
 	}
@@ -1702,10 +3129,10 @@ int __set_int_enable(unsigned char enable)
 }
 
 /*******************************************************************************
-int __mpu_set_sample_rate(int rate)
+int __mpu_set_sample_rate(rc_mpu_t* mpu, int rate)
 Sets the clock rate divider for sensor sampling
 *******************************************************************************/
-int __mpu_set_sample_rate(int rate)
+int __mpu_set_sample_rate(rc_mpu_t* mpu, int rate)
 {
 	if(rate>1000 || rate<4){
 		fprintf(stderr,"ERROR: sample rate must be between 4 & 1000\n");
@@ -1716,7 +3143,7 @@ int __mpu_set_sample_rate(int rate)
 	#ifdef DEBUG
 	printf("setting divider to %d\n", div);
 	#endif
-	if(rc_i2c_write_byte(config.i2c_bus, SMPLRT_DIV, div)){
+	if(__write_byte(mpu, SMPLRT_DIV, div)){
 		fprintf(stderr,"ERROR: in mpu_set_sample_rate, failed to write SMPLRT_DIV register\n");
 		return -1;
 	}
@@ -1730,329 +3157,703 @@ int __mpu_set_sample_rate(int rate)
 * isn't necessary as rc_mpu_initialize_dmp sets these registers but it remains
 * here as a vestige of the invensense open source dmp code.
 *******************************************************************************/
-int __mpu_set_dmp_state(unsigned char enable)
+int __mpu_set_dmp_state(rc_mpu_t* mpu, unsigned char enable)
 {
 	if (enable) {
 		// Disable data ready interrupt.
-		__set_int_enable(0);
+		__set_int_enable(mpu, 0);
 		// make sure bypass mode is enabled
-		__mpu_set_bypass(1);
+		__mpu_set_bypass(mpu, 1);
 		// Remove FIFO elements.
-		rc_i2c_write_byte(config.i2c_bus, FIFO_EN , 0);
+		__write_byte(mpu, FIFO_EN , 0);
 		// Enable DMP interrupt.
-		__set_int_enable(1);
-		__mpu_reset_fifo();
+		__set_int_enable(mpu, 1);
+		__mpu_reset_fifo(mpu);
 	}
 	else {
 		// Disable DMP interrupt.
-		__set_int_enable(0);
+		__set_int_enable(mpu, 0);
 		// Restore FIFO settings.
-		rc_i2c_write_byte(config.i2c_bus, FIFO_EN , 0);
-		__mpu_reset_fifo();
+		__write_byte(mpu, FIFO_EN , 0);
+		__mpu_reset_fifo(mpu);
 	}
 	return 0;
 }
 
 /*******************************************************************************
-* void* __dmp_interrupt_handler(void* ptr)
+* int __take_interrupt(rc_mpu_t* mpu, int fd, uint32_t events)
 *
-* Here is where the magic happens. This function runs as its own thread and
-* monitors the gpio pin config.gpio_interrupt_pin with the blocking function call
-* poll(). If a valid interrupt is received from the IMU then mark the timestamp,
-* read in the IMU data, and call the user-defined interrupt function if set.
+* consumes the event on the interrupt fd or batch timer, records when the edge
+* happened and counts edges that were missed. Returns 0 if it was a real interrupt that
+* should be serviced.
 *******************************************************************************/
-void* __dmp_interrupt_handler( __unused void* ptr)
+static int __take_interrupt(rc_mpu_t* mpu, int fd, uint32_t events)
 {
-	struct pollfd fdset[1];
-	int ret;
-	// start magnetometer read divider at the end of the counter
-	// so it reads on the first run
-	int mag_div_step = config.mag_sample_rate_div;
-	char buf[64];
-	int first_run = 1;
-	int imu_gpio_fd = rc_gpio_get_value_fd(config.gpio_interrupt_pin);
-	if(imu_gpio_fd == -1){
-		fprintf(stderr,"ERROR: can't open config.gpio_interrupt_pin gpio fd\n");
-		fprintf(stderr,"aborting imu_interrupt_handler\n");
-		return NULL;
+	uint64_t edge_ns = 0, expirations;
+	uint32_t seqno = 0;
+
+	if(mpu->imu_shutdown_flag==1) return -1;
+	// batch timer, there is no edge to go by so the wakeup is the timestamp
+	if(fd==mpu->timer_fd){
+		if(read(fd, &expirations, sizeof(expirations))!=sizeof(expirations)) return -1;
+		if(expirations>1){
+			__atomic_fetch_add(&mpu->missed_interrupts, expirations-1, __ATOMIC_RELAXED);
+		}
+		mpu->last_interrupt_ns = rc_nanos_since_boot();
+		__atomic_fetch_add(&mpu->stats.wakeups, 1, __ATOMIC_RELAXED);
+		return 0;
 	}
-	fdset[0].fd = imu_gpio_fd;
-	fdset[0].events = POLLPRI;
-	// keep running until the program closes
-	__mpu_reset_fifo();
-	while(imu_shutdown_flag!=1) {
-		// system hangs here until IMU FIFO interrupt
-		poll(fdset, 1, IMU_POLL_TIMEOUT);
-		if(imu_shutdown_flag==1){
-			break;
+	if(!(events & mpu->imu_interrupt_events)) return -1;
+	if(mpu->irq_tp->interrupt_event!=NULL){
+		if(mpu->irq_tp->interrupt_event(mpu->irq_ctx, fd, &edge_ns, &seqno)) return -1;
+	}
+	else if(mpu->irq_tp->interrupt_ack(mpu->irq_ctx, fd)){
+		return -1;
+	}
+	// interrupt received, mark the timestamp. Prefer the time the
+	// kernel saw the edge so wakeup latency stays out of it.
+	if(edge_ns!=0) mpu->last_interrupt_ns = edge_ns;
+	else mpu->last_interrupt_ns = rc_nanos_since_boot();
+	if(seqno!=0){
+		if(mpu->last_seqno!=0 && seqno-mpu->last_seqno>1){
+			__atomic_fetch_add(&mpu->missed_interrupts, seqno-mpu->last_seqno-1, __ATOMIC_RELAXED);
 		}
-		else if (fdset[0].revents & POLLPRI) {
-			lseek(fdset[0].fd, 0, SEEK_SET);
-			if(read(fdset[0].fd, buf, 64)==-1){
-				perror("ERROR in __dmp_interrupt_handler, failed to read gpio value FD");
-				continue;
-			}
-			// interrupt received, mark the timestamp
-			last_interrupt_timestamp_nanos = rc_nanos_since_epoch();
-			// try to load fifo no matter the claim bus state
-			if(rc_i2c_get_lock(config.i2c_bus)){
-				fprintf(stderr,"WARNING: Something has claimed the I2C bus when an\n");
-				fprintf(stderr,"IMU interrupt was received. Reading IMU anyway.\n");
+		mpu->last_seqno = seqno;
+	}
+	__atomic_fetch_add(&mpu->stats.wakeups, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*******************************************************************************
+* void __count_batch(rc_mpu_t* mpu, int n)
+*
+* adds n delivered samples to the stats
+*******************************************************************************/
+static void __count_batch(rc_mpu_t* mpu, int n)
+{
+	__atomic_fetch_add(&mpu->stats.samples, n, __ATOMIC_RELAXED);
+	if((uint64_t)n>mpu->stats.max_batch){
+		__atomic_store_n(&mpu->stats.max_batch, n, __ATOMIC_RELAXED);
+	}
+}
+
+/*******************************************************************************
+* void __dmp_interrupt_handler(int fd, uint32_t events, void* user)
+*
+* Here is where the magic happens. This is registered with the event loop for
+* the interrupt fd of config.gpio_interrupt_pin and runs on the loop's thread
+* each time it becomes ready. If a valid interrupt is received from the IMU
+* then mark the timestamp, read in every packet waiting in the FIFO, and call
+* the user-defined interrupt function once for each of them, oldest first.
+* Each packet is published to the sample ring as well. Nothing here takes a
+* lock a reader could be holding, only the bus lock.
+*******************************************************************************/
+void __dmp_interrupt_handler(int fd, uint32_t events, void* user)
+{
+	rc_mpu_t* mpu = user;
+	rc_mpu_data_t* data;
+	int n, k, deliver, step;
+
+	if(__take_interrupt(mpu, fd, events)) return;
+	data = mpu->data_ptr;
+	// aquires bus, waiting for any other thread to finish with it
+	__lock_bus(mpu);
+	// read data, record if it was successful or not
+	n = __read_dmp_fifo(mpu);
+	mpu->last_read_successful = n>0;
+	if(n>0) __batch_timestamp(mpu, n);
+	// the magnetometer divider counts samples, there can be several per
+	// wakeup, or none when polling
+	step = n<0 ? 1 : n;
+	// through the I2C master the magnetometer came with the FIFO read
+	if(mpu->mag_master){
+		if(n>=0) __decode_mag(mpu, mpu->mag_raw, data);
+	}
+	// or the bus worker finished a read queued after an earlier batch
+	else if(__atomic_exchange_n(&mpu->mag_ready, 0, __ATOMIC_ACQUIRE)){
+		__decode_mag(mpu, mpu->mag_raw, data);
+	}
+	// if reading mag before callback, check divider and do it now
+	else if(mpu->config.enable_magnetometer && !mpu->config.read_mag_after_callback){
+		if(mpu->mag_div_step>=mpu->config.mag_sample_rate_div){
+			#ifdef DEBUG
+			printf("reading mag before callback\n");
+			#endif
+			rc_mpu_dev_read_mag(mpu, data);
+			// reset address back for next read
+			__set_address(mpu, mpu->config.i2c_addr);
+			mpu->mag_div_step=step;
+		}
+		else mpu->mag_div_step+=step;
+	}
+	// releases bus
+	__unlock_bus(mpu);
+	// call the user function if not the first run
+	deliver = !mpu->first_run;
+	mpu->first_run = 0;
+	// a callback may power the device off, nothing more is delivered then
+	for(k=0;k<n && !mpu->imu_shutdown_flag;k++){
+		__parse_dmp_packet(mpu, &mpu->fifo_buf[mpu->fifo_pkt[k]], data);
+		data->dmp_timestamp_ns = __sample_timestamp(mpu, k);
+		if(data->tap_detected) mpu->last_tap_timestamp_nanos = data->dmp_timestamp_ns;
+		if(!deliver) continue;
+		mpu_ring_push(mpu->ring, data->dmp_timestamp_ns, data);
+		if(mpu->dmp_batch_func!=NULL) mpu->dmp_batch[k] = *data;
+		if(mpu->dmp_callback_func!=NULL) mpu->dmp_callback_func(mpu, mpu->dmp_callback_user);
+		// additionally call tap callback if one was received
+		if(data->tap_detected){
+			if(mpu->tap_callback_func!=NULL){
+				mpu->tap_callback_func(mpu, data->last_tap_direction,
+					data->last_tap_count, mpu->tap_callback_user);
 			}
-			// aquires bus
-			rc_i2c_lock_bus(config.i2c_bus);
-			// aquires mutex
-			pthread_mutex_lock( &read_mutex );
-			pthread_mutex_lock( &tap_mutex );
-			// read data
-			ret = __read_dmp_fifo(data_ptr);
-			rc_i2c_unlock_bus(config.i2c_bus);
-			// record if it was successful or not
-			if(ret==0){
-				last_read_successful=1;
-				if(data_ptr->tap_detected){
-					last_tap_timestamp_nanos = last_interrupt_timestamp_nanos;
+			__atomic_fetch_add(&mpu->tap_futex, 1, __ATOMIC_RELEASE);
+			mpu_futex_wake(&mpu->tap_futex);
+		}
+	}
+	if(unlikely(mpu->imu_shutdown_flag)) return;
+	if(deliver && n>0){
+		if(mpu->dmp_batch_func!=NULL) mpu->dmp_batch_func(mpu, mpu->dmp_batch, n, mpu->dmp_batch_user);
+		__count_batch(mpu, n);
+		// signals that a measurement is available to blocking functions,
+		// neither of these waits on the readers
+		mpu_ring_wake(mpu->ring);
+		pthread_cond_broadcast(mpu->read_condition);
+		if(unlikely(mpu->imu_shutdown_flag)) return;
+	}
+
+	// if reading mag after interrupt, check divider and do it now
+	if(mpu->config.enable_magnetometer && !mpu->mag_master &&
+					mpu->config.read_mag_after_callback){
+		if(mpu->mag_div_step>=mpu->config.mag_sample_rate_div){
+			#ifdef DEBUG
+			printf("reading mag after ISR\n");
+			#endif
+			// on the built-in bus the bus worker can do the
+			// read while this thread goes back to waiting
+			if(mpu->tp==&i2c_transport){
+				if(__submit_mag_read(mpu)){
+					rc_error_report(ERR_SRC_MPU, ERR_LEVEL_ERROR, "in __dmp_interrupt_handler, failed to queue magnetometer read");
 				}
 			}
 			else{
-				last_read_successful=0;
-			}
-			// if reading mag before callback, check divider and do it now
-			if(config.enable_magnetometer && !config.read_mag_after_callback){
-				if(mag_div_step>=config.mag_sample_rate_div){
-					#ifdef DEBUG
-					printf("reading mag before callback\n");
-					#endif
-					rc_mpu_read_mag(data_ptr);
-					// reset address back for next read
-					rc_i2c_set_device_address(config.i2c_bus,config.i2c_addr);
-					mag_div_step=1;
-				}
-				else mag_div_step++;
-			}
-			// releases bus
-			rc_i2c_unlock_bus(config.i2c_bus);
-			// call the user function if not the first run
-			if(first_run == 1){
-				first_run = 0;
-			}
-			else if(last_read_successful){
-				if(dmp_callback_func!=NULL) dmp_callback_func();
-				// signals that a measurement is available to blocking function
-				pthread_cond_broadcast(&read_condition);
-				// additionally call tap callback if one was received
-				if(data_ptr->tap_detected){
-					if(tap_callback_func!=NULL) tap_callback_func(data_ptr->last_tap_direction, data_ptr->last_tap_count);
-					pthread_cond_broadcast(&tap_condition);
-				}
-			}
-
-			// releases mutex
-			pthread_mutex_unlock(&read_mutex);
-			pthread_mutex_unlock(&tap_mutex);
-
-			// if reading mag after interrupt, check divider and do it now
-			if(config.enable_magnetometer && config.read_mag_after_callback){
-				if(mag_div_step>=config.mag_sample_rate_div){
-					#ifdef DEBUG
-					printf("reading mag after ISR\n");
-					#endif
-					rc_i2c_lock_bus(config.i2c_bus);
-					rc_mpu_read_mag(data_ptr);
-					rc_i2c_unlock_bus(config.i2c_bus);
-					// reset address back for next read
-					rc_i2c_set_device_address(config.i2c_bus,config.i2c_addr);
-					mag_div_step=1;
-				}
-				else mag_div_step++;
+				__lock_bus(mpu);
+				rc_mpu_dev_read_mag(mpu, mpu->data_ptr);
+				__unlock_bus(mpu);
+				// reset address back for next read
+				__set_address(mpu, mpu->config.i2c_addr);
 			}
+			mpu->mag_div_step=step;
 		}
+		else mpu->mag_div_step+=step;
 	}
+}
+
+/*******************************************************************************
+* int rc_mpu_dev_set_dmp_callback(rc_mpu_t* mpu, rc_mpu_dmp_callback_t func, void* user)
+*
+* sets a user function to be called when new data is read, NULL removes it
+*******************************************************************************/
+int rc_mpu_dev_set_dmp_callback(rc_mpu_t* mpu, rc_mpu_dmp_callback_t func, void* user)
+{
+	mpu->dmp_callback_user = user;
+	mpu->dmp_callback_func = func;
+	return 0;
+}
+
+int rc_mpu_dev_set_tap_callback(rc_mpu_t* mpu, rc_mpu_tap_callback_t func, void* user)
+{
+	mpu->tap_callback_user = user;
+	mpu->tap_callback_func = func;
+	return 0;
+}
+
+int rc_mpu_dev_set_raw_callback(rc_mpu_t* mpu, rc_mpu_raw_callback_t func, void* user)
+{
+	mpu->raw_callback_user = user;
+	mpu->raw_callback_func = func;
+	return 0;
+}
 
-	// aquires mutex
-	pthread_mutex_lock( &read_mutex );
-	// /releases other threads
-	pthread_cond_broadcast( &read_condition );
-	// releases mutex
-	pthread_mutex_unlock( &read_mutex );
-	thread_running_flag = 0;
+int rc_mpu_dev_set_dmp_batch_callback(rc_mpu_t* mpu, rc_mpu_dmp_batch_callback_t func, void* user)
+{
+	mpu->dmp_batch_user = user;
+	mpu->dmp_batch_func = func;
 	return 0;
 }
 
 /*******************************************************************************
-* int rc_mpu_set_dmp_callback(void (*func)(void))
+* int64_t __clock_offset(clockid_t id)
 *
-* sets a user function to be called when new data is read
+* how far clock id is ahead of CLOCK_MONOTONIC, read between two readings of
+* CLOCK_MONOTONIC so being preempted in between costs at most half the gap
 *******************************************************************************/
-int rc_mpu_set_dmp_callback(void (*func)(void))
+static int64_t __clock_offset(clockid_t id)
 {
-	if(func==NULL){
-		fprintf(stderr,"ERROR: trying to assign NULL pointer to dmp_callback_func\n");
+	struct timespec t1, t2, ts;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	clock_gettime(id, &ts);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	return ((int64_t)ts.tv_sec*1000000000 + ts.tv_nsec) -
+		((int64_t)t1.tv_sec*1000000000 + t1.tv_nsec +
+		 (int64_t)t2.tv_sec*1000000000 + t2.tv_nsec)/2;
+}
+
+/*******************************************************************************
+* void __batch_timestamp(rc_mpu_t* mpu, int n)
+*
+* adds n samples just read from the FIFO to the sample clock model, the newest
+* being the one that raised the last interrupt, and notes how far the chosen
+* timestamp clock is from CLOCK_MONOTONIC for __sample_timestamp. The offset is
+* taken once per batch so samples in a batch keep the model's spacing.
+*******************************************************************************/
+static void __batch_timestamp(rc_mpu_t* mpu, int n)
+{
+	mpu_clock_batch(&mpu->clock, n, mpu->last_interrupt_ns, rc_nanos_since_boot());
+	switch(mpu->config.timestamp_clock){
+	case TIMESTAMP_MONOTONIC:
+		mpu->clock_offset = 0;
+		break;
+	case TIMESTAMP_MONOTONIC_RAW:
+		mpu->clock_offset = __clock_offset(CLOCK_MONOTONIC_RAW);
+		break;
+	default:
+		mpu->clock_offset = __clock_offset(CLOCK_REALTIME);
+		break;
+	}
+}
+
+/*******************************************************************************
+* uint64_t __sample_timestamp(rc_mpu_t* mpu, int k)
+*
+* timestamp of sample k of the batch given to __batch_timestamp, oldest first,
+* on the configured clock. Call for each sample in order. The offset to that
+* clock still wanders between batches, so a stamp that would come out no later
+* than the one before is put just after it.
+*******************************************************************************/
+static uint64_t __sample_timestamp(rc_mpu_t* mpu, int k)
+{
+	uint64_t t = mpu_clock_stamp(&mpu->clock, k) + mpu->clock_offset;
+	if(mpu->last_stamp_ns!=0 && t<=mpu->last_stamp_ns) t = mpu->last_stamp_ns + 1;
+	mpu->last_stamp_ns = t;
+	return t;
+}
+
+/*******************************************************************************
+* uint64_t __timestamp_now(rc_mpu_t* mpu)
+*
+* the current time on the configured timestamp clock
+*******************************************************************************/
+static uint64_t __timestamp_now(rc_mpu_t* mpu)
+{
+	struct timespec ts;
+	switch(mpu->config.timestamp_clock){
+	case TIMESTAMP_MONOTONIC:
+		return rc_nanos_since_boot();
+	case TIMESTAMP_MONOTONIC_RAW:
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+	default:
+		return rc_nanos_since_epoch();
+	}
+}
+
+/*******************************************************************************
+* int __read_raw_fifo(rc_mpu_t* mpu)
+*
+* Reads every complete sample out of the FIFO in one burst, decodes them into
+* raw_samples and timestamps them with __batch_timestamp. Returns the number
+* of samples or -1 on error.
+*******************************************************************************/
+static int __read_raw_fifo(rc_mpu_t* mpu)
+{
+	uint8_t count_raw[2];
+	int count, n, i, len, overflow, gyro_off;
+	const uint8_t* p;
+	rc_mpu_raw_sample_t* smp;
+	int16_t raw_accel[3*RC_MPU_RAW_MAX_SAMPLES], raw_gyro[3*RC_MPU_RAW_MAX_SAMPLES];
+	float accel[3*RC_MPU_RAW_MAX_SAMPLES], gyro[3*RC_MPU_RAW_MAX_SAMPLES];
+	const float as[3] = {mpu->data_ptr->accel_to_ms2, mpu->data_ptr->accel_to_ms2, mpu->data_ptr->accel_to_ms2};
+	const float gs[3] = {mpu->data_ptr->gyro_to_degs, mpu->data_ptr->gyro_to_degs, mpu->data_ptr->gyro_to_degs};
+
+	len = mpu->raw_pkt_len;
+	// samples aren't marked in any way, so read the count first and only
+	// ever take whole samples to stay aligned
+	if(__read_bytes(mpu, FIFO_COUNTH, 2, count_raw)<0){
+		rc_error_report(ERR_SRC_MPU, ERR_LEVEL_ERROR, "in __read_raw_fifo, failed to read FIFO count, errno %d", errno);
 		return -1;
 	}
-	dmp_callback_func = func;
-	return 0;
+	count = ((uint16_t)count_raw[0]<<8) | count_raw[1];
+	overflow = count > MPU_FIFO_SIZE-len;
+	n = count/len;
+	if(n>RC_MPU_RAW_MAX_SAMPLES) n = RC_MPU_RAW_MAX_SAMPLES;
+	if(n==0) return 0;
+	if(__burst_read(mpu, FIFO_R_W, n*len, mpu->fifo_buf)<0){
+		rc_error_report(ERR_SRC_MPU, ERR_LEVEL_ERROR, "in __read_raw_fifo, failed to read %d bytes from FIFO, errno %d", n*len, errno);
+		// can't tell how much was consumed, start over
+		__mpu_reset_raw_fifo(mpu);
+		mpu_clock_restart(&mpu->clock);
+		return -1;
+	}
+	__batch_timestamp(mpu, n);
+
+	// decode the whole burst at once, then scatter into the samples
+	gyro_off = mpu->config.raw_fifo_temp ? 8 : 6;
+	mpu_decode_be16x3(mpu->fifo_buf, len, n, raw_accel, accel, as);
+	mpu_decode_be16x3(mpu->fifo_buf+gyro_off, len, n, raw_gyro, gyro, gs);
+	for(i=0;i<n;i++){
+		p = &mpu->fifo_buf[i*len];
+		smp = &mpu->raw_samples[i];
+		smp->timestamp_ns = __sample_timestamp(mpu, i);
+		memcpy(smp->raw_accel, &raw_accel[3*i], sizeof(smp->raw_accel));
+		memcpy(smp->accel, &accel[3*i], sizeof(smp->accel));
+		memcpy(smp->raw_gyro, &raw_gyro[3*i], sizeof(smp->raw_gyro));
+		memcpy(smp->gyro, &gyro[3*i], sizeof(smp->gyro));
+		if(mpu->config.raw_fifo_temp) smp->temp = __decode_temp(p+6);
+		else smp->temp = 0.0f;
+		// slave 0 data follows the gyro, data_ptr keeps the last good
+		// value for the samples between magnetometer measurements
+		if(mpu->config.raw_fifo_mag){
+			__decode_mag(mpu, p+gyro_off+6, mpu->data_ptr);
+			memcpy(smp->mag, mpu->data_ptr->mag, sizeof(smp->mag));
+		}
+	}
+
+	// the FIFO filled up and later samples were dropped
+	if(overflow){
+		if(mpu->config.show_warnings){
+			rc_error_report(ERR_SRC_MPU, ERR_LEVEL_WARNING, "raw FIFO overflowed, samples lost");
+		}
+		__mpu_reset_raw_fifo(mpu);
+		mpu_clock_restart(&mpu->clock);
+	}
+	return n;
 }
 
-int rc_mpu_set_tap_callback(void (*func)(int dir, int cnt))
+/*******************************************************************************
+* void __raw_interrupt_handler(int fd, uint32_t events, void* user)
+*
+* raw FIFO mode version of __dmp_interrupt_handler. Drains the FIFO, publishes
+* every sample to the ring, leaves the newest in the user's data struct and
+* hands the whole batch to the raw callback.
+*******************************************************************************/
+void __raw_interrupt_handler(int fd, uint32_t events, void* user)
 {
-	if(func==NULL){
-		fprintf(stderr,"ERROR: trying to assign NULL pointer to tap_callback_func\n");
+	rc_mpu_t* mpu = user;
+	rc_mpu_raw_sample_t* smp;
+	int i, n;
+
+	if(__take_interrupt(mpu, fd, events)) return;
+	__lock_bus(mpu);
+	n = __read_raw_fifo(mpu);
+	__unlock_bus(mpu);
+	mpu->last_read_successful = n>0;
+	if(n>0){
+		// each sample goes through data_ptr on its way to the ring, which
+		// leaves the newest there
+		for(i=0;i<n;i++){
+			smp = &mpu->raw_samples[i];
+			memcpy(mpu->data_ptr->accel, smp->accel, sizeof(smp->accel));
+			memcpy(mpu->data_ptr->gyro, smp->gyro, sizeof(smp->gyro));
+			memcpy(mpu->data_ptr->raw_accel, smp->raw_accel, sizeof(smp->raw_accel));
+			memcpy(mpu->data_ptr->raw_gyro, smp->raw_gyro, sizeof(smp->raw_gyro));
+			if(mpu->config.raw_fifo_temp) mpu->data_ptr->temp = smp->temp;
+			if(mpu->config.raw_fifo_mag) memcpy(mpu->data_ptr->mag, smp->mag, sizeof(smp->mag));
+			mpu_ring_push(mpu->ring, smp->timestamp_ns, mpu->data_ptr);
+		}
+		__deliver_raw(mpu, n);
+	}
+}
+
+/*******************************************************************************
+* void __deliver_raw(rc_mpu_t* mpu, int n)
+*
+* hands the n samples in raw_samples, already published to the ring, to the
+* raw callback and wakes everyone waiting for data
+*******************************************************************************/
+static void __deliver_raw(rc_mpu_t* mpu, int n)
+{
+	if(mpu->raw_callback_func!=NULL){
+		mpu->raw_callback_func(mpu, mpu->raw_samples, n, mpu->raw_callback_user);
+		// powered off from the callback
+		if(unlikely(mpu->imu_shutdown_flag)) return;
+	}
+	__count_batch(mpu, n);
+	// signals that a measurement is available to blocking functions,
+	// neither of these waits on the readers
+	mpu_ring_wake(mpu->ring);
+	pthread_cond_broadcast(mpu->read_condition);
+}
+
+/*******************************************************************************
+* int __read_drdy_sample(rc_mpu_t* mpu, uint64_t missed)
+*
+* Data-ready mode counterpart of __read_raw_fifo. Reads the sample that raised
+* the last edge straight from the sensor registers into data_ptr and
+* raw_samples[0]. missed is the number of edges __take_interrupt found missing.
+* Returns 1, or -1 on error.
+*******************************************************************************/
+static int __read_drdy_sample(rc_mpu_t* mpu, uint64_t missed)
+{
+	uint8_t raw[FIFO_LEN_RAW_TEMP+FIFO_LEN_MAG];
+	rc_mpu_data_t* data = mpu->data_ptr;
+	rc_mpu_raw_sample_t* smp = &mpu->raw_samples[0];
+	uint64_t lost;
+
+	if(__read_bytes(mpu, ACCEL_XOUT_H, mpu->raw_pkt_len, raw)<0){
+		rc_error_report(ERR_SRC_MPU, ERR_LEVEL_ERROR, "in __read_drdy_sample, failed to read sensor registers, errno %d", errno);
 		return -1;
 	}
-	tap_callback_func = func;
-	return 0;
+	// the pin pulses for every sample, so a sample is only lost when its
+	// edge is. Most transports number the edges and __take_interrupt counted
+	// those missed, otherwise the time since the last edge has to do.
+	lost = missed;
+	if(mpu->last_seqno==0){
+		lost = mpu_clock_gap(&mpu->clock, mpu->last_interrupt_ns);
+		__atomic_fetch_add(&mpu->missed_interrupts, lost, __ATOMIC_RELAXED);
+	}
+	if(lost>0) mpu_clock_skip(&mpu->clock, lost);
+	__batch_timestamp(mpu, 1);
+
+	__decode_accel(&raw[0], data);
+	data->temp = __decode_temp(&raw[6]);
+	__decode_gyro(&raw[8], data);
+	if(mpu->mag_master) __decode_mag(mpu, &raw[14], data);
+	smp->timestamp_ns = __sample_timestamp(mpu, 0);
+	memcpy(smp->accel, data->accel, sizeof(smp->accel));
+	memcpy(smp->gyro, data->gyro, sizeof(smp->gyro));
+	memcpy(smp->raw_accel, data->raw_accel, sizeof(smp->raw_accel));
+	memcpy(smp->raw_gyro, data->raw_gyro, sizeof(smp->raw_gyro));
+	if(mpu->mag_master) memcpy(smp->mag, data->mag, sizeof(smp->mag));
+	smp->temp = data->temp;
+	return 1;
+}
+
+/*******************************************************************************
+* void __drdy_interrupt_handler(int fd, uint32_t events, void* user)
+*
+* data-ready mode version of __raw_interrupt_handler, one sample per edge
+*******************************************************************************/
+void __drdy_interrupt_handler(int fd, uint32_t events, void* user)
+{
+	rc_mpu_t* mpu = user;
+	uint64_t missed = mpu->missed_interrupts;
+	int n;
+
+	if(__take_interrupt(mpu, fd, events)) return;
+	missed = mpu->missed_interrupts - missed;
+	__lock_bus(mpu);
+	n = __read_drdy_sample(mpu, missed);
+	__unlock_bus(mpu);
+	mpu->last_read_successful = n>0;
+	if(n>0){
+		mpu_ring_push(mpu->ring, mpu->raw_samples[0].timestamp_ns, mpu->data_ptr);
+		__deliver_raw(mpu, n);
+	}
 }
 
 
 /*******************************************************************************
-* int __read_dmp_fifo(rc_mpu_data_t* data)
+* int __quat_valid(const uint8_t* p)
+*
+* We can detect a corrupted or misaligned FIFO by checking that the quaternion
+* at the start of a packet has a magnitude of one. This shouldn't happen in
+* normal operation, but bytes can be lost to bus errors or an overflowing
+* FIFO. The quaternion is scaled down to Q14 first to keep the math small.
+*******************************************************************************/
+static int __quat_valid(const uint8_t* p)
+{
+	int32_t quat[4];
+	int64_t q14, mag_sq = 0;
+	int k;
+	mpu_decode_be32(p, 4, quat);
+	for(k=0;k<4;k++){
+		q14 = quat[k] >> 16;
+		mag_sq += q14*q14;
+	}
+	return mag_sq>=QUAT_MAG_SQ_MIN && mag_sq<=QUAT_MAG_SQ_MAX;
+}
+
+/*******************************************************************************
+* int __read_dmp_fifo(rc_mpu_t* mpu)
 *
-* Reads the FIFO buffer and populates the data struct. Here is where we see
+* Reads everything in the FIFO buffer and finds the packets in it, their
+* offsets in fifo_buf go in fifo_pkt oldest first. Here is where we see
 * bad/empty/double packets due to i2c bus errors and the IMU failing to have
-* data ready in time. enabling warnings in the config struct will let this
-* function print out warnings when these conditions are detected. If write
-* errors are detected then this function tries some i2c transfers a second time.
+* data ready in time. Packets aren't marked, so a packet only counts if its
+* quaternion is normalized. After bytes were lost the parser slides forward a
+* byte at a time until that holds again, and for the next packet too if it's
+* already here, rather than resetting the FIFO and losing what is queued. A
+* packet the DMP is still writing is kept for the next read. Enabling warnings
+* in the config struct will let this function print out warnings when these
+* conditions are detected. Returns the number of packets or -1 on error. With
+* mag_i2c_master the magnetometer's EXT_SENS_DATA copy is read into mag_raw in
+* the same first transaction.
+*
+* Every byte read from FIFO_R_W is gone from the FIFO, so only as many are
+* read as a count showed were there. The first packet only comes with the
+* count when the last count already showed it, otherwise bytes arriving
+* between the two could be popped and not told apart from reading past the
+* end of the FIFO.
 *******************************************************************************/
-int __read_dmp_fifo(rc_mpu_data_t* data)
+static int __read_dmp_fifo(rc_mpu_t* mpu)
 {
-	unsigned char raw[MAX_FIFO_BUFFER];
-	int32_t quat_q14[4], quat[4], quat_mag_sq;
-	uint16_t fifo_count;
-	int ret;
-	int i = 0; // position of beginning of quaternion
-	int j = 0; // position of beginning of accel/gyro data
-	static int first_run = 1; // set to 0 after first call
-	double q_tmp[4];
-	double sum,qlen;
+	uint8_t count_raw[2], reg_count, reg_fifo, reg_mag;
+	uint8_t* buf = mpu->fifo_buf;
+	rc_i2c_seg_t segs[6];
+	int fifo_count, want, first, len, off, skipped, n, pl, ret, nsegs;
 
-	if(!dmp_en){
-		printf("only use mpu_read_fifo in dmp mode\n");
+	if(!mpu->dmp_en){
+		rc_error_report(ERR_SRC_MPU, ERR_LEVEL_ERROR, "only use mpu_read_fifo in dmp mode");
 		return -1;
 	}
 
 	// if the fifo packet_len variable not set up yet, this function must
 	// have been called prematurely
-	if(packet_len!=FIFO_LEN_QUAT_ACCEL_GYRO_TAP && packet_len!=FIFO_LEN_QUAT_TAP){
-		fprintf(stderr,"ERROR: packet_len is set incorrectly for read_dmp_fifo\n");
+	pl = mpu->packet_len;
+	if(pl!=FIFO_LEN_QUAT_ACCEL_GYRO_TAP && pl!=FIFO_LEN_QUAT_TAP){
+		rc_error_report(ERR_SRC_MPU, ERR_LEVEL_ERROR, "packet_len is set incorrectly for read_dmp_fifo");
 		return -1;
 	}
 
 	// make sure the i2c address is set correctly.
 	// this shouldn't take any time at all if already set
-	rc_i2c_set_device_address(config.i2c_bus, config.i2c_addr);
-	int is_new_dmp_data = 0;
-
-	// check fifo count register to make sure new data is there
-	if(rc_i2c_read_word(config.i2c_bus, FIFO_COUNTH, &fifo_count)<0){
-		if(config.show_warnings){
-			printf("fifo_count i2c error: %s\n",strerror(errno));
+	__set_address(mpu, mpu->config.i2c_addr);
+
+	// the start of a packet left over from last time goes in front
+	len = mpu->fifo_carry_len;
+	memcpy(buf, mpu->fifo_carry, len);
+	mpu->fifo_carry_len = 0;
+
+	// check fifo count register to make sure new data is there, taking the
+	// first packet in the same transaction if it is known to be waiting
+	first = mpu->fifo_ahead>=pl ? pl : 0;
+	mpu->fifo_ahead = 0;
+	reg_count = FIFO_COUNTH;
+	reg_fifo = FIFO_R_W;
+	__set_write_seg(mpu, &segs[0], &reg_count, 1);
+	__set_read_seg(mpu, &segs[1], count_raw, 2);
+	nsegs = 2;
+	if(first){
+		__set_write_seg(mpu, &segs[nsegs++], &reg_fifo, 1);
+		__set_read_seg(mpu, &segs[nsegs++], &buf[len], first);
+	}
+	if(mpu->mag_master){
+		reg_mag = EXT_SENS_DATA_00;
+		__set_write_seg(mpu, &segs[nsegs++], &reg_mag, 1);
+		__set_read_seg(mpu, &segs[nsegs++], mpu->mag_raw, FIFO_LEN_MAG);
+	}
+	if(__transfer(mpu, segs, nsegs)<0){
+		if(mpu->config.show_warnings){
+			rc_error_report(ERR_SRC_MPU, ERR_LEVEL_WARNING, "fifo_count i2c error, errno %d", errno);
 		}
+		// a packet may have been taken, the parser finds its way back in
+		if(first) mpu_clock_restart(&mpu->clock);
 		return -1;
 	}
+	fifo_count = ((uint16_t)count_raw[0]<<8) | count_raw[1];
 	#ifdef DEBUG
 	printf("fifo_count: %d\n", fifo_count);
 	#endif
 
-	/***********************************************************************
-	* Check how many packets are in the fifo buffer
-	***********************************************************************/
-
-	// if empty FIFO, just return, nothing else to do
+	// if empty FIFO, just return, nothing else to do. Polling finds it empty
+	// every so often.
 	if(fifo_count==0){
-		if(config.show_warnings && first_run!=1){
-			printf("WARNING: empty fifo\n");
+		if(mpu->config.show_warnings && mpu->fifo_first_run!=1 && !mpu->config.fifo_poll){
+			rc_error_report(ERR_SRC_MPU, ERR_LEVEL_WARNING, "empty fifo");
 		}
-		return -1;
-	}
-	// one packet, perfect!
-	else if(fifo_count==packet_len){
-		i = 0; // set quaternion offset to 0
+		mpu->fifo_carry_len = len;
+		memcpy(mpu->fifo_carry, buf, len);
+		return 0;
 	}
-	// if exactly 2 or 3 packets are there we just missed some (whoops)
-	// read both in and set the offset i to one packet length
-	// the last packet data will be read normally
-	else if(fifo_count==2*packet_len){
-		if(config.show_warnings&& first_run!=1){
-			printf("warning: imu fifo contains two packets\n");
+	if(fifo_count>=MPU_FIFO_SIZE){
+		if(mpu->config.show_warnings){
+			rc_error_report(ERR_SRC_MPU, ERR_LEVEL_WARNING, "imu fifo overflowed, packets lost");
 		}
-		i=packet_len;
+		mpu_clock_restart(&mpu->clock);
 	}
-	else if(fifo_count==3*packet_len){
-		if(config.show_warnings&& first_run!=1){
-			printf("warning: imu fifo contains three packets\n");
+	// the count was taken before the first packet was read, so includes it
+	len += first;
+
+	/***********************************************************************
+	* read in the rest of the fifo, the first packet may already be here
+	***********************************************************************/
+	want = fifo_count-first;
+	if(want>FIFO_BUF_SIZE-len) want = FIFO_BUF_SIZE-len;
+	if(want>0){
+		ret = __burst_read(mpu, FIFO_R_W, want, &buf[len]);
+		if(ret<0){
+			// if the read returned -1 there was an error, try again
+			ret = __burst_read(mpu, FIFO_R_W, want, &buf[len]);
+		}
+		if(ret<0){
+			if(mpu->config.show_warnings){
+				rc_error_report(ERR_SRC_MPU, ERR_LEVEL_ERROR, "failed to read %d bytes from fifo buffer register", want);
+			}
+			// the stream is broken here, the parser finds its way back in
+		}
+		else{
+			len += want;
+			// what didn't fit is still there for next time
+			mpu->fifo_ahead = fifo_count-first-want;
 		}
-		i=2*packet_len;
 	}
-	else if(fifo_count==4*packet_len){
-		if(config.show_warnings&& first_run!=1){
-			printf("warning: imu fifo contains four packets\n");
+
+	/***********************************************************************
+	* find the packets
+	***********************************************************************/
+	n = 0;
+	off = 0;
+	skipped = 0;
+	while(len-off>=pl && n<DMP_MAX_PACKETS){
+		if(__quat_valid(&buf[off]) && (skipped==0 || len-off<2*pl || __quat_valid(&buf[off+pl]))){
+			mpu->fifo_pkt[n++] = off;
+			off += pl;
 		}
-		i=2*packet_len;
-	}
-	else if(fifo_count==5*packet_len){
-		if(config.show_warnings&& first_run!=1){
-			printf("warning: imu fifo contains five packets\n");
+		else{
+			off++;
+			skipped++;
 		}
-		i=2*packet_len;
 	}
-	// finally, if we got a weird packet length, reset the fifo
-	else{
-		if(config.show_warnings && first_run!=1){
-			printf("warning: %d bytes in FIFO, expected %d\n", fifo_count,packet_len);
-		}
-		__mpu_reset_fifo();
-		return -1;
+	// bytes went missing, and maybe whole packets with them
+	if(skipped) mpu_clock_restart(&mpu->clock);
+	// keep a partial packet for next time
+	if(len-off<pl){
+		mpu->fifo_carry_len = len-off;
+		memcpy(mpu->fifo_carry, &buf[off], len-off);
 	}
 
-	/***********************************************************************
-	* read in the fifo
-	******************\\\**************************************************/
-	memset(raw,0,MAX_FIFO_BUFFER);
-	// read it in!
-	ret = rc_i2c_read_bytes(config.i2c_bus, FIFO_R_W, fifo_count, &raw[0]);
-	if(ret<0){
-		// if i2c_read returned -1 there was an error, try again
-		ret = rc_i2c_read_bytes(config.i2c_bus, FIFO_R_W, fifo_count, &raw[0]);
-	}
-	if(ret!=fifo_count){
-		if(config.show_warnings){
-			fprintf(stderr,"ERROR: failed to read fifo buffer register\n");
-			printf("read %d bytes, expected %d\n", ret, packet_len);
+	if(mpu->config.show_warnings && mpu->fifo_first_run!=1){
+		if(skipped){
+			rc_error_report(ERR_SRC_MPU, ERR_LEVEL_WARNING, "skipped %d bytes to find the next packet, fifo_count: %d", skipped, fifo_count);
+		}
+		if(n>1){
+			rc_error_report(ERR_SRC_MPU, ERR_LEVEL_WARNING, "imu fifo contains %d packets", n);
 		}
-		return -1;
 	}
 
+	// if we finally got dmp data, turn off the first run flag
+	if(n>0) mpu->fifo_first_run=0;
+	return n;
+}
+
+/*******************************************************************************
+* void __parse_dmp_packet(rc_mpu_t* mpu, const uint8_t* p, rc_mpu_data_t* data)
+*
+* Fills in the data struct from one packet found by __read_dmp_fifo.
+*******************************************************************************/
+static void __parse_dmp_packet(rc_mpu_t* mpu, const uint8_t* p, rc_mpu_data_t* data)
+{
+	int32_t quat[4];
+	int i = 0; // position in the packet
+	int j;
+	double q_tmp[4];
+	double sum,qlen;
+	unsigned char tap;
 
 	// now we can read the quaternion which is always first
-	// parse the quaternion data from the buffer
-	quat[0] = ((int32_t)raw[i+0] << 24) | ((int32_t)raw[i+1] << 16) |
-		((int32_t)raw[i+2] << 8) | raw[i+3];
-	quat[1] = ((int32_t)raw[i+4] << 24) | ((int32_t)raw[i+5] << 16) |
-		((int32_t)raw[i+6] << 8) | raw[i+7];
-	quat[2] = ((int32_t)raw[i+8] << 24) | ((int32_t)raw[i+9] << 16) |
-		((int32_t)raw[i+10] << 8) | raw[i+11];
-	quat[3] = ((int32_t)raw[i+12] << 24) | ((int32_t)raw[i+13] << 16) |
-		((int32_t)raw[i+14] << 8) | raw[i+15];
-
-	// increment poisition in buffer after 16 bits of quaternion
+	mpu_decode_be32(p, 4, quat);
 	i+=16;
 
-	// check the quaternion size, make sure it's correct
-	quat_q14[0] = quat[0] >> 16;
-	quat_q14[1] = quat[1] >> 16;
-	quat_q14[2] = quat[2] >> 16;
-	quat_q14[3] = quat[3] >> 16;
-	quat_mag_sq = quat_q14[0] * quat_q14[0] + quat_q14[1] * quat_q14[1] + \
-		quat_q14[2] * quat_q14[2] + quat_q14[3] * quat_q14[3];
-	if ((quat_mag_sq < QUAT_MAG_SQ_MIN)||(quat_mag_sq > QUAT_MAG_SQ_MAX)){
-		if(config.show_warnings){
-			printf("warning: Quaternion out of bounds, fifo_count: %d\n", fifo_count);
-		}
-		__mpu_reset_fifo();
-		return -1;
-	}
-
 	// do double-precision quaternion normalization since the numbers
 	// in raw format are huge
 	for(j=0;j<4;j++) q_tmp[j]=(double)quat[j];
@@ -2065,103 +3866,33 @@ int __read_dmp_fifo(rc_mpu_data_t* data)
 
 	// fill in tait-bryan angles to the data struct
 	rc_quaternion_to_tb_array(data->dmp_quat, data->dmp_TaitBryan);
-	is_new_dmp_data=1;
 
-
-	if(packet_len==FIFO_LEN_QUAT_ACCEL_GYRO_TAP){
-		// Read Accel values and load into imu_data struct
-		// Turn the MSB and LSB into a signed 16-bit value
-		data->raw_accel[0] = (int16_t)(((uint16_t)raw[i+0]<<8)|raw[i+1]);
-		data->raw_accel[1] = (int16_t)(((uint16_t)raw[i+2]<<8)|raw[i+3]);
-		data->raw_accel[2] = (int16_t)(((uint16_t)raw[i+4]<<8)|raw[i+5]);
+	if(mpu->packet_len==FIFO_LEN_QUAT_ACCEL_GYRO_TAP){
+		// Read accel and gyro values and load into imu_data struct
+		__decode_accel(&p[i], data);
 		i+=6;
-		// Fill in real unit values
-		data->accel[0] = data->raw_accel[0] * data->accel_to_ms2;
-		data->accel[1] = data->raw_accel[1] * data->accel_to_ms2;
-		data->accel[2] = data->raw_accel[2] * data->accel_to_ms2;
-
-
-		// Read gyro values and load into imu_data struct
-		// Turn the MSB and LSB into a signed 16-bit value
-
-		data->raw_gyro[0] = (int16_t)(((int16_t)raw[0+i]<<8)|raw[1+i]);
-		data->raw_gyro[1] = (int16_t)(((int16_t)raw[2+i]<<8)|raw[3+i]);
-		data->raw_gyro[2] = (int16_t)(((int16_t)raw[4+i]<<8)|raw[5+i]);
+		__decode_gyro(&p[i], data);
 		i+=6;
-		// Fill in real unit values
-		data->gyro[0] = data->raw_gyro[0] * data->gyro_to_degs;
-		data->gyro[1] = data->raw_gyro[1] * data->gyro_to_degs;
-		data->gyro[2] = data->raw_gyro[2] * data->gyro_to_degs;
 	}
 
-	// TODO read in tap data
-	unsigned char tap;
 	//android_orient = gesture[3] & 0xC0;
-	tap = 0x3F & raw[i+3];
+	tap = 0x3F & p[i+3];
 
-	if(raw[i+1] & INT_SRC_TAP){
-		unsigned char direction, count;
-		direction = tap >> 3;
-		count = (tap % 8) + 1;
-		data_ptr->last_tap_direction = direction;
-		data_ptr->last_tap_count = count;
-		data_ptr->tap_detected=1;
+	if(p[i+1] & INT_SRC_TAP){
+		data->last_tap_direction = tap >> 3;
+		data->last_tap_count = (tap % 8) + 1;
+		data->tap_detected=1;
 	}
-	else data_ptr->tap_detected=0;
+	else data->tap_detected=0;
 
 	// run data_fusion to filter yaw with compass
-	if(is_new_dmp_data && config.enable_magnetometer){
+	if(mpu->config.enable_magnetometer){
 		#ifdef DEBUG
 		printf("running data_fusion\n");
 		#endif
-		__data_fusion(data);
+		__data_fusion(mpu, data);
 	}
-
-	// if we finally got dmp data, turn off the first run flag
-	if(is_new_dmp_data) first_run=0;
-
-	// finally, our return value is based on the presence of DMP data only
-	// even if new magnetometer data was read, the expected timing must come
-	// from the DMP samples only
-	if(is_new_dmp_data) return 0;
-	else return -1;
-}
-
-
-// /*******************************************************************************
-// * We can detect a corrupted FIFO by monitoring the quaternion data and
-// * ensuring that the magnitude is always normalized to one. This
-// * shouldn't happen in normal operation, but if an I2C error occurs,
-// * the FIFO reads might become misaligned.
-// *
-// * Let's start by scaling down the quaternion data to avoid long long
-// * math.
-// *******************************************************************************/
-// int __check_quaternion_validity(unsigned char* raw, int i)
-// {
-// 	long quat_q14[4], quat[4], quat_mag_sq;
-// 	// parse the quaternion data from the buffer
-// 	quat[0] = ((long)raw[i+0] << 24) | ((long)raw[i+1] << 16) |
-// 		((long)raw[i+2] << 8) | raw[i+3];
-// 	quat[1] = ((long)raw[i+4] << 24) | ((long)raw[i+5] << 16) |
-// 		((long)raw[i+6] << 8) | raw[i+7];
-// 	quat[2] = ((long)raw[i+8] << 24) | ((long)raw[i+9] << 16) |
-// 		((long)raw[i+10] << 8) | raw[i+11];
-// 	quat[3] = ((long)raw[i+12] << 24) | ((long)raw[i+13] << 16) |
-// 		((long)raw[i+14] << 8) | raw[i+15];
-
-
-// 	quat_q14[0] = quat[0] >> 16;
-// 	quat_q14[1] = quat[1] >> 16;
-// 	quat_q14[2] = quat[2] >> 16;
-// 	quat_q14[3] = quat[3] >> 16;
-// 	quat_mag_sq = quat_q14[0] * quat_q14[0] + quat_q14[1] * quat_q14[1] +
-// 		quat_q14[2] * quat_q14[2] + quat_q14[3] * quat_q14[3];
-// 	if ((quat_mag_sq < QUAT_MAG_SQ_MIN) ||(quat_mag_sq > QUAT_MAG_SQ_MAX)){
-// 		return 0;
-// 	}
-// 	return 1;
-// }
+}
 
 /*******************************************************************************
 * int __data_fusion(rc_mpu_data_t* data)
@@ -2174,15 +3905,11 @@ int __read_dmp_fifo(rc_mpu_data_t* data)
 * with the sample rate so the filter rise time remains constant with different
 * sample rates.
 *******************************************************************************/
-int __data_fusion(rc_mpu_data_t* data)
+int __data_fusion(rc_mpu_t* mpu, rc_mpu_data_t* data)
 {
 	float tilt_tb[3], tilt_q[4], mag_vec[3];
-	static float newMagYaw = 0;
-	static float newDMPYaw = 0;
+	float newMagYaw, newDMPYaw;
 	float lastDMPYaw, lastMagYaw, newYaw;
-	static int dmp_spin_counter = 0;
-	static int mag_spin_counter = 0;
-	static int first_run = 1; // set to 0 after first call to this function
 
 
 	// start by filling in the roll/pitch components of the fused euler
@@ -2199,7 +3926,7 @@ int __data_fusion(rc_mpu_data_t* data)
 	// in IMU body coordinate frame. Since the DMP quaternion is aligned with
 	// a particular orientation, we must be careful to orient the magnetometer
 	// data to match.
-	switch(config.orient){
+	switch(mpu->config.orient){
 	case ORIENTATION_Z_UP:
 		mag_vec[0] = data->mag[TB_PITCH_X];
 		mag_vec[1] = data->mag[TB_ROLL_Y];
@@ -2241,7 +3968,7 @@ int __data_fusion(rc_mpu_data_t* data)
 		mag_vec[2] = data->mag[TB_YAW_Z];
 		break;
 	default:
-		fprintf(stderr,"ERROR: invalid orientation\n");
+		rc_error_report(ERR_SRC_MPU, ERR_LEVEL_ERROR, "invalid orientation");
 		return -1;
 	}
 	// tilt that vector by the roll/pitch of the IMU to align magnetic field
@@ -2249,7 +3976,7 @@ int __data_fusion(rc_mpu_data_t* data)
 	rc_quaternion_rotate_vector_array(mag_vec,tilt_q);
 	// from the aligned magnetic field vector, find a yaw heading
 	// check for validity and make sure the heading is positive
-	lastMagYaw = newMagYaw; // save from last loop
+	lastMagYaw = mpu->mag_yaw; // save from last loop
 	newMagYaw = -atan2(mag_vec[1], mag_vec[0]);
 	if (newMagYaw != newMagYaw) {
 		#ifdef WARNINGS
@@ -2259,38 +3986,40 @@ int __data_fusion(rc_mpu_data_t* data)
 	}
 	data->compass_heading_raw = newMagYaw;
 	// save DMP last from time and record newDMPYaw for this time
-	lastDMPYaw = newDMPYaw;
+	lastDMPYaw = mpu->dmp_yaw;
 	newDMPYaw = data->dmp_TaitBryan[TB_YAW_Z];
+	mpu->mag_yaw = newMagYaw;
+	mpu->dmp_yaw = newDMPYaw;
 
 	// the outputs from atan2 and dmp are between -PI and PI.
 	// for our filters to run smoothly, we can't have them jump between -PI
 	// to PI when doing a complete spin. Therefore we check for a skip and
 	// increment or decrement the spin counter
-	if(newMagYaw-lastMagYaw < -PI) mag_spin_counter++;
-	else if (newMagYaw-lastMagYaw > PI) mag_spin_counter--;
-	if(newDMPYaw-lastDMPYaw < -PI) dmp_spin_counter++;
-	else if (newDMPYaw-lastDMPYaw > PI) dmp_spin_counter--;
+	if(newMagYaw-lastMagYaw < -PI) mpu->mag_spin_counter++;
+	else if (newMagYaw-lastMagYaw > PI) mpu->mag_spin_counter--;
+	if(newDMPYaw-lastDMPYaw < -PI) mpu->dmp_spin_counter++;
+	else if (newDMPYaw-lastDMPYaw > PI) mpu->dmp_spin_counter--;
 
 	// if this is the first run, set up filters
-	if(first_run){
+	if(mpu->fusion_first_run){
 		lastMagYaw = newMagYaw;
 		lastDMPYaw = newDMPYaw;
-		mag_spin_counter = 0;
-		dmp_spin_counter = 0;
+		mpu->mag_spin_counter = 0;
+		mpu->dmp_spin_counter = 0;
 		// generate complementary filters
-		float dt = 1.0/config.dmp_sample_rate;
-		rc_filter_first_order_lowpass(&low_pass,dt,config.compass_time_constant);
-		rc_filter_first_order_highpass(&high_pass,dt,config.compass_time_constant);
-		rc_filter_prefill_inputs(&low_pass,newMagYaw);
-		rc_filter_prefill_outputs(&low_pass,newMagYaw);
-		rc_filter_prefill_inputs(&high_pass,newDMPYaw);
-		rc_filter_prefill_outputs(&high_pass,0);
-		first_run = 0;
+		float dt = 1.0/mpu->config.dmp_sample_rate;
+		rc_filter_first_order_lowpass(&mpu->low_pass,dt,mpu->config.compass_time_constant);
+		rc_filter_first_order_highpass(&mpu->high_pass,dt,mpu->config.compass_time_constant);
+		rc_filter_prefill_inputs(&mpu->low_pass,newMagYaw);
+		rc_filter_prefill_outputs(&mpu->low_pass,newMagYaw);
+		rc_filter_prefill_inputs(&mpu->high_pass,newDMPYaw);
+		rc_filter_prefill_outputs(&mpu->high_pass,0);
+		mpu->fusion_first_run = 0;
 	}
 
 	// new Yaw is the sum of low and high pass complementary filters.
-	newYaw = rc_filter_march(&low_pass,newMagYaw+(TWO_PI*mag_spin_counter)) \
-			+ rc_filter_march(&high_pass,newDMPYaw+(TWO_PI*dmp_spin_counter));
+	newYaw = rc_filter_march(&mpu->low_pass,newMagYaw+(TWO_PI*mpu->mag_spin_counter)) \
+			+ rc_filter_march(&mpu->high_pass,newDMPYaw+(TWO_PI*mpu->dmp_spin_counter));
 
 	newYaw = fmod(newYaw,TWO_PI); // remove the effect of the spins
 	if (newYaw > PI) newYaw -= TWO_PI; // bound between +- PI
@@ -2309,19 +4038,59 @@ int __data_fusion(rc_mpu_data_t* data)
 }
 
 /*******************************************************************************
-* int write_gyro_offsets_to_disk(int16_t offsets[3])
+* int __cal_file_path(rc_mpu_t* mpu, const char* file, char* path, size_t len)
+*
+* Builds the path of a calibration file for this handle. default_mpu and any
+* handle on the cape's own IMU bus and address through the built-in I2C driver
+* keep the original file names, other I2C devices get their own file prefixed
+* with their bus and address and SPI devices with their spidev bus and chip
+* select, so one device's calibration never overwrites another's. Any other
+* transport, such as the emulator or an SPI stand-in, has no physical device to
+* key on and gets no file. Returns 0 on success or -1 if there is no file.
+*******************************************************************************/
+int __cal_file_path(rc_mpu_t* mpu, const char* file, char* path, size_t len)
+{
+	const rc_mpu_spi_t* spi;
+
+	if(mpu==&default_mpu){
+		snprintf(path, len, "%s%s", CONFIG_DIRECTORY, file);
+		return 0;
+	}
+	if(mpu->config.transport==&rc_mpu_spi_transport){
+		spi = mpu->config.transport_ctx;
+		if(spi==NULL || spi->xfer!=NULL) return -1;
+		snprintf(path, len, "%sspi%d.%d_%s", CONFIG_DIRECTORY, \
+			spi->bus, spi->slave, file);
+		return 0;
+	}
+	if(mpu->config.transport!=NULL) return -1;
+	if(mpu->config.i2c_bus==RC_IMU_BUS && \
+				mpu->config.i2c_addr==RC_MPU_DEFAULT_I2C_ADDR){
+		snprintf(path, len, "%s%s", CONFIG_DIRECTORY, file);
+	}
+	else{
+		snprintf(path, len, "%sbus%d_0x%02x_%s", CONFIG_DIRECTORY, \
+			mpu->config.i2c_bus, mpu->config.i2c_addr, file);
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int write_gyro_offsets_to_disk(rc_mpu_t* mpu, int16_t offsets[3])
 *
 * Reads steady state gyro offsets from the disk and puts them in the IMU's
 * gyro offset register. If no calibration file exists then make a new one.
 *******************************************************************************/
-int write_gyro_offets_to_disk(int16_t offsets[3])
+int write_gyro_offets_to_disk(rc_mpu_t* mpu, int16_t offsets[3])
 {
 	FILE *cal;
 	char file_path[100];
 
 	// construct a new file path string and open for writing
-	strcpy(file_path, CONFIG_DIRECTORY);
-	strcat(file_path, GYRO_CAL_FILE);
+	if(__cal_file_path(mpu, GYRO_CAL_FILE, file_path, sizeof(file_path))){
+		fprintf(stderr,"ERROR: no calibration file for this transport\n");
+		return -1;
+	}
 	cal = fopen(file_path, "w+");
 	// if opening for writing failed, the directory may not exist yet
 	if (cal == 0) {
@@ -2348,19 +4117,21 @@ int write_gyro_offets_to_disk(int16_t offsets[3])
 * Loads steady state gyro offsets from the disk and puts them in the IMU's
 * gyro offset register. If no calibration file exists then make a new one.
 *******************************************************************************/
-int __load_gyro_calibration()
+int __load_gyro_calibration(rc_mpu_t* mpu)
 {
 	FILE *cal;
 	char file_path[100];
 	uint8_t data[6];
 	int x,y,z;
 
-	// construct a new file path string and open for reading
-	strcpy (file_path, CONFIG_DIRECTORY);
-	strcat (file_path, GYRO_CAL_FILE);
-	cal = fopen(file_path, "r");
-
-	if(cal==NULL){
+	// construct a new file path string and open for reading, transports
+	// without a calibration file just run uncalibrated
+	if(__cal_file_path(mpu, GYRO_CAL_FILE, file_path, sizeof(file_path))){
+		x = 0;
+		y = 0;
+		z = 0;
+	}
+	else if((cal = fopen(file_path, "r"))==NULL){
 		// calibration file doesn't exist yet
 		fprintf(stderr,"WARNING: no gyro calibration data found\n");
 		fprintf(stderr,"Please run rc_mpu_calibrate_gyro\n\n");
@@ -2398,7 +4169,7 @@ int __load_gyro_calibration()
 	data[5] = (-z/4)       & 0xFF;
 
 	// Push gyro biases to hardware registers
-	if(rc_i2c_write_bytes(config.i2c_bus, XG_OFFSET_H, 6, &data[0])){
+	if(__write_bytes(mpu, XG_OFFSET_H, 6, &data[0])){
 		fprintf(stderr,"ERROR: failed to load gyro offsets into IMU register\n");
 		return -1;
 	}
@@ -2411,106 +4182,115 @@ int __load_gyro_calibration()
 * Initializes the IMU and samples the gyro for a short period to get steady
 * state gyro offsets. These offsets are then saved to disk for later use.
 *******************************************************************************/
-int rc_mpu_calibrate_gyro_routine(rc_mpu_config_t conf)
+int rc_mpu_dev_calibrate_gyro_routine(rc_mpu_t* mpu, rc_mpu_config_t conf)
 {
 	uint8_t c, data[6];
 	int32_t gyro_sum[3] = {0, 0, 0};
 	int16_t offsets[3];
 	int was_last_steady = 1;
+	char file_path[100];
 
-	if(geteuid()!=0){
+	if(conf.transport==NULL && geteuid()!=0){
 		fprintf(stderr,"rc_mpu_calibrate_gyro_routine must be run with root privileges\n");
 		return -1;
 	}
 
 	// wipe global config with defaults to avoid problems
-	config = rc_mpu_default_config();
+	mpu->config = rc_mpu_default_config();
 	// configure with user's i2c bus info
-	config.i2c_bus = conf.i2c_bus;
-	config.i2c_addr = conf.i2c_addr;
+	mpu->config.i2c_bus = conf.i2c_bus;
+	mpu->config.i2c_addr = conf.i2c_addr;
+	mpu->config.transport = conf.transport;
+	mpu->config.transport_ctx = conf.transport_ctx;
+	if(__cal_file_path(mpu, GYRO_CAL_FILE, file_path, sizeof(file_path))){
+		fprintf(stderr,"ERROR: rc_mpu_calibrate_gyro_routine needs the built-in I2C driver or rc_mpu_spi_transport\n");
+		return -1;
+	}
 
 	// make sure the bus is not currently in use by another thread
 	// do not proceed to prevent interfering with that process
-	if(rc_i2c_get_lock(config.i2c_bus)){
+	if(mpu->config.transport==NULL && rc_i2c_get_lock(mpu->config.i2c_bus)){
 		fprintf(stderr,"i2c bus claimed by another process\n");
 		fprintf(stderr,"aborting gyro calibration()\n");
 		return -1;
 	}
 
 	// if it is not claimed, start the i2c bus
-	if(rc_i2c_init(config.i2c_bus, config.i2c_addr)){
-		fprintf(stderr,"rc_mpu_initialize_dmp failed at rc_i2c_init\n");
+	if(__transport_init(mpu)){
+		fprintf(stderr,"rc_mpu_calibrate_gyro_routine failed to initialize the bus\n");
 		return -1;
 	}
 
-	// claiming the bus does no guarantee other code will not interfere
-	// with this process, but best to claim it so other code can check
-	// like we did above
-	rc_i2c_lock_bus(config.i2c_bus);
+	// hold the bus for the whole sequence so other threads using the
+	// bus wait rather than interleave transactions with ours
+	__lock_bus(mpu);
 
 	// reset device, reset all registers
-	if(__reset_mpu()<0){
+	if(__reset_mpu(mpu)<0){
 		fprintf(stderr,"ERROR: failed to reset MPU9250\n");
+		__unlock_bus(mpu);
 		return -1;
 	}
 
 	// set up the IMU specifically for calibration.
-	rc_i2c_write_byte(config.i2c_bus, PWR_MGMT_1, 0x01);
-	rc_i2c_write_byte(config.i2c_bus, PWR_MGMT_2, 0x00);
+	__write_byte(mpu, PWR_MGMT_1, 0x01);
+	__write_byte(mpu, PWR_MGMT_2, 0x00);
 	rc_usleep(200000);
 
 	// // set bias registers to 0
 	// // Push gyro biases to hardware registers
 	// uint8_t zeros[] = {0,0,0,0,0,0};
-	// if(rc_i2c_write_bytes(config.i2c_bus, XG_OFFSET_H, 6, zeros)){
+	// if(__write_bytes(XG_OFFSET_H, 6, zeros)){
 		// fprintf(stderr,"ERROR: failed to load gyro offsets into IMU register\n");
 		// return -1;
 	// }
 
-	rc_i2c_write_byte(config.i2c_bus, INT_ENABLE, 0x00);  // Disable all interrupts
-	rc_i2c_write_byte(config.i2c_bus, FIFO_EN, 0x00);     // Disable FIFO
-	rc_i2c_write_byte(config.i2c_bus, PWR_MGMT_1, 0x00);  // Turn on internal clock source
-	rc_i2c_write_byte(config.i2c_bus, I2C_MST_CTRL, 0x00);// Disable I2C master
-	rc_i2c_write_byte(config.i2c_bus, USER_CTRL, 0x00);   // Disable FIFO and I2C master
-	rc_i2c_write_byte(config.i2c_bus, USER_CTRL, 0x0C);   // Reset FIFO and DMP
+	__write_byte(mpu, INT_ENABLE, 0x00);  // Disable all interrupts
+	__write_byte(mpu, FIFO_EN, 0x00);     // Disable FIFO
+	__write_byte(mpu, PWR_MGMT_1, 0x00);  // Turn on internal clock source
+	__write_byte(mpu, I2C_MST_CTRL, 0x00);// Disable I2C master
+	__write_byte(mpu, USER_CTRL, 0x00);   // Disable FIFO and I2C master
+	__write_byte(mpu, USER_CTRL, 0x0C);   // Reset FIFO and DMP
 	rc_usleep(15000);
 
 	// Configure MPU9250 gyro and accelerometer for bias calculation
-	rc_i2c_write_byte(config.i2c_bus, CONFIG, 0x01);      // Set low-pass filter to 188 Hz
-	rc_i2c_write_byte(config.i2c_bus, SMPLRT_DIV, 0x04);  // Set sample rate to 200hz
+	__write_byte(mpu, CONFIG, 0x01);      // Set low-pass filter to 188 Hz
+	__write_byte(mpu, SMPLRT_DIV, 0x04);  // Set sample rate to 200hz
 	// Set gyro full-scale to 250 degrees per second, maximum sensitivity
-	rc_i2c_write_byte(config.i2c_bus, GYRO_CONFIG, 0x00);
+	__write_byte(mpu, GYRO_CONFIG, 0x00);
 	// Set accelerometer full-scale to 2 g, maximum sensitivity
-	rc_i2c_write_byte(config.i2c_bus, ACCEL_CONFIG, 0x00);
+	__write_byte(mpu, ACCEL_CONFIG, 0x00);
 
 COLLECT_DATA:
 
 	// if(imu_shutdown_flag){
-	// 	rc_i2c_unlock_bus(config.i2c_bus);
+	// 	__unlock_bus();
 	// 	return -1;
 	// }
 
 	// Configure FIFO to capture gyro data for bias calculation
-	rc_i2c_write_byte(config.i2c_bus, USER_CTRL, 0x40);   // Enable FIFO
+	__write_byte(mpu, USER_CTRL, 0x40);   // Enable FIFO
 	// Enable gyro sensors for FIFO (max size 512 bytes in MPU-9250)
 	c = FIFO_GYRO_X_EN|FIFO_GYRO_Y_EN|FIFO_GYRO_Z_EN;
-	rc_i2c_write_byte(config.i2c_bus, FIFO_EN, c);
+	__write_byte(mpu, FIFO_EN, c);
 	// 6 bytes per sample. 200hz. wait 0.4 seconds
 	rc_usleep(400000);
 
 	// At end of sample accumulation, turn off FIFO sensor read
-	rc_i2c_write_byte(config.i2c_bus, FIFO_EN, 0x00);
+	__write_byte(mpu, FIFO_EN, 0x00);
 	// read FIFO sample count and log number of samples
-	rc_i2c_read_bytes(config.i2c_bus, FIFO_COUNTH, 2, &data[0]);
+	__read_bytes(mpu, FIFO_COUNTH, 2, &data[0]);
 	int16_t fifo_count = ((uint16_t)data[0] << 8) | data[1];
 	int samples = fifo_count/6;
+	if(samples>CAL_MAX_SAMPLES) samples = CAL_MAX_SAMPLES;
 
 	#ifdef DEBUG
 	printf("calibration samples: %d\n", samples);
 	#endif
 
 	int i;
-	int16_t x,y,z;
+	uint8_t fifo[CAL_MAX_SAMPLES*6];
+	int16_t raw[CAL_MAX_SAMPLES*3];
 	rc_vector_t vx = rc_vector_empty();
 	rc_vector_t vy = rc_vector_empty();
 	rc_vector_t vz = rc_vector_empty();
@@ -2521,21 +4301,23 @@ COLLECT_DATA:
 	gyro_sum[0] = 0;
 	gyro_sum[1] = 0;
 	gyro_sum[2] = 0;
+	// read every sample in one burst and decode them together
+	if(samples>0 && __burst_read(mpu, FIFO_R_W, samples*6, fifo)<0){
+		fprintf(stderr,"ERROR: failed to read FIFO\n");
+		rc_vector_free(&vx);
+		rc_vector_free(&vy);
+		rc_vector_free(&vz);
+		__unlock_bus(mpu);
+		return -1;
+	}
+	mpu_decode_be16x3(fifo, 6, samples, raw, NULL, NULL);
 	for (i=0; i<samples; i++) {
-		// read data for averaging
-		if(rc_i2c_read_bytes(config.i2c_bus, FIFO_R_W, 6, data)<0){
-			fprintf(stderr,"ERROR: failed to read FIFO\n");
-			return -1;
-		}
-		x = (int16_t)(((int16_t)data[0] << 8) | data[1]) ;
-		y = (int16_t)(((int16_t)data[2] << 8) | data[3]) ;
-		z = (int16_t)(((int16_t)data[4] << 8) | data[5]) ;
-		gyro_sum[0]  += (int32_t) x;
-		gyro_sum[1]  += (int32_t) y;
-		gyro_sum[2]  += (int32_t) z;
-		vx.d[i] = (float)x;
-		vy.d[i] = (float)y;
-		vz.d[i] = (float)z;
+		gyro_sum[0]  += (int32_t) raw[i*3];
+		gyro_sum[1]  += (int32_t) raw[i*3+1];
+		gyro_sum[2]  += (int32_t) raw[i*3+2];
+		vx.d[i] = (float)raw[i*3];
+		vy.d[i] = (float)raw[i*3+1];
+		vz.d[i] = (float)raw[i*3+2];
 	}
 	dev_x = rc_vector_std_dev(vx);
 	dev_y = rc_vector_std_dev(vy);
@@ -2575,12 +4357,12 @@ COLLECT_DATA:
 		goto COLLECT_DATA;
 	}
 	// done with I2C for now
-	rc_i2c_unlock_bus(config.i2c_bus);
+	__unlock_bus(mpu);
 	#ifdef DEBUG
 	printf("offsets: %d %d %d\n", offsets[0], offsets[1], offsets[2]);
 	#endif
 	// write to disk
-	if(write_gyro_offets_to_disk(offsets)<0){
+	if(write_gyro_offets_to_disk(mpu, offsets)<0){
 		fprintf(stderr,"ERROR in rc_mpu_calibrate_gyro_routine, failed to write to disk\n");
 		return -1;
 	}
@@ -2697,33 +4479,121 @@ void print_orientation_info()
 * how long it has been since that interrupt was received they may use this
 * function.
 *******************************************************************************/
-int64_t rc_mpu_nanos_since_last_dmp_interrupt()
+int64_t rc_mpu_dev_nanos_since_last_dmp_interrupt(rc_mpu_t* mpu)
 {
-	if(last_interrupt_timestamp_nanos==0) return -1;
-	return rc_nanos_since_epoch() - last_interrupt_timestamp_nanos;
+	if(mpu->last_interrupt_ns==0) return -1;
+	return rc_nanos_since_boot() - mpu->last_interrupt_ns;
 }
 
-int64_t rc_mpu_nanos_since_last_tap()
+uint64_t rc_mpu_dev_missed_dmp_interrupts(rc_mpu_t* mpu)
+{
+	return __atomic_load_n(&mpu->missed_interrupts, __ATOMIC_RELAXED);
+}
+
+int rc_mpu_dev_get_stats(rc_mpu_t* mpu, rc_mpu_stats_t* stats)
+{
+	uint64_t period_ps;
+	if(unlikely(stats==NULL)){
+		fprintf(stderr,"ERROR: in rc_mpu_get_stats, received NULL pointer\n");
+		return -1;
+	}
+	stats->wakeups = __atomic_load_n(&mpu->stats.wakeups, __ATOMIC_RELAXED);
+	stats->samples = __atomic_load_n(&mpu->stats.samples, __ATOMIC_RELAXED);
+	stats->max_batch = __atomic_load_n(&mpu->stats.max_batch, __ATOMIC_RELAXED);
+	period_ps = __atomic_load_n(&mpu->clock.period_ps, __ATOMIC_RELAXED);
+	stats->sample_rate_hz = period_ps ? 1e12/period_ps : 0.0;
+	stats->arrival_jitter_ns = __atomic_load_n(&mpu->clock.jitter_ns, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*******************************************************************************
+* sample ring readers
+*
+* Thin checks around mpu_ring.c. The ring is allocated by the first
+* interrupt-driven init and then kept, so readers are safe across power off.
+*******************************************************************************/
+int rc_mpu_dev_ring_pop(rc_mpu_t* mpu, uint64_t* cursor, rc_mpu_record_t* rec)
+{
+	if(unlikely(cursor==NULL || rec==NULL)){
+		fprintf(stderr,"ERROR: in rc_mpu_ring_pop, received NULL pointer\n");
+		return -1;
+	}
+	if(unlikely(mpu->ring==NULL)){
+		fprintf(stderr,"ERROR: in rc_mpu_ring_pop, no interrupt-driven mode started yet\n");
+		return -1;
+	}
+	return mpu_ring_read(mpu->ring, cursor, rec, 1) ? 0 : 1;
+}
+
+int rc_mpu_dev_ring_read(rc_mpu_t* mpu, uint64_t* cursor, rc_mpu_record_t* recs, int max)
+{
+	if(unlikely(cursor==NULL || recs==NULL || max<0)){
+		fprintf(stderr,"ERROR: in rc_mpu_ring_read, invalid arguments\n");
+		return -1;
+	}
+	if(unlikely(mpu->ring==NULL)){
+		fprintf(stderr,"ERROR: in rc_mpu_ring_read, no interrupt-driven mode started yet\n");
+		return -1;
+	}
+	return mpu_ring_read(mpu->ring, cursor, recs, max);
+}
+
+int rc_mpu_dev_ring_latest(rc_mpu_t* mpu, rc_mpu_record_t* rec)
+{
+	if(unlikely(rec==NULL)){
+		fprintf(stderr,"ERROR: in rc_mpu_ring_latest, received NULL pointer\n");
+		return -1;
+	}
+	if(unlikely(mpu->ring==NULL)){
+		fprintf(stderr,"ERROR: in rc_mpu_ring_latest, no interrupt-driven mode started yet\n");
+		return -1;
+	}
+	return mpu_ring_latest(mpu->ring, rec);
+}
+
+int rc_mpu_dev_ring_wait(rc_mpu_t* mpu, uint64_t cursor, int timeout_ms)
+{
+	uint64_t deadline = 0, now;
+	int ms = timeout_ms;
+	if(unlikely(mpu->ring==NULL)){
+		fprintf(stderr,"ERROR: in rc_mpu_ring_wait, no interrupt-driven mode started yet\n");
+		return -1;
+	}
+	if(timeout_ms>=0) deadline = rc_nanos_since_boot() + (uint64_t)timeout_ms*1000000;
+	// woken once per batch, which may not be far enough yet
+	while(mpu_ring_wait(mpu->ring, cursor, ms)){
+		if(__atomic_load_n(&mpu->ring->closed, __ATOMIC_ACQUIRE)) return 1;
+		if(timeout_ms<0) continue;
+		now = rc_nanos_since_boot();
+		if(now>=deadline) return 1;
+		ms = (deadline-now+999999)/1000000;
+	}
+	return 0;
+}
+
+int64_t rc_mpu_dev_nanos_since_last_tap(rc_mpu_t* mpu)
 {
-	if(last_tap_timestamp_nanos==0) return -1;
-	return rc_nanos_since_epoch() - last_tap_timestamp_nanos;
+	if(mpu->last_tap_timestamp_nanos==0) return -1;
+	return __timestamp_now(mpu) - mpu->last_tap_timestamp_nanos;
 }
 
 /*******************************************************************************
-* int __write_mag_cal_to_disk(float offsets[3], float scale[3])
+* int __write_mag_cal_to_disk(rc_mpu_t* mpu, float offsets[3], float scale[3])
 *
 * Reads steady state gyro offsets from the disk and puts them in the IMU's
 * gyro offset register. If no calibration file exists then make a new one.
 *******************************************************************************/
-int __write_mag_cal_to_disk(float offsets[3], float scale[3])
+int __write_mag_cal_to_disk(rc_mpu_t* mpu, float offsets[3], float scale[3])
 {
 	FILE *cal;
 	char file_path[100];
 	int ret;
 
 	// construct a new file path string and open for writing
-	strcpy(file_path, CONFIG_DIRECTORY);
-	strcat(file_path, MAG_CAL_FILE);
+	if(__cal_file_path(mpu, MAG_CAL_FILE, file_path, sizeof(file_path))){
+		fprintf(stderr,"ERROR: no calibration file for this transport\n");
+		return -1;
+	}
 	cal = fopen(file_path, "w+");
 	// if opening for writing failed, the directory may not exist yet
 	if (cal == 0) {
@@ -2759,27 +4629,30 @@ int __write_mag_cal_to_disk(float offsets[3], float scale[3])
 * Loads steady state magnetometer offsets and scale from the disk into global
 * variables for correction later by read_magnetometer and FIFO read functions
 *******************************************************************************/
-int __load_mag_calibration()
+int __load_mag_calibration(rc_mpu_t* mpu)
 {
 	FILE *cal;
 	char file_path[100];
 	float x,y,z,sx,sy,sz;
 
-	// construct a new file path string and open for reading
-	strcpy (file_path, CONFIG_DIRECTORY);
-	strcat (file_path, MAG_CAL_FILE);
-	cal = fopen(file_path, "r");
-
+	// construct a new file path string and open for reading, transports
+	// without a calibration file just run uncalibrated
+	cal = NULL;
+	if(__cal_file_path(mpu, MAG_CAL_FILE, file_path, sizeof(file_path))==0){
+		cal = fopen(file_path, "r");
+		if(cal==NULL){
+			// calibration file doesn't exist yet
+			fprintf(stderr,"WARNING: no magnetometer calibration data found\n");
+			fprintf(stderr,"Please run rc_mpu_calibrate_mag\n\n");
+		}
+	}
 	if(cal==NULL) {
-		// calibration file doesn't exist yet
-		fprintf(stderr,"WARNING: no magnetometer calibration data found\n");
-		fprintf(stderr,"Please run rc_mpu_calibrate_mag\n\n");
-		mag_offsets[0]=0.0;
-		mag_offsets[1]=0.0;
-		mag_offsets[2]=0.0;
-		mag_scales[0]=1.0;
-		mag_scales[1]=1.0;
-		mag_scales[2]=1.0;
+		mpu->mag_offsets[0]=0.0;
+		mpu->mag_offsets[1]=0.0;
+		mpu->mag_offsets[2]=0.0;
+		mpu->mag_scales[0]=1.0;
+		mpu->mag_scales[1]=1.0;
+		mpu->mag_scales[2]=1.0;
 		return 0;
 	}
 	else{ // read in data
@@ -2801,12 +4674,12 @@ int __load_mag_calibration()
 	#endif
 
 	// write to global variables fo use by rc_mpu_read_mag
-	mag_offsets[0]=x;
-	mag_offsets[1]=y;
-	mag_offsets[2]=z;
-	mag_scales[0]=sx;
-	mag_scales[1]=sy;
-	mag_scales[2]=sz;
+	mpu->mag_offsets[0]=x;
+	mpu->mag_offsets[1]=y;
+	mpu->mag_offsets[2]=z;
+	mpu->mag_scales[0]=sx;
+	mpu->mag_scales[1]=sy;
+	mpu->mag_scales[2]=sz;
 
 	fclose(cal);
 	return 0;
@@ -2821,7 +4694,7 @@ int __load_mag_calibration()
 * applied to correct the uncalibrated magnetometer data to map calibrated
 * field vectors to a sphere.
 *******************************************************************************/
-int rc_mpu_calibrate_mag_routine(rc_mpu_config_t conf)
+int rc_mpu_dev_calibrate_mag_routine(rc_mpu_t* mpu, rc_mpu_config_t conf)
 {
 	const int samples = 200;
 	const int sample_time_us = 12000000; // 12 seconds ()
@@ -2830,8 +4703,9 @@ int rc_mpu_calibrate_mag_routine(rc_mpu_config_t conf)
 
 	int i;
 	float new_scale[3];
+	char file_path[100];
 
-	if(geteuid()!=0){
+	if(conf.transport==NULL && geteuid()!=0){
 		fprintf(stderr,"rc_mpu_calibrate_mag_routine must be run with root privileges\n");
 		return -1;
 	}
@@ -2841,63 +4715,71 @@ int rc_mpu_calibrate_mag_routine(rc_mpu_config_t conf)
 	rc_vector_t lengths = rc_vector_empty();
 	rc_mpu_data_t imu_data; // to collect magnetometer data
 	// wipe it with defaults to avoid problems
-	config = rc_mpu_default_config();
+	mpu->config = rc_mpu_default_config();
 	// configure with user's i2c bus info
-	config.enable_magnetometer = 1;
-	config.i2c_bus = conf.i2c_bus;
-	config.i2c_addr = conf.i2c_addr;
+	mpu->config.enable_magnetometer = 1;
+	mpu->config.mag_i2c_master = conf.mag_i2c_master;
+	mpu->config.i2c_bus = conf.i2c_bus;
+	mpu->config.i2c_addr = conf.i2c_addr;
+	mpu->config.transport = conf.transport;
+	mpu->config.transport_ctx = conf.transport_ctx;
+	if(__cal_file_path(mpu, MAG_CAL_FILE, file_path, sizeof(file_path))){
+		fprintf(stderr,"ERROR: rc_mpu_calibrate_mag_routine needs the built-in I2C driver or rc_mpu_spi_transport\n");
+		return -1;
+	}
 
 	// make sure the bus is not currently in use by another thread
 	// do not proceed to prevent interfering with that process
-	if(rc_i2c_get_lock(config.i2c_bus)){
+	if(mpu->config.transport==NULL && rc_i2c_get_lock(mpu->config.i2c_bus)){
 		fprintf(stderr,"i2c bus claimed by another process\n");
 		fprintf(stderr,"aborting magnetometer calibration()\n");
 		return -1;
 	}
 
 	// if it is not claimed, start the i2c bus
-	if(rc_i2c_init(config.i2c_bus, config.i2c_addr)){
-		fprintf(stderr,"ERROR rc_mpu_calibrate_mag_routine failed at rc_i2c_init\n");
+	if(__transport_init(mpu)){
+		fprintf(stderr,"ERROR rc_mpu_calibrate_mag_routine failed to initialize the bus\n");
 		return -1;
 	}
 
-	// claiming the bus does no guarantee other code will not interfere
-	// with this process, but best to claim it so other code can check
-	// like we did above
-	rc_i2c_lock_bus(config.i2c_bus);
+	// hold the bus for the whole sequence so other threads using the
+	// bus wait rather than interleave transactions with ours
+	__lock_bus(mpu);
 
 	// reset device, reset all registers
-	if(__reset_mpu()<0){
+	if(__reset_mpu(mpu)<0){
 		fprintf(stderr,"ERROR: failed to reset MPU9250\n");
+		__unlock_bus(mpu);
 		return -1;
 	}
 	//check the who am i register to make sure the chip is alive
-	if(__check_who_am_i()){
-		rc_i2c_unlock_bus(config.i2c_bus);
+	if(__check_who_am_i(mpu)){
+		__unlock_bus(mpu);
 		return -1;
 	}
-	if(__init_magnetometer(1)){
+	if(__init_magnetometer(mpu, 1)){
 		fprintf(stderr,"ERROR: failed to initialize_magnetometer\n");
-		rc_i2c_unlock_bus(config.i2c_bus);
+		__unlock_bus(mpu);
 		return -1;
 	}
 
 	// set local calibration to initial values and prepare variables
-	mag_offsets[0] = 0.0;
-	mag_offsets[1] = 0.0;
-	mag_offsets[2] = 0.0;
-	mag_scales[0]  = 1.0;
-	mag_scales[1]  = 1.0;
-	mag_scales[2]  = 1.0;
+	mpu->mag_offsets[0] = 0.0;
+	mpu->mag_offsets[1] = 0.0;
+	mpu->mag_offsets[2] = 0.0;
+	mpu->mag_scales[0]  = 1.0;
+	mpu->mag_scales[1]  = 1.0;
+	mpu->mag_scales[2]  = 1.0;
 	if(rc_matrix_alloc(&A,samples,3)){
 		fprintf(stderr,"ERROR: in rc_mpu_calibrate_mag_routine, failed to alloc data matrix\n");
+		__unlock_bus(mpu);
 		return -1;
 	}
 
 	// sample data
 	i = 0;
 	while(i<samples){
-		if(rc_mpu_read_mag(&imu_data)<0){
+		if(rc_mpu_dev_read_mag(mpu, &imu_data)<0){
 			fprintf(stderr,"ERROR: failed to read magnetometer\n");
 			break;
 		}
@@ -2924,8 +4806,8 @@ int rc_mpu_calibrate_mag_routine(rc_mpu_config_t conf)
 		rc_usleep(loop_wait_us);
 	}
 	// done with I2C for now
-	rc_mpu_power_off();
-	rc_i2c_unlock_bus(config.i2c_bus);
+	rc_mpu_dev_power_off(mpu);
+	__unlock_bus(mpu);
 
 	printf("\n\nOkay Stop!\n");
 	printf("Calculating calibration constants.....\n");
@@ -2976,7 +4858,7 @@ int rc_mpu_calibrate_mag_routine(rc_mpu_config_t conf)
 							new_scale[1],\
 							new_scale[2]);
 	// write to disk
-	if(__write_mag_cal_to_disk(center.d,new_scale)<0){
+	if(__write_mag_cal_to_disk(mpu, center.d,new_scale)<0){
 		rc_vector_free(&center);
 		rc_vector_free(&lengths);
 		return -1;
@@ -2987,73 +4869,289 @@ int rc_mpu_calibrate_mag_routine(rc_mpu_config_t conf)
 }
 
 /*******************************************************************************
-* int rc_mpu_is_gyro_calibrated()
+* int rc_mpu_dev_is_gyro_calibrated(rc_mpu_t* mpu)
 *
-* return 1 is a gyro calibration file exists, otherwise 0
+* return 1 is a gyro calibration file exists for this handle, otherwise 0
 *******************************************************************************/
-int rc_mpu_is_gyro_calibrated()
+int rc_mpu_dev_is_gyro_calibrated(rc_mpu_t* mpu)
 {
 	char file_path[100];
-	strcpy (file_path, CONFIG_DIRECTORY);
-	strcat (file_path, GYRO_CAL_FILE);
+	if(__cal_file_path(mpu, GYRO_CAL_FILE, file_path, sizeof(file_path))) return 0;
 	if(!access(file_path, F_OK)) return 1;
 	else return 0;
 }
 
 /*******************************************************************************
-* int rc_mpu_is_mag_calibrated()
+* int rc_mpu_dev_is_mag_calibrated(rc_mpu_t* mpu)
 *
-* return 1 is a magnetometer calibration file exists, otherwise 0
+* return 1 is a magnetometer calibration file exists for this handle, otherwise 0
 *******************************************************************************/
-int rc_mpu_is_mag_calibrated()
+int rc_mpu_dev_is_mag_calibrated(rc_mpu_t* mpu)
 {
 	char file_path[100];
-	strcpy (file_path, CONFIG_DIRECTORY);
-	strcat (file_path, MAG_CAL_FILE);
+	if(__cal_file_path(mpu, MAG_CAL_FILE, file_path, sizeof(file_path))) return 0;
 	if(!access(file_path, F_OK)) return 1;
 	else return 0;
 }
 
+int rc_mpu_is_gyro_calibrated()
+{
+	return rc_mpu_dev_is_gyro_calibrated(&default_mpu);
+}
+
+int rc_mpu_is_mag_calibrated()
+{
+	return rc_mpu_dev_is_mag_calibrated(&default_mpu);
+}
+
 
-int rc_mpu_block_until_dmp_data()
+int rc_mpu_dev_block_until_dmp_data(rc_mpu_t* mpu)
 {
-	if(imu_shutdown_flag!=0){
+	uint64_t cursor;
+	if(mpu->imu_shutdown_flag!=0){
 		fprintf(stderr,"ERROR: call to rc_mpu_block_until_dmp_data after shutting down mpu\n");
 		return -1;
 	}
-	if(!thread_running_flag){
+	if(!mpu->thread_running_flag){
 		fprintf(stderr,"ERROR: call to rc_mpu_block_until_dmp_data when DMP handler not running\n");
 		return -1;
 	}
-	// wait for condition signal which unlocks mutex
-	pthread_mutex_lock(&read_mutex);
-	pthread_cond_wait(&read_condition, &read_mutex);
-	pthread_mutex_unlock(&read_mutex);
-	// check if condition was broadcast due to shutdown
-	if(imu_shutdown_flag) return 1;
-	// otherwise return 0 on actual button press
+	// wait for the record after the newest one, the ring is woken once per
+	// batch and closed at shutdown
+	cursor = __atomic_load_n(&mpu->ring->head, __ATOMIC_ACQUIRE) + 1;
+	while(mpu_ring_wait(mpu->ring, cursor, -1)){
+		if(mpu->imu_shutdown_flag) return 1;
+	}
+	// check if woken due to shutdown
+	if(mpu->imu_shutdown_flag) return 1;
 	return 0;
 }
 
-int rc_mpu_block_until_tap()
+int rc_mpu_dev_block_until_tap(rc_mpu_t* mpu)
 {
-	if(imu_shutdown_flag!=0){
+	uint32_t val;
+	if(mpu->imu_shutdown_flag!=0){
 		fprintf(stderr,"ERROR: call to rc_mpu_block_until_tap after shutting down mpu\n");
 		return -1;
 	}
-	if(!thread_running_flag){
+	if(!mpu->thread_running_flag){
 		fprintf(stderr,"ERROR: call to rc_mpu_block_until_tap when DMP handler not running\n");
 		return -1;
 	}
-	// wait for condition signal which unlocks mutex
-	pthread_mutex_lock(&tap_mutex);
-	pthread_cond_wait(&tap_condition, &tap_mutex);
-	pthread_mutex_unlock(&tap_mutex);
-	// check if condition was broadcast due to shutdown
-	if(imu_shutdown_flag) return 1;
+	// wait for the tap counter to move, power off sets the flag and then
+	// moves it too
+	val = __atomic_load_n(&mpu->tap_futex, __ATOMIC_ACQUIRE);
+	if(mpu->imu_shutdown_flag) return 1;
+	while(__atomic_load_n(&mpu->tap_futex, __ATOMIC_ACQUIRE)==val){
+		mpu_futex_wait(&mpu->tap_futex, val, -1);
+	}
+	// check if woken due to shutdown
+	if(mpu->imu_shutdown_flag) return 1;
 	// otherwise return 0 on actual button press
 	return 0;
 }
 
 
+/*******************************************************************************
+* rc_mpu_t* rc_mpu_dev_create()
+*
+* Allocates a handle in the same state default_mpu starts out in, with its own
+* read mutex and condition instead of the exported globals.
+*******************************************************************************/
+rc_mpu_t* rc_mpu_dev_create(void)
+{
+	rc_mpu_t* mpu = calloc(1, sizeof(rc_mpu_t));
+	if(mpu==NULL){
+		fprintf(stderr,"ERROR: in rc_mpu_dev_create, out of memory\n");
+		return NULL;
+	}
+	pthread_mutex_init(&mpu->read_mutex_own, NULL);
+	pthread_cond_init(&mpu->read_condition_own, NULL);
+	mpu->read_mutex = &mpu->read_mutex_own;
+	mpu->read_condition = &mpu->read_condition_own;
+	mpu->imu_interrupt_fd = -1;
+	mpu->timer_fd = -1;
+	mpu->fifo_first_run = 1;
+	mpu->fusion_first_run = 1;
+	mpu->mag_req.efd = -1;
+	mpu->mag_req.done = 1;
+	mpu->mag_reg = AK8963_ST1;
+	return mpu;
+}
+
+void rc_mpu_dev_destroy(rc_mpu_t* mpu)
+{
+	if(mpu==NULL) return;
+	if(mpu->tp!=NULL && !mpu->imu_shutdown_flag) rc_mpu_dev_power_off(mpu);
+	// the default handle lives on, it just ends up powered off
+	if(mpu==&default_mpu) return;
+	pthread_mutex_destroy(&mpu->read_mutex_own);
+	pthread_cond_destroy(&mpu->read_condition_own);
+	mpu_ring_destroy(mpu->ring, mpu->ring_shm);
+	free(mpu->ring_shm);
+	free(mpu);
+}
+
+rc_mpu_t* rc_mpu_dev_default(void)
+{
+	return &default_mpu;
+}
+
+/*******************************************************************************
+* functions without a handle
+*
+* These all operate on default_mpu. Their callbacks take no handle so they
+* are stored on their own and called from small adapters.
+*******************************************************************************/
+static void __legacy_dmp_adapter(__unused rc_mpu_t* mpu, __unused void* user)
+{
+	if(legacy_dmp_callback!=NULL) legacy_dmp_callback();
+}
+
+static void __legacy_tap_adapter(__unused rc_mpu_t* mpu, int dir, int cnt, __unused void* user)
+{
+	if(legacy_tap_callback!=NULL) legacy_tap_callback(dir, cnt);
+}
+
+int rc_mpu_initialize(rc_mpu_data_t *data, rc_mpu_config_t conf)
+{
+	return rc_mpu_dev_initialize(&default_mpu, data, conf);
+}
+
+int rc_mpu_read_accel(rc_mpu_data_t *data)
+{
+	return rc_mpu_dev_read_accel(&default_mpu, data);
+}
+
+int rc_mpu_read_gyro(rc_mpu_data_t *data)
+{
+	return rc_mpu_dev_read_gyro(&default_mpu, data);
+}
+
+int rc_mpu_read_temp(rc_mpu_data_t* data)
+{
+	return rc_mpu_dev_read_temp(&default_mpu, data);
+}
+
+int rc_mpu_read_mag(rc_mpu_data_t* data)
+{
+	return rc_mpu_dev_read_mag(&default_mpu, data);
+}
+
+int rc_mpu_read_all(rc_mpu_data_t* data)
+{
+	return rc_mpu_dev_read_all(&default_mpu, data);
+}
+
+int rc_mpu_power_off()
+{
+	return rc_mpu_dev_power_off(&default_mpu);
+}
+
+int rc_mpu_initialize_dmp(rc_mpu_data_t *data, rc_mpu_config_t conf)
+{
+	return rc_mpu_dev_initialize_dmp(&default_mpu, data, conf);
+}
+
+int rc_mpu_set_dmp_callback(void (*func)(void))
+{
+	if(func==NULL){
+		fprintf(stderr,"ERROR: trying to assign NULL pointer to dmp_callback_func\n");
+		return -1;
+	}
+	legacy_dmp_callback = func;
+	return rc_mpu_dev_set_dmp_callback(&default_mpu, __legacy_dmp_adapter, NULL);
+}
+
+int rc_mpu_initialize_raw_fifo(rc_mpu_data_t *data, rc_mpu_config_t conf)
+{
+	return rc_mpu_dev_initialize_raw_fifo(&default_mpu, data, conf);
+}
+
+int rc_mpu_initialize_data_ready(rc_mpu_data_t *data, rc_mpu_config_t conf)
+{
+	return rc_mpu_dev_initialize_data_ready(&default_mpu, data, conf);
+}
+
+int rc_mpu_set_raw_callback(rc_mpu_raw_callback_t func, void* user)
+{
+	return rc_mpu_dev_set_raw_callback(&default_mpu, func, user);
+}
+
+int rc_mpu_block_until_dmp_data()
+{
+	return rc_mpu_dev_block_until_dmp_data(&default_mpu);
+}
+
+int64_t rc_mpu_nanos_since_last_dmp_interrupt()
+{
+	return rc_mpu_dev_nanos_since_last_dmp_interrupt(&default_mpu);
+}
+
+uint64_t rc_mpu_missed_dmp_interrupts(void)
+{
+	return rc_mpu_dev_missed_dmp_interrupts(&default_mpu);
+}
+
+int rc_mpu_set_dmp_batch_callback(rc_mpu_dmp_batch_callback_t func, void* user)
+{
+	return rc_mpu_dev_set_dmp_batch_callback(&default_mpu, func, user);
+}
+
+int rc_mpu_get_stats(rc_mpu_stats_t* stats)
+{
+	return rc_mpu_dev_get_stats(&default_mpu, stats);
+}
+
+int rc_mpu_ring_pop(uint64_t* cursor, rc_mpu_record_t* rec)
+{
+	return rc_mpu_dev_ring_pop(&default_mpu, cursor, rec);
+}
+
+int rc_mpu_ring_read(uint64_t* cursor, rc_mpu_record_t* recs, int max)
+{
+	return rc_mpu_dev_ring_read(&default_mpu, cursor, recs, max);
+}
+
+int rc_mpu_ring_latest(rc_mpu_record_t* rec)
+{
+	return rc_mpu_dev_ring_latest(&default_mpu, rec);
+}
+
+int rc_mpu_ring_wait(uint64_t cursor, int timeout_ms)
+{
+	return rc_mpu_dev_ring_wait(&default_mpu, cursor, timeout_ms);
+}
+
+int rc_mpu_set_tap_callback(void (*func)(int dir, int cnt))
+{
+	if(func==NULL){
+		fprintf(stderr,"ERROR: trying to assign NULL pointer to tap_callback_func\n");
+		return -1;
+	}
+	legacy_tap_callback = func;
+	return rc_mpu_dev_set_tap_callback(&default_mpu, __legacy_tap_adapter, NULL);
+}
+
+int rc_mpu_block_until_tap()
+{
+	return rc_mpu_dev_block_until_tap(&default_mpu);
+}
+
+int64_t rc_mpu_nanos_since_last_tap()
+{
+	return rc_mpu_dev_nanos_since_last_tap(&default_mpu);
+}
+
+int rc_mpu_calibrate_gyro_routine(rc_mpu_config_t conf)
+{
+	return rc_mpu_dev_calibrate_gyro_routine(&default_mpu, conf);
+}
+
+int rc_mpu_calibrate_mag_routine(rc_mpu_config_t conf)
+{
+	return rc_mpu_dev_calibrate_mag_routine(&default_mpu, conf);
+}
+
+
 // Phew, that was a lot of code....
@@ -0,0 +1,196 @@
+/**
+ * @file mpu_clock.c
+ *
+ * The sums are kept around the newest point used, shifting them along with
+ * each new one, so they stay small however long the driver runs and decaying
+ * them is just a multiply. The slope is used from the first few points, as
+ * long as it is within the oscillator's tolerance, since even a rough fit
+ * beats a period that is a few percent off. It is only reported, and the
+ * residuals only counted as jitter, once the points cover enough time for it
+ * to have settled. An arrival far off a settled line, a thread that stalled
+ * or a wakeup that raced the FIFO, is left out, and a run of them means the
+ * indices have slipped so the fit starts again.
+ *
+ * An interrupt can only arrive after its sample was taken, so latency only
+ * ever adds to the arrival time. The least squares line runs through the
+ * middle of the arrivals, late by the average latency, so samples are stamped
+ * on the line moved down to the low edge of the arrivals instead. That edge
+ * drops to any arrival below it at once and rises back only slowly. The time of
+ * the read is a limit as well, the newest sample was in the FIFO by then.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "mpu_clock.h"
+
+// arrivals older than this carry about a third of the weight of a new one
+#define FIT_TIME_CONSTANT_NS	10e9
+// spread of the points in time, as a standard deviation, before the slope has
+// settled. About 0.9 seconds of evenly spaced arrivals.
+#define FIT_SETTLED_STD_NS	250e6
+#define FIT_MIN_POINTS		4
+// datasheet tolerance of the MPU's oscillator is a few percent
+#define FIT_MAX_DRIFT		0.1
+// time constant of the low edge's rise towards arrivals above it
+#define FLOOR_RISE_NS		10e9
+#define OUTLIER_RMS		8.0
+#define MAX_OUTLIERS		16
+
+
+void mpu_clock_reset(mpu_clock_t* c, uint64_t period_ns)
+{
+	memset(c, 0, sizeof(mpu_clock_t));
+	c->nominal = period_ns;
+	c->period = period_ns;
+}
+
+
+void mpu_clock_restart(mpu_clock_t* c)
+{
+	c->sw = c->sx = c->sy = c->sxx = c->sxy = 0.0;
+	c->srw = c->srr = 0.0;
+	c->offset = 0.0;
+	c->floor = 0.0;
+	c->settled = 0;
+	c->outliers = 0;
+}
+
+
+void mpu_clock_skip(mpu_clock_t* c, uint64_t n)
+{
+	c->next += n;
+}
+
+
+uint64_t mpu_clock_gap(const mpu_clock_t* c, uint64_t arrival_ns)
+{
+	double r;
+	if(c->sw==0.0) return 0;
+	// the line runs through the middle of the arrivals, so whichever index
+	// it puts nearest is the likeliest. Going by the low edge instead would
+	// take every arrival more than a period late for a lost sample, and
+	// the indices that then run ahead would pull the slope down into more.
+	r = (double)(int64_t)(arrival_ns - c->t0) - c->offset - c->period*(double)(int64_t)(c->next - c->x0);
+	r = round(r/c->period);
+	return r>0.0 ? (uint64_t)r : 0;
+}
+
+
+void mpu_clock_batch(mpu_clock_t* c, int n, uint64_t arrival_ns, uint64_t read_ns)
+{
+	double dx = 0.0, dy = 0.0, r = 0.0;
+	double lambda, mx, my, vx, b, sx, sy;
+	uint64_t xa;
+
+	c->xn = c->next + n - 1;
+	c->next += n;
+	c->n = n;
+	c->read_ns = read_ns;
+
+	// index of the sample the arrival belongs to
+	xa = c->xn;
+	if(c->sw>0.0){
+		dx = (double)(xa - c->x0);
+		dy = (double)(int64_t)(arrival_ns - c->t0);
+		r = dy - (c->offset + c->period*dx);
+		// an arrival can't come before its sample, so one that seems to
+		// is for an earlier sample in the batch and the later ones landed
+		// between the interrupt and the read
+		while(c->settled && r < c->floor - c->period/2.0 && xa > c->xn+1-n){
+			xa--;
+			dx -= 1.0;
+			r += c->period;
+		}
+		if(c->settled && c->srw>0.0 && fabs(r) > OUTLIER_RMS*sqrt(c->srr/c->srw) + c->nominal){
+			// stamps for this batch still come off the old line
+			if(++c->outliers < MAX_OUTLIERS) return;
+			mpu_clock_restart(c);
+		}
+	}
+	if(c->sw==0.0){
+		c->x0 = xa;
+		c->t0 = arrival_ns;
+		c->sw = 1.0;
+		return;
+	}
+	c->outliers = 0;
+	if(c->settled){
+		if(r<c->floor) c->floor = r;
+		else c->floor += fmin(dy/FLOOR_RISE_NS, 1.0)*(r-c->floor);
+	}
+
+	// move the origin to the new point, then decay by the time since the last
+	lambda = 1.0 - dy/FIT_TIME_CONSTANT_NS;
+	if(lambda<0.0) lambda = 0.0;
+	if(lambda>1.0) lambda = 1.0;
+	sx = c->sx - dx*c->sw;
+	sy = c->sy - dy*c->sw;
+	c->sxx = lambda*(c->sxx - 2.0*dx*c->sx + dx*dx*c->sw);
+	c->sxy = lambda*(c->sxy - dx*c->sy - dy*c->sx + dx*dy*c->sw);
+	c->sx = lambda*sx;
+	c->sy = lambda*sy;
+	c->sw = lambda*c->sw + 1.0;
+	if(c->settled){
+		c->srw = lambda*c->srw + 1.0;
+		c->srr = lambda*c->srr + r*r;
+	}
+	c->x0 = xa;
+	c->t0 = arrival_ns;
+
+	mx = c->sx/c->sw;
+	my = c->sy/c->sw;
+	vx = c->sxx/c->sw - mx*mx;
+	b = c->period;
+	if(c->sw>=FIT_MIN_POINTS && vx>0.0){
+		b = (c->sxy/c->sw - mx*my)/vx;
+		if(fabs(b/c->nominal-1.0)>FIT_MAX_DRIFT) b = c->period;
+	}
+	c->period = b;
+	c->offset = my - b*mx;
+
+	if(!c->settled){
+		c->settled = vx*c->nominal*c->nominal>=FIT_SETTLED_STD_NS*FIT_SETTLED_STD_NS;
+		// stamps come off the line from this batch on, bounded by its read
+		if(!c->settled) return;
+	}
+	// the newest sample was in the FIFO by the time it was read, which
+	// bounds the edge from above too when it came in after the interrupt
+	r = (double)(int64_t)(read_ns - c->t0) - (c->offset + b*(double)(int64_t)(c->xn - c->x0));
+	if(r<c->floor) c->floor = r;
+	__atomic_store_n(&c->period_ps, (uint64_t)llround(b*1000.0), __ATOMIC_RELAXED);
+	__atomic_store_n(&c->jitter_ns, (uint64_t)llround(sqrt(c->srr/c->srw)), __ATOMIC_RELAXED);
+}
+
+
+uint64_t mpu_clock_stamp(mpu_clock_t* c, int k)
+{
+	double rel;
+	uint64_t t, x;
+	int left;
+
+	x = c->xn + 1 - c->n + k;
+	if(!c->settled && c->last_ns!=0){
+		// the fit still moves with every point, so until it settles
+		// samples just follow the last one the configured period apart
+		t = c->last_ns + (uint64_t)llround(c->nominal*(double)(x - c->last_x));
+	}
+	else{
+		rel = c->offset + c->floor + c->period*(double)(int64_t)(x - c->x0);
+		t = c->t0 + (int64_t)llround(rel);
+		// can't come before the one ahead of it, which only matters
+		// when the line moved
+		if(c->last_ns!=0 && t<=c->last_ns) t = c->last_ns + (uint64_t)(c->period/2.0);
+	}
+	// nor after it was read. Samples that hit that bound share what room is
+	// left before it evenly, so the rest of the batch still fits in
+	left = c->n - k;
+	if(t>c->read_ns){
+		if(c->last_ns==0) t = c->read_ns - (uint64_t)((left-1)*c->period);
+		else if(c->read_ns>c->last_ns) t = c->last_ns + (c->read_ns - c->last_ns)/left;
+	}
+	c->last_ns = t;
+	c->last_x = x;
+	return t;
+}
@@ -0,0 +1,76 @@
+/**
+ * @file mpu_clock.h
+ *
+ * Model of the MPU's sample clock against CLOCK_MONOTONIC. Every FIFO read
+ * adds one point, the index of the newest sample against the time its
+ * interrupt arrived, to a least squares line with exponential forgetting. The
+ * slope is the real sample period, which is off the configured one by as much
+ * as the MPU's oscillator is, and every sample is timestamped on the line so
+ * interrupt and wakeup latency drop out. Internal to the MPU driver, not
+ * installed.
+ */
+
+#ifndef RC_MPU_CLOCK_H
+#define RC_MPU_CLOCK_H
+
+#include <stdint.h>
+
+#define MPU_CLOCK_HIDDEN __attribute__ ((visibility ("hidden")))
+
+typedef struct mpu_clock_t{
+	double nominal;		// configured sample period, ns
+	double period;		// period in use, the fit once there is enough data
+	double offset;		// the line at x0, relative to t0, ns
+	double floor;		// low edge of the arrivals relative to the line, ns
+	uint64_t x0, t0;	// sample index and time the sums are taken around
+	uint64_t next;		// index the next sample read gets
+	uint64_t xn;		// index of the newest sample in the current batch
+	double sw, sx, sy, sxx, sxy; // decaying sums of weight, x, y, x*x, x*y
+	double srw, srr;	// decaying weight and residual^2 since the fit settled
+	int settled;		// points cover enough time to trust the slope
+	int outliers;		// arrivals in a row too far off the line to use
+	int n;			// samples in the current batch
+	uint64_t read_ns;	// when the current batch was read
+	uint64_t last_ns;	// newest timestamp handed out
+	uint64_t last_x;	// and the index of its sample
+	uint64_t period_ps;	// fitted period for the stats, 0 until settled
+	uint64_t jitter_ns;	// rms of arrivals around the line for the stats
+} mpu_clock_t;
+
+/**
+ * Forgets everything and starts again from the configured sample period.
+ */
+MPU_CLOCK_HIDDEN void mpu_clock_reset(mpu_clock_t* c, uint64_t period_ns);
+
+/**
+ * Samples were lost so indices no longer line up with earlier arrivals. Starts
+ * a new fit but keeps the period and never hands out an earlier timestamp.
+ */
+MPU_CLOCK_HIDDEN void mpu_clock_restart(mpu_clock_t* c);
+
+/**
+ * n samples were lost before the next batch without breaking the timing, so
+ * the indices of those after still count them.
+ */
+MPU_CLOCK_HIDDEN void mpu_clock_skip(mpu_clock_t* c, uint64_t n);
+
+/**
+ * Number of samples that came between the last batch and the one an interrupt
+ * at arrival_ns is for, when only that interrupt shows they were there.
+ */
+MPU_CLOCK_HIDDEN uint64_t mpu_clock_gap(const mpu_clock_t* c, uint64_t arrival_ns);
+
+/**
+ * Adds a batch of n samples read at read_ns, the newest of which raised an
+ * interrupt at arrival_ns, both CLOCK_MONOTONIC.
+ */
+MPU_CLOCK_HIDDEN void mpu_clock_batch(mpu_clock_t* c, int n, uint64_t arrival_ns, uint64_t read_ns);
+
+/**
+ * Timestamp of sample k of the last batch, oldest first. Call in order, each
+ * is later than the one before and none is later than the read. Until the fit
+ * settles samples are spaced the configured period apart from the first.
+ */
+MPU_CLOCK_HIDDEN uint64_t mpu_clock_stamp(mpu_clock_t* c, int k);
+
+#endif // RC_MPU_CLOCK_H
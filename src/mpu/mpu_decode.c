@@ -0,0 +1,131 @@
+/**
+ * @file mpu_decode.c
+ *
+ * Vector paths work on four triples (24 bytes) or four int32 (16 bytes) at a
+ * time. With three axes and four float lanes the per-axis scale factors line
+ * up again every four triples, so three rotated copies of the scale vector
+ * cover every lane. Leftovers go through the scalar code.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MPU_DECODE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define MPU_DECODE_SSE2
+#endif
+
+#include "mpu_decode.h"
+
+
+static inline int16_t __be16(const uint8_t* p)
+{
+	return (int16_t)(((uint16_t)p[0]<<8) | p[1]);
+}
+
+static inline int32_t __be32(const uint8_t* p)
+{
+	return (int32_t)(((uint32_t)p[0]<<24) | ((uint32_t)p[1]<<16) |
+			((uint32_t)p[2]<<8) | p[3]);
+}
+
+static inline void __triple(const uint8_t* src, int16_t* raw, float* out, const float scale[3])
+{
+	int16_t x = __be16(src);
+	int16_t y = __be16(src+2);
+	int16_t z = __be16(src+4);
+	if(raw!=NULL){
+		raw[0] = x;
+		raw[1] = y;
+		raw[2] = z;
+	}
+	if(out!=NULL){
+		out[0] = x * scale[0];
+		out[1] = y * scale[1];
+		out[2] = z * scale[2];
+	}
+}
+
+
+void mpu_decode_be16x3(const uint8_t* src, size_t stride, int n,
+					int16_t* raw, float* out, const float scale[3])
+{
+	static const float one[3] = {1.0f, 1.0f, 1.0f};
+	int k = 0;
+
+	if(scale==NULL) scale = one;
+	if(stride==6){
+#if defined(MPU_DECODE_NEON)
+		const float32x4_t s0 = {scale[0], scale[1], scale[2], scale[0]};
+		const float32x4_t s1 = {scale[1], scale[2], scale[0], scale[1]};
+		const float32x4_t s2 = {scale[2], scale[0], scale[1], scale[2]};
+		for(;k+4<=n;k+=4){
+			const uint8_t* p = src + k*6;
+			int16x8_t a = vreinterpretq_s16_u8(vrev16q_u8(vld1q_u8(p)));
+			int16x4_t b = vreinterpret_s16_u8(vrev16_u8(vld1_u8(p+16)));
+			if(raw!=NULL){
+				vst1q_s16(raw + k*3, a);
+				vst1_s16(raw + k*3 + 8, b);
+			}
+			if(out!=NULL){
+				float* o = out + k*3;
+				vst1q_f32(o,   vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(a))), s0));
+				vst1q_f32(o+4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(a))), s1));
+				vst1q_f32(o+8, vmulq_f32(vcvtq_f32_s32(vmovl_s16(b)), s2));
+			}
+		}
+#elif defined(MPU_DECODE_SSE2)
+		const __m128 s0 = _mm_setr_ps(scale[0], scale[1], scale[2], scale[0]);
+		const __m128 s1 = _mm_setr_ps(scale[1], scale[2], scale[0], scale[1]);
+		const __m128 s2 = _mm_setr_ps(scale[2], scale[0], scale[1], scale[2]);
+		for(;k+4<=n;k+=4){
+			const uint8_t* p = src + k*6;
+			__m128i a = _mm_loadu_si128((const __m128i*)p);
+			__m128i b = _mm_loadl_epi64((const __m128i*)(p+16));
+			a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+			b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+			if(raw!=NULL){
+				_mm_storeu_si128((__m128i*)(raw + k*3), a);
+				_mm_storel_epi64((__m128i*)(raw + k*3 + 8), b);
+			}
+			if(out!=NULL){
+				float* o = out + k*3;
+				// sign extend by putting each value in the top half of a
+				// 32-bit lane and shifting it back down
+				__m128i a_lo = _mm_srai_epi32(_mm_unpacklo_epi16(a, a), 16);
+				__m128i a_hi = _mm_srai_epi32(_mm_unpackhi_epi16(a, a), 16);
+				__m128i b_lo = _mm_srai_epi32(_mm_unpacklo_epi16(b, b), 16);
+				_mm_storeu_ps(o,   _mm_mul_ps(_mm_cvtepi32_ps(a_lo), s0));
+				_mm_storeu_ps(o+4, _mm_mul_ps(_mm_cvtepi32_ps(a_hi), s1));
+				_mm_storeu_ps(o+8, _mm_mul_ps(_mm_cvtepi32_ps(b_lo), s2));
+			}
+		}
+#endif
+	}
+	for(;k<n;k++){
+		__triple(src + k*stride, raw!=NULL ? raw + k*3 : NULL,
+				out!=NULL ? out + k*3 : NULL, scale);
+	}
+}
+
+
+void mpu_decode_be32(const uint8_t* src, int n, int32_t* out)
+{
+	int k = 0;
+#if defined(MPU_DECODE_NEON)
+	for(;k+4<=n;k+=4){
+		vst1q_s32(out+k, vreinterpretq_s32_u8(vrev32q_u8(vld1q_u8(src + k*4))));
+	}
+#elif defined(MPU_DECODE_SSE2)
+	for(;k+4<=n;k+=4){
+		__m128i x = _mm_loadu_si128((const __m128i*)(src + k*4));
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		x = _mm_or_si128(_mm_slli_epi32(x, 16), _mm_srli_epi32(x, 16));
+		_mm_storeu_si128((__m128i*)(out+k), x);
+	}
+#endif
+	for(;k<n;k++) out[k] = __be32(src + k*4);
+}
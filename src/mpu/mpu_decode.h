@@ -0,0 +1,36 @@
+/**
+ * @file mpu_decode.h
+ *
+ * Kernels for turning the big-endian register and FIFO contents of the
+ * MPU6050/6500/9250 into native integers and scaled floats. Each has a NEON
+ * and an SSE2 version selected at compile time and a plain C fallback, so the
+ * driver can decode whole multi-packet FIFO bursts in one pass. Internal to
+ * the MPU driver, not installed.
+ */
+
+#ifndef RC_MPU_DECODE_H
+#define RC_MPU_DECODE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MPU_DECODE_HIDDEN __attribute__ ((visibility ("hidden")))
+
+/**
+ * Decodes n XYZ triples of big-endian int16.
+ *
+ * Triple k starts at src + k*stride. raw, if not NULL, receives the 3n native
+ * values and out, if not NULL, receives them multiplied by the per-axis
+ * factors in scale, or by 1 if scale is NULL. Packed triples (stride 6) take
+ * the vector path, anything else such as accel and gyro interleaved in a DMP
+ * packet is done triple by triple.
+ */
+MPU_DECODE_HIDDEN void mpu_decode_be16x3(const uint8_t* src, size_t stride, int n,
+					int16_t* raw, float* out, const float scale[3]);
+
+/**
+ * Decodes n packed big-endian int32 such as the DMP quaternion.
+ */
+MPU_DECODE_HIDDEN void mpu_decode_be32(const uint8_t* src, int n, int32_t* out);
+
+#endif // RC_MPU_DECODE_H
@@ -22,7 +22,13 @@ identical but the latter has a different register map
 // internal DMP sample rate limits
 #define DMP_MAX_RATE		200
 #define DMP_MIN_RATE		4
-#define IMU_POLL_TIMEOUT	300 // milliseconds
+
+// raw FIFO sample rate limits, the top rate needs the gyro DLPF bypassed
+#define RAW_MAX_RATE		8000
+#define RAW_MIN_RATE		4
+
+// data-ready mode reads every sample over the bus on its own edge
+#define DRDY_MAX_RATE		1000
 
 
 /******************************************************************
@@ -225,6 +231,14 @@ identical but the latter has a different register map
 #define FIFO_SLV1_EN		0x01<<1
 #define FIFO_SLV0_EN		0x01
 
+/*******************************************************************
+* I2C master settings, for reaching the magnetometer without bypass
+*******************************************************************/
+#define I2C_MST_CLK_400KHZ	0x0D	// I2C_MST_CTRL clock divider
+#define I2C_SLV4_DONE		0x01<<6	// I2C_MST_STATUS bits, cleared on read
+#define I2C_SLV4_NACK		0x01<<4
+#define I2C_SLV0_NACK		0x01
+
 
 /*******************************************************************
 * PWR_MGMT_1 register settings
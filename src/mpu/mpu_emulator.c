@@ -0,0 +1,827 @@
+/**
+ * @file mpu_emulator.c
+ *
+ * Software model of the MPU9250 and its AK8963 magnetometer, plugged into the
+ * MPU driver as a transport. Only the behaviour the driver relies on is
+ * modelled: the register file with its self-clearing bits, the FIFO, the DMP
+ * memory and packet format, the I2C bypass to the magnetometer, the I2C
+ * master's slave 0 polling and slave 4 single transfers, and the data
+ * interrupt.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <rc/mpu_emulator.h>
+#include <rc/time.h>
+
+#include "mpu_defs.h"
+#include "dmp_firmware.h"
+#include "dmpKey.h"
+
+// macros
+#define unlikely(x)	__builtin_expect (!!(x), 0)
+#define likely(x)	__builtin_expect (!!(x), 1)
+#define __unused	__attribute__ ((unused))
+
+#define EMU_NUM_REGS		128
+#define EMU_NUM_MAG_REGS	32
+#define EMU_MEM_SIZE		4096
+#define EMU_FIFO_SIZE		1024
+#define EMU_MAX_CATCHUP		1000	// most samples generated per wakeup
+#define EMU_WHO_AM_I		0x71	// MPU9250
+#define EMU_MAG_WHO_AM_I	0x48
+#define EMU_MAG_ASA		128	// sensitivity adjustment of exactly 1.0
+#define EMU_MEM_START_ADDR	0x6E
+#define EMU_PRGM_START_L	0x71
+#define EMU_INT_DMP		0x02	// INT_STATUS bit for DMP interrupts
+#define EMU_TEMP_C		25.0
+#define EMU_GRAVITY_G		1.0
+#define EMU_MAG_RAW_TO_uT	(4912.0/32760.0)
+
+// local field in uT expressed in the world frame, roughly mid-latitude
+static const double mag_field_uT[3] = {20.0, 0.0, -40.0};
+
+struct rc_mpu_emulator_t{
+	pthread_mutex_t mutex;		// guards everything below
+	pthread_mutex_t bus_mutex;	// recursive, backs the transport lock
+	pthread_t thread;
+	int running;
+	int efd;
+	uint64_t irq_ns;		// CLOCK_MONOTONIC time of the last interrupt
+	uint32_t irq_seqno;		// interrupts so far, unlike stats never reset
+	uint8_t regs[EMU_NUM_REGS];
+	uint8_t mag_regs[EMU_NUM_MAG_REGS];
+	uint8_t mem[EMU_MEM_SIZE];
+	uint8_t fifo[EMU_FIFO_SIZE];
+	int fifo_head;			// index of the oldest byte
+	int fifo_count;
+	int dmp_div_count;
+	int slv_dly_count;		// samples since I2C slave 0 last ran
+	double scale;
+	double time;			// emulated seconds since create
+	double mag_next;		// emulated time of the next mag sample
+	double rate[3];			// body rate in rad/s
+	double q[4];			// body attitude, wxyz
+	int tap_pending;
+	uint8_t tap_byte;
+	rc_mpu_emulator_stats_t stats;
+};
+
+/*******************************************************************************
+* register defaults
+*******************************************************************************/
+static void __reset_regs(rc_mpu_emulator_t* emu)
+{
+	memset(emu->regs, 0, sizeof(emu->regs));
+	emu->regs[PWR_MGMT_1] = 0x01;
+	emu->regs[WHO_AM_I_MPU9250] = EMU_WHO_AM_I;
+	emu->fifo_head = 0;
+	emu->fifo_count = 0;
+	emu->dmp_div_count = 0;
+}
+
+static void __reset_mag_regs(rc_mpu_emulator_t* emu)
+{
+	memset(emu->mag_regs, 0, sizeof(emu->mag_regs));
+	emu->mag_regs[WHO_AM_I_AK8963] = EMU_MAG_WHO_AM_I;
+}
+
+/*******************************************************************************
+* FIFO
+*******************************************************************************/
+static void __fifo_push(rc_mpu_emulator_t* emu, const uint8_t* data, int len)
+{
+	int i, drop;
+	drop = emu->fifo_count + len - EMU_FIFO_SIZE;
+	if(drop>0){
+		emu->stats.fifo_overflows += drop;
+		emu->regs[INT_STATUS] |= BIT_FIFO_OVERFLOW;
+		// like the real chip, either lose the newest data or overwrite the
+		// oldest, which leaves the reader misaligned
+		if(emu->regs[CONFIG] & FIFO_MODE_KEEP_OLD){
+			len -= drop;
+		}
+		else{
+			emu->fifo_head = (emu->fifo_head + drop) % EMU_FIFO_SIZE;
+			emu->fifo_count -= drop;
+		}
+	}
+	for(i=0;i<len;i++){
+		emu->fifo[(emu->fifo_head + emu->fifo_count) % EMU_FIFO_SIZE] = data[i];
+		emu->fifo_count++;
+	}
+}
+
+static uint8_t __fifo_pop(rc_mpu_emulator_t* emu)
+{
+	uint8_t c;
+	if(emu->fifo_count==0) return 0;
+	c = emu->fifo[emu->fifo_head];
+	emu->fifo_head = (emu->fifo_head + 1) % EMU_FIFO_SIZE;
+	emu->fifo_count--;
+	return c;
+}
+
+/*******************************************************************************
+* register access, called with the mutex held
+*******************************************************************************/
+static uint16_t __mem_addr(rc_mpu_emulator_t* emu)
+{
+	return ((uint16_t)emu->regs[MPU6500_BANK_SEL]<<8 | emu->regs[EMU_MEM_START_ADDR]) % EMU_MEM_SIZE;
+}
+
+static void __mem_addr_inc(rc_mpu_emulator_t* emu)
+{
+	uint16_t a = (__mem_addr(emu) + 1) % EMU_MEM_SIZE;
+	emu->regs[MPU6500_BANK_SEL] = a>>8;
+	emu->regs[EMU_MEM_START_ADDR] = a&0xFF;
+}
+
+static uint8_t __reg_read(rc_mpu_emulator_t* emu, uint8_t reg)
+{
+	uint8_t c;
+	switch(reg){
+	case FIFO_COUNTH:
+		return (emu->fifo_count>>8) & 0x1F;
+	case FIFO_COUNTL:
+		return emu->fifo_count & 0xFF;
+	case FIFO_R_W:
+		return __fifo_pop(emu);
+	case MPU6500_MEM_R_W:
+		c = emu->mem[__mem_addr(emu)];
+		__mem_addr_inc(emu);
+		return c;
+	case INT_STATUS:
+	case I2C_MST_STATUS:
+		c = emu->regs[reg];
+		emu->regs[reg] = 0;
+		return c;
+	default:
+		return emu->regs[reg];
+	}
+}
+
+static void __reg_write(rc_mpu_emulator_t* emu, uint8_t reg, uint8_t val)
+{
+	switch(reg){
+	case PWR_MGMT_1:
+		if(val & H_RESET){
+			__reset_regs(emu);
+			return;
+		}
+		emu->regs[reg] = val;
+		return;
+	case USER_CTRL:
+		if(val & BIT_FIFO_RST){
+			emu->fifo_head = 0;
+			emu->fifo_count = 0;
+		}
+		if(val & BIT_DMP_RST) emu->dmp_div_count = 0;
+		// reset bits clear themselves
+		emu->regs[reg] = val & ~(BIT_FIFO_RST | BIT_DMP_RST | I2C_MST_RST | SIG_COND_RST);
+		return;
+	case MPU6500_MEM_R_W:
+		emu->mem[__mem_addr(emu)] = val;
+		__mem_addr_inc(emu);
+		return;
+	case FIFO_R_W:
+		__fifo_push(emu, &val, 1);
+		return;
+	case WHO_AM_I_MPU9250:
+	case FIFO_COUNTH:
+	case FIFO_COUNTL:
+	case INT_STATUS:
+	case I2C_MST_STATUS:
+	case I2C_SLV4_DI:
+		return; // read only
+	default:
+		emu->regs[reg] = val;
+		return;
+	}
+}
+
+static uint8_t __mag_reg_read(rc_mpu_emulator_t* emu, uint8_t reg)
+{
+	uint8_t c;
+	reg %= EMU_NUM_MAG_REGS;
+	// fuse ROM is only visible in fuse access mode
+	if(reg>=AK8963_ASAX && reg<=AK8963_ASAZ){
+		if((emu->mag_regs[AK8963_CNTL]&0x0F)==MAG_FUSE_ROM) return EMU_MAG_ASA;
+		return 0;
+	}
+	c = emu->mag_regs[reg];
+	// reading ST2 marks the end of a data read and releases the data registers
+	if(reg==AK8963_ST2) emu->mag_regs[AK8963_ST1] &= ~MAG_DATA_READY;
+	return c;
+}
+
+static void __mag_reg_write(rc_mpu_emulator_t* emu, uint8_t reg, uint8_t val)
+{
+	reg %= EMU_NUM_MAG_REGS;
+	switch(reg){
+	case AK8963_CNTL:
+		emu->mag_regs[reg] = val;
+		emu->mag_next = emu->time;
+		return;
+	case AK8963_CNTL+1: // CNTL2, soft reset bit clears itself
+		if(val & 0x01) __reset_mag_regs(emu);
+		return;
+	case AK8963_ASTC:
+	case AK8963_I2CDIS:
+		emu->mag_regs[reg] = val;
+		return;
+	default:
+		return; // everything else is read only
+	}
+}
+
+/*******************************************************************************
+* sample generation, called with the mutex held
+*******************************************************************************/
+static void __put_be16(uint8_t* p, int16_t v)
+{
+	p[0] = (uint16_t)v >> 8;
+	p[1] = (uint16_t)v & 0xFF;
+}
+
+static void __put_be32(uint8_t* p, int32_t v)
+{
+	p[0] = (uint32_t)v >> 24;
+	p[1] = ((uint32_t)v >> 16) & 0xFF;
+	p[2] = ((uint32_t)v >> 8) & 0xFF;
+	p[3] = (uint32_t)v & 0xFF;
+}
+
+static int16_t __sat16(double v)
+{
+	if(v>32767.0) return 32767;
+	if(v<-32768.0) return -32768;
+	return (int16_t)lrint(v);
+}
+
+// rotate a world frame vector into the body frame, v_b = R(q)^T v_w
+static void __world_to_body(const double q[4], const double w[3], double b[3])
+{
+	double qw=q[0], qx=q[1], qy=q[2], qz=q[3];
+	b[0] = (1-2*(qy*qy+qz*qz))*w[0] + 2*(qx*qy+qw*qz)*w[1] + 2*(qx*qz-qw*qy)*w[2];
+	b[1] = 2*(qx*qy-qw*qz)*w[0] + (1-2*(qx*qx+qz*qz))*w[1] + 2*(qy*qz+qw*qx)*w[2];
+	b[2] = 2*(qx*qz+qw*qy)*w[0] + 2*(qy*qz-qw*qx)*w[1] + (1-2*(qx*qx+qy*qy))*w[2];
+}
+
+// advance the attitude by the body rate over dt seconds
+static void __integrate(rc_mpu_emulator_t* emu, double dt)
+{
+	double h[3], a, s, dq[4], q[4], n;
+	int i;
+	for(i=0;i<3;i++) h[i] = emu->rate[i]*dt/2.0;
+	a = sqrt(h[0]*h[0] + h[1]*h[1] + h[2]*h[2]);
+	if(a==0.0) return;
+	s = sin(a)/a;
+	dq[0] = cos(a);
+	dq[1] = h[0]*s;
+	dq[2] = h[1]*s;
+	dq[3] = h[2]*s;
+	q[0] = emu->q[0]*dq[0] - emu->q[1]*dq[1] - emu->q[2]*dq[2] - emu->q[3]*dq[3];
+	q[1] = emu->q[0]*dq[1] + emu->q[1]*dq[0] + emu->q[2]*dq[3] - emu->q[3]*dq[2];
+	q[2] = emu->q[0]*dq[2] - emu->q[1]*dq[3] + emu->q[2]*dq[0] + emu->q[3]*dq[1];
+	q[3] = emu->q[0]*dq[3] + emu->q[1]*dq[2] - emu->q[2]*dq[1] + emu->q[3]*dq[0];
+	n = sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+	for(i=0;i<4;i++) emu->q[i] = q[i]/n;
+}
+
+// update the accel, temp and gyro output registers from the current attitude
+static void __update_sensor_regs(rc_mpu_emulator_t* emu)
+{
+	static const double up[3] = {0.0, 0.0, EMU_GRAVITY_G};
+	double g[3];
+	double accel_lsb = 32768.0 / (2 << ((emu->regs[ACCEL_CONFIG]>>3)&3));
+	double gyro_lsb = 32768.0 / (250 << ((emu->regs[GYRO_CONFIG]>>3)&3));
+	int i;
+	__world_to_body(emu->q, up, g);
+	for(i=0;i<3;i++){
+		__put_be16(&emu->regs[ACCEL_XOUT_H+2*i], __sat16(g[i]*accel_lsb));
+		__put_be16(&emu->regs[GYRO_XOUT_H+2*i], __sat16(emu->rate[i]*RAD_TO_DEG*gyro_lsb));
+	}
+	__put_be16(&emu->regs[TEMP_OUT_H], __sat16((EMU_TEMP_C-21.0)*TEMP_SENSITIVITY));
+}
+
+static void __update_mag_regs(rc_mpu_emulator_t* emu)
+{
+	double b[3];
+	int16_t adc[3];
+	int i;
+	double lsb = 1.0/EMU_MAG_RAW_TO_uT;
+	__world_to_body(emu->q, mag_field_uT, b);
+	// undo the axis swap the driver applies to the AK8963 frame
+	adc[0] = __sat16(b[1]*lsb);
+	adc[1] = __sat16(b[0]*lsb);
+	adc[2] = __sat16(-b[2]*lsb);
+	// 14 bit mode has a quarter of the resolution
+	if(!(emu->mag_regs[AK8963_CNTL] & MSCALE_16)){
+		for(i=0;i<3;i++) adc[i] /= 4;
+	}
+	// data is little endian on the AK8963
+	for(i=0;i<3;i++){
+		emu->mag_regs[AK8963_XOUT_L+2*i] = (uint16_t)adc[i] & 0xFF;
+		emu->mag_regs[AK8963_XOUT_H+2*i] = (uint16_t)adc[i] >> 8;
+	}
+	emu->mag_regs[AK8963_ST2] = emu->mag_regs[AK8963_CNTL] & MSCALE_16;
+	emu->mag_regs[AK8963_ST1] |= MAG_DATA_READY;
+	emu->stats.mag_samples++;
+}
+
+// push one packet laid out the way the motion driver firmware configures it
+static void __push_dmp_packet(rc_mpu_emulator_t* emu)
+{
+	uint8_t pkt[32];
+	int len = 0;
+	int i;
+	const uint8_t* m = emu->mem;
+	if(m[CFG_8]==DINA20 || m[CFG_LP_QUAT]==DINBC0){
+		for(i=0;i<4;i++) __put_be32(&pkt[len+4*i], (int32_t)lrint(emu->q[i]*(1L<<30)));
+		len += 16;
+	}
+	if(m[CFG_15+1]==0xC0){
+		memcpy(&pkt[len], &emu->regs[ACCEL_XOUT_H], 6);
+		len += 6;
+	}
+	if(m[CFG_15+4]==0xC4){
+		memcpy(&pkt[len], &emu->regs[GYRO_XOUT_H], 6);
+		len += 6;
+	}
+	if(m[CFG_27]==DINA20){
+		memset(&pkt[len], 0, 4);
+		if(emu->tap_pending){
+			pkt[len+1] = INT_SRC_TAP;
+			pkt[len+3] = emu->tap_byte;
+			emu->tap_pending = 0;
+		}
+		len += 4;
+	}
+	if(len==0) return;
+	__fifo_push(emu, pkt, len);
+	emu->stats.fifo_packets++;
+}
+
+// push one sample of whatever sensors are enabled in FIFO_EN, in register order
+static void __push_raw_sample(rc_mpu_emulator_t* emu)
+{
+	uint8_t pkt[32];
+	int len = 0;
+	uint8_t en = emu->regs[FIFO_EN];
+	if(en & FIFO_ACCEL_EN){
+		memcpy(&pkt[len], &emu->regs[ACCEL_XOUT_H], 6);
+		len += 6;
+	}
+	if(en & FIFO_TEMP_EN){
+		memcpy(&pkt[len], &emu->regs[TEMP_OUT_H], 2);
+		len += 2;
+	}
+	if(en & FIFO_GYRO_X_EN){
+		memcpy(&pkt[len], &emu->regs[GYRO_XOUT_H], 2);
+		len += 2;
+	}
+	if(en & FIFO_GYRO_Y_EN){
+		memcpy(&pkt[len], &emu->regs[GYRO_XOUT_H+2], 2);
+		len += 2;
+	}
+	if(en & FIFO_GYRO_Z_EN){
+		memcpy(&pkt[len], &emu->regs[GYRO_XOUT_H+4], 2);
+		len += 2;
+	}
+	if((en & FIFO_SLV0_EN) && (emu->regs[I2C_SLV0_CTRL] & BIT_SLAVE_EN)){
+		memcpy(&pkt[len], &emu->regs[EXT_SENS_DATA_00], emu->regs[I2C_SLV0_CTRL] & BITS_SLAVE_LENGTH);
+		len += emu->regs[I2C_SLV0_CTRL] & BITS_SLAVE_LENGTH;
+	}
+	if(len==0) return;
+	__fifo_push(emu, pkt, len);
+	emu->stats.fifo_packets++;
+}
+
+/*******************************************************************************
+* void __i2c_master(rc_mpu_emulator_t* emu)
+*
+* one sample tick of the auxiliary I2C master. Slave 4 does a single byte
+* transfer when enabled and flags it done or NACKed in I2C_MST_STATUS, slave 0
+* copies its registers into EXT_SENS_DATA, on every 1+I2C_MST_DLY samples if
+* its delay is enabled. Only the magnetometer is on the auxiliary bus.
+*******************************************************************************/
+static void __i2c_master(rc_mpu_emulator_t* emu)
+{
+	uint8_t* r = emu->regs;
+	int i, len, dly;
+	if(!(r[USER_CTRL] & I2C_MST_EN)) return;
+	if(r[I2C_SLV4_CTRL] & BIT_SLAVE_EN){
+		if((r[I2C_SLV4_ADDR] & 0x7F)!=AK8963_ADDR) r[I2C_MST_STATUS] |= I2C_SLV4_NACK;
+		else{
+			if(r[I2C_SLV4_ADDR] & BIT_I2C_READ) r[I2C_SLV4_DI] = __mag_reg_read(emu, r[I2C_SLV4_REG]);
+			else __mag_reg_write(emu, r[I2C_SLV4_REG], r[I2C_SLV4_DO]);
+		}
+		r[I2C_SLV4_CTRL] &= ~BIT_SLAVE_EN;
+		r[I2C_MST_STATUS] |= I2C_SLV4_DONE;
+	}
+	if(!(r[I2C_SLV0_CTRL] & BIT_SLAVE_EN)) return;
+	dly = (r[I2C_MST_DELAY_CTRL] & BIT_S0_DELAY_EN) ? (r[I2C_SLV4_CTRL] & BITS_I2C_MASTER_DLY) : 0;
+	if(emu->slv_dly_count++ < dly) return;
+	emu->slv_dly_count = 0;
+	if((r[I2C_SLV0_ADDR] & 0x7F)!=AK8963_ADDR || !(r[I2C_SLV0_ADDR] & BIT_I2C_READ)){
+		r[I2C_MST_STATUS] |= I2C_SLV0_NACK;
+		return;
+	}
+	len = r[I2C_SLV0_CTRL] & BITS_SLAVE_LENGTH;
+	for(i=0;i<len;i++) r[EXT_SENS_DATA_00+i] = __mag_reg_read(emu, r[I2C_SLV0_REG]+i);
+	emu->stats.mag_reads++;
+}
+
+// internal sample rate follows the gyro DLPF setting like the real chip
+static double __sample_period(rc_mpu_emulator_t* emu)
+{
+	int dlpf = emu->regs[CONFIG] & BITS_LPF;
+	double base = (dlpf==0 || dlpf==7) ? 8000.0 : 1000.0;
+	return (1.0 + emu->regs[SMPLRT_DIV]) / base;
+}
+
+/*******************************************************************************
+* int __sample(rc_mpu_emulator_t* emu, double dt)
+*
+* advances emulated time by one sample period and does everything the chip
+* does on a sample clock tick. Returns 1 if the interrupt line should fire.
+*******************************************************************************/
+static int __sample(rc_mpu_emulator_t* emu, double dt)
+{
+	uint8_t user = emu->regs[USER_CTRL];
+	uint8_t int_en = emu->regs[INT_ENABLE];
+	uint8_t status = 0;
+	uint16_t div;
+	double mag_period;
+
+	emu->time += dt;
+	if(emu->regs[PWR_MGMT_1] & MPU_SLEEP) return 0;
+	__integrate(emu, dt);
+	__update_sensor_regs(emu);
+	emu->stats.samples++;
+	status |= BIT_DATA_RDY_EN;
+
+	// the magnetometer samples on its own clock
+	switch(emu->mag_regs[AK8963_CNTL] & 0x0F){
+	case MAG_CONT_MES_1:
+		mag_period = 1.0/8.0;
+		break;
+	case MAG_CONT_MES_2:
+		mag_period = 1.0/100.0;
+		break;
+	default:
+		mag_period = 0.0;
+		break;
+	}
+	if(mag_period>0.0 && emu->time>=emu->mag_next){
+		__update_mag_regs(emu);
+		emu->mag_next += mag_period;
+		if(emu->mag_next<emu->time) emu->mag_next = emu->time + mag_period;
+	}
+	__i2c_master(emu);
+
+	// the DMP runs once per sample, the driver clocks it at 200hz, and only
+	// produces output once firmware has been started
+	if((user & BIT_DMP_EN) && (emu->regs[MPU6500_PRGM_START_H] || emu->regs[EMU_PRGM_START_L])){
+		div = ((uint16_t)emu->mem[D_0_22]<<8) | emu->mem[D_0_22+1];
+		if(emu->dmp_div_count++ >= div){
+			emu->dmp_div_count = 0;
+			if(user & BIT_FIFO_EN) __push_dmp_packet(emu);
+			status |= EMU_INT_DMP;
+		}
+	}
+	else if(user & BIT_FIFO_EN){
+		__push_raw_sample(emu);
+	}
+
+	status |= emu->regs[INT_STATUS] & BIT_FIFO_OVERFLOW;
+	emu->regs[INT_STATUS] |= status;
+	return (status & int_en & (BIT_DATA_RDY_EN|BIT_DMP_INT_EN|BIT_FIFO_OVERFLOW))!=0;
+}
+
+/*******************************************************************************
+* void* __emulator_thread(void* ptr)
+*
+* sample clock. Sleeps until the next emulated sample is due in real time, and
+* if it woke up late generates every sample it missed in one go, up to a limit,
+* so the FIFO fills the way it would had the reader been slow.
+*******************************************************************************/
+static void* __emulator_thread(void* ptr)
+{
+	rc_mpu_emulator_t* emu = ptr;
+	struct timespec next, now;
+	double dt, real_dt;
+	int n, fire;
+	uint64_t one = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(__atomic_load_n(&emu->running, __ATOMIC_ACQUIRE)){
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		fire = 0;
+		n = 0;
+		pthread_mutex_lock(&emu->mutex);
+		dt = __sample_period(emu);
+		real_dt = dt/emu->scale;
+		do{
+			fire += __sample(emu, dt);
+			rc_timespec_add(&next, real_dt);
+			n++;
+		}while(n<EMU_MAX_CATCHUP && (next.tv_sec<now.tv_sec ||
+			(next.tv_sec==now.tv_sec && next.tv_nsec<=now.tv_nsec)));
+		// too far behind to catch up, drop the backlog and carry on from now
+		if(n>=EMU_MAX_CATCHUP){
+			next = now;
+			rc_timespec_add(&next, real_dt);
+		}
+		if(fire){
+			// a latched pin stays asserted through the burst, a pulsing
+			// one would have pulsed for each sample
+			if(emu->regs[INT_PIN_CFG] & LATCH_INT_EN) fire = 1;
+			emu->stats.interrupts += fire;
+			emu->irq_seqno += fire;
+			emu->irq_ns = now.tv_sec*1000000000ULL + now.tv_nsec;
+		}
+		pthread_mutex_unlock(&emu->mutex);
+
+		if(fire && write(emu->efd, &one, sizeof(one))!=sizeof(one)){
+			// counter can only saturate if nobody reads it, safe to ignore
+		}
+	}
+	return NULL;
+}
+
+/*******************************************************************************
+* transport functions
+*******************************************************************************/
+static int __emu_init(void* ctx, __unused int bus, __unused uint8_t addr)
+{
+	if(unlikely(ctx==NULL)){
+		fprintf(stderr,"ERROR: in rc_mpu_emulator_transport, transport_ctx must be an emulator\n");
+		return -1;
+	}
+	return 0;
+}
+
+// the bypass switch only connects the buses while the I2C master is off
+static inline int __bypass_on(rc_mpu_emulator_t* emu)
+{
+	return (emu->regs[INT_PIN_CFG] & BYPASS_EN) && !(emu->regs[USER_CTRL] & I2C_MST_EN);
+}
+
+static int __emu_read_regs(void* ctx, uint8_t addr, uint8_t reg, size_t length, uint8_t* data)
+{
+	rc_mpu_emulator_t* emu = ctx;
+	size_t i;
+	pthread_mutex_lock(&emu->mutex);
+	if(addr==AK8963_ADDR){
+		// the magnetometer only answers while the MPU is bypassing it
+		if(unlikely(!__bypass_on(emu))){
+			pthread_mutex_unlock(&emu->mutex);
+			errno = ENXIO;
+			return -1;
+		}
+		for(i=0;i<length;i++) data[i] = __mag_reg_read(emu, reg+i);
+	}
+	else{
+		for(i=0;i<length;i++){
+			data[i] = __reg_read(emu, reg);
+			// FIFO and DMP memory ports don't auto-increment
+			if(reg!=FIFO_R_W && reg!=MPU6500_MEM_R_W) reg = (reg+1) % EMU_NUM_REGS;
+		}
+	}
+	emu->stats.reg_reads++;
+	emu->stats.bytes_read += length;
+	pthread_mutex_unlock(&emu->mutex);
+	return 0;
+}
+
+static int __emu_write_regs(void* ctx, uint8_t addr, uint8_t reg, size_t length, const uint8_t* data)
+{
+	rc_mpu_emulator_t* emu = ctx;
+	size_t i;
+	pthread_mutex_lock(&emu->mutex);
+	if(addr==AK8963_ADDR){
+		if(unlikely(!__bypass_on(emu))){
+			pthread_mutex_unlock(&emu->mutex);
+			errno = ENXIO;
+			return -1;
+		}
+		for(i=0;i<length;i++) __mag_reg_write(emu, reg+i, data[i]);
+	}
+	else{
+		for(i=0;i<length;i++){
+			__reg_write(emu, reg, data[i]);
+			if(reg!=FIFO_R_W && reg!=MPU6500_MEM_R_W) reg = (reg+1) % EMU_NUM_REGS;
+		}
+	}
+	emu->stats.reg_writes++;
+	emu->stats.bytes_written += length;
+	pthread_mutex_unlock(&emu->mutex);
+	return 0;
+}
+
+static int __emu_lock(void* ctx)
+{
+	return pthread_mutex_lock(&((rc_mpu_emulator_t*)ctx)->bus_mutex) ? -1 : 0;
+}
+
+static int __emu_unlock(void* ctx)
+{
+	return pthread_mutex_unlock(&((rc_mpu_emulator_t*)ctx)->bus_mutex) ? -1 : 0;
+}
+
+static int __emu_interrupt_open(void* ctx, __unused int pin, short* events)
+{
+	*events = POLLIN;
+	return ((rc_mpu_emulator_t*)ctx)->efd;
+}
+
+static int __emu_interrupt_ack(__unused void* ctx, int fd)
+{
+	uint64_t count;
+	if(read(fd, &count, sizeof(count))!=sizeof(count)) return -1;
+	return 0;
+}
+
+// like the gpio character device, numbers each interrupt so the driver can
+// tell when it fell behind and several were merged into one read
+static int __emu_interrupt_event(void* ctx, int fd, uint64_t* timestamp_ns, uint32_t* seqno)
+{
+	rc_mpu_emulator_t* emu = ctx;
+	uint64_t count;
+	if(read(fd, &count, sizeof(count))!=sizeof(count)) return -1;
+	pthread_mutex_lock(&emu->mutex);
+	*timestamp_ns = emu->irq_ns;
+	*seqno = emu->irq_seqno;
+	pthread_mutex_unlock(&emu->mutex);
+	return 0;
+}
+
+static void __emu_interrupt_close(void* ctx, __unused int pin)
+{
+	uint64_t count;
+	// drain anything left so the next user starts clean
+	if(read(((rc_mpu_emulator_t*)ctx)->efd, &count, sizeof(count))<0){
+		// nothing pending
+	}
+}
+
+const rc_mpu_transport_t rc_mpu_emulator_transport = {
+	.init		= __emu_init,
+	.close		= NULL,
+	.read_regs	= __emu_read_regs,
+	.write_regs	= __emu_write_regs,
+	.burst_read	= __emu_read_regs,
+	.transfer	= NULL,
+	.lock		= __emu_lock,
+	.unlock		= __emu_unlock,
+	.interrupt_open	= __emu_interrupt_open,
+	.interrupt_ack	= __emu_interrupt_ack,
+	.interrupt_close= __emu_interrupt_close,
+	.interrupt_event= __emu_interrupt_event
+};
+
+/*******************************************************************************
+* public functions
+*******************************************************************************/
+int rc_mpu_emulator_spi_xfer(void* emu, const uint8_t* tx, uint8_t* rx, size_t length)
+{
+	if(unlikely(emu==NULL || tx==NULL || length<2)){
+		fprintf(stderr,"ERROR: in rc_mpu_emulator_spi_xfer, invalid message\n");
+		return -1;
+	}
+	// first byte is the register address, top bit set for reads
+	if(tx[0] & 0x80){
+		if(unlikely(rx==NULL)) return -1;
+		rx[0] = 0;
+		return __emu_read_regs(emu, 0, tx[0]&0x7F, length-1, rx+1);
+	}
+	if(rx!=NULL) memset(rx, 0, length);
+	return __emu_write_regs(emu, 0, tx[0], length-1, tx+1);
+}
+
+rc_mpu_emulator_t* rc_mpu_emulator_create(void)
+{
+	rc_mpu_emulator_t* emu;
+	pthread_mutexattr_t attr;
+
+	emu = calloc(1, sizeof(rc_mpu_emulator_t));
+	if(emu==NULL){
+		perror("ERROR in rc_mpu_emulator_create, failed to allocate memory");
+		return NULL;
+	}
+	emu->efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if(emu->efd==-1){
+		perror("ERROR in rc_mpu_emulator_create, failed to create eventfd");
+		free(emu);
+		return NULL;
+	}
+	pthread_mutex_init(&emu->mutex, NULL);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&emu->bus_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	__reset_regs(emu);
+	__reset_mag_regs(emu);
+	emu->scale = 1.0;
+	emu->q[0] = 1.0;
+
+	emu->running = 1;
+	if(pthread_create(&emu->thread, NULL, __emulator_thread, emu)){
+		fprintf(stderr,"ERROR in rc_mpu_emulator_create, failed to start thread\n");
+		close(emu->efd);
+		pthread_mutex_destroy(&emu->mutex);
+		pthread_mutex_destroy(&emu->bus_mutex);
+		free(emu);
+		return NULL;
+	}
+	return emu;
+}
+
+void rc_mpu_emulator_destroy(rc_mpu_emulator_t* emu)
+{
+	if(emu==NULL) return;
+	__atomic_store_n(&emu->running, 0, __ATOMIC_RELEASE);
+	pthread_join(emu->thread, NULL);
+	close(emu->efd);
+	pthread_mutex_destroy(&emu->mutex);
+	pthread_mutex_destroy(&emu->bus_mutex);
+	free(emu);
+}
+
+int rc_mpu_emulator_set_time_scale(rc_mpu_emulator_t* emu, double scale)
+{
+	if(emu==NULL || !(scale>0.0)){
+		fprintf(stderr,"ERROR in rc_mpu_emulator_set_time_scale, invalid argument\n");
+		return -1;
+	}
+	pthread_mutex_lock(&emu->mutex);
+	emu->scale = scale;
+	pthread_mutex_unlock(&emu->mutex);
+	return 0;
+}
+
+int rc_mpu_emulator_set_rotation_rate(rc_mpu_emulator_t* emu, const float rate_degs[3])
+{
+	int i;
+	if(emu==NULL || rate_degs==NULL){
+		fprintf(stderr,"ERROR in rc_mpu_emulator_set_rotation_rate, received NULL pointer\n");
+		return -1;
+	}
+	pthread_mutex_lock(&emu->mutex);
+	for(i=0;i<3;i++) emu->rate[i] = rate_degs[i]*DEG_TO_RAD;
+	pthread_mutex_unlock(&emu->mutex);
+	return 0;
+}
+
+int rc_mpu_emulator_inject_tap(rc_mpu_emulator_t* emu, int direction, int count)
+{
+	if(emu==NULL || direction<1 || direction>6 || count<1 || count>8){
+		fprintf(stderr,"ERROR in rc_mpu_emulator_inject_tap, invalid argument\n");
+		return -1;
+	}
+	pthread_mutex_lock(&emu->mutex);
+	emu->tap_byte = (direction<<3) | (count-1);
+	emu->tap_pending = 1;
+	pthread_mutex_unlock(&emu->mutex);
+	return 0;
+}
+
+int rc_mpu_emulator_get_stats(rc_mpu_emulator_t* emu, rc_mpu_emulator_stats_t* stats)
+{
+	if(emu==NULL || stats==NULL){
+		fprintf(stderr,"ERROR in rc_mpu_emulator_get_stats, received NULL pointer\n");
+		return -1;
+	}
+	pthread_mutex_lock(&emu->mutex);
+	*stats = emu->stats;
+	pthread_mutex_unlock(&emu->mutex);
+	return 0;
+}
+
+int rc_mpu_emulator_reset_stats(rc_mpu_emulator_t* emu)
+{
+	if(emu==NULL){
+		fprintf(stderr,"ERROR in rc_mpu_emulator_reset_stats, received NULL pointer\n");
+		return -1;
+	}
+	pthread_mutex_lock(&emu->mutex);
+	memset(&emu->stats, 0, sizeof(emu->stats));
+	pthread_mutex_unlock(&emu->mutex);
+	return 0;
+}
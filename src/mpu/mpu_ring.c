@@ -0,0 +1,235 @@
+/**
+ * @file mpu_ring.c
+ *
+ * Each slot is a seqlock. The writer marks it odd, fills it in and marks it
+ * with twice the record's sequence number, then moves the head. A reader
+ * after record s checks the slot holds 2s before and after copying it, and
+ * if not the writer has lapped it and the record is gone. Sleeping readers
+ * count themselves in waiters before reading the futex word and checking the
+ * head, so the writer, which bumps the futex word before looking at waiters,
+ * can't miss them. Closing sets its flag before the bump for the same reason.
+ * Readers of a shared ring can't write to it, so there the writer skips the
+ * count and always wakes, with a process-shared futex.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "mpu_ring.h"
+
+// preposessor macros
+#define unlikely(x)	__builtin_expect (!!(x), 0)
+#define likely(x)	__builtin_expect (!!(x), 1)
+
+
+size_t mpu_ring_size(int depth)
+{
+	return sizeof(mpu_ring_t) + (size_t)depth*sizeof(mpu_ring_slot_t);
+}
+
+
+// local function
+// empties a ring and marks it ready for readers
+static void __init(mpu_ring_t* r, int depth, int shared)
+{
+	memset(r, 0, mpu_ring_size(depth));
+	r->rec_size = sizeof(rc_mpu_record_t);
+	r->mask = depth-1;
+	r->shared = shared;
+	__atomic_store_n(&r->magic, MPU_RING_MAGIC, __ATOMIC_RELEASE);
+}
+
+
+mpu_ring_t* mpu_ring_create(int depth, const char* shm_name)
+{
+	mpu_ring_t* r;
+	size_t len = mpu_ring_size(depth);
+	int fd;
+
+	if(shm_name==NULL){
+		r = malloc(len);
+		if(r==NULL){
+			fprintf(stderr,"ERROR: failed to allocate sample ring\n");
+			return NULL;
+		}
+		__init(r, depth, 0);
+		return r;
+	}
+	// a fresh object every time, subscribers still mapping one left by a
+	// publisher that went away keep it and see it closed
+	shm_unlink(shm_name);
+	fd = shm_open(shm_name, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+	if(fd<0){
+		perror("ERROR: failed to create shared memory for sample ring");
+		return NULL;
+	}
+	if(ftruncate(fd, len)){
+		perror("ERROR: failed to size shared memory for sample ring");
+		close(fd);
+		shm_unlink(shm_name);
+		return NULL;
+	}
+	r = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(r==MAP_FAILED){
+		perror("ERROR: failed to map shared memory for sample ring");
+		shm_unlink(shm_name);
+		return NULL;
+	}
+	__init(r, depth, 1);
+	return r;
+}
+
+
+void mpu_ring_destroy(mpu_ring_t* r, const char* shm_name)
+{
+	if(r==NULL) return;
+	if(!r->shared){
+		free(r);
+		return;
+	}
+	munmap(r, mpu_ring_size(r->mask+1));
+	if(shm_name!=NULL) shm_unlink(shm_name);
+}
+
+
+void mpu_ring_reopen(mpu_ring_t* r)
+{
+	__atomic_store_n(&r->closed, 0, __ATOMIC_RELEASE);
+}
+
+
+void mpu_ring_push(mpu_ring_t* r, uint64_t timestamp_ns, const rc_mpu_data_t* data)
+{
+	uint64_t s = __atomic_load_n(&r->head, __ATOMIC_RELAXED) + 1;
+	mpu_ring_slot_t* slot = &r->slot[s & r->mask];
+	__atomic_store_n(&slot->seq, 2*s-1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->rec.seq = s;
+	slot->rec.timestamp_ns = timestamp_ns;
+	slot->rec.data = *data;
+	__atomic_store_n(&slot->seq, 2*s, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->head, s, __ATOMIC_RELEASE);
+}
+
+
+// local function
+static void __futex_wait(uint32_t* word, int op, uint32_t val, int timeout_ms)
+{
+	struct timespec ts;
+	ts.tv_sec = timeout_ms/1000;
+	ts.tv_nsec = (long)(timeout_ms%1000)*1000000;
+	// EAGAIN if it already changed, EINTR and ETIMEDOUT all just return
+	syscall(SYS_futex, word, op, val, timeout_ms<0 ? NULL : &ts, NULL, 0);
+}
+
+
+// local function
+static void __futex_wake(uint32_t* word, int op)
+{
+	syscall(SYS_futex, word, op, INT32_MAX, NULL, NULL, 0);
+}
+
+
+void mpu_ring_wake(mpu_ring_t* r)
+{
+	__atomic_fetch_add(&r->futex, 1, __ATOMIC_SEQ_CST);
+	if(r->shared) __futex_wake(&r->futex, FUTEX_WAKE);
+	else if(__atomic_load_n(&r->waiters, __ATOMIC_SEQ_CST)) __futex_wake(&r->futex, FUTEX_WAKE_PRIVATE);
+}
+
+
+void mpu_ring_close(mpu_ring_t* r)
+{
+	__atomic_store_n(&r->closed, 1, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&r->futex, 1, __ATOMIC_SEQ_CST);
+	__futex_wake(&r->futex, r->shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE);
+}
+
+
+// local function
+// copies record s if it is still in its slot, returns 0 or -1 if it's gone
+static int __copy(const mpu_ring_t* r, uint64_t s, rc_mpu_record_t* out)
+{
+	const mpu_ring_slot_t* slot = &r->slot[s & r->mask];
+	if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)!=2*s) return -1;
+	memcpy(out, &slot->rec, sizeof(rc_mpu_record_t));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED)!=2*s) return -1;
+	return 0;
+}
+
+
+int mpu_ring_read(const mpu_ring_t* r, uint64_t* cursor, rc_mpu_record_t* out, int max)
+{
+	uint64_t head, s = *cursor;
+	int n = 0;
+	if(s==0) s = 1;
+	while(n<max){
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if(s>head) break;
+		// already overwritten, skip to the oldest left
+		if(head-s > r->mask) s = head - r->mask;
+		// lapped while copying, the next one may still be there
+		if(__copy(r, s, &out[n])){
+			s++;
+			continue;
+		}
+		n++;
+		s++;
+	}
+	*cursor = s;
+	return n;
+}
+
+
+int mpu_ring_latest(const mpu_ring_t* r, rc_mpu_record_t* out)
+{
+	uint64_t head;
+	// only fails if the writer got all the way round the ring during the
+	// copy, so this hardly ever goes round twice
+	for(;;){
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if(head==0) return 1;
+		if(__copy(r, head, out)==0) return 0;
+	}
+}
+
+
+int mpu_ring_wait(mpu_ring_t* r, uint64_t cursor, int timeout_ms)
+{
+	uint32_t val;
+	int shared = r->shared;
+	if(cursor==0) cursor = 1;
+	if(!shared) __atomic_fetch_add(&r->waiters, 1, __ATOMIC_SEQ_CST);
+	val = __atomic_load_n(&r->futex, __ATOMIC_SEQ_CST);
+	if(!__atomic_load_n(&r->closed, __ATOMIC_SEQ_CST) &&
+			__atomic_load_n(&r->head, __ATOMIC_ACQUIRE)<cursor){
+		__futex_wait(&r->futex, shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, val, timeout_ms);
+	}
+	if(!shared) __atomic_fetch_sub(&r->waiters, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)<cursor;
+}
+
+
+void mpu_futex_wait(uint32_t* word, uint32_t val, int timeout_ms)
+{
+	__futex_wait(word, FUTEX_WAIT_PRIVATE, val, timeout_ms);
+}
+
+
+void mpu_futex_wake(uint32_t* word)
+{
+	__futex_wake(word, FUTEX_WAKE_PRIVATE);
+}
@@ -0,0 +1,111 @@
+/**
+ * @file mpu_ring.h
+ *
+ * Single-producer ring of rc_mpu_record_t behind the rc_mpu_ring_ functions.
+ * The interrupt thread is the only writer and never waits, readers keep their
+ * own cursor and check each slot's sequence number to catch records that were
+ * overwritten while they copied them. The ring holds no pointers, so the same
+ * layout is published as a POSIX shared memory object for
+ * rc_mpu_subscriber_open in other processes. Internal to the MPU driver, not
+ * installed.
+ */
+
+#ifndef RC_MPU_RING_H
+#define RC_MPU_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <rc/mpu.h>
+
+#define MPU_RING_HIDDEN __attribute__ ((visibility ("hidden")))
+
+#define MPU_RING_MAGIC	0x524d5055 // "UPMR", set last so other processes never see half a header
+
+typedef struct mpu_ring_slot_t{
+	uint64_t seq;		// 2*rec.seq once written, odd while being written
+	rc_mpu_record_t rec;
+} mpu_ring_slot_t;
+
+typedef struct mpu_ring_t{
+	uint32_t magic;		// MPU_RING_MAGIC once the ring is ready
+	uint32_t rec_size;	// sizeof(rc_mpu_record_t) as built into the writer
+	uint32_t mask;		// depth-1
+	uint32_t shared;	// in shared memory, see mpu_ring_wake
+	uint32_t futex;		// bumped after each batch to wake sleeping readers
+	uint32_t waiters;	// readers in this process asleep on futex
+	uint32_t closed;	// set while the producer is stopped
+	uint32_t reserved;
+	uint64_t head;		// seq of the newest complete record, 0 before the first
+	mpu_ring_slot_t slot[];
+} mpu_ring_t;
+
+/**
+ * Bytes needed for a ring of depth records, depth a power of two.
+ */
+MPU_RING_HIDDEN size_t mpu_ring_size(int depth);
+
+/**
+ * Allocates an empty ring of depth records. With a shm_name it is created as
+ * that POSIX shared memory object instead, replacing any left by an earlier
+ * process. Prints the reason and returns NULL on failure.
+ */
+MPU_RING_HIDDEN mpu_ring_t* mpu_ring_create(int depth, const char* shm_name);
+
+/**
+ * Frees a ring from mpu_ring_create, unlinking its shared memory object if
+ * it has one. Subscribers that still have it mapped keep their copy.
+ */
+MPU_RING_HIDDEN void mpu_ring_destroy(mpu_ring_t* r, const char* shm_name);
+
+/**
+ * Producer only. Clears the closed flag when the producer starts again.
+ * Records and sequence numbers carry on from where they stopped.
+ */
+MPU_RING_HIDDEN void mpu_ring_reopen(mpu_ring_t* r);
+
+/**
+ * Producer only. Publishes the next record, numbered one past the head.
+ * Readers see it straight away but aren't woken until mpu_ring_wake.
+ */
+MPU_RING_HIDDEN void mpu_ring_push(mpu_ring_t* r, uint64_t timestamp_ns, const rc_mpu_data_t* data);
+
+/**
+ * Producer only. Wakes readers sleeping in mpu_ring_wait, a system call only
+ * when there are any. Readers in other processes map the ring read-only and
+ * can't count themselves, so a shared ring always makes the call.
+ */
+MPU_RING_HIDDEN void mpu_ring_wake(mpu_ring_t* r);
+
+/**
+ * Producer only. Marks the ring as stopped and wakes every reader, waits
+ * return straight away from then on until mpu_ring_reopen.
+ */
+MPU_RING_HIDDEN void mpu_ring_close(mpu_ring_t* r);
+
+/**
+ * Copies up to max records from *cursor on and moves the cursor past them.
+ * Returns the number copied.
+ */
+MPU_RING_HIDDEN int mpu_ring_read(const mpu_ring_t* r, uint64_t* cursor, rc_mpu_record_t* out, int max);
+
+/**
+ * Copies the newest record. Returns 0, or 1 if there isn't one yet.
+ */
+MPU_RING_HIDDEN int mpu_ring_latest(const mpu_ring_t* r, rc_mpu_record_t* out);
+
+/**
+ * Sleeps until record cursor is published, the ring is woken with nothing new
+ * or closed, or timeout_ms passes, -1 for no limit. Returns 0 if the record is
+ * there and 1 otherwise. Writes nothing to a shared ring, so it works on a
+ * read-only mapping.
+ */
+MPU_RING_HIDDEN int mpu_ring_wait(mpu_ring_t* r, uint64_t cursor, int timeout_ms);
+
+/**
+ * Futex wait and wake on a 32-bit word private to this process.
+ */
+MPU_RING_HIDDEN void mpu_futex_wait(uint32_t* word, uint32_t val, int timeout_ms);
+MPU_RING_HIDDEN void mpu_futex_wake(uint32_t* word);
+
+#endif // RC_MPU_RING_H
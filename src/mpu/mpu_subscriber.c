@@ -0,0 +1,141 @@
+/**
+ * @file mpu_subscriber.c
+ *
+ * The subscriber maps the publisher's mpu_ring_t read-only and runs the same
+ * reader side of mpu_ring.c on it, which never writes to a shared ring.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <rc/mpu_subscriber.h>
+#include <rc/time.h>
+
+#include "mpu_ring.h"
+
+// preposessor macros
+#define unlikely(x)	__builtin_expect (!!(x), 0)
+#define likely(x)	__builtin_expect (!!(x), 1)
+
+struct rc_mpu_subscriber_t {
+	mpu_ring_t* ring;	// mapped read-only
+	size_t len;
+};
+
+
+rc_mpu_subscriber_t* rc_mpu_subscriber_open(const char* name)
+{
+	rc_mpu_subscriber_t* sub;
+	struct stat st;
+	mpu_ring_t* r;
+	int fd;
+
+	if(unlikely(name==NULL)){
+		fprintf(stderr,"ERROR: in rc_mpu_subscriber_open, received NULL pointer\n");
+		return NULL;
+	}
+	fd = shm_open(name, O_RDONLY|O_CLOEXEC, 0);
+	if(fd<0){
+		perror("ERROR: in rc_mpu_subscriber_open, failed to open shared memory");
+		return NULL;
+	}
+	if(fstat(fd, &st) || (size_t)st.st_size<sizeof(mpu_ring_t)){
+		fprintf(stderr,"ERROR: in rc_mpu_subscriber_open, %s is not a sample ring\n", name);
+		close(fd);
+		return NULL;
+	}
+	r = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(r==MAP_FAILED){
+		perror("ERROR: in rc_mpu_subscriber_open, failed to map shared memory");
+		return NULL;
+	}
+	// the header is only trusted once the magic is there
+	if(__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE)!=MPU_RING_MAGIC || !r->shared ||
+			mpu_ring_size(r->mask+1)>(size_t)st.st_size){
+		fprintf(stderr,"ERROR: in rc_mpu_subscriber_open, %s is not a sample ring or not ready yet\n", name);
+		munmap(r, st.st_size);
+		return NULL;
+	}
+	if(r->rec_size!=sizeof(rc_mpu_record_t)){
+		fprintf(stderr,"ERROR: in rc_mpu_subscriber_open, %s holds %u byte records, this library expects %zu\n",
+				name, r->rec_size, sizeof(rc_mpu_record_t));
+		munmap(r, st.st_size);
+		return NULL;
+	}
+	sub = malloc(sizeof(rc_mpu_subscriber_t));
+	if(sub==NULL){
+		fprintf(stderr,"ERROR: in rc_mpu_subscriber_open, out of memory\n");
+		munmap(r, st.st_size);
+		return NULL;
+	}
+	sub->ring = r;
+	sub->len = st.st_size;
+	return sub;
+}
+
+
+void rc_mpu_subscriber_close(rc_mpu_subscriber_t* sub)
+{
+	if(sub==NULL) return;
+	munmap(sub->ring, sub->len);
+	free(sub);
+}
+
+
+int rc_mpu_subscriber_read(rc_mpu_subscriber_t* sub, uint64_t* cursor, rc_mpu_record_t* recs, int max)
+{
+	if(unlikely(sub==NULL || cursor==NULL || recs==NULL || max<1)){
+		fprintf(stderr,"ERROR: in rc_mpu_subscriber_read, invalid arguments\n");
+		return -1;
+	}
+	return mpu_ring_read(sub->ring, cursor, recs, max);
+}
+
+
+int rc_mpu_subscriber_latest(rc_mpu_subscriber_t* sub, rc_mpu_record_t* rec)
+{
+	if(unlikely(sub==NULL || rec==NULL)){
+		fprintf(stderr,"ERROR: in rc_mpu_subscriber_latest, received NULL pointer\n");
+		return -1;
+	}
+	return mpu_ring_latest(sub->ring, rec);
+}
+
+
+int rc_mpu_subscriber_wait(rc_mpu_subscriber_t* sub, uint64_t cursor, int timeout_ms)
+{
+	uint64_t deadline = 0, now;
+	int ms = timeout_ms;
+	if(unlikely(sub==NULL)){
+		fprintf(stderr,"ERROR: in rc_mpu_subscriber_wait, received NULL pointer\n");
+		return -1;
+	}
+	if(timeout_ms>=0) deadline = rc_nanos_since_boot() + (uint64_t)timeout_ms*1000000;
+	// woken once per batch, which may not be far enough yet
+	while(mpu_ring_wait(sub->ring, cursor, ms)){
+		if(__atomic_load_n(&sub->ring->closed, __ATOMIC_ACQUIRE)) return 1;
+		if(timeout_ms<0) continue;
+		now = rc_nanos_since_boot();
+		if(now>=deadline) return 1;
+		ms = (deadline-now+999999)/1000000;
+	}
+	return 0;
+}
+
+
+int rc_mpu_subscriber_closed(rc_mpu_subscriber_t* sub)
+{
+	if(unlikely(sub==NULL)){
+		fprintf(stderr,"ERROR: in rc_mpu_subscriber_closed, received NULL pointer\n");
+		return -1;
+	}
+	return __atomic_load_n(&sub->ring->closed, __ATOMIC_ACQUIRE) ? 1 : 0;
+}
@@ -0,0 +1,222 @@
+/**
+ * @file error_log.c
+ *
+ * Reporters claim a slot with a compare and swap on the tail counter, format
+ * into it, then publish it by bumping the slot's sequence number. Each slot's
+ * sequence is the lap base while free for that lap and base+1 once filled,
+ * so the ring needs no initialization and a full ring shows up as a filled
+ * slot from the previous lap. Drainers are ordinary threads so they just
+ * share a mutex.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <rc/error_log.h>
+#include <rc/time.h>
+
+// preposessor macros
+#define unlikely(x)	__builtin_expect (!!(x), 0)
+#define likely(x)	__builtin_expect (!!(x), 1)
+
+#define PRINTER_PERIOD_US	50000
+#define PRINTER_BATCH		16
+
+typedef struct rc_error_slot_t {
+	uint64_t seq;
+	rc_error_event_t ev;
+} rc_error_slot_t;
+
+typedef struct rc_error_limit_t {
+	uint64_t window_start;
+	uint32_t window_count;
+	uint32_t suppressed;
+	rc_error_counts_t counts;
+} rc_error_limit_t;
+
+static rc_error_slot_t ring[ERROR_LOG_SIZE];
+static uint64_t tail;
+static uint64_t head;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static rc_error_limit_t limit[ERR_NUM_SOURCES];
+
+static pthread_mutex_t printer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t printer_thread;
+static int printer_users;
+static int printer_running;
+
+
+// local function
+// returns the number of events suppressed before this one, or -1 if this one
+// is over the limit itself
+static int64_t __rate_limit(rc_error_limit_t* l, uint64_t now)
+{
+	uint64_t start = __atomic_load_n(&l->window_start, __ATOMIC_RELAXED);
+	if(now-start >= 1000000000){
+		if(__atomic_compare_exchange_n(&l->window_start, &start, now, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+			__atomic_store_n(&l->window_count, 0, __ATOMIC_RELAXED);
+		}
+	}
+	if(__atomic_fetch_add(&l->window_count, 1, __ATOMIC_RELAXED) >= ERROR_LOG_RATE_LIMIT){
+		__atomic_fetch_add(&l->suppressed, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&l->counts.rate_limited, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	return __atomic_exchange_n(&l->suppressed, 0, __ATOMIC_RELAXED);
+}
+
+
+int rc_error_report(rc_error_source_t source, rc_error_level_t level, const char* fmt, ...)
+{
+	rc_error_slot_t* slot;
+	rc_error_limit_t* l;
+	uint64_t now, pos, base, seq;
+	int64_t suppressed;
+	va_list args;
+
+	if(unlikely((int)source<0 || source>=ERR_NUM_SOURCES)) source = ERR_SRC_OTHER;
+	l = &limit[source];
+	__atomic_fetch_add(&l->counts.reported, 1, __ATOMIC_RELAXED);
+	now = rc_nanos_since_boot();
+	suppressed = __rate_limit(l, now);
+	if(suppressed<0) return -1;
+
+	// claim a slot
+	pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+	for(;;){
+		slot = &ring[pos%ERROR_LOG_SIZE];
+		base = pos - pos%ERROR_LOG_SIZE;
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if(seq==base){
+			if(__atomic_compare_exchange_n(&tail, &pos, pos+1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		}
+		else if((int64_t)(seq-base)<0){
+			// still holding last lap's event, the ring is full
+			__atomic_fetch_add(&l->counts.overflowed, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&l->suppressed, suppressed, __ATOMIC_RELAXED);
+			return -1;
+		}
+		else pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+	}
+
+	slot->ev.timestamp_ns = now;
+	slot->ev.suppressed = suppressed;
+	slot->ev.source = source;
+	slot->ev.level = level;
+	va_start(args, fmt);
+	vsnprintf(slot->ev.msg, ERROR_LOG_MSG_LEN, fmt, args);
+	va_end(args);
+	__atomic_store_n(&slot->seq, base+1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+int rc_error_drain(rc_error_event_t* events, int max)
+{
+	rc_error_slot_t* slot;
+	uint64_t base;
+	int n = 0;
+
+	if(unlikely(events==NULL || max<0)){
+		fprintf(stderr,"ERROR: in rc_error_drain, invalid arguments\n");
+		return -1;
+	}
+	pthread_mutex_lock(&drain_mutex);
+	while(n<max){
+		slot = &ring[head%ERROR_LOG_SIZE];
+		base = head - head%ERROR_LOG_SIZE;
+		// stop at an empty slot or one still being written
+		if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)!=base+1) break;
+		events[n++] = slot->ev;
+		__atomic_store_n(&slot->seq, base+ERROR_LOG_SIZE, __ATOMIC_RELEASE);
+		head++;
+	}
+	pthread_mutex_unlock(&drain_mutex);
+	return n;
+}
+
+
+int rc_error_get_counts(rc_error_source_t source, rc_error_counts_t* counts)
+{
+	rc_error_counts_t* c;
+	if(unlikely((int)source<0 || source>=ERR_NUM_SOURCES || counts==NULL)){
+		fprintf(stderr,"ERROR: in rc_error_get_counts, invalid arguments\n");
+		return -1;
+	}
+	c = &limit[source].counts;
+	counts->reported = __atomic_load_n(&c->reported, __ATOMIC_RELAXED);
+	counts->rate_limited = __atomic_load_n(&c->rate_limited, __ATOMIC_RELAXED);
+	counts->overflowed = __atomic_load_n(&c->overflowed, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+// local function
+// prints whatever is queued, returns the number of events printed
+static int __print_events(void)
+{
+	rc_error_event_t ev[PRINTER_BATCH];
+	int i, n, total = 0;
+	do{
+		n = rc_error_drain(ev, PRINTER_BATCH);
+		for(i=0;i<n;i++){
+			if(ev[i].suppressed){
+				fprintf(stderr, "(%u similar messages suppressed)\n", ev[i].suppressed);
+			}
+			fprintf(stderr, "%s: %s\n", ev[i].level==ERR_LEVEL_WARNING ? "WARNING" : "ERROR", ev[i].msg);
+		}
+		total += n;
+	}while(n==PRINTER_BATCH);
+	return total;
+}
+
+
+// local function
+static void* __printer(__attribute__ ((unused)) void* ptr)
+{
+	while(__atomic_load_n(&printer_running, __ATOMIC_ACQUIRE)){
+		__print_events();
+		rc_usleep(PRINTER_PERIOD_US);
+	}
+	__print_events();
+	return NULL;
+}
+
+
+int rc_error_printer_start(void)
+{
+	pthread_mutex_lock(&printer_mutex);
+	if(printer_users==0){
+		__atomic_store_n(&printer_running, 1, __ATOMIC_RELEASE);
+		if(pthread_create(&printer_thread, NULL, __printer, NULL)){
+			__atomic_store_n(&printer_running, 0, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&printer_mutex);
+			fprintf(stderr,"ERROR: in rc_error_printer_start, failed to start thread\n");
+			return -1;
+		}
+	}
+	printer_users++;
+	pthread_mutex_unlock(&printer_mutex);
+	return 0;
+}
+
+
+int rc_error_printer_stop(void)
+{
+	pthread_mutex_lock(&printer_mutex);
+	if(printer_users==0){
+		pthread_mutex_unlock(&printer_mutex);
+		return -1;
+	}
+	if(--printer_users==0){
+		__atomic_store_n(&printer_running, 0, __ATOMIC_RELEASE);
+		pthread_join(printer_thread, NULL);
+	}
+	pthread_mutex_unlock(&printer_mutex);
+	return 0;
+}
@@ -0,0 +1,293 @@
+/**
+ * @file event_loop.c
+ *
+ * Each registered descriptor gets a slot, and epoll hands back the slot index
+ * together with the slot's generation so an event still in flight for a
+ * descriptor that was just removed is recognised and dropped. Callbacks run
+ * with the loop's recursive mutex held, which is what lets remove promise
+ * the callback is finished. Destroying the loop from one of its own callbacks
+ * can't free it under the running loop, so the loop frees itself on the way
+ * out instead.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <rc/event_loop.h>
+#include <rc/pthread_helpers.h>
+#include <rc/error_log.h>
+
+// preposessor macros
+#define unlikely(x)	__builtin_expect (!!(x), 0)
+#define likely(x)	__builtin_expect (!!(x), 1)
+
+// epoll data for the stop eventfd, never a valid slot
+#define STOP_ID		UINT64_MAX
+
+typedef struct rc_event_slot_t {
+	int fd;
+	uint32_t gen;
+	rc_event_cb_t cb;	// NULL while the slot is free
+	void* user;
+} rc_event_slot_t;
+
+struct rc_event_loop_t {
+	int epfd;
+	int stopfd;
+	int running;
+	int started;
+	int in_run;		// __run is on the stack of runner
+	int free_on_exit;	// destroyed from a callback, __run frees it
+	pthread_t thread;
+	pthread_t runner;
+	pthread_mutex_t mutex;	// recursive, held during callbacks
+	rc_event_slot_t slot[EVENT_LOOP_MAX_FDS];
+};
+
+
+rc_event_loop_t* rc_event_loop_create(void)
+{
+	rc_event_loop_t* loop;
+	pthread_mutexattr_t attr;
+	struct epoll_event ev;
+	int i;
+
+	loop = calloc(1, sizeof(rc_event_loop_t));
+	if(loop==NULL){
+		fprintf(stderr,"ERROR: in rc_event_loop_create, out of memory\n");
+		return NULL;
+	}
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	loop->stopfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if(loop->epfd<0 || loop->stopfd<0){
+		perror("ERROR: in rc_event_loop_create");
+		goto fail;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = STOP_ID;
+	if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->stopfd, &ev)){
+		perror("ERROR: in rc_event_loop_create, failed to add stop eventfd");
+		goto fail;
+	}
+	for(i=0;i<EVENT_LOOP_MAX_FDS;i++) loop->slot[i].fd = -1;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&loop->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	return loop;
+
+fail:
+	if(loop->epfd>=0) close(loop->epfd);
+	if(loop->stopfd>=0) close(loop->stopfd);
+	free(loop);
+	return NULL;
+}
+
+
+// local function
+static void __free_loop(rc_event_loop_t* loop)
+{
+	close(loop->epfd);
+	close(loop->stopfd);
+	pthread_mutex_destroy(&loop->mutex);
+	free(loop);
+}
+
+
+void rc_event_loop_destroy(rc_event_loop_t* loop)
+{
+	if(loop==NULL) return;
+	rc_event_loop_stop(loop);
+	// from a callback, __run still needs the loop until it returns
+	if(loop->in_run && pthread_equal(pthread_self(), loop->runner)){
+		if(loop->started) pthread_detach(loop->thread);
+		loop->free_on_exit = 1;
+		return;
+	}
+	// stopped from its own thread earlier, it's gone by now or about to be
+	if(loop->started) pthread_join(loop->thread, NULL);
+	__free_loop(loop);
+}
+
+
+int rc_event_loop_add(rc_event_loop_t* loop, int fd, uint32_t events, rc_event_cb_t cb, void* user)
+{
+	struct epoll_event ev;
+	rc_event_slot_t* s = NULL;
+	int i;
+
+	if(unlikely(loop==NULL || fd<0 || cb==NULL)){
+		fprintf(stderr,"ERROR: in rc_event_loop_add, invalid arguments\n");
+		return -1;
+	}
+	pthread_mutex_lock(&loop->mutex);
+	for(i=0;i<EVENT_LOOP_MAX_FDS;i++){
+		if(loop->slot[i].cb==NULL){
+			if(s==NULL) s = &loop->slot[i];
+		}
+		else if(loop->slot[i].fd==fd){
+			pthread_mutex_unlock(&loop->mutex);
+			fprintf(stderr,"ERROR: in rc_event_loop_add, fd %d already registered\n", fd);
+			return -1;
+		}
+	}
+	if(s==NULL){
+		pthread_mutex_unlock(&loop->mutex);
+		fprintf(stderr,"ERROR: in rc_event_loop_add, loop already has %d fds\n", EVENT_LOOP_MAX_FDS);
+		return -1;
+	}
+	s->gen++;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u64 = ((uint64_t)s->gen<<32) | (uint64_t)(s - loop->slot);
+	if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev)){
+		pthread_mutex_unlock(&loop->mutex);
+		perror("ERROR: in rc_event_loop_add, epoll_ctl failed");
+		return -1;
+	}
+	s->fd = fd;
+	s->user = user;
+	s->cb = cb;
+	pthread_mutex_unlock(&loop->mutex);
+	return 0;
+}
+
+
+int rc_event_loop_remove(rc_event_loop_t* loop, int fd)
+{
+	int i;
+	if(unlikely(loop==NULL)) return -1;
+	// waits for a callback in progress on the loop thread to return
+	pthread_mutex_lock(&loop->mutex);
+	for(i=0;i<EVENT_LOOP_MAX_FDS;i++){
+		if(loop->slot[i].cb!=NULL && loop->slot[i].fd==fd) break;
+	}
+	if(i==EVENT_LOOP_MAX_FDS){
+		pthread_mutex_unlock(&loop->mutex);
+		return -1;
+	}
+	// the fd may already be closed, which removed it from the set anyway
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+	loop->slot[i].cb = NULL;
+	loop->slot[i].fd = -1;
+	pthread_mutex_unlock(&loop->mutex);
+	return 0;
+}
+
+
+// local function
+static int __run(rc_event_loop_t* loop)
+{
+	struct epoll_event ev[EVENT_LOOP_MAX_FDS+1];
+	rc_event_slot_t* s;
+	uint64_t id, count;
+	int i, n, ret = 0;
+
+	loop->runner = pthread_self();
+	loop->in_run = 1;
+	while(__atomic_load_n(&loop->running, __ATOMIC_ACQUIRE)){
+		n = epoll_wait(loop->epfd, ev, EVENT_LOOP_MAX_FDS+1, -1);
+		if(n<0){
+			if(errno==EINTR) continue;
+			rc_error_report(ERR_SRC_OTHER, ERR_LEVEL_ERROR, "in rc_event_loop_run, epoll_wait failed, errno %d", errno);
+			ret = -1;
+			break;
+		}
+		pthread_mutex_lock(&loop->mutex);
+		for(i=0;i<n;i++){
+			id = ev[i].data.u64;
+			if(id==STOP_ID){
+				if(read(loop->stopfd, &count, sizeof(count))<0){
+					// already drained
+				}
+				continue;
+			}
+			s = &loop->slot[(uint32_t)id];
+			if(s->cb==NULL || s->gen!=(uint32_t)(id>>32)) continue;
+			s->cb(s->fd, ev[i].events, s->user);
+			if(!__atomic_load_n(&loop->running, __ATOMIC_ACQUIRE)) break;
+		}
+		pthread_mutex_unlock(&loop->mutex);
+	}
+	loop->in_run = 0;
+	if(loop->free_on_exit) __free_loop(loop);
+	return ret;
+}
+
+
+// local function
+static void __reset_stop(rc_event_loop_t* loop)
+{
+	uint64_t count;
+	// forget a stop that was sent while nothing was running
+	if(read(loop->stopfd, &count, sizeof(count))<0){
+		// nothing pending
+	}
+	__atomic_store_n(&loop->running, 1, __ATOMIC_RELEASE);
+}
+
+
+int rc_event_loop_run(rc_event_loop_t* loop)
+{
+	if(unlikely(loop==NULL)){
+		fprintf(stderr,"ERROR: in rc_event_loop_run, received NULL pointer\n");
+		return -1;
+	}
+	__reset_stop(loop);
+	return __run(loop);
+}
+
+
+// local function
+static void* __loop_thread(void* ptr)
+{
+	__run(ptr);
+	return NULL;
+}
+
+
+int rc_event_loop_start(rc_event_loop_t* loop, int policy, int priority)
+{
+	if(unlikely(loop==NULL)){
+		fprintf(stderr,"ERROR: in rc_event_loop_start, received NULL pointer\n");
+		return -1;
+	}
+	if(loop->started){
+		fprintf(stderr,"ERROR: in rc_event_loop_start, loop already started\n");
+		return -1;
+	}
+	__reset_stop(loop);
+	if(rc_pthread_create(&loop->thread, __loop_thread, loop, policy, priority)<0){
+		__atomic_store_n(&loop->running, 0, __ATOMIC_RELEASE);
+		fprintf(stderr,"ERROR: in rc_event_loop_start, failed to start thread\n");
+		return -1;
+	}
+	loop->started = 1;
+	return 0;
+}
+
+
+int rc_event_loop_stop(rc_event_loop_t* loop)
+{
+	uint64_t one = 1;
+	if(unlikely(loop==NULL)) return -1;
+	__atomic_store_n(&loop->running, 0, __ATOMIC_RELEASE);
+	if(write(loop->stopfd, &one, sizeof(one))!=sizeof(one)){
+		// only fails if the counter is saturated, it's readable either way
+	}
+	if(loop->started && !pthread_equal(pthread_self(), loop->thread)){
+		pthread_join(loop->thread, NULL);
+		loop->started = 0;
+	}
+	return 0;
+}